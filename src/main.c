@@ -18,6 +18,7 @@
 static const char *k_args_exec_switch1				= "--exec";
 static const char *k_args_exec_switch2				= "--exe";
 static const char *k_args_attach_switch				= "--attach";
+static const char *k_args_compile_switch			= "--compile";
 static const muse_char *k_main_function_name		= L"main";
 static const muse_char *k_program_string_name		= L"*program*";
 
@@ -306,6 +307,11 @@ static muse_cell fn_repl( muse_env *env, args_t *context, muse_cell args )
  *		
  *		Starts the REPL but it may not be able to load any appended source code.
  *
+ * D)	muse --compile source.scm output.c
+ *
+ *		Translates the given source file into C source for a plugin.
+ *		@see fn_compile_module() for details.
+ *
  * If the appended source code has a function called "main", it is invoked with
  * a list of command line argument strings supplied to the executable. If no such
  * main function is defined, it simply starts the REPL.
@@ -314,6 +320,7 @@ int main( int argc, char **argv )
 {
 	char execpath[1024];
 	muse_env *env = muse_init_env(NULL);
+	int result = 0;
 	
 	get_execpath( env, argv[0], execpath, 1024 );
 
@@ -335,6 +342,22 @@ int main( int argc, char **argv )
 		   "--exec" or "--exe" switch. */
 		create_exec( env, execpath, argc-2, argv+2 );
 	}
+
+	/* If we've been asked to compile a module into C, do so. */
+	else if ( argc > 1 && strcmp( argv[1], k_args_compile_switch ) == 0 )
+	{
+		if ( argc != 4 )
+		{
+			fprintf( stderr, "Usage: muse --compile source.scm output.c\n" );
+			result = 1;
+		}
+		else
+		{
+			muse_cell args = _cons( muse_mk_ctext_utf8( env, argv[2] ), _cons( muse_mk_ctext_utf8( env, argv[3] ), MUSE_NIL ) );
+			if ( muse_apply_top_level( env, _symval(_csymbol(L"compile-module")), args ) == MUSE_NIL )
+				result = 1;
+		}
+	}
 	
 	/* Check if this is a muSE executable that has
 	source code at the end of the file. */
@@ -384,5 +407,5 @@ int main( int argc, char **argv )
 	}
 
 	muse_destroy_env(env);
-	return 0;
+	return result;
 }
@@ -22,6 +22,31 @@
 #include <sys/time.h>
 #endif
 
+#if defined(MUSE_PLATFORM_POSIX) && !defined(__APPLE__)
+#include <signal.h>
+#include <time.h>
+#include <sched.h>
+#define MUSE_PREEMPTION_TIMER 1
+#if defined(__linux__) && defined(SIGEV_THREAD_ID)
+#include <sys/syscall.h>
+#define MUSE_THREAD_TIMERS 1
+#endif
+#endif
+
+#if defined(MUSE_PLATFORM_POSIX)
+#include <sys/mman.h>
+#include <unistd.h>
+#define MUSE_GUARDED_CSTACKS 1
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifdef MAP_NORESERVE
+#define MUSE_MAP_NORESERVE MAP_NORESERVE
+#else
+#define MUSE_MAP_NORESERVE 0
+#endif
+#endif
+
 /**
  * String names for the various cell types, intended for
  * debugging and reporting use.
@@ -75,6 +100,164 @@ static muse_boolean realloc_stack( muse_stack *s, int new_size )
 		return MUSE_TRUE;
 }
 
+/**
+ * Grows a process stack to hold at least \p min_size cells by
+ * doubling its size, but to no more than \p max_size cells.
+ * The cells of the stack may move, so pointers into it
+ * must not be held across pushes.
+ */
+void grow_stack( muse_env *env, muse_stack *s, int min_size, int max_size )
+{
+	int old_size = s->size;
+	int new_size = s->size > 0 ? s->size : 1;
+
+	muse_assert( min_size <= max_size && "Process stack overflow!" );
+
+	while ( new_size < min_size )
+		new_size *= 2;
+
+	if ( new_size > max_size )
+		new_size = max_size;
+
+	if ( !realloc_stack( s, new_size ) )
+		muse_assert( MUSE_FALSE && "Out of memory for process stack!" );
+
+	/* Unused cells are kept zero for stack_high_water(). */
+	if ( s->size > old_size )
+		memset( s->bottom + old_size, 0, (s->size - old_size) * sizeof(muse_cell) );
+}
+
+/**
+ * Returns the most cells ever used on a process stack. The cells
+ * of a process stack start out zero and aren't cleared when popped,
+ * so this is one past the last cell that isn't zero.
+ */
+static int stack_high_water( muse_stack *s )
+{
+	int n = s->size;
+
+	while ( n > 0 && s->bottom[n-1] == 0 )
+		--n;
+
+	return n;
+}
+
+/**
+ * Allocates the C stack of a spawned process. Where pages can be
+ * mapped, up to MUSE_MAX_GUARDED_CSTACKS stacks get a page below
+ * them that can't be accessed, so that overflowing one faults
+ * rather than silently corrupting whatever lies below. Mapped
+ * pages are only committed when the process first touches them,
+ * so idle processes cost little.
+ */
+static void init_cstack( muse_env *env, muse_process_frame_t *p, int size )
+{
+#ifdef MUSE_GUARDED_CSTACKS
+	size_t page = (size_t)sysconf( _SC_PAGESIZE );
+	size_t bytes = size * sizeof(muse_cell);
+	size_t guard = (env->num_guarded_cstacks < MUSE_MAX_GUARDED_CSTACKS) ? page : 0;
+	char *m;
+
+	if ( bytes < MUSE_MAPPED_CSTACK_SIZE )
+		bytes = MUSE_MAPPED_CSTACK_SIZE;
+	bytes = (bytes + page - 1) & ~(page - 1);
+
+	m = (char*)mmap( NULL, bytes + guard, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MUSE_MAP_NORESERVE, -1, 0 );
+
+	if ( m != (char*)MAP_FAILED )
+	{
+		/* If the guard page can't be protected, the stack is
+		merely unguarded. */
+		if ( guard > 0 )
+		{
+			mprotect( m, guard, PROT_NONE );
+			env->num_guarded_cstacks++;
+		}
+
+		p->cstack_mapping	= m;
+		p->cstack.bottom	= (muse_cell*)(m + guard);
+		p->cstack.size		= (int)(bytes / sizeof(muse_cell));
+		return;
+	}
+#endif
+
+	init_stack( &p->cstack, size );
+}
+
+static void destroy_cstack( muse_process_frame_t *p )
+{
+#ifdef MUSE_GUARDED_CSTACKS
+	if ( p->cstack_mapping )
+	{
+		char *end = (char*)(p->cstack.bottom + p->cstack.size);
+
+		if ( p->cstack_mapping != (char*)p->cstack.bottom )
+			p->env->num_guarded_cstacks--;
+
+		munmap( p->cstack_mapping, end - p->cstack_mapping );
+		p->cstack_mapping = NULL;
+		p->cstack.bottom = p->cstack.top = NULL;
+		p->cstack.size = 0;
+		return;
+	}
+#endif
+
+	destroy_stack( &p->cstack );
+}
+
+/**
+ * Gives back the pages that a dead process touched on its C stack
+ * while its frame waits in the pool. They read as zeros again.
+ */
+static void trim_cstack( muse_process_frame_t *p )
+{
+#if defined(MUSE_GUARDED_CSTACKS) && defined(MADV_DONTNEED)
+	if ( p->cstack_mapping )
+	{
+		madvise( p->cstack.bottom, p->cstack.size * sizeof(muse_cell), MADV_DONTNEED );
+		return;
+	}
+#endif
+
+	memset( p->cstack.bottom, 0, p->cstack.size * sizeof(muse_cell) );
+}
+
+/**
+ * Returns the most bytes ever used on the C stack of a spawned 
+ * process. Like the other process stacks, it starts out zero.
+ * The C stack grows down, so its first cell that isn't zero 
+ * is the deepest one used.
+ */
+static int cstack_high_water( muse_process_frame_t *p )
+{
+	muse_cell *c = p->cstack.bottom;
+	muse_cell *end = p->cstack.bottom + p->cstack.size;
+
+	while ( c < end && *c == 0 )
+		++c;
+
+	return (int)((char*)end - (char*)c);
+}
+
+static void destroy_process_frame( muse_process_frame_t *p );
+
+static void init_symbol_index( muse_symbol_index_t *index, int min_capacity )
+{
+	index->capacity = 64;
+	while ( index->capacity < min_capacity )
+		index->capacity *= 2;
+
+	index->count	= 0;
+	index->entries	= (muse_symbol_entry_t*)calloc( index->capacity, sizeof(muse_symbol_entry_t) );
+}
+
+static void destroy_symbol_index( muse_symbol_index_t *index )
+{
+	free( index->entries );
+	index->entries	= NULL;
+	index->capacity	= index->count = 0;
+}
+
 static void init_heap( muse_env *env, muse_heap *heap, int heap_size )
 {
 	heap_size				= (heap_size + 7) & ~7;
@@ -200,6 +383,9 @@ static const struct _bs { int builtin; const muse_char *symbol; } k_builtin_symb
 	{ MUSE_GENERIC_INVOKE,		L"*invoke*"	},
 	{ MUSE_GET,					L"get"		},
 	{ MUSE_PUT,					L"put"		},
+	{ MUSE_LEXICAL_FRAME,		L"{{frame}}"	},
+	{ MUSE_LEXICAL_REF,			L"{{local}}"	},
+	{ MUSE_LEXICAL_LET,			L"{{let}}"	},
 	{ -1,						NULL		},
 };
 
@@ -237,7 +423,11 @@ static void init_parameters( muse_env *env, const int *parameters )
 		0,		/* MUSE_ENABLE_OBJC */
 		0,		/* MUSE_OWN_OBJC_AUTORELEASE_POOL */
 #endif
-		MUSE_TRUE	/* MUSE_ENABLE_TRACE */
+		MUSE_TRUE,	/* MUSE_ENABLE_TRACE */
+		0,		/* MUSE_PREEMPTION_INTERVAL_US */
+		0,		/* MUSE_LEXICAL_ADDRESSING */
+		MUSE_TRUE,	/* MUSE_FLIGHT_RECORDER_SIGNALS */
+		0		/* MUSE_WORKER_THREADS */
 	};
 
 	/* Initialize default values. */
@@ -263,6 +453,165 @@ static void init_parameters( muse_env *env, const int *parameters )
 	}
 }
 
+#ifdef MUSE_PREEMPTION_TIMER
+/**
+ * The environments whose preemption timers are running. A timer's
+ * signal carries the index of its environment's entry and not the
+ * environment itself, so a signal that is still queued when the
+ * environment goes away finds the entry empty and is ignored.
+ */
+enum { MUSE_MAX_PREEMPTION_TIMERS = 256 };
+static muse_env * volatile g_preemption_envs[MUSE_MAX_PREEMPTION_TIMERS];
+
+/**
+ * SIGALRM is process wide, so the handler is installed when the first
+ * timer starts and whatever handled the signal before is put back when
+ * the last one stops. Environments can start and stop their timers on
+ * several threads at once, so the entries, the count and the handler
+ * are only touched by the environment that has claimed the lock with a
+ * compare-and-swap.
+ */
+static muse_env * volatile g_preemption_lock = NULL;
+static int g_num_preemption_timers = 0;
+static struct sigaction g_prev_alrm;
+
+static void lock_preemption_timers( muse_env *env )
+{
+	while ( !muse_atomic_cas_ptr( &g_preemption_lock, NULL, env ) )
+		sched_yield();
+}
+
+static void unlock_preemption_timers( muse_env *env )
+{
+	muse_atomic_cas_ptr( &g_preemption_lock, env, NULL );
+}
+
+/**
+ * The preemption timer's signal handler. It only sets the environment's
+ * flag. The actual process switch happens at the next function
+ * application, which is a safe point.
+ */
+static void preemption_tick( int sig, siginfo_t *info, void *context )
+{
+	int index = info->si_value.sival_int;
+
+	if ( index >= 0 && index < MUSE_MAX_PREEMPTION_TIMERS )
+	{
+		muse_env *env = g_preemption_envs[index];
+		if ( env )
+			env->preempt_requested = 1;
+	}
+}
+
+/**
+ * Makes a timer with the notification \p sev signal the calling thread
+ * instead of whichever thread of the process happens to be running.
+ * An environment runs on a single thread, so its timers must interrupt
+ * that thread and not one that is evaluating some other environment.
+ * Where signals can't be directed to a thread, the process gets them
+ * as before.
+ */
+void muse_signal_this_thread( struct sigevent *sev )
+{
+#ifdef MUSE_THREAD_TIMERS
+	sev->sigev_notify = SIGEV_THREAD_ID;
+	sev->_sigev_un._tid = (pid_t)syscall( SYS_gettid );
+#endif
+}
+
+/**
+ * Starts a timer that raises SIGALRM every \p interval_us microseconds
+ * for the given environment. If the timer can't be created, processes
+ * continue to be switched based on their attention.
+ */
+static void start_preemption_timer( muse_env *env, int interval_us )
+{
+	struct sigevent sev;
+	struct itimerspec its;
+	timer_t *timer;
+	int index;
+
+	lock_preemption_timers(env);
+
+	for ( index = 0; index < MUSE_MAX_PREEMPTION_TIMERS && g_preemption_envs[index]; ++index );
+
+	if ( index == MUSE_MAX_PREEMPTION_TIMERS )
+	{
+		unlock_preemption_timers(env);
+		MUSE_DIAGNOSTICS({
+			fprintf( stderr, "muse: Too many preemption timers. Using attention instead.\n" );
+		});
+		return;
+	}
+
+	memset( &sev, 0, sizeof(sev) );
+	sev.sigev_notify = SIGEV_SIGNAL;
+	sev.sigev_signo = SIGALRM;
+	sev.sigev_value.sival_int = index;
+	muse_signal_this_thread( &sev );
+
+	timer = (timer_t*)calloc( 1, sizeof(timer_t) );
+	if ( timer_create( CLOCK_MONOTONIC, &sev, timer ) != 0 )
+	{
+		unlock_preemption_timers(env);
+		MUSE_DIAGNOSTICS({
+			fprintf( stderr, "muse: Couldn't create the preemption timer. Using attention instead.\n" );
+		});
+		free( timer );
+		return;
+	}
+
+	if ( g_num_preemption_timers++ == 0 )
+	{
+		struct sigaction sa;
+
+		memset( &sa, 0, sizeof(sa) );
+		sa.sa_sigaction = preemption_tick;
+		sa.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset( &sa.sa_mask );
+		sigaction( SIGALRM, &sa, &g_prev_alrm );
+	}
+
+	g_preemption_envs[index] = env;
+	env->preempt_timer = timer;
+	env->preempt_timer_index = index;
+	unlock_preemption_timers(env);
+
+	its.it_interval.tv_sec = interval_us / 1000000;
+	its.it_interval.tv_nsec = (interval_us % 1000000) * 1000;
+	its.it_value = its.it_interval;
+	timer_settime( *timer, 0, &its, NULL );
+}
+
+static void stop_preemption_timer( muse_env *env )
+{
+	if ( env->preempt_timer )
+	{
+		lock_preemption_timers(env);
+
+		timer_delete( *(timer_t*)env->preempt_timer );
+		g_preemption_envs[env->preempt_timer_index] = NULL;
+
+		if ( --g_num_preemption_timers == 0 )
+			sigaction( SIGALRM, &g_prev_alrm, NULL );
+
+		unlock_preemption_timers(env);
+
+		free( env->preempt_timer );
+		env->preempt_timer = NULL;
+	}
+}
+#else
+static void start_preemption_timer( muse_env *env, int interval_us )
+{
+	/* No timer available. Processes are switched based on their attention. */
+}
+
+static void stop_preemption_timer( muse_env *env )
+{
+}
+#endif
+
 /**
  * Creates a new muse environment.
  *
@@ -280,14 +629,12 @@ MUSEAPI muse_env *muse_init_env( const int *parameters )
 	
 	init_heap( env, &env->heap, env->parameters[MUSE_HEAP_SIZE] );
 	init_stack( &env->symbol_stack, env->parameters[MUSE_MAX_SYMBOLS] );
-	
-	/* The symbol stack is not really a stack. Its an array of buckets 
-	containing lists of symbols and is of fixed size. We use a hashing
-	algorithm to uniquify a symbol. */
-	env->symbol_stack.top = env->symbol_stack.bottom + env->symbol_stack.size;
+	init_symbol_index( &env->symbol_index, env->parameters[MUSE_MAX_SYMBOLS] );
+	init_stack( &env->free_locals, 256 );
 
 	/* Start a time reference point. */
 	env->timer = muse_tick();
+	muse_init_flight_recorder(env);
 
 	/* Create the main process. */
 	{
@@ -321,6 +668,9 @@ MUSEAPI muse_env *muse_init_env( const int *parameters )
 #else
 	env->parameters[MUSE_ENABLE_OBJC] = MUSE_FALSE;
 #endif
+
+	if ( env->parameters[MUSE_PREEMPTION_INTERVAL_US] > 0 )
+		start_preemption_timer( env, env->parameters[MUSE_PREEMPTION_INTERVAL_US] );
 	
 	return env;
 }
@@ -348,6 +698,12 @@ static void cleanup_slots( muse_env *env )
  */
 MUSEAPI void muse_destroy_env( muse_env *env )
 {
+	stop_preemption_timer(env);
+	muse_stop_profiler(env);
+	muse_stop_call_profile(env);
+	muse_stop_trace_events(env);
+	muse_destroy_worker_pool(env);
+
 #if defined(__APPLE__) && defined(MUSE_OBJC_SUPPORT)
 	/* Deallocate objc pool if enabled. */
 	destroy_objc_bridge(env);
@@ -367,11 +723,23 @@ MUSEAPI void muse_destroy_env( muse_env *env )
 
 	muse_gc(env, 0);
 	cleanup_slots(env);
+	muse_destroy_flight_recorder(env);
 	free_process( env->current_process );
+	muse_close_inbox(env);
+	while ( env->free_processes )
+	{
+		muse_process_frame_t *p = env->free_processes;
+		env->free_processes = p->next;
+		destroy_process_frame( p );
+	}
+	env->num_free_processes = 0;
 	muse_tock(env->timer);
 	free(env->builtin_symbols);
 	env->builtin_symbols = NULL;
 	destroy_stack( &env->symbol_stack );
+	destroy_symbol_index( &env->symbol_index );
+	destroy_stack( &env->free_locals );
+	destroy_timers( env );
 	destroy_heap( &env->heap );
 	free( env->parameters );
 	free( env->slots );
@@ -483,6 +851,7 @@ MUSEAPI muse_cell muse_cons( muse_env *env, muse_cell head, muse_cell tail )
 		if ( env->heap.free_cells == MUSE_NIL )
 		{
 			fprintf( stderr, "\t\t\tNo free cells!\n" );
+			muse_flight_record( env, "heap: out of free cells, growing from " MUSE_FMT_INT " to " MUSE_FMT_INT " cells", env->heap.size_cells, env->heap.size_cells * 2 );
 			grow_heap( &env->heap, env->heap.size_cells * 2 );
 		}
 	}
@@ -830,46 +1199,106 @@ MUSEAPI muse_cell muse_mk_destructor( muse_env *env, muse_nativefn_t fn, void *c
 	return f;
 }
 
-static muse_cell lookup_symbol( muse_env *env, const muse_char *start, const muse_char *end, muse_int *out_hash )
+enum { MUSE_SYMBOL_UTF8_BUFFER_SIZE = 128 };
+
+static int symbol_slot( muse_symbol_index_t *index, muse_int hash )
 {
-	muse_int hash = muse_hash_text( start, end, MUSE_SYMBOL_CELL );
-	
-	muse_stack *ss = _symstack();
-	
-	if ( out_hash )
-		*out_hash = hash;
+	return (int)((hash ^ (hash >> 16) ^ (hash >> 32)) & (index->capacity - 1));
+}
+
+/**
+ * Probes the symbol index for a symbol with the given name.
+ * The name is given either as a unicode string in \p wname
+ * or as a pure ASCII string in \p aname, of \p length characters.
+ * Returns the entry holding the symbol if found, or the free
+ * entry at which it should be inserted.
+ */
+static muse_symbol_entry_t *probe_symbol( muse_env *env, muse_int hash, const muse_char *wname, const char *aname, int length )
+{
+	muse_symbol_index_t *index = &env->symbol_index;
+	int mask = index->capacity - 1;
+	int i = symbol_slot( index, hash );
 
-	/* The symbols are allocated over a set of buckets according to 
-		their hashes. All symbols with the same hash are assigned to the
-		same bucket, which essentially contains a linear linked list of
-		symbols. After finding the bucket, we just do a linear search
-		through the symbols in the list to find the one that matches,
-		if there is one. */
+	/* Linear probing. The index is never more than 3/4 full, 
+	so we'll hit a free entry soon enough. Only entries with the
+	same hash and length need a look at the name. */
+	for ( ;; i = (i + 1) & mask )
 	{
-		int bucket = (int)(((hash % ss->size) + ss->size) % ss->size);
-		muse_cell slist = ss->bottom[bucket];
-		
-		while ( slist )
+		muse_symbol_entry_t *e = index->entries + i;
+
+		if ( e->symbol == MUSE_NIL )
+			return e;
+
+		if ( e->hash == hash && e->length == length )
 		{
-			muse_cell considering = _next(&slist);
-			muse_cell symdef = _head(_tail(considering));
-			
-			if ( _ptr(_head(symdef))->i == hash )
+			const muse_char *t = _ptr(_symname(e->symbol))->text.start;
+
+			int j = 0;
+
+			if ( wname )
+				j = (memcmp( t, wname, length * sizeof(muse_char) ) == 0) ? length : 0;
+			else
 			{
-				/* Maybe found. */
-				muse_text_cell t = _ptr(_tail(symdef))->text;
-				if ( (t.end - t.start) == (end - start) && wcscmp( t.start, start ) == 0 )
-				{
-					/* Found. */
-					return considering;
-				}
+				while ( j < length && t[j] == (muse_char)aname[j] )
+					++j;
+			}
+
+			if ( j == length )
+			{
+				/* Symbols that are looked up survive the next gc
+				even if nothing refers to them yet. */
+				e->gc_epoch = env->heap.gc_epoch;
+				return e;
 			}
 		}
-		
-		return MUSE_NIL;
 	}
 }
 
+static void grow_symbol_index( muse_env *env )
+{
+	muse_symbol_index_t *index = &env->symbol_index;
+	muse_symbol_entry_t *old_entries = index->entries;
+	int old_capacity = index->capacity;
+	int i;
+
+	index->capacity *= 2;
+	index->entries = (muse_symbol_entry_t*)calloc( index->capacity, sizeof(muse_symbol_entry_t) );
+
+	if ( index->entries == NULL )
+	{
+		index->entries = old_entries;
+		index->capacity = old_capacity;
+		muse_raise_error( env, MUSE_NIL, MUSE_NIL );
+		return;
+	}
+
+	for ( i = 0; i < old_capacity; ++i )
+	{
+		if ( old_entries[i].symbol )
+		{
+			int mask = index->capacity - 1;
+			int j = symbol_slot( index, old_entries[i].hash );
+
+			while ( index->entries[j].symbol )
+				j = (j + 1) & mask;
+
+			index->entries[j] = old_entries[i];
+		}
+	}
+
+	free( old_entries );
+}
+
+static muse_cell lookup_symbol( muse_env *env, const muse_char *start, const muse_char *end, muse_int *out_hash )
+{
+	muse_int hash = muse_hash_text( start, end, MUSE_SYMBOL_CELL );
+	
+	if ( out_hash )
+		*out_hash = hash;
+
+	return probe_symbol( env, hash, start, NULL, (int)(end - start) )->symbol;
+}
+
 /**
  * Includes the given symbol in the symbol table
  * and makes its value process-local. Note that no check
@@ -882,33 +1311,40 @@ MUSEAPI muse_cell muse_intern_symbol( muse_env *env, muse_cell sym, int local_ix
 
 	muse_assert( _cellt(sym) == MUSE_SYMBOL_CELL );
 
-	/* Define the symbol to be itself in all processes. */
+	/* Keep the symbol on the symbol stack at its local index. The
+	symbol stack serves as a list of all symbols. */
+	while ( local_ix >= ss->size )
 	{
-		muse_process_frame_t *cp = env->current_process;
-		muse_process_frame_t *p = cp;
-
-		do
-		{
-			/* Make sure we have enough storage for defined symbols 
-			in each process. */
-			if ( local_ix >= p->locals.size )
-			{
-				muse_assert( local_ix < 2 * p->locals.size );
-				if ( realloc_stack( &(p->locals), 2 * p->locals.size ) == MUSE_FALSE )
-					muse_raise_error( env, MUSE_NIL, MUSE_NIL );
-			}
-			
-			p->locals.bottom[local_ix] = sym;
-			p->locals.top = p->locals.bottom + env->num_symbols;
-			p = p->next;
-		}
-		while ( p != cp );
+		if ( realloc_stack( ss, 2 * ss->size ) == MUSE_FALSE )
+			muse_raise_error( env, MUSE_NIL, MUSE_NIL );
 	}
 
-	/* Add the symbol to its hash bucket. */
+	ss->bottom[local_ix] = sym;
+	if ( ss->top <= ss->bottom + local_ix )
+		ss->top = ss->bottom + local_ix + 1;
+
+	/* The symbol is itself in all processes, which is what it is
+	when no process has given it a value. So we don't need to touch
+	the processes here. */
+
+	/* Add named symbols to the index. Anonymous symbols made by
+	gensym don't have a name to be looked up by. */
+	if ( _symname(sym) )
 	{
-		int bucket = (int)(((hash % ss->size) + ss->size) % ss->size);
-		ss->bottom[bucket] = _cons( sym, ss->bottom[bucket] );
+		muse_text_cell *t = &_ptr(_symname(sym))->text;
+		int length = (int)(t->end - t->start);
+		muse_symbol_entry_t *e;
+
+		if ( 4 * (env->symbol_index.count + 1) > 3 * env->symbol_index.capacity )
+			grow_symbol_index(env);
+
+		e = probe_symbol( env, hash, t->start, NULL, length );
+		muse_assert( e->symbol == MUSE_NIL );
+		e->hash		= hash;
+		e->length	= length;
+		e->gc_epoch	= env->heap.gc_epoch;
+		e->symbol	= sym;
+		env->symbol_index.count++;
 	}
 
 	/* Set the head of the symbol to refer to the local index */
@@ -945,9 +1381,11 @@ MUSEAPI muse_cell muse_symbol( muse_env *env, const muse_char *start, const muse
 	{
 		int local_ix = _newlocal();
 		
-		/* sym -> ( . ) */
+		/* sym -> ( . ). The stack holds the cell as a cons until 
+		we're done, so the local cell goes into its head only when
+		it is interned. A gc in between would take it for a reference. */
 		p = _spos();
-		sym = _setcellt( _cons( _localcell(local_ix), MUSE_NIL ), MUSE_SYMBOL_CELL );
+		sym = _setcellt( _cons( MUSE_NIL, MUSE_NIL ), MUSE_SYMBOL_CELL );
 		
 		{
 			muse_cell name = muse_mk_text( env, start, end );
@@ -985,13 +1423,36 @@ MUSEAPI muse_cell muse_csymbol( muse_env *env, const muse_char *sym )
 MUSEAPI muse_cell muse_symbol_utf8( muse_env *env, const char *start, const char *end )
 {
 	int utf8_len = (int)(end - start);
-	muse_char *s = (muse_char*)calloc( muse_unicode_size(start, utf8_len), 1 );
-	int len = (int)muse_utf8_to_unicode( s, utf8_len, start, utf8_len );
-	
+
+	/* ASCII names, which is what most JSON keys and XML tags are,
+	are hashed and compared straight from the utf8 bytes, so an
+	existing symbol is found without converting the name. */
 	{
-		muse_cell c = muse_symbol( env, s, s + len );
-		free(s);
-		return c;
+		const unsigned char *c = (const unsigned char *)start;
+		muse_int hash = MUSE_SYMBOL_CELL;
+
+		for ( ; c < (const unsigned char *)end && *c < 0x80; ++c )
+			hash = hash * 65599 + (*c);
+
+		if ( c == (const unsigned char *)end )
+		{
+			muse_cell sym = probe_symbol( env, hash, NULL, start, utf8_len )->symbol;
+			if ( sym )
+				return sym;
+		}
+	}
+
+	/* Short names are converted on the stack. */
+	{
+		muse_char buffer[MUSE_SYMBOL_UTF8_BUFFER_SIZE];
+		muse_char *s = (utf8_len < MUSE_SYMBOL_UTF8_BUFFER_SIZE) ? buffer : (muse_char*)calloc( muse_unicode_size(start, utf8_len), 1 );
+		int len = (int)muse_utf8_to_unicode( s, utf8_len, start, utf8_len );
+		muse_cell sym = muse_symbol( env, s, s + len );
+
+		if ( s != buffer )
+			free(s);
+
+		return sym;
 	}
 }
 
@@ -1235,42 +1696,163 @@ void collect_free_cells( muse_env *env, muse_heap *heap )
 }
 
 
-void muse_gc_impl( muse_env *env, int free_cells_needed );
-
 /**
- * Collects all the garbage cells - i.e. unreferenced
- * cells. Cells referenced on the various stacks 
- * including the symbol stack are not collected.
- * \c _cons() automaticallly invokes this function
- * when it cannot take a cell from the free list.
- * 
- * @param free_cells_needed Tells the garbage collector
- * to ensure that these many free cells are available 
- * after collection. If simply collecting unreferenced
- * cells is insufficient, the collector will grow the heap
- * by a sufficient amount. If this parameter is <= 0,
- * it means muse environment is being destroyed and 
- * the gc call simply destroys all the specials.
+ * Marks the symbols that are kept even when nothing refers to
+ * them - builtin symbols, symbols with property lists and symbols
+ * that were looked up since the previous garbage collection.
+ * The last rule keeps symbols that native code has just obtained,
+ * but not stored anywhere yet. Also marks what the flight recorder
+ * and the profilers hold on to for their reports.
  */
-MUSEAPI void muse_gc( muse_env *env, int free_cells_needed )
+static void mark_symbols( muse_env *env )
 {
-	MUSE_DIAGNOSTICS3({
-		fprintf(stderr, "Gc...");
-		fflush(stderr);
-	});
+	muse_cell *syms = env->symbol_stack.bottom;
+	muse_cell *syms_end = env->symbol_stack.top;
+	muse_symbol_entry_t *e = env->symbol_index.entries;
+	muse_symbol_entry_t *e_end = e + env->symbol_index.capacity;
+	int i;
+
+	for ( i = 0; i < MUSE_NUM_BUILTIN_SYMBOLS; ++i )
+		muse_mark( env, env->builtin_symbols[i] );
 
+	for ( ; syms < syms_end; ++syms )
 	{
-#if MUSE_DIAGNOSTICS_LEVEL >= 3
-		muse_int time_taken;
-		void *timer = muse_tick();
-#endif
+		if ( *syms && _tail(_tail(*syms)) )
+			muse_mark( env, *syms );
+	}
 
-		env->collecting_garbage = MUSE_TRUE;
-		enter_atomic(env);
-		muse_gc_impl( env, free_cells_needed );
+	for ( ; e < e_end; ++e )
+	{
+		if ( e->symbol && e->gc_epoch + 1 >= env->heap.gc_epoch )
+			muse_mark( env, e->symbol );
+	}
+
+	muse_mark_flight_recorder( env );
+	muse_mark_profile_cells( env );
+}
+
+/**
+ * Removes the unmarked symbols from the symbol table
+ * and frees their local indices for reuse.
+ */
+static void sweep_symbols( muse_env *env )
+{
+	muse_stack *ss = _symstack();
+	muse_symbol_index_t *index = &env->symbol_index;
+	int collected = 0;
+	int ix;
+
+	for ( ix = 0; ix < (int)(ss->top - ss->bottom); ++ix )
+	{
+		muse_cell sym = ss->bottom[ix];
+
+		if ( sym && !_ismarked(sym) )
+		{
+			ss->bottom[ix] = MUSE_NIL;
+
+			if ( env->free_locals.top >= env->free_locals.bottom + env->free_locals.size )
+			{
+				if ( realloc_stack( &env->free_locals, 2 * env->free_locals.size ) == MUSE_FALSE )
+					continue; /* Leave the index unused. */
+			}
+
+			*(env->free_locals.top++) = ix;
+			++collected;
+		}
+	}
+
+	if ( collected > 0 )
+	{
+		int mask = index->capacity - 1;
+		int i = 0;
+
+		while ( i < index->capacity )
+		{
+			muse_cell sym = index->entries[i].symbol;
+
+			if ( sym && !_ismarked(sym) )
+			{
+				/* Removing an entry from a linear probing table would
+				break the probe sequences running through it. So the
+				entries after it that would no longer be found move
+				back into the hole. The entry moved into slot i gets
+				examined in the next iteration. */
+				int hole = i, j = i;
+
+				for ( ;; )
+				{
+					int k;
+
+					j = (j + 1) & mask;
+					if ( index->entries[j].symbol == MUSE_NIL )
+						break;
+
+					k = symbol_slot( index, index->entries[j].hash );
+					if ( (hole <= j) ? (hole < k && k <= j) : (hole < k || k <= j) )
+						continue;
+
+					index->entries[hole] = index->entries[j];
+					hole = j;
+				}
+
+				index->entries[hole].symbol = MUSE_NIL;
+				index->count--;
+			}
+			else
+				++i;
+		}
+
+		muse_flight_record( env, "gc: " MUSE_FMT_INT " symbols collected", collected, 0 );
+	}
+}
+
+void muse_gc_impl( muse_env *env, int free_cells_needed );
+
+/**
+ * Collects all the garbage cells - i.e. unreferenced
+ * cells. Cells referenced on the various stacks 
+ * including the symbol stack are not collected.
+ * \c _cons() automaticallly invokes this function
+ * when it cannot take a cell from the free list.
+ * 
+ * @param free_cells_needed Tells the garbage collector
+ * to ensure that these many free cells are available 
+ * after collection. If simply collecting unreferenced
+ * cells is insufficient, the collector will grow the heap
+ * by a sufficient amount. If this parameter is <= 0,
+ * it means muse environment is being destroyed and 
+ * the gc call simply destroys all the specials.
+ */
+MUSEAPI void muse_gc( muse_env *env, int free_cells_needed )
+{
+	MUSE_DIAGNOSTICS3({
+		fprintf(stderr, "Gc...");
+		fflush(stderr);
+	});
+
+	{
+#if MUSE_DIAGNOSTICS_LEVEL >= 3
+		muse_int time_taken;
+		void *timer = muse_tick();
+#endif
+
+		muse_int start_us = muse_elapsed_us(env->timer);
+
+		env->collecting_garbage = MUSE_TRUE;
+		enter_atomic(env);
+		muse_gc_impl( env, free_cells_needed );
 		leave_atomic(env);
+		if ( env->call_profile )
+			muse_call_profile_forget_cells(env);
 		env->collecting_garbage = MUSE_FALSE;
 
+		if ( free_cells_needed > 0 )
+		{
+			muse_flight_record( env, "gc: " MUSE_FMT_INT " free cells after " MUSE_FMT_INT " us", env->heap.free_cell_count, muse_elapsed_us(env->timer) - start_us );
+			if ( env->trace_events )
+				muse_trace_event( env, "gc", 'X', start_us, "free-cells", env->heap.free_cell_count );
+		}
+
 		MUSE_DIAGNOSTICS3({
 			time_taken = muse_tock(timer);
 			fprintf(stderr, "done. (free cells = %d)\n", _heap()->free_cell_count);		
@@ -1344,11 +1926,10 @@ void muse_gc_impl( muse_env *env, int free_cells_needed )
 				keep_marks( heap );
 				
 				_mark(0);
+				heap->gc_epoch++;
 
-				/* 2. Mark all symbols and their values and plists. */
-				mark_stack( env, _symstack() );
-				
-				/* 3. Mark references held by every process. */
+				/* 2. Mark references held by every process. This
+				also marks the symbols which have values in a process. */
 				{
 					muse_process_frame_t *cp = env->current_process;
 					muse_process_frame_t *p = cp;
@@ -1361,6 +1942,12 @@ void muse_gc_impl( muse_env *env, int free_cells_needed )
 					while ( p != cp );
 				}
 
+				/* 3. Mark the symbols that must be kept even if 
+				nothing refers to them, and drop the rest from the 
+				symbol table. */
+				mark_symbols( env );
+				sweep_symbols( env );
+
 				/* 4. Go through the specials list and release 
 					  everything that isn't referenced. */
 				free_unused_specials( env, &env->specials );
@@ -1382,6 +1969,7 @@ void muse_gc_impl( muse_env *env, int free_cells_needed )
 				while ( new_size < opt_size )
 					new_size *= 2;
 				
+				muse_flight_record( env, "heap: growing from " MUSE_FMT_INT " to " MUSE_FMT_INT " cells", heap->size_cells, new_size );
 				grow_heap( heap, new_size );
 			}
 		}
@@ -1494,6 +2082,120 @@ MUSEAPI muse_functional_object_t *muse_functional_object_data( muse_env *env, mu
  */
 /*@{*/
 
+static void share_locals( muse_locals_t *dest, const muse_locals_t *src )
+{
+	int i;
+
+	dest->num_pages = src->num_pages;
+	dest->pages = (muse_locals_page_t**)calloc( src->num_pages + 1, sizeof(muse_locals_page_t*) );
+
+	for ( i = 0; i < src->num_pages; ++i )
+	{
+		if ( (dest->pages[i] = src->pages[i]) )
+			dest->pages[i]->refs++;
+	}
+}
+
+static void release_locals( muse_locals_t *l )
+{
+	int i;
+
+	for ( i = 0; i < l->num_pages; ++i )
+	{
+		if ( l->pages[i] && --(l->pages[i]->refs) == 0 )
+			free( l->pages[i] );
+	}
+
+	free( l->pages );
+	l->pages = NULL;
+	l->num_pages = 0;
+}
+
+static void mark_locals( muse_env *env, muse_locals_t *l )
+{
+	int i, j;
+
+	for ( i = 0; i < l->num_pages; ++i )
+	{
+		muse_locals_page_t *page = l->pages[i];
+
+		/* Shared pages need to be marked only once. */
+		if ( page && page->mark_epoch != env->heap.gc_epoch )
+		{
+			page->mark_epoch = env->heap.gc_epoch;
+
+			for ( j = 0; j < MUSE_LOCALS_PAGE_SIZE; ++j )
+			{
+				int ix = (i << MUSE_LOCALS_PAGE_BITS) + j;
+
+				/* A symbol with a value in some process is kept. */
+				if ( page->cells[j] != MUSE_NO_LOCAL_VALUE )
+				{
+					muse_mark( env, page->cells[j] );
+					muse_mark( env, env->symbol_stack.bottom[ix] );
+				}
+			}
+		}
+	}
+}
+
+/**
+ * Returns the storage for the value of the local with index \p ix 
+ * in the given process, after making sure that the page it lives
+ * in belongs to the process alone.
+ */
+muse_cell *muse_own_local( muse_process_frame_t *p, int ix )
+{
+	muse_locals_t *l = &p->locals;
+	int page_ix = ix >> MUSE_LOCALS_PAGE_BITS;
+	muse_locals_page_t *page;
+
+	if ( page_ix >= l->num_pages )
+	{
+		int num_pages = l->num_pages;
+		muse_locals_page_t **pages;
+
+		while ( num_pages <= page_ix )
+			num_pages = num_pages * 2 + 16;
+
+		pages = (muse_locals_page_t**)realloc( l->pages, num_pages * sizeof(muse_locals_page_t*) );
+		if ( pages == NULL )
+			muse_raise_error( p->env, MUSE_NIL, MUSE_NIL );
+
+		memset( pages + l->num_pages, 0, (num_pages - l->num_pages) * sizeof(muse_locals_page_t*) );
+		l->pages = pages;
+		l->num_pages = num_pages;
+	}
+
+	page = l->pages[page_ix];
+
+	if ( page == NULL || page->refs > 1 )
+	{
+		muse_locals_page_t *copy = (muse_locals_page_t*)malloc( sizeof(muse_locals_page_t) );
+		if ( copy == NULL )
+			muse_raise_error( p->env, MUSE_NIL, MUSE_NIL );
+
+		copy->refs = 1;
+		copy->mark_epoch = 0;
+
+		if ( page )
+		{
+			memcpy( copy->cells, page->cells, sizeof(copy->cells) );
+			page->refs--;
+		}
+		else
+		{
+			int j;
+			for ( j = 0; j < MUSE_LOCALS_PAGE_SIZE; ++j )
+				copy->cells[j] = MUSE_NO_LOCAL_VALUE;
+		}
+
+		l->pages[page_ix] = page = copy;
+	}
+
+	return page->cells + (ix & (MUSE_LOCALS_PAGE_SIZE-1));
+}
+
 /**
  * Creates a new process and returns a pointer to the frame of the newly created process.
  * The new process is initially in the "paused" state. It will not run initially because
@@ -1512,39 +2214,76 @@ MUSEAPI muse_functional_object_t *muse_functional_object_data( muse_env *env, mu
  */
 muse_process_frame_t *create_process( muse_env *env, int attention, muse_cell thunk, void *sp )
 {
-	muse_process_frame_t *p = (muse_process_frame_t*)calloc( 1, sizeof(muse_process_frame_t) );
+	muse_process_frame_t *p = env->free_processes;
 
 	muse_assert( attention > 0 );
 
+	if ( sp == NULL && p )
+	{
+		/* Reuse the frame of a dead process along with its stacks. */
+		muse_stack stack			= p->stack;
+		muse_stack bindings_stack	= p->bindings_stack;
+		muse_stack cstack			= p->cstack;
+		char *cstack_mapping		= p->cstack_mapping;
+		muse_traceinfo_t traceinfo	= p->traceinfo;
+		muse_call_profile_calls_t calls = p->call_profile_calls;
+
+		env->free_processes = p->next;
+		env->num_free_processes--;
+
+		memset( p, 0, sizeof(muse_process_frame_t) );
+		p->stack			= stack;
+		p->bindings_stack	= bindings_stack;
+		p->cstack			= cstack;
+		p->cstack_mapping	= cstack_mapping;
+		p->traceinfo		= traceinfo;
+
+		/* Keep the arrays, but not the calls of the dead process. */
+		p->call_profile_calls = calls;
+		p->call_profile_calls.generation = 0;
+	}
+	else
+	{
+		int max_size = env->parameters[MUSE_STACK_SIZE];
+		int initial_size = (max_size < MUSE_INITIAL_STACK_SIZE) ? max_size : MUSE_INITIAL_STACK_SIZE;
+
+		p = (muse_process_frame_t*)calloc( 1, sizeof(muse_process_frame_t) );
+
+		/* Create all the stacks. They start small and grow as needed. */
+		init_stack( &p->stack,			initial_size	);
+		init_stack( &p->bindings_stack, initial_size	);
+			/**< 
+			 * The bindings stack can grow to twice the size of the
+			 * evaluation stack because the bindings stack is an
+			 * array of symbol-value pairs.
+			 */
+
+		/* Create the trace info. */
+		p->traceinfo.size = 32;
+		p->traceinfo.data = (muse_trace_t*)calloc( p->traceinfo.size, sizeof(muse_trace_t) );
+
+		if ( sp == NULL )
+			init_cstack( env, p, max_size );
+	}
+
 	p->env						= env;
 	p->attention				= attention;
 	p->remaining_attention		= attention;
 	p->state_bits				= MUSE_PROCESS_PAUSED;
+	p->priority					= MUSE_PRIORITY_NORMAL;
 	p->thunk					= thunk;
-	
-	/* Create all the stacks. */
-	init_stack( &p->stack,			env->parameters[MUSE_STACK_SIZE]		);
-	init_stack( &p->bindings_stack, env->parameters[MUSE_STACK_SIZE] * 2	);
-		/**< 
-		 * We need a x2 in the size for the bindings stack 
-		 * above because the bindings stack is an array of 
-		 * symbol-value pairs.
-		 */
-	init_stack( &p->locals,			env->parameters[MUSE_MAX_SYMBOLS]		);
-
-	/* Create the trace info. */
-	p->traceinfo.size = 32;
-	p->traceinfo.depth = 0;
-	p->traceinfo.data = (muse_trace_t*)calloc( p->traceinfo.size, sizeof(muse_trace_t) );
+	p->wakeup.index				= -1;
+	p->wakeup.kind				= MUSE_TIMER_WAKEUP;
+	p->wakeup.process			= p;
+	p->switched_in_us			= muse_elapsed_us(env->timer);
+	p->switched_in_cells		= env->heap.cells_taken;
 
 	if ( sp == NULL )
 	{
-		/* This is not the main process. Create a stack frame. 
-		The cstack frame is different from the other stack frame
-		in that it grows down. So top is the place the SP has to
-		jump to when entering the process and it'll be decremented
-		as more items gets pushed onto it. */
-		init_stack( &p->cstack, env->parameters[MUSE_STACK_SIZE] );
+		/* This is not the main process. The cstack frame is different 
+		from the other stack frames in that it grows down. So top is 
+		the place the SP has to jump to when entering the process and 
+		it'll be decremented as more items gets pushed onto it. */
 		p->cstack.top = p->cstack.bottom + p->cstack.size - 4;
 	}
 	else
@@ -1559,10 +2298,11 @@ muse_process_frame_t *create_process( muse_env *env, int attention, muse_cell th
 	/* Initialize the recent items. */
 	muse_init_recent( &(p->recent), 2, 16 );
 
-	/* Copy all the currently defined symbols over to the new process. */
+	/* The new process starts with the symbol values of the spawning
+	process. It shares the pages of values until one of them changes. */
 	if ( env->current_process )
 	{
-		memcpy( p->locals.bottom, env->current_process->locals.bottom, sizeof(muse_cell) * env->num_symbols );
+		share_locals( &p->locals, &env->current_process->locals );
 
 		/* Also set the current_port settings to stdin/out/err. */
 		p->current_port[MUSE_STDIN_PORT] = muse_stdport( env, MUSE_STDIN_PORT );
@@ -1602,12 +2342,71 @@ muse_cell process_id( muse_process_frame_t *p )
 	return _head(p->mailbox);
 }
 
+/**
+ * Appends the process to the given queue.
+ */
+static void enqueue_process( muse_process_queue_t *q, muse_process_frame_t *p )
+{
+	p->queue		= q;
+	p->queue_next	= NULL;
+	p->queue_prev	= q->tail;
+
+	if ( q->tail )
+		q->tail->queue_next = p;
+	else
+		q->head = p;
+
+	q->tail = p;
+}
+
+/**
+ * Puts the process at the front of the given queue.
+ */
+static void push_process( muse_process_queue_t *q, muse_process_frame_t *p )
+{
+	p->queue		= q;
+	p->queue_prev	= NULL;
+	p->queue_next	= q->head;
+
+	if ( q->head )
+		q->head->queue_prev = p;
+	else
+		q->tail = p;
+
+	q->head = p;
+}
+
+/**
+ * Takes the process out of whatever queue it is in.
+ */
+static void dequeue_process( muse_process_frame_t *p )
+{
+	muse_process_queue_t *q = p->queue;
+
+	if ( q )
+	{
+		if ( p->queue_prev )
+			p->queue_prev->queue_next = p->queue_next;
+		else
+			q->head = p->queue_next;
+
+		if ( p->queue_next )
+			p->queue_next->queue_prev = p->queue_prev;
+		else
+			q->tail = p->queue_prev;
+
+		p->queue = NULL;
+		p->queue_next = p->queue_prev = NULL;
+	}
+}
+
 /**
  * Should be called after create_process to get it rolling.
  * A newly created process (using create_process()) is not part of the 
  * process ring until it is "primed" using this function. A "primed" process
- * is initially in the "virgin" state. When the process is first switched to
- * in switch_to_process(), it comes alive.
+ * is initially in the "virgin" state. It is placed at the front of the 
+ * ready queue of its priority, so it comes alive at the next process switch
+ * that doesn't find a process of higher priority.
  */
 muse_boolean prime_process( muse_process_frame_t *process )
 {
@@ -1632,10 +2431,19 @@ muse_boolean prime_process( muse_process_frame_t *process )
 	Just save the current state. */
 	process->state_bits = MUSE_PROCESS_VIRGIN;
 
+	if ( env->current_process && env->current_process != process )
+		push_process( env->ready + process->priority, process );
+
 	return MUSE_TRUE;
 }
 
-static muse_env *g_env = NULL;
+/**
+ * The environment whose process is being started on its own C stack.
+ * run_process() takes no arguments since it is called right after the
+ * stack pointer is changed. Each thread runs its own environment, so
+ * this is kept per thread.
+ */
+static MUSE_THREAD_LOCAL muse_env *g_env = NULL;
 
 /**
  * Evaluates a process's thunk in a loop until the thunk 
@@ -1662,142 +2470,457 @@ muse_boolean run_process()
 }
 
 /**
- * Immediately switches attention to the given process. If the given
- * process is in the "virgin" state, run_process() is called on it.
- * If the process is in the "paused" state, it checks whether the
- * pause has timed out and if so switches to the process. If the process
- * is still waiting, then it tries all processes in the process ring
- * before giving the process another chance. 
+ * Adds the time and cells that the running process \p p has
+ * used since it was switched to, up to \p now_us.
+ */
+static void account_running( muse_env *env, muse_process_frame_t *p, muse_int now_us )
+{
+	p->running_us += now_us - p->switched_in_us;
+	p->cells_allocated += env->heap.cells_taken - p->switched_in_cells;
+	p->switched_in_us = now_us;
+	p->switched_in_cells = env->heap.cells_taken;
+}
+
+/**
+ * Immediately switches attention to the given process, which must be
+ * runnable. If the given process is in the "virgin" state, run_process() 
+ * is called on it. The process is taken out of its ready queue.
+ * Use run_next_process() to let the scheduler pick the process.
  *
- * Note that switch_to_process() will always return \c MUSE_TRUE,
- * - i.e. it will either block indefinitely or successfuly switch to the
- * given process.
+ * Note that switch_to_process() returns \c MUSE_TRUE when the
+ * current process gets to run again.
  */
 muse_boolean switch_to_process( muse_env *env, muse_process_frame_t *process )
 {
-SWITCH_TO_PROCESS:
-	if ( env->current_process == process )
-	{
-		/* We reach here only on deadlock conditions. However,
-		there may be a timeout in effect, in which case we shouldn't
-		use up CPU time just looping and should sleep like a good
-		citizen. */
-		if ( process->state_bits & MUSE_PROCESS_WAITING )
-			muse_sleep( 1000 );
-		else
-			return MUSE_TRUE;
-	}
+	muse_assert( process->state_bits & (MUSE_PROCESS_RUNNING | MUSE_PROCESS_VIRGIN) );
 
-	if ( process->state_bits & (MUSE_PROCESS_RUNNING | MUSE_PROCESS_VIRGIN) )
-	{
-		/* The process is running. Save current process state
-		and switch to the given process. */
+	dequeue_process( process );
 
-		if ( env->current_process->state_bits == MUSE_PROCESS_DEAD || setjmp( env->current_process->jmp ) == 0 )
-		{
-			env->current_process = process;
+	if ( env->current_process == process )
+		return MUSE_TRUE;
 
-			if ( env->current_process->state_bits & MUSE_PROCESS_VIRGIN )
-			{
-				env->current_process->state_bits = MUSE_PROCESS_RUNNING;
+	/* Save current process state and switch to the given process. */
+	{
+		muse_int now_us = muse_elapsed_us(env->timer);
 
-				/* Change the SP for the virgin process. */
-				g_env = env;
-				CHANGE_STACK_POINTER(env->current_process->cstack.top);
+		if ( now_us - env->last_switch_us > MUSE_FLIGHT_STALL_US && env->current_process->state_bits != MUSE_PROCESS_DEAD )
+			muse_flight_record( env, "stall: ran for " MUSE_FMT_INT " us before switching to process " MUSE_FMT_INT, now_us - env->last_switch_us, _celli( process_id(process) ) );
+		env->last_switch_us = now_us;
 
-				return run_process();
-			}
-			else
-				longjmp( env->current_process->jmp, 1 );
-		} 
+		if ( env->trace_events )
+			muse_trace_event( env, "switch", 'i', now_us, "to", muse_trace_event_tid( env, process ) );
 
-		return MUSE_TRUE;
+		account_running( env, env->current_process, now_us );
+		process->switched_in_us = now_us;
+		process->switched_in_cells = env->heap.cells_taken;
 	}
 
-	if ( process->state_bits & MUSE_PROCESS_WAITING )
+	if ( env->current_process->state_bits == MUSE_PROCESS_DEAD || setjmp( env->current_process->jmp ) == 0 )
 	{
-		/* If process is waiting for a message and it got one, the
-		fn_pid would have activated the process already. If it is still
-		waiting, check the timeout value in order to resume the process. */
+		env->current_process = process;
 
-		if ( process->state_bits & MUSE_PROCESS_HAS_TIMEOUT )
+		if ( env->current_process->state_bits & MUSE_PROCESS_VIRGIN )
 		{
-			/* Check timeout. */
-			muse_int elapsed_us = muse_elapsed_us(env->timer);
-			if ( elapsed_us >= process->timeout_us )
-				process->state_bits = MUSE_PROCESS_RUNNING;
+			env->current_process->state_bits = MUSE_PROCESS_RUNNING;
+
+			/* Change the SP for the virgin process. */
+			g_env = env;
+			CHANGE_STACK_POINTER(env->current_process->cstack.top);
+
+			return run_process();
 		}
+		else
+			longjmp( env->current_process->jmp, 1 );
+	} 
 
-		if ( process->state_bits == MUSE_PROCESS_RUNNING && env->current_process != process )
-			goto SWITCH_TO_PROCESS;
-	}
+	return MUSE_TRUE;
+}
 
-	/* Can't run this one. Try the next process. */
-	process = process->next;
-	goto SWITCH_TO_PROCESS;
+static void place_timer( muse_timer_heap_t *h, muse_timer_t *t, int i )
+{
+	h->timers[i] = t;
+	t->index = i;
 }
 
 /**
- * Goes around the processes list and returns to the same point
- * after one round-robin cycle. procrastinate() will not 
- * switch to the next process if an atomic operation is going on.
+ * Moves the timer at position \p i towards the top of the
+ * heap until its parent isn't due later than itself.
  */
-muse_boolean procrastinate( muse_env *env )
+static void sift_timer_up( muse_timer_heap_t *h, int i )
 {
-	if ( env->current_process->atomicity == 0 )
-		return switch_to_process( env, env->current_process->next );
-	else
-		return MUSE_TRUE;
+	muse_timer_t *t = h->timers[i];
+
+	while ( i > 0 && h->timers[(i-1)/2]->due_us > t->due_us )
+	{
+		place_timer( h, h->timers[(i-1)/2], i );
+		i = (i-1)/2;
+	}
+
+	place_timer( h, t, i );
 }
 
 /**
- * Used by muse_apply() to decrement the attention spent on the
- * current process.
+ * Moves the timer at position \p i towards the bottom of the
+ * heap until none of its children are due earlier than itself.
  */
-void yield_process( muse_env *env, int spent_attention )
+static void sift_timer_down( muse_timer_heap_t *h, int i )
 {
-	muse_process_frame_t *p = env->current_process;
-	
-	if ( p == p->next ) {
-		if ( p->num_eval_timeouts == 0 ) return;
-		check_timeout(env);
-		return;
-	}
+	muse_timer_t *t = h->timers[i];
 
-	if ( p->atomicity == 0 )
+	while ( 2*i+1 < h->count )
 	{
-		/* Not in an atomic block. So check remaining attention. */
-		if ( p->remaining_attention <= 0 )
-		{
-			/* Give time to the next process. */
-			if ( p->num_eval_timeouts > 0 ) check_timeout(env);
-			p->remaining_attention = p->attention;
-			switch_to_process( env, p->next );
-		}
-		else
-			p->remaining_attention -= spent_attention;
+		int c = 2*i+1;
+
+		if ( c+1 < h->count && h->timers[c+1]->due_us < h->timers[c]->due_us )
+			++c;
+
+		if ( h->timers[c]->due_us >= t->due_us )
+			break;
+
+		place_timer( h, h->timers[c], i );
+		i = c;
 	}
+
+	place_timer( h, t, i );
 }
 
 /**
- * Returns \c MUSE_TRUE if the current process is the main process
- * and \c MUSE_FALSE otherwise.
+ * Takes a timer off the timer heap. Does nothing if the timer isn't set.
  */
-muse_boolean is_main_process( muse_env *env )
+static void cancel_timer( muse_env *env, muse_timer_t *t )
 {
-	return (env->current_process->cstack.size > 0) ? MUSE_FALSE : MUSE_TRUE;
+	muse_timer_heap_t *h = &env->timers;
+	int i = t->index;
+
+	if ( i >= 0 )
+	{
+		t->index = -1;
+
+		if ( i < --h->count )
+		{
+			/* Fill the gap with the last timer. */
+			muse_timer_t *last = h->timers[h->count];
+			place_timer( h, last, i );
+
+			if ( i > 0 && h->timers[(i-1)/2]->due_us > last->due_us )
+				sift_timer_up( h, i );
+			else
+				sift_timer_down( h, i );
+		}
+	}
 }
 
 /**
- * Removes the given process from the process ring and marks it
- * as "dead". It then switches to the next process in the ring so that
- * the ring can continue.
+ * Sets the timer to expire at \p due_us on the environment's timer,
+ * replacing its previous due time if it was already set.
  */
-muse_boolean remove_process( muse_process_frame_t *process )
+static void set_timer( muse_env *env, muse_timer_t *t, muse_int due_us )
 {
-	muse_env *env = process->env;
+	muse_timer_heap_t *h = &env->timers;
 
-	/* First take the process out of the ring. */
+	cancel_timer( env, t );
+	t->due_us = due_us;
+
+	if ( h->count == h->capacity )
+	{
+		h->capacity = h->capacity ? h->capacity * 2 : 64;
+		h->timers = (muse_timer_t**)realloc( h->timers, h->capacity * sizeof(muse_timer_t*) );
+	}
+
+	place_timer( h, t, h->count++ );
+	sift_timer_up( h, t->index );
+}
+
+/**
+ * Acts on the timers that have expired by \p now_us. A process
+ * whose wakeup timer expired becomes runnable. A process whose
+ * eval timeout expired gets to check its timeouts the next time
+ * it yields, and stops waiting so that the timeout also cuts
+ * short a \ref fn_receive "receive".
+ */
+static void expire_timers( muse_env *env, muse_int now_us )
+{
+	muse_timer_heap_t *h = &env->timers;
+
+	while ( h->count > 0 && h->timers[0]->due_us <= now_us )
+	{
+		muse_timer_t *t = h->timers[0];
+
+		cancel_timer( env, t );
+
+		if ( t->kind == MUSE_TIMER_WAKEUP )
+			resume_process( t->process );
+		else
+		{
+			t->process->expired_eval_timeouts++;
+			resume_process( t->process );
+		}
+	}
+}
+
+/**
+ * Removes the timers of a process that is being freed.
+ */
+static void cancel_process_timers( muse_process_frame_t *p )
+{
+	muse_timer_heap_t *h = &p->env->timers;
+	int i, n = 0;
+
+	for ( i = 0; i < h->count; ++i )
+	{
+		if ( h->timers[i]->process == p )
+			h->timers[i]->index = -1;
+		else
+			place_timer( h, h->timers[i], n++ );
+	}
+
+	h->count = n;
+
+	for ( i = n/2 - 1; i >= 0; --i )
+		sift_timer_down( h, i );
+}
+
+/**
+ * Frees the timer heap of an environment.
+ */
+void destroy_timers( muse_env *env )
+{
+	free( env->timers.timers );
+	env->timers.timers = NULL;
+	env->timers.count = env->timers.capacity = 0;
+}
+
+/**
+ * Resumes the waiting processes that are due - those whose
+ * timeouts have expired and, every MUSE_IO_POLL_INTERVAL_US, 
+ * those whose sockets have got ready.
+ */
+static void wake_processes( muse_env *env )
+{
+	muse_int now_us = muse_elapsed_us(env->timer);
+
+	if ( env->timers.count > 0 && now_us >= env->timers.timers[0]->due_us )
+		expire_timers( env, now_us );
+
+	if ( env->io_waiting > 0 && now_us >= env->next_io_poll_us )
+	{
+		env->next_io_poll_us = now_us + MUSE_IO_POLL_INTERVAL_US;
+		env->poll_io( env, 0 );
+	}
+}
+
+/**
+ * Called when no process can run. Blocks until the earliest 
+ * timeout expires, a socket that a process is waiting for 
+ * gets ready or a message arrives from another environment.
+ * If there is none of these to wait for, nothing can wake the
+ * processes up and this just sleeps.
+ */
+static void wait_for_ready_process( muse_env *env )
+{
+	muse_int now_us = muse_elapsed_us(env->timer);
+	muse_int wait_us = MUSE_IDLE_WAIT_US;
+
+	if ( env->timers.count > 0 )
+	{
+		if ( env->timers.timers[0]->due_us - now_us < wait_us )
+			wait_us = env->timers.timers[0]->due_us - now_us;
+		if ( wait_us < 0 )
+			wait_us = 0;
+	}
+
+	if ( env->io_waiting > 0 )
+	{
+		env->poll_io( env, wait_us );
+		env->next_io_poll_us = muse_elapsed_us(env->timer) + MUSE_IO_POLL_INTERVAL_US;
+	}
+	else if ( env->inbox )
+		muse_wait_remote_messages( env, wait_us );
+	else if ( wait_us > 0 )
+		muse_sleep( wait_us );
+
+	if ( env->timers.count > 0 )
+		expire_timers( env, muse_elapsed_us(env->timer) );
+
+	if ( env->inbox )
+		muse_deliver_remote_messages( env );
+}
+
+/**
+ * Switches to the next process in line. The current process, if it
+ * can still run, goes to the back of its ready queue and the first
+ * process of the highest priority ready queue gets to run. If no 
+ * process can run, this blocks until one can.
+ */
+muse_boolean run_next_process( muse_env *env )
+{
+	muse_process_frame_t *p = env->current_process;
+
+	if ( env->timers.count > 0 || env->io_waiting > 0 )
+		wake_processes( env );
+
+	if ( p->state_bits & MUSE_PROCESS_RUNNING )
+		enqueue_process( env->ready + p->priority, p );
+
+	if ( env->inbox )
+		muse_deliver_remote_messages( env );
+
+	while (1)
+	{
+		int i;
+
+		muse_flight_recorder_poll( env );
+
+		for ( i = 0; i < MUSE_NUM_PRIORITIES; ++i )
+		{
+			if ( env->ready[i].head )
+				return switch_to_process( env, env->ready[i].head );
+		}
+
+		wait_for_ready_process( env );
+	}
+}
+
+/**
+ * Puts the current process into the waiting state and switches to
+ * the next process. The process waits until resume_process() is
+ * called on it or, if \p wakeup_us is not negative, until the
+ * environment's timer reaches \p wakeup_us. \p wait_bits are
+ * additional state bits such as MUSE_PROCESS_WAITING_IO.
+ */
+void pause_process( muse_env *env, int wait_bits, muse_int wakeup_us )
+{
+	muse_process_frame_t *p = env->current_process;
+
+	p->state_bits = MUSE_PROCESS_WAITING | wait_bits;
+	p->wait_started_us = muse_elapsed_us(env->timer);
+
+	if ( wait_bits & MUSE_PROCESS_WAITING_IO )
+		p->wait_reason = MUSE_WAIT_SOCKET;
+	else if ( wait_bits & MUSE_PROCESS_WAITING_ROOM )
+		p->wait_reason = MUSE_WAIT_MAILBOX;
+	else if ( wait_bits & MUSE_PROCESS_WAITING_MESSAGE )
+		p->wait_reason = MUSE_WAIT_MESSAGE;
+	else
+		p->wait_reason = MUSE_WAIT_TIMEOUT;
+
+	if ( wakeup_us >= 0 )
+	{
+		p->state_bits |= MUSE_PROCESS_HAS_TIMEOUT;
+		set_timer( env, &p->wakeup, wakeup_us );
+	}
+
+	run_next_process( env );
+}
+
+/**
+ * Makes a waiting process runnable by placing it at the back
+ * of its ready queue. Does nothing if the process isn't waiting.
+ */
+void resume_process( muse_process_frame_t *p )
+{
+	if ( p->state_bits & MUSE_PROCESS_WAITING )
+	{
+		muse_env *env = p->env;
+
+		muse_int now_us = muse_elapsed_us(env->timer);
+
+		cancel_timer( env, &p->wakeup );
+		dequeue_process( p );
+		p->state_bits = MUSE_PROCESS_RUNNING;
+		p->waiting_us[p->wait_reason] += now_us - p->wait_started_us;
+		enqueue_process( env->ready + p->priority, p );
+
+		/* The running process isn't keeping anyone waiting until now. */
+		env->last_switch_us = now_us;
+	}
+}
+
+/**
+ * Lets the next process run and returns when the current
+ * process's turn comes again. procrastinate() will not 
+ * switch to the next process if an atomic operation is going on.
+ */
+muse_boolean procrastinate( muse_env *env )
+{
+	if ( env->current_process->atomicity == 0 )
+		return run_next_process( env );
+	else
+		return MUSE_TRUE;
+}
+
+/**
+ * Used by muse_apply() to decrement the attention spent on the
+ * current process.
+ */
+void yield_process( muse_env *env, int spent_attention )
+{
+	muse_process_frame_t *p = env->current_process;
+	
+	if ( p == p->next ) {
+		if ( p->num_eval_timeouts == 0 ) return;
+		check_timeout(env);
+		return;
+	}
+
+	if ( p->atomicity == 0 )
+	{
+		/* Not in an atomic block. So check remaining attention. */
+		if ( p->remaining_attention <= 0 )
+		{
+			/* Give time to the next process. */
+			if ( p->num_eval_timeouts > 0 ) check_timeout(env);
+			p->remaining_attention = p->attention;
+			run_next_process( env );
+		}
+		else
+			p->remaining_attention -= spent_attention;
+	}
+}
+
+/**
+ * Used by muse_apply() instead of yield_process() when the environment's
+ * preemption timer has ticked since the last switch, or when SIGUSR1 asked
+ * for a flight recorder dump, which is written first. The switch is
+ * postponed while the current process is in an atomic block.
+ */
+void preempt_process( muse_env *env )
+{
+	muse_process_frame_t *p = env->current_process;
+
+	muse_flight_recorder_poll( env );
+
+	if ( p->atomicity > 0 )
+		return;
+
+	env->preempt_requested = 0;
+
+	if ( p->num_eval_timeouts > 0 ) 
+		check_timeout(env);
+
+	if ( p != p->next )
+		run_next_process( env );
+}
+
+/**
+ * Returns \c MUSE_TRUE if the current process is the main process
+ * and \c MUSE_FALSE otherwise.
+ */
+muse_boolean is_main_process( muse_env *env )
+{
+	return (env->current_process->cstack.size > 0) ? MUSE_FALSE : MUSE_TRUE;
+}
+
+/**
+ * Removes the given process from the process ring and marks it
+ * as "dead". It then switches to the next process in the ring so that
+ * the ring can continue.
+ */
+muse_boolean remove_process( muse_process_frame_t *process )
+{
+	muse_env *env = process->env;
+
+	/* First take the process out of the ring. */
 	muse_process_frame_t 
 		*prev = process->prev,
 		*next = process->next;
@@ -1814,9 +2937,19 @@ muse_boolean remove_process( muse_process_frame_t *process )
 		prev->next = next;
 	}
 
+	dequeue_process( process );
 	process->state_bits = MUSE_PROCESS_DEAD;
 	process->next = process->prev = NULL;
 
+	/* Its escape continuations can't be invoked any more. */
+	close_escape_points( env, process, NULL );
+
+	/* Processes waiting to post to this one find it dead. */
+	while ( process->blocked_senders.head )
+		resume_process( process->blocked_senders.head );
+
+	muse_flight_record( env, "exit: process " MUSE_FMT_INT, _celli( process_id(process) ), 0 );
+
 	if ( env->current_process == process )
 	{
 		if ( process == next )
@@ -1825,7 +2958,7 @@ muse_boolean remove_process( muse_process_frame_t *process )
 			exit(0); /* All processes exited! */
 		}
 		else
-			return switch_to_process( env, next );
+			return run_next_process( env );
 	}
 	else
 		return MUSE_TRUE;
@@ -1861,7 +2994,10 @@ muse_boolean remove_process( muse_process_frame_t *process )
  *   ((pid 'MsgType2 . args) expr-2)
  *   ...
  *   )
- * @endcode
+ * @endcode *
+ * If the target process's mailbox is full, the sending process waits until
+ * there is room for the message. Sending evaluates to T, or to () if the
+ * target process has ended.
  */
 muse_cell fn_pid( muse_env *env, muse_process_frame_t *p, muse_cell args )
 {
@@ -1875,12 +3011,14 @@ muse_cell fn_pid( muse_env *env, muse_process_frame_t *p, muse_cell args )
 		To this, we prepend the pid of the sending process and append
 		the result to the message queue of our process. */
 		muse_cell msg = _cons( process_id(env->current_process), muse_eval_list(env,args) );
+		muse_boolean posted = wait_for_mailbox_room( env, p, MUSE_TRUE );
 
-		post_message( p, msg );
+		if ( posted )
+			post_message( p, msg );
 
 		_unwind(sp);
 
-		return _builtin_symbol( MUSE_T );
+		return posted ? _builtin_symbol( MUSE_T ) : MUSE_NIL;
 	}
 
 	if ( muse_doing_gc(env) && p->state_bits == MUSE_PROCESS_DEAD )
@@ -1892,6 +3030,85 @@ muse_cell fn_pid( muse_env *env, muse_process_frame_t *p, muse_cell args )
 	return MUSE_NIL;
 }
 
+/**
+ * Fills \p info with what there is to know about the process
+ * with the given pid, for profiling and for finding processes that
+ * hog the scheduler or the heap. Returns \c MUSE_FALSE if \p pid
+ * isn't a process id.
+ *
+ * The time a process is currently running or waiting is included,
+ * as are the cells allocated by the current process so far. The
+ * C stack high water mark is only known for spawned processes
+ * and the main process has -1 for it.
+ */
+MUSEAPI muse_boolean muse_process_info( muse_env *env, muse_cell pid, muse_process_info_t *info )
+{
+	muse_process_frame_t *p;
+	muse_int now_us;
+	int i;
+
+	if ( pid <= 0 || _cellt(pid) != MUSE_NATIVEFN_CELL || _ptr(pid)->fn.fn != (muse_nativefn_t)fn_pid )
+		return MUSE_FALSE;
+
+	p		= (muse_process_frame_t*)_ptr(pid)->fn.context;
+	now_us	= muse_elapsed_us(env->timer);
+
+	memset( info, 0, sizeof(muse_process_info_t) );
+	info->state_bits		= p->state_bits;
+	info->priority			= p->priority;
+	info->attention			= p->attention;
+	info->reductions		= p->reductions;
+	info->running_us		= p->running_us;
+	info->cells_allocated	= p->cells_allocated;
+	info->mailbox_length	= p->mailbox_count;
+	info->mailbox_capacity	= p->mailbox_capacity;
+	info->stack_high_water	= stack_high_water( &p->stack );
+	info->bindings_high_water = stack_high_water( &p->bindings_stack );
+	info->cstack_high_water	= (p->cstack.size > 0) ? cstack_high_water( p ) : -1;
+
+	for ( i = 0; i < MUSE_NUM_WAIT_REASONS; ++i )
+		info->waiting_us[i] = p->waiting_us[i];
+
+	if ( p == env->current_process )
+	{
+		info->running_us		+= now_us - p->switched_in_us;
+		info->cells_allocated	+= env->heap.cells_taken - p->switched_in_cells;
+	}
+	else if ( p->state_bits & MUSE_PROCESS_WAITING )
+	{
+		info->waiting_us[p->wait_reason] += now_us - p->wait_started_us;
+	}
+
+	return MUSE_TRUE;
+}
+
+/**
+ * Returns a list of the pids of all the processes that haven't 
+ * ended yet, starting with the current process.
+ */
+MUSEAPI muse_cell muse_processes( muse_env *env )
+{
+	muse_process_frame_t *cp = env->current_process;
+	muse_process_frame_t *p = cp;
+	muse_cell result = MUSE_NIL, last = MUSE_NIL;
+
+	do
+	{
+		muse_cell c = _cons( process_id(p), MUSE_NIL );
+
+		if ( last )
+			_sett( last, c );
+		else
+			result = c;
+
+		last = c;
+		p = p->next;
+	}
+	while ( p && p != cp );
+
+	return result;
+}
+
 /**
  * Marks all references held by the given process. Called prior to
  * garbage collection.
@@ -1901,27 +3118,75 @@ void mark_process( muse_process_frame_t *p )
 	muse_env *env = p->env;
 	mark_stack( env, &p->stack );
 	mark_stack( env, &p->bindings_stack );
-	mark_stack( env, &p->locals );
+	mark_locals( env, &p->locals );
+	mark_trap_points( env, p->traps );
 	muse_mark( env, p->thunk );
 	muse_mark( env, p->mailbox );
+	muse_mark( env, p->generator );
 	muse_mark_recent( env, &(p->recent) );
 }
 
-/**
- * Frees process data structure memory.
- */
-void free_process( muse_process_frame_t *p )
+static void destroy_process_frame( muse_process_frame_t *p )
 {
-	muse_clear_recent( &(p->recent) );
-	destroy_stack( &p->locals );
+	destroy_cstack( p );
 	destroy_stack( &p->bindings_stack );
 	destroy_stack( &p->stack );
 	free(p->traceinfo.data);
 	p->traceinfo.data = NULL;
 	p->traceinfo.size = p->traceinfo.depth = 0;
+	free(p->call_profile_calls.stats);
+	free(p->call_profile_calls.active);
 	free(p);
 }
 
+/**
+ * Frees process data structure memory. The frames of spawned
+ * processes are kept in a pool of up to MUSE_PROCESS_POOL_SIZE
+ * frames for reuse by create_process().
+ */
+void free_process( muse_process_frame_t *p )
+{
+	muse_env *env = p->env;
+
+	cancel_process_timers( p );
+	if ( p->remote_slot )
+		muse_unexport_process( p );
+	muse_clear_recent( &(p->recent) );
+	release_locals( &p->locals );
+	destroy_trap_points( p );
+
+	/* The frames of waiting senders and receivers can be freed in any order. */
+	dequeue_process( p );
+	while ( p->blocked_senders.head )
+		dequeue_process( p->blocked_senders.head );
+	free( p->senders.queues );
+	p->senders.queues = NULL;
+	p->senders.capacity = p->senders.count = 0;
+
+	if ( p->cstack.size > 0 && env->num_free_processes < MUSE_PROCESS_POOL_SIZE )
+	{
+		/* Keep the frame of a spawned process for the next one to use.
+		Stacks that grew are trimmed back so that the pool stays small. */
+		if ( p->stack.size > MUSE_INITIAL_STACK_SIZE )
+			realloc_stack( &p->stack, MUSE_INITIAL_STACK_SIZE );
+		if ( p->bindings_stack.size > MUSE_INITIAL_STACK_SIZE )
+			realloc_stack( &p->bindings_stack, MUSE_INITIAL_STACK_SIZE );
+		p->stack.top = p->stack.bottom;
+		p->bindings_stack.top = p->bindings_stack.bottom;
+		memset( p->stack.bottom, 0, p->stack.size * sizeof(muse_cell) );
+		memset( p->bindings_stack.bottom, 0, p->bindings_stack.size * sizeof(muse_cell) );
+		p->traceinfo.depth = 0;
+		trim_cstack( p );
+
+		p->next = env->free_processes;
+		env->free_processes = p;
+		env->num_free_processes++;
+		return;
+	}
+
+	destroy_process_frame( p );
+}
+
 /**
  * Enters an atomic block that should be evaluated
  * without switching to another process.
@@ -1944,44 +3209,281 @@ void leave_atomic(muse_env *env)
 	env->current_process->atomicity--;
 }
 
+static int sender_slot( muse_mailbox_index_t *index, muse_cell sender )
+{
+	return (int)((sender ^ (sender >> 8)) & (index->capacity - 1));
+}
+
+/**
+ * Returns the queue of messages from the given sender, or
+ * the free slot where it should go if there are none.
+ */
+static muse_sender_queue_t *probe_sender( muse_mailbox_index_t *index, muse_cell sender )
+{
+	int mask = index->capacity - 1;
+	int i = sender_slot( index, sender );
+
+	while ( index->queues[i].sender && index->queues[i].sender != sender )
+		i = (i + 1) & mask;
+
+	return index->queues + i;
+}
+
+static muse_boolean grow_mailbox_index( muse_mailbox_index_t *index )
+{
+	muse_sender_queue_t *old_queues = index->queues;
+	int old_capacity = index->capacity;
+	int i;
+
+	index->capacity = old_capacity ? 2 * old_capacity : 8;
+	index->queues = (muse_sender_queue_t*)calloc( index->capacity, sizeof(muse_sender_queue_t) );
+
+	if ( index->queues == NULL )
+	{
+		index->queues = old_queues;
+		index->capacity = old_capacity;
+		return MUSE_FALSE;
+	}
+
+	for ( i = 0; i < old_capacity; ++i )
+	{
+		if ( old_queues[i].sender )
+			*probe_sender( index, old_queues[i].sender ) = old_queues[i];
+	}
+
+	free( old_queues );
+	return MUSE_TRUE;
+}
+
+/**
+ * Frees the slot of a sender with no more messages. The entries
+ * after it that would no longer be found move back into the hole.
+ */
+static void remove_sender( muse_mailbox_index_t *index, muse_sender_queue_t *q )
+{
+	int mask = index->capacity - 1;
+	int hole = (int)(q - index->queues), j = hole;
+
+	for ( ;; )
+	{
+		int k;
+
+		j = (j + 1) & mask;
+		if ( index->queues[j].sender == MUSE_NIL )
+			break;
+
+		k = sender_slot( index, index->queues[j].sender );
+
+		/* The entry at j stays if its home slot k is cyclically in (hole, j]. */
+		if ( (hole <= j) ? (hole < k && k <= j) : (hole < k || k <= j) )
+			continue;
+
+		index->queues[hole] = index->queues[j];
+		hole = j;
+	}
+
+	index->queues[hole].sender = MUSE_NIL;
+	index->queues[hole].first = index->queues[hole].last = MUSE_NIL;
+	index->count--;
+}
+
+/**
+ * Returns the pid at the head of the message if the message
+ * is indexed by sender, and MUSE_NIL otherwise.
+ */
+static muse_cell message_sender( muse_env *env, muse_cell msg )
+{
+	if ( msg && _cellt(msg) == MUSE_CONS_CELL )
+	{
+		muse_cell h = _head(msg);
+
+		if ( h && _cellt(h) == MUSE_NATIVEFN_CELL && _ptr(h)->fn.fn == (muse_nativefn_t)fn_pid )
+			return h;
+	}
+
+	return MUSE_NIL;
+}
+
 /**
  * Appends the given message (which, in general, should include the 
  * sending process's pid at the head) to the mailbox of the given 
- * process. 
+ * process. The mailbox's capacity isn't checked here.
  *
  * @see fn_post
+ * @see wait_for_mailbox_room()
  */
 void post_message( muse_process_frame_t *p, muse_cell msg )
 {
-	muse_env *env = p->env;
+	post_message_from( p, msg, process_id(p->env->current_process) );
+}
 
-	muse_cell msg_entry = _cons( msg, MUSE_NIL );
+/**
+ * Same as post_message(), but \p from is taken to be the posting
+ * process when deciding whether to wake a process that is receiving
+ * from a particular process. A message from another environment
+ * has no local sender and is given as MUSE_NIL.
+ */
+void post_message_from( muse_process_frame_t *p, muse_cell msg, muse_cell from )
+{
+	muse_env *env = p->env;
+	int sp = _spos();
+	muse_cell sender = message_sender( env, msg );
+	muse_cell msg_entry = _cons( _cons( msg, MUSE_NIL ), MUSE_NIL );
 
 	_sett( p->mailbox_end, msg_entry );
 
 	p->mailbox_end = msg_entry;
+	p->mailbox_count++;
 
-	if ( p->state_bits & MUSE_PROCESS_WAITING )
+	if ( sender && (4 * (p->senders.count + 1) <= 3 * p->senders.capacity || grow_mailbox_index( &p->senders )) )
 	{
-		if ( !(p->waiting_for_pid) || p->waiting_for_pid == process_id(env->current_process) )
-			p->state_bits = MUSE_PROCESS_RUNNING;
+		muse_sender_queue_t *q = probe_sender( &p->senders, sender );
+
+		if ( q->sender )
+			_sett( _head(q->last), msg_entry );
+		else
+		{
+			q->sender = sender;
+			q->first = msg_entry;
+			p->senders.count++;
+		}
+
+		q->last = msg_entry;
+	}
+
+	_unwind(sp);
+
+	if ( env->trace_events )
+		muse_trace_event( env, "post", 'i', muse_elapsed_us(env->timer), "to", muse_trace_event_tid( env, p ) );
+
+	if ( (p->state_bits & (MUSE_PROCESS_WAITING | MUSE_PROCESS_WAITING_IO | MUSE_PROCESS_WAITING_ROOM)) == MUSE_PROCESS_WAITING )
+	{
+		if ( !(p->waiting_for_pid) || p->waiting_for_pid == from )
+			resume_process( p );
+	}
+}
+
+/**
+ * Returns MUSE_TRUE when the process's mailbox has room for another 
+ * message. If the mailbox is full and \p block is MUSE_TRUE, the 
+ * current process waits for the receiver to make room, otherwise
+ * this returns MUSE_FALSE. Also returns MUSE_FALSE if the process is dead.
+ * A process always has room for messages it posts to itself.
+ */
+muse_boolean wait_for_mailbox_room( muse_env *env, muse_process_frame_t *p, muse_boolean block )
+{
+	while ( p->state_bits != MUSE_PROCESS_DEAD
+			&& p->mailbox_capacity > 0 
+			&& p->mailbox_count >= p->mailbox_capacity 
+			&& p != env->current_process )
+	{
+		if ( !block )
+			return MUSE_FALSE;
+
+		enqueue_process( &p->blocked_senders, env->current_process );
+		pause_process( env, MUSE_PROCESS_WAITING_ROOM, -1 );
+
+		/* A with-timeout-us block may have expired during the wait. */
+		if ( env->current_process->expired_eval_timeouts > 0 )
+			check_timeout(env);
+	}
+
+	return (p->state_bits == MUSE_PROCESS_DEAD) ? MUSE_FALSE : MUSE_TRUE;
+}
+
+/**
+ * Drops the entries of messages that were received 
+ * out of order from the front of the mailbox.
+ */
+static void drop_received_entries( muse_process_frame_t *p )
+{
+	muse_env *env = p->env;
+	muse_cell entry;
+
+	while ( (entry = _tail(p->mailbox)) && _head(entry) == p->mailbox )
+	{
+		_sett( p->mailbox, _tail(entry) );
+
+		if ( entry == p->mailbox_end )
+			p->mailbox_end = p->mailbox;
 	}
 }
 
+/**
+ * Returns the mailbox entry of the oldest message, or of the oldest 
+ * message from the process \p pid if it isn't MUSE_NIL. Returns 
+ * MUSE_NIL if there is no such message.
+ *
+ * @see take_message()
+ */
+muse_cell next_message( muse_process_frame_t *p, muse_cell pid )
+{
+	muse_env *env = p->env;
+
+	if ( pid )
+	{
+		muse_sender_queue_t *q;
+
+		if ( p->senders.count == 0 )
+			return MUSE_NIL;
+
+		q = probe_sender( &p->senders, pid );
+		return q->sender ? q->first : MUSE_NIL;
+	}
+
+	return _tail(p->mailbox);
+}
+
+/**
+ * Removes the given entry, got from next_message(), from the
+ * mailbox and returns its message. One process waiting for room
+ * in the mailbox gets to run again.
+ */
+muse_cell take_message( muse_process_frame_t *p, muse_cell entry )
+{
+	muse_env *env = p->env;
+	muse_cell node = _head(entry);
+	muse_cell msg = _head(node);
+	muse_cell sender = message_sender( env, msg );
+
+	if ( sender && p->senders.count > 0 )
+	{
+		muse_sender_queue_t *q = probe_sender( &p->senders, sender );
+
+		if ( q->first == entry )
+		{
+			q->first = _tail(node);
+			if ( !q->first )
+				remove_sender( &p->senders, q );
+		}
+	}
+
+	/* Messages after the front one are only marked as received. */
+	_seth( entry, p->mailbox );
+	drop_received_entries( p );
+	p->mailbox_count--;
+
+	if ( p->blocked_senders.head )
+		resume_process( p->blocked_senders.head );
+
+	return msg;
+}
+
 typedef struct _timeout_info_t
 {
 	struct _timeout_info_t *prev;
 	muse_cell prevcell;
 	muse_cell id;
-	void *timer;
+	muse_int start_us;
 	muse_int timeout_us;
+	muse_timer_t timer;
 } timeout_info_t;
 
 static muse_cell fn_timeout_var( muse_env *env, timeout_info_t *ti, muse_cell args )
 {
 	if ( muse_doing_gc(env) )
 	{
-		muse_tock(ti->timer);
+		cancel_timer( env, &ti->timer );
 		free(ti);
 	}
 
@@ -1989,7 +3491,8 @@ static muse_cell fn_timeout_var( muse_env *env, timeout_info_t *ti, muse_cell ar
 }
 
 /**
- * Adds another level of timeout nesting.
+ * Adds another level of timeout nesting. The timeout's
+ * deadline goes into the environment's timer heap.
  */
 void push_timeout( muse_env *env, muse_cell id, muse_int timeout_us )
 {
@@ -2005,8 +3508,13 @@ void push_timeout( muse_env *env, muse_cell id, muse_int timeout_us )
 
 	next_timeout->prevcell		= curr_timeout;
 	next_timeout->id			= id;
-	next_timeout->timer			= muse_tick();
+	next_timeout->start_us		= muse_elapsed_us(env->timer);
 	next_timeout->timeout_us	= timeout_us;
+	next_timeout->timer.index	= -1;
+	next_timeout->timer.kind	= MUSE_TIMER_EVAL_TIMEOUT;
+	next_timeout->timer.process	= env->current_process;
+
+	set_timer( env, &next_timeout->timer, next_timeout->start_us + timeout_us );
 
 	_pushdef( _builtin_symbol(MUSE_TIMEOUTVAR), muse_mk_destructor( env, (muse_nativefn_t)fn_timeout_var, next_timeout ) );
 	_unwind(sp);
@@ -2014,36 +3522,90 @@ void push_timeout( muse_env *env, muse_cell id, muse_int timeout_us )
 	env->current_process->num_eval_timeouts++;
 }
 
+/**
+ * Ends the innermost level of timeout nesting after its
+ * body completed. The caller unwinds the binding.
+ */
+void pop_timeout( muse_env *env )
+{
+	muse_cell sym = _builtin_symbol(MUSE_TIMEOUTVAR);
+	muse_cell ticell = _symval(sym);
+
+	if ( ticell != sym )
+		cancel_timer( env, &((timeout_info_t*)muse_nativefn_context( env, ticell, NULL ))->timer );
+
+	env->current_process->num_eval_timeouts--;
+}
+
+/**
+ * Cancels the timers of the timeouts nested deeper than \p depth when
+ * an exception or an escape unwinds past them, so that they don't
+ * cut short a later wait of the process. Must be called before the
+ * bindings are unwound, while the timeout chain still holds them.
+ */
+void unwind_timeouts( muse_env *env, int depth )
+{
+	muse_cell sym = _builtin_symbol(MUSE_TIMEOUTVAR);
+	muse_cell ticell = _symval(sym);
+	timeout_info_t *ti = (ticell != sym) ? (timeout_info_t*)muse_nativefn_context( env, ticell, NULL ) : NULL;
+	int n = env->current_process->num_eval_timeouts;
+
+	for ( ; n > depth && ti != NULL; --n, ti = ti->prev )
+		cancel_timer( env, &ti->timer );
+
+	env->current_process->num_eval_timeouts = depth;
+}
+
 /**
  * Checks whether any timeout has expired
  * and if so raises an exception to the effect.
  * The structure of the exception is -
  *		('timeout 'id given-us elapsed-us)
+ *
+ * The timeouts are only looked at after the timer of one of them
+ * expired. They stay marked for checking if an exception 
+ * handler doesn't resume, so enclosing timeouts that have
+ * also expired get raised at the next check.
  */
 void check_timeout( muse_env *env )
 {
-	int sp = _spos();
-	muse_cell sym = _builtin_symbol(MUSE_TIMEOUTVAR);
-	muse_cell ticell = _symval(sym);
-	if ( ticell != sym ) {
-		timeout_info_t *ti = (timeout_info_t*)(timeout_info_t*)muse_nativefn_context( env, ticell, NULL );
-		while ( ti != NULL ) {
-			muse_int elapsed_us = muse_elapsed_us(ti->timer);
-			if ( elapsed_us >= ti->timeout_us ) {
-				// Timed out.
-				int bsp = _bspos();
-				_pushdef( sym, ti->prevcell );
-				muse_raise_error( env, _builtin_symbol(MUSE_TIMEOUT), muse_list( env, "cII", ti->id, ti->timeout_us, elapsed_us ) );
-				_unwind_bindings(bsp);
-
-				// Disable the current timeout on resume.
-				_define( sym, ti->prevcell );
-			}
+	muse_process_frame_t *p = env->current_process;
+	muse_int now_us;
+
+	if ( env->timers.count > 0 )
+	{
+		now_us = muse_elapsed_us(env->timer);
+		if ( now_us >= env->timers.timers[0]->due_us )
+			expire_timers( env, now_us );
+	}
 
-			ti = ti->prev;
+	if ( p->expired_eval_timeouts > 0 )
+	{
+		int sp = _spos();
+		muse_cell sym = _builtin_symbol(MUSE_TIMEOUTVAR);
+		muse_cell ticell = _symval(sym);
+		now_us = muse_elapsed_us(env->timer);
+		if ( ticell != sym ) {
+			timeout_info_t *ti = (timeout_info_t*)(timeout_info_t*)muse_nativefn_context( env, ticell, NULL );
+			while ( ti != NULL ) {
+				muse_int elapsed_us = now_us - ti->start_us;
+				if ( elapsed_us >= ti->timeout_us ) {
+					// Timed out.
+					int bsp = _bspos();
+					_pushdef( sym, ti->prevcell );
+					muse_raise_error( env, _builtin_symbol(MUSE_TIMEOUT), muse_list( env, "cII", ti->id, ti->timeout_us, elapsed_us ) );
+					_unwind_bindings(bsp);
+
+					// Disable the current timeout on resume.
+					_define( sym, ti->prevcell );
+				}
+
+				ti = ti->prev;
+			}
 		}
+		p->expired_eval_timeouts = 0;
+		_unwind(sp);
 	}
-	_unwind(sp);
 }
 
 /**
@@ -86,11 +86,11 @@ BEGIN_MUSE_C_FUNCTIONS
  * 
  * @subsection ML_StructuringCode Structuring code
  *	- \ref fn_define "define", \ref syntax_let "let", \ref syntax_do "do"
- * 	- \ref syntax_lambda "fn", \ref syntax_block "fn:"
+ * 	- \ref syntax_lambda "fn", \ref syntax_block "fn:", \ref fn_lexical_addressing "lexical-addressing"
  *	- \ref syntax_if "if", \ref syntax_cond "cond", \ref syntax_case "case"
  *	- \ref syntax_try "try", \ref fn_raise "raise", \ref fn_retry "retry", \ref syntax_finally "finally"
  *	- \ref fn_the "the and it"
- *	- \ref fn_callcc "call/cc"
+ *	- \ref fn_callcc "call/cc", \ref fn_callec "call/ec"
  * 
  * @subsection ML_MathOps Mathematical operators
  *	- Binary operators 
@@ -111,11 +111,12 @@ BEGIN_MUSE_C_FUNCTIONS
  * 
  * @subsection ML_DataStructures Data structures
  *	- \ref fn_cons "cons", \ref fn_first "first", \ref fn_rest "rest", \ref fn_length "length"
- *	- \ref fn_lcons "lcons", \ref fn_lazy "lazy"
+ *	- \ref fn_lcons "lcons", \ref fn_lazy "lazy", \ref fn_chunked_stream "chunked-stream"
  *	- \ref Vectors "vectors"
  *	- \ref Hashtables "hashtables"
  *	- \ref ByteArray "byte arrays"
  *	- \ref Boxes "boxes"
+ *	- \ref Generators "generators"
  *
  * @subsection ML_ListOps List operations
  *	- \ref fn_list "list", \ref fn_first "first", \ref fn_rest "rest"
@@ -156,6 +157,8 @@ BEGIN_MUSE_C_FUNCTIONS
  *	- \ref fn_spawn "spawn", \ref fn_receive "receive", \ref syntax_atomic "atomic", \ref fn_post "post"
  *	- \ref fn_run "run", \ref fn_this_process "this-process", \ref fn_process_p "process?"
  *	- \ref fn_with_timeout_us "with-timeout-us"
+ *	- \ref fn_remote_pid "remote-pid", \ref fn_remote_pid_p "remote-pid?"
+ *	- \ref fn_pmap "pmap", \ref fn_preduce "preduce"
  *
  * @subsection ML_Crypto Cryptographic utilities
  *	- \ref fn_sha1_hash "sha1-hash", \ref fn_md5_hash "md5-hash"
@@ -182,10 +185,17 @@ BEGIN_MUSE_C_FUNCTIONS
  * @section MuseEnv The muSE environment
  * 
  * The muSE environment holds all the data constructed using the muSE API
- * calls and keeps track of object references. There is a single global
- * muse environment \ref muse_env* active at any given time. One creates
- * this global muse environment using \ref muse_init_env and destroys it
- * using \ref muse_destroy_env.
+ * calls and keeps track of object references. One creates a muse
+ * environment using \ref muse_init_env and destroys it using
+ * \ref muse_destroy_env.
+ *
+ * Environments share no mutable state, so several of them can be
+ * created and run at the same time on different threads. An environment
+ * must be created, used and destroyed on a single thread though, since
+ * its processes switch C stacks and its preemption timer and profiler
+ * signal the thread that created them. The flight recorder's signal
+ * handlers are process wide and go with the first environment that asks
+ * for them.
  * 
  * @section MuseDataTypes The basic data types in muSE
  * 	- 64-bit integers - see \ref MUSE_INT_CELL, \ref muse_mk_int
@@ -314,6 +324,9 @@ typedef enum
 	MUSE_GENERIC_INVOKE,				/**< *invoke* */
 	MUSE_GET,							/**< get */
 	MUSE_PUT,							/**< put */
+	MUSE_LEXICAL_FRAME,					/**< [internal] */
+	MUSE_LEXICAL_REF,					/**< [internal] */
+	MUSE_LEXICAL_LET,					/**< [internal] */
 	
 	MUSE_NUM_BUILTIN_SYMBOLS /**< Not a symbol. */
 } muse_builtin_symbol_t;
@@ -333,7 +346,7 @@ typedef enum
 	MUSE_HEAP_SIZE,				/**< Integer parameter giving required heap size.	*/
 	MUSE_GROW_HEAP_THRESHOLD,	/**< Percentage of heap size usage above which to grow the heap. Default = 80. */
 	MUSE_STACK_SIZE,			/**< Integer parameter giving required stack size.	*/
-	MUSE_MAX_SYMBOLS,			/**< Integer parameter giving max symbols used.		*/
+	MUSE_MAX_SYMBOLS,			/**< Integer parameter giving the initial capacity of the symbol table. It grows as needed. */
 	MUSE_DISCARD_DOC,			/**< Boolean parameter indicating that documentation should not be kept. Default = MUSE_FALSE. */
 	MUSE_PRETTY_PRINT,			/**< Boolean parameter indicating whether write and print should indent their output. Default = MUSE_TRUE */
 	MUSE_TAB_SIZE,				/**< Defaults to 4. Controls pretty printed output. */
@@ -343,6 +356,18 @@ typedef enum
 	MUSE_OWN_OBJC_AUTORELEASE_POOL, /**< Creates a keeps a reference to an independent auto-release pool, which is 
 									 * released when the muSE environment is destroyed. Default is MUSE_TRUE. */
 	MUSE_ENABLE_TRACE,			/**< Default = MUSE_TRUE. Enables the collection of stack traces during execution for error detection. */
+	MUSE_PREEMPTION_INTERVAL_US,	/**< If non-zero, processes are switched by a timer that ticks every so many microseconds
+								 *   instead of after they've spent their attention. Default is 0. Falls back to
+								 *   attention counting where a timer isn't available. */
+	MUSE_LEXICAL_ADDRESSING,	/**< If MUSE_TRUE, closures created by \c fn keep their local variables in a stack frame
+								 *   instead of binding the symbols, wherever the variables are not referred to
+								 *   dynamically within the function body. Default is MUSE_FALSE. */
+	MUSE_FLIGHT_RECORDER_SIGNALS,	/**< If MUSE_TRUE, the flight recorder is dumped on SIGUSR1 and on fatal signals,
+									 *   where signals are available. Default is MUSE_TRUE. Either way, the thread
+									 *   that creates the environment is given an alternate signal stack if it
+									 *   has none, so that fatal signals can be handled on C stack overflows. */
+	MUSE_WORKER_THREADS,		/**< The number of threads that \ref fn_pmap "pmap" and \ref fn_preduce "preduce"
+								 *   spread their work over. Default is 0, which means one per processor. */
 	
 	MUSE_NUM_PARAMETER_NAMES	/**< Not a parameter. */
 } muse_env_parameter_name_t;
@@ -375,6 +400,7 @@ MUSEAPI muse_cell	muse_stack_push( muse_env *env, muse_cell obj );
 MUSEAPI void		muse_trace_push( muse_env *env, const muse_char *label, muse_cell fn, muse_cell arglist );
 MUSEAPI void		muse_trace_pop( muse_env *env );
 MUSEAPI size_t		muse_trace_report( muse_env *env, size_t numchars, muse_char *buffer );
+MUSEAPI void		muse_flight_recorder_dump( muse_env *env, const char *reason );
 MUSEAPI void		muse_gc( muse_env *env, int free_cells_needed );
 MUSEAPI void		muse_mark( muse_env *env, muse_cell cell );
 MUSEAPI muse_boolean muse_doing_gc( muse_env *env );
@@ -506,6 +532,62 @@ MUSEAPI muse_cell	muse_symbol_with_value( muse_env *env, muse_cell value );
 MUSEAPI muse_cell	muse_symbol_is_defined( muse_env *env, void *context, muse_cell symbol );
 /*@}*/
 
+/** @name Process introspection */
+/*@{*/
+/**
+ * The things a process can wait for.
+ */
+typedef enum
+{
+	MUSE_WAIT_MESSAGE,		/**< A message, in \ref fn_receive "receive". */
+	MUSE_WAIT_TIMEOUT,		/**< Time to pass, in \ref fn_run "run". */
+	MUSE_WAIT_SOCKET,		/**< A socket to get ready. */
+	MUSE_WAIT_MAILBOX,		/**< Room in the full mailbox of another process. */
+	MUSE_NUM_WAIT_REASONS
+} muse_wait_reason_t;
+
+/**
+ * What muse_process_info() tells about a process. 
+ * Times are in microseconds.
+ */
+typedef struct
+{
+	int			state_bits;			/**< The process's state. Zero if it has ended. */
+	int			priority;			/**< 0 for high, 1 for normal and 2 for low. */
+	int			attention;			/**< Reductions per turn. */
+	muse_int	reductions;			/**< Function applications evaluated so far. */
+	muse_int	running_us;			/**< Time spent running. */
+	muse_int	waiting_us[MUSE_NUM_WAIT_REASONS]; /**< Time spent waiting, by muse_wait_reason_t. */
+	muse_int	cells_allocated;	/**< Cells allocated while the process was running. */
+	int			mailbox_length;		/**< Messages waiting to be received. */
+	int			mailbox_capacity;	/**< Zero if the mailbox is unbounded. */
+	int			stack_high_water;	/**< The most cells used on the evaluation stack. */
+	int			bindings_high_water;/**< The most cells used on the bindings stack. */
+	int			cstack_high_water;	/**< The most bytes used on the C stack, or -1 for the main process. */
+} muse_process_info_t;
+
+MUSEAPI muse_boolean muse_process_info( muse_env *env, muse_cell pid, muse_process_info_t *info );
+MUSEAPI muse_cell	muse_processes( muse_env *env );
+/*@}*/
+
+/**
+ * @name Messages between environments
+ * A process can be posted to from another environment, possibly
+ * running on another thread, through a reference that
+ * muse_export_pid() makes on the process's own thread and that the
+ * other environment makes a \ref fn_remote_pid "remote pid" of using
+ * muse_import_pid(). The reference itself can be passed around freely
+ * and has to be released using muse_release_pid() when done.
+ */
+/*@{*/
+typedef struct _muse_remote_pid_t muse_remote_pid_t;
+
+MUSEAPI muse_remote_pid_t *muse_export_pid( muse_env *env, muse_cell pid );
+MUSEAPI muse_cell	muse_import_pid( muse_env *env, const muse_remote_pid_t *rpid );
+MUSEAPI void		muse_release_pid( muse_remote_pid_t *rpid );
+MUSEAPI muse_boolean muse_post_remote( muse_env *env, const muse_remote_pid_t *to, muse_cell msg );
+/*@}*/
+
 /** @name Multilingual stuff */
 /*@{*/
 	MUSEAPI size_t	muse_unicode_to_utf8( char *out, size_t out_maxlen, const muse_char *win, size_t win_len );
@@ -548,6 +630,7 @@ MUSEAPI int muSEexec_finish( FILE *e, int source_size );
  */
 typedef muse_cell (*muse_plugin_entry_t)( void *module, muse_env *env, muse_cell arglist );
 MUSEAPI muse_cell muse_link_plugin( muse_env *env, const muse_char *path, muse_cell arglist );
+MUSEAPI muse_boolean muse_compile_module( muse_env *env, FILE *in, FILE *out );
 /*@}*/
 
 /** @name REPL - Read Eval Print Loop */
@@ -126,6 +126,25 @@ static muse_cell list_map( muse_env *env, muse_cell list, muse_cell fn, muse_cel
 	}
 }
 
+static muse_cell map_object( muse_env *env, muse_cell fn, muse_cell obj )
+{
+	if ( _cellt(obj) == MUSE_CONS_CELL )
+	{
+		/* Map being done on a list. */
+		return list_map( env, obj, fn, MUSE_NIL, MUSE_NIL );
+	}
+	else
+	{
+		muse_functional_object_t *objptr = NULL;
+		muse_monad_view_t *monad = get_monad_view( env, obj, &objptr );
+		
+		if ( monad )
+			return monad->map( env, objptr, fn );
+	}
+	
+	return MUSE_NIL;
+}
+
 /**
  * @code (map fn obj) @endcode
  * The object can be a list, vector or hashtable and the return value will
@@ -156,22 +175,7 @@ muse_cell fn_map( muse_env *env, void *context, muse_cell args )
 	muse_cell obj = _evalnext(&args);
 	
 	muse_push_recent_scope(env);
-
-	if ( _cellt(obj) == MUSE_CONS_CELL )
-	{
-		/* Map being done on a list. */
-		return muse_pop_recent_scope( env, (muse_int)fn_map, list_map( env, obj, fn, MUSE_NIL, MUSE_NIL ) );
-	}
-	else
-	{
-		muse_functional_object_t *objptr = NULL;
-		muse_monad_view_t *monad = get_monad_view( env, obj, &objptr );
-		
-		if ( monad )
-			return muse_pop_recent_scope( env, (muse_int)fn_map, monad->map( env, objptr, fn ) );
-	}
-	
-	return muse_pop_recent_scope( env, (muse_int)fn_map, MUSE_NIL );
+	return muse_pop_recent_scope( env, (muse_int)fn_map, map_object( env, fn, obj ) );
 }
 
 struct list_append_generator_context_t
@@ -310,6 +314,29 @@ static muse_cell list_collect( muse_env *env, muse_cell list, muse_cell predicat
 	}
 }
 
+/**
+ * Implements collect for an evaluated object. \p args holds the 
+ * remaining unevaluated arguments, if any, from which the optional
+ * reduction function is taken for vectors and hashtables.
+ */
+static muse_cell collect_object( muse_env *env, muse_cell obj, muse_cell predicate, muse_cell mapper, muse_cell *args )
+{
+	if ( _cellt(obj) == MUSE_CONS_CELL )
+	{
+		return list_collect( env, obj, predicate, mapper, MUSE_NIL, MUSE_NIL );
+	}
+	else
+	{
+		muse_functional_object_t *objptr = NULL;
+		muse_monad_view_t *monad = get_monad_view( env, obj, &objptr );
+		
+		if ( monad )
+			return monad->collect( env, objptr, predicate, mapper, args ? _evalnext(args) : MUSE_NIL );
+	}
+
+	return MUSE_NIL;
+}
+
 /**
  * @code (collect obj predicate mapper [reduction-fn]) @endcode
  * EXPERIMENTAL
@@ -349,41 +376,234 @@ muse_cell fn_collect( muse_env *env, void *context, muse_cell args )
 	muse_cell mapper = _evalnext(&args);
 	
 	muse_push_recent_scope(env);
+	return muse_pop_recent_scope( env, (muse_int)fn_collect, collect_object( env, obj, predicate, mapper, &args ) );
+}
 
-	if ( _cellt(obj) == MUSE_CONS_CELL )
+/**
+ * Fusing map and collect into reduce and for-each.
+ *
+ * When the collection argument of \ref fn_reduce "reduce" or 
+ * \ref fn_for_each "for-each" is a \ref fn_map "map" or 
+ * \ref fn_collect "collect" expression, possibly nested, the
+ * stages are evaluated as a single pass over the innermost collection
+ * without building the intermediate lazy lists, vectors or hashtables.
+ * For example -
+ * @code (reduce + 0 (map sqr (collect xs odd? ()))) @endcode
+ * calls \c odd?, \c sqr and \c + on each element of \c xs in turn.
+ * Each element passes through all the stages before the next one
+ * is taken up, whereas lazily built lists may run a few elements
+ * ahead in the inner stages.
+ *
+ * Over lists, any chain of map and collect stages is fused. Over
+ * vectors and hashtables, only chains of map stages are fused since
+ * collect works on (index . value) and (key . value) pairs there.
+ * Over \ref Generators "generators", which give plain values, any
+ * chain is fused again. Chains that can't be fused are evaluated stage by stage as usual.
+ */
+#define MUSE_MAX_FUSED_STAGES 8
+
+typedef struct
+{
+	muse_cell predicate;	/**< The predicate of a collect stage, or () for a map stage. */
+	muse_cell mapper;		/**< The map function of the stage, or () if none. */
+	muse_boolean is_collect;
+} stage_t;
+
+typedef struct
+{
+	int num_stages;
+	stage_t stages[MUSE_MAX_FUSED_STAGES];	/**< Innermost stage first. */
+	muse_cell fn;							/**< The reduction function or the for-each function. */
+	muse_cell acc;							/**< Holds the accumulator of a reduction at its head. */
+} pipeline_t;
+
+/**
+ * Returns the builtin function which the head of the given 
+ * expression refers to, if the expression is a call to
+ * map or collect that can take part in a fused pipeline.
+ */
+static muse_nativefn_t pipeline_stage_fn( muse_env *env, muse_cell expr )
+{
+	muse_cell head, fn, args;
+	int argc = 0;
+
+	if ( expr <= 0 || _cellt(expr) != MUSE_CONS_CELL )
+		return NULL;
+
+	head = _head(expr);
+	if ( head <= 0 )
+		return NULL;
+
+	/* Only look at symbols and builtins. Evaluating other head 
+	expressions could have side effects. */
+	switch ( _cellt(head) )
+	{
+	case MUSE_SYMBOL_CELL : fn = _symval(head); break;
+	case MUSE_NATIVEFN_CELL : fn = head; break;
+	default: return NULL;
+	}
+
+	if ( _cellt(fn) != MUSE_NATIVEFN_CELL || _ptr(fn)->fn.context != NULL )
+		return NULL;
+
+	for ( args = _tail(expr); args > 0 && _cellt(args) == MUSE_CONS_CELL; args = _tail(args) )
+		++argc;
+
+	if ( args != MUSE_NIL )
+		return NULL;
+
+	if ( _ptr(fn)->fn.fn == fn_map && argc == 2 )
+		return fn_map;
+
+	if ( _ptr(fn)->fn.fn == fn_collect && argc == 3 )
+		return fn_collect;
+
+	return NULL;
+}
+
+/**
+ * Evaluates the given collection expression, recording any map and
+ * collect stages in the pipeline instead of applying them. Arguments
+ * are evaluated in the same order as map and collect evaluate them.
+ * Returns the innermost collection.
+ */
+static muse_cell eval_pipeline( muse_env *env, muse_cell expr, pipeline_t *p )
+{
+	muse_nativefn_t stage_fn = (p->num_stages < MUSE_MAX_FUSED_STAGES) ? pipeline_stage_fn( env, expr ) : NULL;
+	muse_cell args, obj;
+	stage_t stage;
+
+	if ( stage_fn == NULL )
+		return _eval(expr);
+
+	args = _tail(expr);
+
+	if ( stage_fn == fn_map )
 	{
-		return muse_pop_recent_scope( env, (muse_int)fn_collect, list_collect( env, obj, predicate, mapper, MUSE_NIL, MUSE_NIL ) );
+		stage.predicate = MUSE_NIL;
+		stage.mapper = _spush(_evalnext(&args));
+		stage.is_collect = MUSE_FALSE;
+		obj = eval_pipeline( env, _head(args), p );
 	}
 	else
 	{
-		muse_functional_object_t *objptr = NULL;
-		muse_monad_view_t *monad = get_monad_view( env, obj, &objptr );
-		
-		if ( monad )
-			return muse_pop_recent_scope( env, (muse_int)fn_collect, monad->collect( env, objptr, predicate, mapper, _evalnext(&args) ) );
+		obj = eval_pipeline( env, _head(args), p );
+		args = _tail(args);
+		stage.predicate = _spush(_evalnext(&args));
+		stage.mapper = _spush(_evalnext(&args));
+		stage.is_collect = MUSE_TRUE;
 	}
 
-	return muse_pop_recent_scope( env, (muse_int)fn_collect, MUSE_NIL );
+	if ( p->num_stages < MUSE_MAX_FUSED_STAGES )
+	{
+		p->stages[p->num_stages++] = stage;
+		return obj;
+	}
+	else
+	{
+		/* The inner stages used up the pipeline. Apply this stage as usual. */
+		int i;
+		for ( i = 0; i < p->num_stages; ++i )
+		{
+			stage_t *s = p->stages + i;
+			obj = s->is_collect ? collect_object( env, obj, s->predicate, s->mapper, NULL ) : map_object( env, s->mapper, obj );
+		}
+		p->num_stages = 0;
+		return stage.is_collect ? collect_object( env, obj, stage.predicate, stage.mapper, NULL ) : map_object( env, stage.mapper, obj );
+	}
 }
 
-static muse_cell list_reduce( muse_env *env, muse_cell obj, muse_cell reduction_fn, muse_cell acc )
+/**
+ * Returns the iterator to use to run the pipeline over the given
+ * collection, or NULL if the stages have to be applied one by one.
+ */
+static muse_iterator_t pipeline_iterator( muse_env *env, pipeline_t *p, muse_cell obj, muse_functional_object_t **objptr_out )
 {
-	if ( obj )
+	if ( _cellt(obj) != MUSE_CONS_CELL )
 	{
+		muse_functional_object_t *objptr = _fnobjdata(obj);
+		int i;
+
+		/* Generators give plain values like lists do. */
+		for ( i = 0; i < p->num_stages && !(objptr && objptr->type_info->type_word == 'gnrt'); ++i )
 		{
-			int sp = _spos();
-			
-			_spush(acc);
-			
-			acc = _apply( reduction_fn, _cons( acc, _cons( muse_head(env,obj), MUSE_NIL ) ), MUSE_TRUE );
-		
-			_unwind(sp);
+			if ( p->stages[i].is_collect )
+				return NULL;
 		}
-		
-		return list_reduce( env, muse_tail(env,obj), reduction_fn, acc );
+
+		if ( get_monad_view( env, obj, NULL ) == NULL )
+			return NULL;
 	}
-	else
-		return acc;
+
+	return get_iterator_view( env, obj, objptr_out );
+}
+
+/**
+ * Passes the given item through the stages of the pipeline.
+ * Returns MUSE_FALSE if a collect stage dropped the item.
+ */
+static muse_boolean pipeline_item( muse_env *env, pipeline_t *p, muse_cell *item )
+{
+	int i;
+	for ( i = 0; i < p->num_stages; ++i )
+	{
+		stage_t *s = p->stages + i;
+
+		if ( s->predicate && !_apply( s->predicate, _cons( *item, MUSE_NIL ), MUSE_TRUE ) )
+			return MUSE_FALSE;
+
+		if ( s->mapper )
+			(*item) = _apply( s->mapper, _cons( *item, MUSE_NIL ), MUSE_TRUE );
+	}
+
+	return MUSE_TRUE;
+}
+
+static muse_boolean pipeline_reducer( muse_env *env, void *self, pipeline_t *p, muse_cell thing )
+{
+	if ( pipeline_item( env, p, &thing ) )
+		_seth( p->acc, _apply( p->fn, _cons( _head(p->acc), _cons( thing, MUSE_NIL ) ), MUSE_TRUE ) );
+	return MUSE_TRUE;
+}
+
+static muse_boolean pipeline_mapper( muse_env *env, void *self, pipeline_t *p, muse_cell thing )
+{
+	if ( pipeline_item( env, p, &thing ) )
+		_apply( p->fn, _cons( thing, MUSE_NIL ), MUSE_TRUE );
+	return MUSE_TRUE;
+}
+
+/**
+ * Applies the stages of a pipeline that couldn't be fused 
+ * one by one and returns the resulting collection.
+ */
+static muse_cell pipeline_materialize( muse_env *env, pipeline_t *p, muse_cell obj )
+{
+	int i;
+	for ( i = 0; i < p->num_stages; ++i )
+	{
+		stage_t *s = p->stages + i;
+		_spush(obj);
+		obj = s->is_collect ? collect_object( env, obj, s->predicate, s->mapper, NULL ) : map_object( env, s->mapper, obj );
+	}
+	p->num_stages = 0;
+	return obj;
+}
+
+static muse_cell list_reduce( muse_env *env, muse_cell obj, muse_cell reduction_fn, muse_cell acc )
+{
+	int sp = _spos();
+
+	while ( obj )
+	{
+		acc = _apply( reduction_fn, _cons( acc, _cons( muse_head(env,obj), MUSE_NIL ) ), MUSE_TRUE );
+		obj = muse_tail(env,obj);
+		_unwind(sp);
+		_spush(acc);
+		_spush(obj);
+	}
+
+	return acc;
 }
 
 /**
@@ -408,10 +628,30 @@ muse_cell fn_reduce( muse_env *env, void *context, muse_cell args )
 {
 	muse_cell fn		= _evalnext(&args);
 	muse_cell initial	= _evalnext(&args);
-	muse_cell obj		= _evalnext(&args);
+	pipeline_t p;
+	muse_cell obj;
+
+	p.num_stages = 0;
+	obj = eval_pipeline( env, _next(&args), &p );
 	
 	muse_push_recent_scope(env);
 
+	if ( p.num_stages > 0 )
+	{
+		muse_functional_object_t *objptr = NULL;
+		muse_iterator_t iter = pipeline_iterator( env, &p, obj, &objptr );
+
+		if ( iter )
+		{
+			p.fn = fn;
+			p.acc = _cons( initial, MUSE_NIL );
+			iter( env, objptr, (muse_iterator_callback_t)pipeline_reducer, &p );
+			return muse_pop_recent_scope( env, (muse_int)fn_reduce, _head(p.acc) );
+		}
+
+		obj = pipeline_materialize( env, &p, obj );
+	}
+
 	if ( _cellt(obj) == MUSE_CONS_CELL )
 		return muse_pop_recent_scope( env, (muse_int)fn_reduce, list_reduce( env, obj, fn, initial ) );
 	else
@@ -582,17 +822,40 @@ muse_cell fn_ormap( muse_env *env, void *context, muse_cell args )
  */
 muse_cell fn_for_each( muse_env *env, void *context, muse_cell args )
 {
-	muse_cell list = _evalnext(&args);
-	muse_cell fn = _evalnext(&args);
-	
-	mapinfo_t info = { fn, _cons(MUSE_NIL, MUSE_NIL) };
+	pipeline_t p;
+	muse_cell list, fn;
 	muse_functional_object_t *collObj = NULL;
-	muse_iterator_t iter = get_iterator_view( env, list, &collObj );
+	muse_iterator_t iter;
+
+	p.num_stages = 0;
+	list = eval_pipeline( env, _next(&args), &p );
+	fn = _evalnext(&args);
+
+	if ( p.num_stages > 0 )
+	{
+		iter = pipeline_iterator( env, &p, list, &collObj );
+
+		if ( iter )
+		{
+			p.fn = fn;
+			p.acc = MUSE_NIL;
+			muse_push_copy_recent_scope(env);
+			iter( env, collObj, (muse_iterator_callback_t)pipeline_mapper, &p );
+			return muse_pop_recent_scope( env, (muse_int)fn_for_each, _evalnext(&args) );
+		}
+
+		list = pipeline_materialize( env, &p, list );
+	}
+
+	{
+		mapinfo_t info = { fn, _cons(MUSE_NIL, MUSE_NIL) };
+		iter = get_iterator_view( env, list, &collObj );
 	
-	muse_push_copy_recent_scope(env);
+		muse_push_copy_recent_scope(env);
 
-	if ( iter )
-		iter( env, collObj, (muse_iterator_callback_t)domapper, &info );
+		if ( iter )
+			iter( env, collObj, (muse_iterator_callback_t)domapper, &info );
+	}
 
 	return muse_pop_recent_scope( env, (muse_int)fn_for_each, _evalnext(&args) );
 }
@@ -221,6 +221,8 @@ static muse_cell _defgen( muse_env *env, int option, muse_cell sym, muse_cell ge
 			break;
 		}
 
+		gfn_dispatch_invalidate( env, case_e );
+
 		define_in_context( env, sym, gen );
 	}
 
@@ -91,9 +91,25 @@ int fn_deep_compare( muse_env *env, muse_cell args )
 {
 	muse_cell lhs = _evalnext(&args);
 	muse_cell rhs = _evalnext(&args);
-	int result = deep_compare( env, lhs, rhs );
 
-	return result;
+	/* Numbers are by far the most common case. Compare them 
+	without going through the general deep comparison. */
+	if ( lhs > 0 && rhs > 0 )
+	{
+		int lhs_t = _cellt(lhs), rhs_t = _cellt(rhs);
+
+		if ( lhs_t == MUSE_INT_CELL && rhs_t == MUSE_INT_CELL )
+			return deep_compare_int( _ptr(lhs)->i, _ptr(rhs)->i );
+
+		if ( _isnumbert(lhs_t) && _isnumbert(rhs_t) )
+		{
+			muse_float f1 = _floatvalue(lhs);
+			muse_float f2 = _floatvalue(rhs);
+			return (f1 < f2) ? -1 : (f1 > f2 ? 1 : 0);
+		}
+	}
+
+	return deep_compare( env, lhs, rhs );
 }
 
 /**
@@ -37,8 +37,20 @@ typedef struct _continuation_t
 	muse_cell	this_cont;
 	muse_cell	invoke_result;
 	int			num_eval_timeouts;
+	int			lexical_frame;
+	struct _muse_escape_point_t *escape_points;
+	struct _muse_escape_point_t **escape_chain;
+	int			escape_chain_length;
+	struct _muse_trap_point_t *traps;
+	muse_cell	generator;
 } continuation_t;
 
+static struct _muse_escape_point_t **copy_escape_chain( muse_env *env, int *length );
+static void close_escape_points_outside( muse_env *env, struct _muse_escape_point_t **chain, int length );
+static void pin_trap_points( struct _muse_trap_point_t *trap, int delta );
+static void reenter_trap_points( struct _muse_trap_point_t *trap );
+static void unwind_trap_points_outside( muse_env *env, struct _muse_trap_point_t *traps );
+
 static void continuation_init( muse_env *env, void *p, muse_cell args )
 {
 }
@@ -51,6 +63,24 @@ static void mark_array( muse_env *env, muse_cell *begin, muse_cell *end )
 	}
 }
 
+/**
+ * Symbols which have no value in the process hold
+ * MUSE_NO_LOCAL_VALUE in the bindings copy.
+ * The symbols themselves are kept so that their local
+ * indices aren't reused while the continuation is around.
+ */
+static void mark_bindings( muse_env *env, muse_cell *bindings, int size )
+{
+	int i;
+	for ( i = 0; i < size; ++i )
+	{
+		if ( bindings[i] != MUSE_NO_LOCAL_VALUE )
+			muse_mark( env, bindings[i] );
+
+		muse_mark( env, env->symbol_stack.bottom[i] );
+	}
+}
+
 static void continuation_mark( muse_env *env, void *p )
 {
 	continuation_t *c = (continuation_t*)p;
@@ -59,7 +89,9 @@ static void continuation_mark( muse_env *env, void *p )
 
 	mark_array( env, c->muse_stack_copy, c->muse_stack_copy + c->muse_stack_size );
 	mark_array( env, c->bindings_stack_copy, c->bindings_stack_copy + c->bindings_stack_size );
-	mark_array( env, c->bindings_copy, c->bindings_copy + c->bindings_size );
+	mark_bindings( env, c->bindings_copy, c->bindings_size );
+	mark_trap_points( env, c->traps );
+	muse_mark( env, c->generator );
 
 	muse_mark_recent( env, &(c->recent) );
 }
@@ -72,6 +104,8 @@ static void continuation_destroy( muse_env *env, void *p )
 	free( c->muse_stack_copy );
 	free( c->bindings_stack_copy );
 	free( c->bindings_copy );
+	free( c->escape_chain );
+	pin_trap_points( c->traps, -1 );
 	muse_clear_recent( &(c->recent) );
 	
 	{
@@ -83,12 +117,13 @@ static void continuation_destroy( muse_env *env, void *p )
 
 static muse_cell *copy_current_bindings( muse_env *env, int *size )
 {
-	muse_stack *s = &(env->current_process->locals);
 	muse_cell *copy = NULL;
+	int i;
 
 	(*size) = env->num_symbols;
 	copy = (muse_cell*)malloc( sizeof(muse_cell) * (*size) );
-	memcpy( copy, s->bottom, sizeof(muse_cell) * (*size) );
+	for ( i = 0; i < (*size); ++i )
+		copy[i] = muse_local( env->current_process, i );
 
 	return copy;
 }
@@ -96,9 +131,17 @@ static muse_cell *copy_current_bindings( muse_env *env, int *size )
 
 static void restore_bindings( muse_env *env, muse_cell *bindings, int size )
 {
+	int i;
+
 	muse_assert( size >= 0 );
 
-	memcpy( env->current_process->locals.bottom, bindings, sizeof(muse_cell) * size );
+	/* Only the values that changed need to be written,
+	so that shared pages of values stay shared. */
+	for ( i = 0; i < size; ++i )
+	{
+		if ( muse_local( env->current_process, i ) != bindings[i] )
+			*muse_own_local( env->current_process, i ) = bindings[i];
+	}
 }
 
 static void *min3( void *p1, void *p2, void *p3 )
@@ -181,6 +224,12 @@ static muse_cell capture_continuation( muse_env *env, muse_cell cont )
 		c->process = env->current_process;
 		c->process_atomicity = env->current_process->atomicity;
 		c->num_eval_timeouts = env->current_process->num_eval_timeouts;
+		c->lexical_frame = env->current_process->lexical_frame;
+		c->escape_points = env->current_process->escape_points;
+		c->escape_chain = copy_escape_chain( env, &c->escape_chain_length );
+		c->traps = env->current_process->traps;
+		pin_trap_points( c->traps, +1 );
+		c->generator = env->current_process->generator;
 
 		c->this_cont = cont;
 		
@@ -208,6 +257,10 @@ static muse_cell capture_continuation( muse_env *env, muse_cell cont )
 		muse_assert( env->current_process == c->process );
 		c->process->atomicity = c->process_atomicity;
 		c->process->num_eval_timeouts = c->num_eval_timeouts;
+		c->process->lexical_frame = c->lexical_frame;
+		c->process->escape_points = c->escape_points;
+		c->process->traps = c->traps;
+		reenter_trap_points( c->traps );
 
 		/* Restore the evaluation stack. */
 		memcpy( _stack()->bottom + c->muse_stack_from, c->muse_stack_copy, sizeof(muse_cell) * c->muse_stack_size );
@@ -239,7 +292,16 @@ static muse_cell fn_continuation( muse_env *env, continuation_t *c, muse_cell ar
 	/* Continuation invocation cannot cross process boundaries. */
 	muse_assert( c->process == env->current_process );
 
+	/* Nor can it cross into or out of a generator, whose C stack is its own. */
+	if ( c->generator != env->current_process->generator )
+		return muse_raise_error( env, _csymbol(L"error:foreign-continuation"), _cons( c->this_cont, MUSE_NIL ) );
+
 	c->invoke_result = _evalnext(&args);
+
+	/* The try blocks and escape points that the continuation
+	doesn't return into are gone. */
+	unwind_trap_points_outside( env, c->traps );
+	close_escape_points_outside( env, c->escape_chain, c->escape_chain_length );
 	
 	longjmp( c->state, (int)(size_t)c );
 
@@ -334,9 +396,16 @@ static muse_functional_object_type_t g_continuation_type =
  * captures a complete snapshot of the execution environment at the time
  * it is created. 
  *
+ * A continuation captured while a \ref fn_generator "generator" runs
+ * can only be invoked while the same generator runs, and one captured
+ * outside a generator can't be invoked from within one.
+ *
  * @todo The current implementation of call/cc seems to be working properly 
  * on Windows + Intel, but doesn't work correctly on PowerPC. 
  * Needs investigation.
+ *
+ * @exception error:foreign-continuation
+ * Handler format: @code (fn (resume 'error:foreign-continuation k) ...) @endcode
  */
 muse_cell fn_callcc( muse_env *env, void *context, muse_cell args )
 {
@@ -378,8 +447,8 @@ muse_cell fn_callcc( muse_env *env, void *context, muse_cell args )
  *
  * When a \c try expression is evaluated, the handlers are all evaluated
  * first and placed on a stack of handlers to try when an exception is
- * raised. (The handler stack is maintained as the value of the internal symbol
- * \c "{{trap}}".) The \c try protected expression is then evaluated. When evaluation is
+ * raised. (Each process keeps its own stack of trap points, whose
+ * entries are reused.) The \c try protected expression is then evaluated. When evaluation is
  * complete, the handler stack is unwound and the set of handlers defined by the
  * enclosing \ref syntax_try "try" block take effect.
  *
@@ -402,13 +471,82 @@ typedef struct _resume_point_t
 	int spos;			/**< Captures the state of the muSE stack. */
 	int bspos;			/**< Captures the state of the muSE bindings stack. */
 	int atomicity;		/**< Captures the atomicity to return to. */
-	muse_cell trapval;	/**< Captures the state of the trap stack that we should restore to. */
-	muse_cell resumingtrap; /**< The trap one of whose handlers resumed the exception. */
+	struct _muse_trap_point_t *trap;	/**< Captures the state of the trap stack that we should restore to. */
+	struct _muse_trap_point_t *resumingtrap; /**< The trap one of whose handlers resumed the exception. */
 	muse_cell result;	/**< Holds the result of the resume invocation. */
 	recent_t recent;		/**< The top index of the recent list at capture time. */
 	int num_eval_timeouts;	/**< The depth of the timeout stack when the capture is made. */
+	int profiled_calls;		/**< The number of profiled calls in progress when the capture is made. */
+	int lexical_frame;		/**< The frame of the lexically addressed function active at capture time. */
+	struct _muse_escape_point_t *escape_points; /**< The escape points that are live at capture time. */
 } resume_point_t;
 
+/**
+ * The point to return to from a \ref fn_callec "call/ec" block.
+ * It lives in the C stack frame of the call/ec and is linked into
+ * the process's escape points while that frame is live. The escape
+ * continuation has it as its context until the escape point is
+ * closed, after which the continuation can't be invoked.
+ */
+typedef struct _muse_escape_point_t
+{
+	int magic_word;			/**< Zero, so that the escape point isn't taken for a functional object. */
+	resume_point_t escape;	/**< The state to return to. */
+	muse_cell k;			/**< The escape continuation. */
+	struct _muse_escape_point_t *prev; /**< The enclosing escape point. */
+} muse_escape_point_t;
+
+/**
+ * Closes the escape points of process \p p that are deeper
+ * than \p upto, which must be one of them or NULL.
+ */
+void close_escape_points( muse_env *env, muse_process_frame_t *p, muse_escape_point_t *upto )
+{
+	muse_escape_point_t *ep;
+
+	for ( ep = p->escape_points; ep && ep != upto; ep = ep->prev )
+		_ptr(ep->k)->fn.context = NULL;
+}
+
+/**
+ * A full continuation can return into call/ec blocks, so it keeps
+ * the escape points that were live when it was captured.
+ */
+static muse_escape_point_t **copy_escape_chain( muse_env *env, int *length )
+{
+	muse_escape_point_t *ep;
+	muse_escape_point_t **chain = NULL;
+	int i = 0;
+
+	for ( ep = env->current_process->escape_points, (*length) = 0; ep; ep = ep->prev )
+		++(*length);
+
+	if ( (*length) > 0 )
+	{
+		chain = (muse_escape_point_t**)malloc( sizeof(muse_escape_point_t*) * (*length) );
+		for ( ep = env->current_process->escape_points; ep; ep = ep->prev )
+			chain[i++] = ep;
+	}
+
+	return chain;
+}
+
+static void close_escape_points_outside( muse_env *env, muse_escape_point_t **chain, int length )
+{
+	muse_escape_point_t *ep;
+
+	for ( ep = env->current_process->escape_points; ep; ep = ep->prev )
+	{
+		int i = 0;
+
+		while ( i < length && chain[i] != ep )
+			++i;
+
+		if ( i == length )
+			_ptr(ep->k)->fn.context = NULL;
+	}
+}
+
 /**
  * @code
  * Usage: if ( resume_capture( env, rp, setjmp(rp->state) ) == 0 )
@@ -425,19 +563,25 @@ static int resume_capture( muse_env *env, resume_point_t *rp, int setjmp_result
 		rp->spos = _spos();
 		rp->bspos = _bspos();
 		rp->atomicity = env->current_process->atomicity;
-		rp->trapval = _symval( _builtin_symbol( MUSE_TRAP_POINT ) );
-		rp->resumingtrap = MUSE_NIL;
+		rp->trap = env->current_process->traps;
+		rp->resumingtrap = NULL;
 		rp->result = 0;
 		rp->recent = env->current_process->recent;
 		rp->num_eval_timeouts = env->current_process->num_eval_timeouts;
+		rp->profiled_calls = env->current_process->call_profile_calls.depth;
+		rp->lexical_frame = env->current_process->lexical_frame;
+		rp->escape_points = env->current_process->escape_points;
 	}
 	else
 	{
-		env->current_process->num_eval_timeouts = rp->num_eval_timeouts;
+		unwind_timeouts( env, rp->num_eval_timeouts );
+		muse_call_profile_unwind( env, rp->profiled_calls );
 		env->current_process->atomicity = rp->atomicity;
+		env->current_process->lexical_frame = rp->lexical_frame;
+		env->current_process->escape_points = rp->escape_points;
 		_unwind( rp->spos );
 		_unwind_bindings( rp->bspos );
-		_define( _builtin_symbol( MUSE_TRAP_POINT ), rp->trapval );
+		env->current_process->traps = rp->trap;
 		rp->result = (setjmp_result >= 0) ? (setjmp_result-1) : setjmp_result;
 		env->current_process->recent.entries.top = rp->recent.entries.top;
 		env->current_process->recent.contexts.top = rp->recent.contexts.top;
@@ -446,31 +590,20 @@ static int resume_capture( muse_env *env, resume_point_t *rp, int setjmp_result
 	return setjmp_result;
 }
 
-/**
- * Invokes an already captured resume point with the given result.
- * The longjmp call is made with result+1 and rp->result will
- * be set to the longjmp return value minus 1.
- */
-static void resume_invoke( muse_env *env, resume_point_t *p, muse_cell result )
-{
-	longjmp( p->state, (result >= 0) ? (result+1) : result );
-}
-
 /**
  * A trap point is a marker for the beginning of a
  * (try...) block. When you return to a trap point,
  * you return with a value that is supposed to be the
- * value of the try block. Trap points are maintained as
- * a stack of values of the built-in symbol "{{trap}}",
- * which is available via MUSE_TRAP_POINT.
+ * value of the try block. The trap points of a process
+ * form a stack, innermost first, whose entries are
+ * recycled through the process's free trap points so
+ * that entering a try block allocates nothing.
  */
-typedef struct _trap_point_t
+typedef struct _muse_trap_point_t
 {
-	muse_functional_object_t base;
 	resume_point_t escape;	/**< The resume point to invoke to return from the try block. */
-	muse_cell handlers;		/**< A list of unevaluated handlers. */
-	muse_cell prev;			/**< The previous shallower trap point. */
-	muse_cell next;			/**< The next deeper trap point. */
+	muse_cell handlers;		/**< The list of evaluated handlers. */
+	struct _muse_trap_point_t *prev; /**< The previous shallower trap point, or the next free one. */
 	muse_cell tried_handlers; /**< The list of handlers already tried. 
 									 Used to prevent re-entry into the same handler
 									 that might result in an infinite loop and stack blow up. */
@@ -480,85 +613,92 @@ typedef struct _trap_point_t
 								thunks by invoking (finally (fn () ...) ...).
 								Finalizers are evaluated in the reverse order in which
 								they are created. */
+	int pins;				/**< The number of full continuations that can return into the try block. */
+	muse_boolean exited;	/**< Set when a pinned trap point is popped. It is freed when unpinned. */
 } trap_point_t;
 
-#define _tpdata(trap) trap_point_data(env,trap)
-static trap_point_t *trap_point_data( muse_env *env, muse_cell trap )
-{
-	return (trap_point_t*)_functional_object_data(trap, 'trap');
-}
-
 /**
-* The function that gets called to resume a particular exception.
- * At exception raise time, a resume point is captured and passed
- * on to the handlers. A handler may choose to resume the computation
- * by calling the resume function with a particular result value.
+ * Evaluates the handlers of a try block. Handlers that evaluate 
+ * to themselves - such as those written as {fn ...} - are the
+ * common case, for which the given list is used as is rather
+ * than copied.
  */
-static muse_cell fn_resume( muse_env *env, void *context, muse_cell args )
+static muse_cell eval_handlers( muse_env *env, muse_cell handlers )
 {
-	resume_point_t *rp = (resume_point_t*)context;
-	
-	if ( muse_doing_gc(env) )
-	{
-		free(rp);
-	}
-	else
+	muse_cell h;
+
+	for ( h = handlers; h; h = _tail(h) )
 	{
-		if ( rp->resumingtrap ) {
-			trap_point_t *tp = _tpdata(rp->resumingtrap);
-			if ( tp ) {
-				_step(&(tp->tried_handlers));
+		muse_cell value = _eval( _head(h) );
+
+		if ( value != _head(h) )
+		{
+			/* Copy the handlers so far and evaluate the rest into the copy. */
+			muse_cell result = MUSE_NIL, last = MUSE_NIL, c;
+			muse_cell copy;
+
+			for ( c = handlers; c != h; c = _tail(c) )
+			{
+				copy = _cons( _head(c), MUSE_NIL );
+				if ( last ) _sett( last, copy ); else result = copy;
+				last = copy;
 			}
+
+			while ( h )
+			{
+				copy = _cons( value, MUSE_NIL );
+				if ( last ) _sett( last, copy ); else result = copy;
+				last = copy;
+
+				h = _tail(h);
+				if ( h )
+					value = _eval( _head(h) );
+			}
+
+			return result;
 		}
-		
-		resume_invoke( env, rp, _evalnext(&args) );
 	}
-	
-	return MUSE_NIL;
+
+	return handlers;
 }
 
-static void trap_point_init( muse_env *env, void *p, muse_cell args )
+/**
+ * Pushes a trap point for a try block with the given unevaluated
+ * handlers, taking it from the free trap points of the process.
+ */
+static trap_point_t *push_trap_point( muse_env *env, muse_cell handlers )
 {
-	trap_point_t *trap = (trap_point_t*)p;
+	muse_process_frame_t *p = env->current_process;
+	trap_point_t *trap = p->free_traps;
 
 	/* We're evaluating the list of handlers here. This is
 	fairly expensive to simply enter a try block. We either accept
 	this overhead or accept the overhead of capturing a full 
 	continuation at the point at which the exception is raised
 	in order to get resumable exceptions. */
-	trap->handlers = muse_eval_list(env, args);
+	handlers = eval_handlers( env, handlers );
 
-	trap->prev = _symval( _builtin_symbol( MUSE_TRAP_POINT ) );
+	if ( trap )
+		p->free_traps = trap->prev;
+	else
+		trap = (trap_point_t*)malloc( sizeof(trap_point_t) );
 
-	{
-		trap_point_t *trap_prev = _tpdata(trap->prev);
-		trap->tried_handlers = trap_prev ? trap_prev->tried_handlers : MUSE_NIL;
-	}
-}
+	trap->handlers			= handlers;
+	trap->prev				= p->traps;
+	trap->tried_handlers	= p->traps ? p->traps->tried_handlers : MUSE_NIL;
+	trap->finalizers		= MUSE_NIL;
+	trap->pins				= 0;
+	trap->exited			= MUSE_FALSE;
 
-static void trap_point_mark( muse_env *env, void *p )
-{
-	trap_point_t *trap = (trap_point_t*)p;
-	muse_mark( env, trap->handlers );
-	muse_mark( env, trap->tried_handlers );
-	muse_mark( env, trap->prev );
-	muse_mark( env, trap->next );
-	muse_mark( env, trap->finalizers );
+	p->traps = trap;
+	return trap;
 }
 
 /**
- * Starts from the deepest trap point, runs its finalizers,
- * then all the way up to the try block that is exiting.
+ * Runs the finalizers of the given trap point. 
  */
 static void trap_point_finalize( muse_env *env, trap_point_t *trap )
 {
-	/* Deepest first. */
-	if ( trap->next )
-		trap_point_finalize( env, _tpdata(trap->next) );
-		
-	/* Disconnect the finished trap point. */
-	trap->next = MUSE_NIL;
-	
 	while ( trap->finalizers )
 	{
 		muse_cell f = trap->finalizers;
@@ -568,23 +708,169 @@ static void trap_point_finalize( muse_env *env, trap_point_t *trap )
 	}
 }
 
-static muse_cell fn_trap_point( muse_env *env, void *trap_point, muse_cell args )
+/**
+ * A trap point that a full continuation can return into stays
+ * allocated until the continuation goes away.
+ */
+static void release_trap_point( muse_process_frame_t *p, trap_point_t *trap )
 {
-	muse_assert( !"fn_trap_point should never be called!" );
-	return MUSE_NIL;
+	if ( trap->pins > 0 )
+	{
+		trap->exited = MUSE_TRUE;
+	}
+	else
+	{
+		trap->prev = p->free_traps;
+		p->free_traps = trap;
+	}
 }
 
-static muse_functional_object_type_t g_trap_point_type =
+/**
+ * Pops the trap points of the current process that are deeper 
+ * than \p to, running their finalizers deepest first. Nothing is
+ * popped if \p to isn't one of the trap points of the process.
+ */
+static void unwind_trap_points( muse_env *env, trap_point_t *to )
 {
-	'muSE',
-	'trap',
-	sizeof(trap_point_t),
-	fn_trap_point,
-	NULL,
-	trap_point_init,
-	trap_point_mark,
-	NULL
-};
+	muse_process_frame_t *p = env->current_process;
+	trap_point_t *t = p->traps;
+
+	while ( t && t != to )
+		t = t->prev;
+
+	if ( t != to )
+		return;
+
+	while ( p->traps != to )
+	{
+		trap_point_t *trap = p->traps;
+		trap_point_finalize( env, trap );
+		p->traps = trap->prev;
+		release_trap_point( p, trap );
+	}
+}
+
+static void unwind_trap_points_outside( muse_env *env, trap_point_t *traps )
+{
+	trap_point_t *t = env->current_process->traps;
+
+	/* Find the innermost trap point that the continuation returns into. */
+	for ( ; t; t = t->prev )
+	{
+		trap_point_t *c = traps;
+
+		while ( c && c != t )
+			c = c->prev;
+
+		if ( c == t )
+			break;
+	}
+
+	unwind_trap_points( env, t );
+}
+
+static void pin_trap_points( trap_point_t *trap, int delta )
+{
+	while ( trap )
+	{
+		trap_point_t *prev = trap->prev;
+
+		trap->pins += delta;
+
+		if ( trap->pins == 0 && trap->exited )
+			free( trap );
+
+		trap = prev;
+	}
+}
+
+/**
+ * The try blocks that a full continuation returns into are
+ * live again, even if they had exited.
+ */
+static void reenter_trap_points( trap_point_t *trap )
+{
+	for ( ; trap; trap = trap->prev )
+		trap->exited = MUSE_FALSE;
+}
+
+/**
+ * Marks the handlers and finalizers of the given trap point
+ * and the ones enclosing it.
+ */
+void mark_trap_points( muse_env *env, trap_point_t *trap )
+{
+	for ( ; trap; trap = trap->prev )
+	{
+		muse_mark( env, trap->handlers );
+		muse_mark( env, trap->tried_handlers );
+		muse_mark( env, trap->finalizers );
+	}
+}
+
+/**
+ * Frees the trap points of a process that is done with. 
+ */
+void destroy_trap_points( muse_process_frame_t *p )
+{
+	while ( p->free_traps )
+	{
+		trap_point_t *trap = p->free_traps;
+		p->free_traps = trap->prev;
+		free( trap );
+	}
+
+	while ( p->traps )
+	{
+		trap_point_t *trap = p->traps;
+		p->traps = trap->prev;
+
+		if ( trap->pins > 0 )
+			trap->exited = MUSE_TRUE;
+		else
+			free( trap );
+	}
+}
+
+/**
+ * Invokes an already captured resume point with the given result.
+ * The longjmp call is made with result+1 and rp->result will
+ * be set to the longjmp return value minus 1. The try blocks
+ * entered since the capture are finalized and the escape points
+ * made since then are closed.
+ */
+static void resume_invoke( muse_env *env, resume_point_t *p, muse_cell result )
+{
+	unwind_trap_points( env, p->trap );
+	close_escape_points( env, env->current_process, p->escape_points );
+	longjmp( p->state, (result >= 0) ? (result+1) : result );
+}
+
+/**
+* The function that gets called to resume a particular exception.
+ * At exception raise time, a resume point is captured and passed
+ * on to the handlers. A handler may choose to resume the computation
+ * by calling the resume function with a particular result value.
+ */
+static muse_cell fn_resume( muse_env *env, void *context, muse_cell args )
+{
+	resume_point_t *rp = (resume_point_t*)context;
+	
+	if ( muse_doing_gc(env) )
+	{
+		free(rp);
+	}
+	else
+	{
+		if ( rp->resumingtrap ) {
+			_step(&(rp->resumingtrap->tried_handlers));
+		}
+		
+		resume_invoke( env, rp, _evalnext(&args) );
+	}
+	
+	return MUSE_NIL;
+}
 
 /**
  * Examines the handlers of the given scope first, then followed by
@@ -595,14 +881,9 @@ static muse_functional_object_type_t g_trap_point_type =
  */
 static muse_cell try_handlers( muse_env *env, muse_cell handler_args )
 {
-	muse_cell sym_trap_point = _builtin_symbol( MUSE_TRAP_POINT );
-
-	muse_cell trapval = _symval( sym_trap_point );
-
-	trap_point_t *trap = _tpdata(trapval);
+	trap_point_t *trap = env->current_process->traps;
 	
-	/* Note that the value of the "{{trap}}" symbol, which holds the
-	list of trap points, is not modified in the loop below. This has the
+	/* Note that the stack of trap points is not modified in the loop below. This has the
 	consequence that if a handler itself raises an exception, the exception
 	pattern is searched for again starting from the handlers in the 
 	inner-most try block from which the original exception was raised. 
@@ -643,7 +924,7 @@ static muse_cell try_handlers( muse_env *env, muse_cell handler_args )
 							muse_cell rpc = _head(handler_args);
 							if ( _cellt(rpc) == MUSE_NATIVEFN_CELL && _ptr(rpc)->fn.fn == fn_resume ) {
 								resume_point_t *rp = (resume_point_t*)_ptr(rpc)->fn.context;
-								rp->resumingtrap = trapval;
+								rp->resumingtrap = trap;
 							}
 						}
 						
@@ -670,8 +951,7 @@ static muse_cell try_handlers( muse_env *env, muse_cell handler_args )
 			/* Switch to handlers of shallower scopes if necessary. */
 			while ( !handlers )
 			{
-				trapval = trap->prev;
-				trap = _tpdata(trapval);
+				trap = trap->prev;
 
 				if ( trap == NULL )
 				{
@@ -689,6 +969,20 @@ static muse_cell try_handlers( muse_env *env, muse_cell handler_args )
 		while (handlers);
 	}
 
+	/* An exception that a generator doesn't handle finishes the
+	generator and is raised again where it was resumed. */
+	if ( env->current_process->generator )
+	{
+		muse_cell rpc = handler_args ? _head(handler_args) : MUSE_NIL;
+
+		if ( _cellt(rpc) == MUSE_NATIVEFN_CELL && _ptr(rpc)->fn.fn == fn_resume )
+			handler_args = _tail(handler_args);
+
+		unwind_trap_points( env, NULL );
+		close_escape_points( env, env->current_process, NULL );
+		fail_generator( env, handler_args );
+	}
+
 	/* No handler succeeded in handling the exception. */
 	{
 		muse_cell sym_deh = muse_builtin_symbol( env, MUSE_DEFAULT_EXCEPTION_HANDLER );
@@ -779,12 +1073,15 @@ static muse_cell localfn_eval( muse_env *env, void *context, muse_cell arg )
  *
  * If continuations are captured in the middle of try blocks,
  * they will automatically include the correct state of the
- * try block nesting because they will capture the correct
- * value of the "{{trap}}" symbol.
+ * try block nesting because they will capture the process's
+ * stack of trap points. Try blocks that are left by invoking a
+ * continuation or an exception handler have their finalizers run.
  *
  * It is convenient to use read-time evaluated dynamically
  * scoped function objects as handlers since they cause the
- * least overhead and are usually sufficiently general.
+ * least overhead and are usually sufficiently general. When all
+ * the handlers evaluate to themselves like these do, entering
+ * and leaving a try block allocates no memory at all.
  * For example -
  * @code
  * (try 
@@ -809,21 +1106,10 @@ muse_cell syntax_try( muse_env *env, void *context, muse_cell args )
  */ 
 MUSEAPI muse_cell muse_try( muse_env *env, muse_cell handlers, muse_nativefn_t fn, void *context, muse_cell arg )
 {
-	muse_cell trapval = _mk_functional_object( &g_trap_point_type, handlers );
-
-	trap_point_t *tp = _tpdata(trapval);
+	trap_point_t *tp = push_trap_point( env, handlers );
 
 	muse_cell result = MUSE_NIL;
 
-	/* The next pointer isn't linked yet. Do that. */
-	{
-		trap_point_t *tpprev = _tpdata(tp->prev);
-		if ( tpprev )
-			tpprev->next = trapval;
-	}
-
-	_define( _builtin_symbol( MUSE_TRAP_POINT ), trapval );
-
 	if ( resume_capture( env, &(tp->escape), setjmp(tp->escape.state) ) == 0 )
 	{
 		/* Evaluate the body of the try block. */
@@ -846,12 +1132,9 @@ MUSEAPI muse_cell muse_try( muse_env *env, muse_cell handlers, muse_nativefn_t f
 		}
 	}
 
-	/* We need to invoke the finalizers of all the trap points
-	that led us up to this point, starting from the deepest one. */
-	trap_point_finalize( env, tp );
-	
-	tp->tried_handlers = MUSE_NIL;
-	_define( _builtin_symbol( MUSE_TRAP_POINT ), tp->prev );
+	/* Any deeper trap points were finalized when they were
+	escaped from, so this pops and finalizes just this one. */
+	unwind_trap_points( env, tp->prev );
 	return result;
 }
 
@@ -861,6 +1144,8 @@ static muse_cell raise_error( muse_env *env, muse_cell args )
 	muse_cell resume_pt = _mk_destructor( fn_resume, rp );
 	muse_cell handler_args = _cons( resume_pt, args );
 
+	muse_flight_record_symbol( env, "raise:", _head(args) );
+
 	if ( resume_capture( env, rp, setjmp(rp->state) ) == 0 )
 	{
 		return try_handlers( env, handler_args );
@@ -921,9 +1206,8 @@ muse_cell fn_raise( muse_env *env, void *context, muse_cell args )
  */
 muse_cell fn_retry( muse_env *env, void *context, muse_cell args )
 {
-	muse_cell trapval = _symval( _builtin_symbol( MUSE_TRAP_POINT ) );
 	muse_cell handler_args = muse_eval_list( env, args );
-	trap_point_t *trap = _tpdata(trapval);
+	trap_point_t *trap = env->current_process->traps;
 
 	if ( trap )
 	{
@@ -938,6 +1222,78 @@ muse_cell fn_retry( muse_env *env, void *context, muse_cell args )
 	return MUSE_NIL; /* Never returns! */
 }
 
+static muse_cell fn_escape( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell result = _evalnext(&args);
+	muse_escape_point_t *ep = env->current_process->escape_points;
+
+	/* The escape point of a completed call/ec, or of one
+	in another process, isn't among ours. */
+	while ( ep && ep != context )
+		ep = ep->prev;
+
+	if ( ep == NULL )
+		return muse_raise_error( env, _csymbol(L"error:dead-continuation"), _cons( result, MUSE_NIL ) );
+
+	resume_invoke( env, &(ep->escape), result );
+	return MUSE_NIL; /* Never returns! */
+}
+
+/**
+ * @code (call/ec (fn (k) ... (k result) ...)) @endcode
+ *
+ * "Call with escape continuation". Like \ref fn_callcc "call/cc", 
+ * but the continuation \c k can only be used to return from the
+ * call/ec expression while it is still being evaluated. This covers
+ * the common uses of continuations - breaking out of loops and 
+ * returning early from searches - at about the cost of a function 
+ * call, since only a few stack positions need to be saved where
+ * call/cc copies the stacks and the values of all symbols.
+ * @code
+ * (define (find-first pred xs)
+ *   (call/ec (fn (return)
+ *     (for-each xs (fn (x) (when (pred x) (return x))))
+ *     ())))
+ * @endcode
+ *
+ * Escaping from within \ref syntax_try "try" blocks runs their
+ * \ref syntax_finally "finally" thunks on the way out. Invoking
+ * \c k after the call/ec has completed, or from another process,
+ * raises \c error:dead-continuation with the value given to \c k. 
+ * If a handler resumes it, the resumed value is the result of 
+ * invoking \c k.
+ *
+ * @exception error:dead-continuation
+ * Handler format: @code (fn (resume 'error:dead-continuation value) ...) @endcode
+ */
+muse_cell fn_callec( muse_env *env, void *context, muse_cell args )
+{
+	muse_process_frame_t *p = env->current_process;
+	muse_cell proc = _evalnext(&args);
+	muse_escape_point_t ep;
+
+	ep.magic_word = 0;
+	ep.prev = p->escape_points;
+	ep.k = _mk_nativefn( fn_escape, &ep );
+
+	if ( resume_capture( env, &(ep.escape), setjmp(ep.escape.state) ) == 0 )
+	{
+		muse_cell result;
+
+		p->escape_points = &ep;
+		result = _apply( proc, _cons( ep.k, MUSE_NIL ), MUSE_TRUE );
+		close_escape_points( env, p, ep.prev );
+		p->escape_points = ep.prev;
+		return result;
+	}
+	else
+	{
+		/* k was invoked and resume_capture() has restored the
+		enclosing escape points. */
+		return ep.escape.result;
+	}
+}
+
 muse_cell fn_with_recent( muse_env *env, void *context, muse_cell args );
 
 /**
@@ -964,8 +1320,7 @@ muse_cell fn_with_recent( muse_env *env, void *context, muse_cell args );
 muse_cell syntax_finally( muse_env *env, void *context, muse_cell args )
 {
 	/* Get the current trap point. */
-	muse_cell trapval = _symval( _builtin_symbol( MUSE_TRAP_POINT ) );
-	trap_point_t *trap = _tpdata(trapval);
+	trap_point_t *trap = env->current_process->traps;
 	
 	if ( trap )
 	{
@@ -990,8 +1345,7 @@ muse_cell syntax_finally( muse_env *env, void *context, muse_cell args )
 MUSEAPI void muse_add_finalizer( muse_env *env, muse_cell finalizer )
 {
 	/* Get the current trap point. */
-	muse_cell trapval = _symval( _builtin_symbol( MUSE_TRAP_POINT ) );
-	trap_point_t *trap = _tpdata(trapval);
+	trap_point_t *trap = env->current_process->traps;
 	
 	if ( trap )
 	{
@@ -1037,11 +1391,8 @@ int print_handler_choices( muse_env *env, trap_point_t *tp, muse_port_t p, int n
 				muse_pwrite( p, h );
 		}
 	}
-	
-	if ( tp->next )
-		return print_handler_choices( env, _tpdata(tp->next), p, nchoices );
-	else
-		return nchoices;
+
+	return nchoices;
 }
 
 /**
@@ -1069,10 +1420,9 @@ muse_cell fn_top_level_handler( muse_env *env, void *context, muse_cell args )
 	}
 	
 	{
-		muse_cell trap = _symval( _builtin_symbol( MUSE_TRAP_POINT ) );
-		trap_point_t *tp = _tpdata(trap);
+		trap_point_t *tp = env->current_process->traps;
 		
-		int choices = print_handler_choices( env, tp, mstderr, 0 );
+		int choices = tp ? print_handler_choices( env, tp, mstderr, 0 ) : 0;
 		
 		if ( choices == 0 )
 		{
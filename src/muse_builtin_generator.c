@@ -0,0 +1,501 @@
+/**
+ * @file muse_builtin_generator.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * Implements generators - functions that hand out a sequence of
+ * values one at a time, running only as far as needed to produce
+ * the next one.
+ */
+
+#include "muse_builtins.h"
+#include "muse_opcodes.h"
+#include <stdlib.h>
+#include <setjmp.h>
+
+/** @addtogroup FunctionalObjects */
+/*@{*/
+/**
+ * @defgroup Generators
+ *
+ * A generator runs a function on a C stack of its own, so it can
+ * stop in the middle of the function whenever it has a value to
+ * give, and carry on from there when the next value is asked for.
+ * Producing a sequence this way doesn't need a process, a mailbox
+ * or the scheduler - the values are handed over directly between
+ * the generator and the code that uses it.
+ *
+ * The generator's function runs with a process frame of its own
+ * that isn't part of the process ring. Its evaluation stacks,
+ * symbol values, try blocks and trace are exchanged with those of
+ * the process that resumes it for as long as it runs. The C stack
+ * comes from the pool of process stacks, so it is small to begin
+ * with and committed only as far as it gets used.
+ */
+/*@{*/
+
+enum
+{
+	GENERATOR_NEW,			/**< The function hasn't been started yet. */
+	GENERATOR_SUSPENDED,	/**< Waiting in a yield for the next resume. */
+	GENERATOR_RUNNING,		/**< Being run by its process. */
+	GENERATOR_DONE			/**< The function has returned or raised an exception. */
+};
+
+typedef struct
+{
+	muse_functional_object_t base;
+	muse_env		*env;
+	muse_cell		fn;				/**< The generator function, which takes the yield function. */
+	muse_cell		pid;			/**< The process that the generator belongs to. */
+	int				state;
+	muse_process_frame_t *frame;
+	/**<
+	 * Holds the evaluation state of the generator while it is
+	 * suspended and that of the process that resumed it while it
+	 * runs. Taken when the generator is first run and released
+	 * once it is done.
+	 */
+	jmp_buf			resume_state;	/**< Where the generator continues from when resumed. */
+	jmp_buf			yield_state;	/**< Where the resuming code continues from when the generator yields. */
+	muse_cell		value;			/**< The value being handed over in either direction. */
+	muse_boolean	failed;			/**< Set if the generator ended with an unhandled exception. */
+	muse_cell		condition;		/**< The arguments of that exception. */
+} generator_t;
+
+static void generator_init( muse_env *env, void *ptr, muse_cell args )
+{
+	generator_t *g = (generator_t*)ptr;
+
+	g->env		= env;
+	g->fn		= _evalnext(&args);
+	g->pid		= process_id( env->current_process );
+	g->state	= GENERATOR_NEW;
+}
+
+static void generator_mark( muse_env *env, void *ptr )
+{
+	generator_t *g = (generator_t*)ptr;
+
+	muse_mark( env, g->fn );
+	muse_mark( env, g->pid );
+	muse_mark( env, g->value );
+	muse_mark( env, g->condition );
+
+	if ( g->frame )
+		mark_process( g->frame );
+}
+
+static void generator_destroy( muse_env *env, void *ptr )
+{
+	generator_t *g = (generator_t*)ptr;
+
+	/* A generator that is dropped while suspended is never resumed.
+	Its try blocks are abandoned without being finalized. */
+	if ( g->frame )
+	{
+		close_escape_points( env, g->frame, NULL );
+		free_process( g->frame );
+		g->frame = NULL;
+	}
+}
+
+/**
+ * Exchanges the evaluation state of the two frames. The identity
+ * of a process - its pid, mailbox, scheduling and C stack memory -
+ * stays with its frame.
+ */
+static void swap_evaluation_state( muse_process_frame_t *p, muse_process_frame_t *q )
+{
+#define SWAP_FIELD(type,field) { type temp = p->field; p->field = q->field; q->field = temp; }
+	SWAP_FIELD( muse_stack, stack );
+	SWAP_FIELD( muse_stack, bindings_stack );
+	SWAP_FIELD( muse_locals_t, locals );
+	SWAP_FIELD( int, lexical_frame );
+	SWAP_FIELD( struct _muse_trap_point_t *, traps );
+	SWAP_FIELD( struct _muse_escape_point_t *, escape_points );
+	SWAP_FIELD( muse_cell, generator );
+	SWAP_FIELD( muse_cell *, cstack.top );
+	SWAP_FIELD( muse_traceinfo_t, traceinfo );
+	SWAP_FIELD( recent_t, recent );
+#undef SWAP_FIELD
+}
+
+/**
+ * Returns to the code that resumed the generator,
+ * leaving the generator done.
+ */
+static void finish_generator( muse_env *env, generator_t *g )
+{
+	g->state = GENERATOR_DONE;
+	swap_evaluation_state( env->current_process, g->frame );
+	longjmp( g->yield_state, 1 );
+}
+
+/**
+ * The generator that a newly started generator stack picks up.
+ * Like the C stack of a virgin process, the new stack has none
+ * of the local variables of the code that switched to it. Kept
+ * per thread, so environments on different threads can each
+ * start generators.
+ */
+static MUSE_THREAD_LOCAL generator_t *g_starting_generator = NULL;
+
+static muse_cell fn_yield( muse_env *env, void *context, muse_cell args );
+
+static void run_generator()
+{
+	generator_t *g = g_starting_generator;
+	muse_env *env = g->env;
+
+	_apply( g->fn, _cons( _mk_nativefn( fn_yield, NULL ), MUSE_NIL ), MUSE_TRUE );
+
+	g->value = MUSE_NIL;
+	finish_generator( env, g );
+}
+
+/**
+ * Called when an exception raised while a generator runs isn't
+ * handled by any of the generator's try blocks. The generator is
+ * done, and the exception is raised again in the code that
+ * resumed it.
+ */
+void fail_generator( muse_env *env, muse_cell condition )
+{
+	generator_t *g = (generator_t*)_functional_object_data( env->current_process->generator, 'gnrt' );
+
+	g->failed		= MUSE_TRUE;
+	g->condition	= condition;
+	finish_generator( env, g );
+}
+
+/**
+ * Runs the generator until it yields its next value, which is
+ * returned, or until it is done. \p value is given as the result
+ * of the yield that the generator is waiting in.
+ */
+static muse_cell resume_generator( muse_env *env, generator_t *g, muse_cell value )
+{
+	muse_process_frame_t *p = env->current_process;
+	int state = g->state;
+
+	switch ( state )
+	{
+	case GENERATOR_DONE:
+		return MUSE_NIL;
+
+	case GENERATOR_RUNNING:
+		return muse_raise_error( env, _csymbol(L"error:generator-running"), _cons( g->base.self, MUSE_NIL ) );
+	}
+
+	if ( process_id(p) != g->pid )
+		return muse_raise_error( env, _csymbol(L"error:generator-process"), _cons( g->base.self, MUSE_NIL ) );
+
+	if ( state == GENERATOR_NEW )
+	{
+		/* The generator starts out with the symbol values of its process. */
+		g->frame = create_process( env, env->parameters[MUSE_DEFAULT_ATTENTION], g->fn, NULL );
+		g->frame->generator = g->base.self;
+	}
+
+	g->value = value;
+	g->state = GENERATOR_RUNNING;
+	swap_evaluation_state( p, g->frame );
+
+	if ( setjmp( g->yield_state ) == 0 )
+	{
+		if ( state == GENERATOR_NEW )
+		{
+			/* Start the generator on its own C stack. */
+			g_starting_generator = g;
+			CHANGE_STACK_POINTER( p->cstack.top );
+			run_generator();
+		}
+		else
+			longjmp( g->resume_state, 1 );
+	}
+
+	if ( g->state == GENERATOR_DONE )
+	{
+		free_process( g->frame );
+		g->frame = NULL;
+
+		if ( g->failed )
+		{
+			muse_cell condition = _spush(g->condition);
+			g->failed = MUSE_FALSE;
+			g->condition = MUSE_NIL;
+			return muse_raise_error( env, _head(condition), _tail(condition) );
+		}
+	}
+
+	return g->value;
+}
+
+/**
+ * @code (yield [value]) @endcode
+ *
+ * The function that a \ref fn_generator "generator" is given to hand
+ * out values with. It suspends the innermost generator being run by
+ * the process, which gives \p value as its next value. The yield
+ * evaluates to the value given when the generator is resumed.
+ *
+ * @exception error:not-in-generator
+ * Handler format: @code (fn (resume 'error:not-in-generator value) ...) @endcode
+ */
+static muse_cell fn_yield( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell value = _evalnext(&args);
+	generator_t *g = (generator_t*)_functional_object_data( env->current_process->generator, 'gnrt' );
+
+	if ( g == NULL )
+		return muse_raise_error( env, _csymbol(L"error:not-in-generator"), _cons( value, MUSE_NIL ) );
+
+	g->value = value;
+	g->state = GENERATOR_SUSPENDED;
+	swap_evaluation_state( env->current_process, g->frame );
+
+	if ( setjmp( g->resume_state ) == 0 )
+		longjmp( g->yield_state, 1 );
+
+	return g->value;
+}
+
+/**
+ * The function that implements generator invocation.
+ */
+static muse_cell fn_generator_object( muse_env *env, generator_t *g, muse_cell args )
+{
+	return resume_generator( env, g, args ? _evalnext(&args) : MUSE_NIL );
+}
+
+static muse_cell generator_iterator( muse_env *env, generator_t *g, muse_iterator_callback_t callback, void *context )
+{
+	int sp = _spos();
+
+	for (;;)
+	{
+		muse_cell item = resume_generator( env, g, MUSE_NIL );
+
+		if ( g->state == GENERATOR_DONE )
+			return MUSE_NIL;
+
+		_spush(item);
+
+		if ( callback( env, g, context, item ) == MUSE_FALSE )
+		{
+			_unwind(sp);
+			return item; /**< Return the item that stopped the iteration. */
+		}
+
+		_unwind(sp);
+	}
+}
+
+/**
+ * Produces the next element of a lazy list of the values of a
+ * generator that pass a predicate, optionally transformed by a
+ * mapper.
+ */
+static muse_cell lazy_generate( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell orig, me, generator, predicate, mapper;
+	generator_t *g;
+
+	orig = args; /**< Only lazy_generate generates calls to itself, so args can be reused. */
+	me = _quq(_head(args)); args = _tail(args);
+	generator = _quq(_head(args)); args = _tail(args);
+	predicate = _quq(_head(args)); args = _tail(args);
+	mapper = _quq(_head(args));
+	g = (generator_t*)_functional_object_data( generator, 'gnrt' );
+
+	for (;;)
+	{
+		int sp = _spos();
+		muse_cell thing = _cons( resume_generator( env, g, MUSE_NIL ), MUSE_NIL );
+
+		if ( g->state == GENERATOR_DONE )
+			return MUSE_NIL;
+
+		if ( !predicate || _apply( predicate, thing, MUSE_TRUE ) )
+		{
+			if ( mapper )
+				_seth( thing, _apply( mapper, thing, MUSE_TRUE ) );
+			return _cons( _head(thing), _setcellt( _cons( me, orig ), MUSE_LAZY_CELL ) );
+		}
+
+		_unwind(sp);
+	}
+}
+
+static muse_cell generator_list( muse_env *env, generator_t *g, muse_cell predicate, muse_cell mapper )
+{
+	muse_cell lg = _mk_nativefn( lazy_generate, NULL );
+	return lazy_generate( env, NULL, _cons( lg, _cons( g->base.self, _cons( predicate, _cons( mapper, MUSE_NIL ) ) ) ) );
+}
+
+/**
+ * A generator's length isn't known until it is done, and a
+ * generator can't be sliced or joined without running it.
+ */
+static muse_cell generator_unsupported( muse_env *env, void *self )
+{
+	return MUSE_NIL;
+}
+
+static muse_cell generator_map( muse_env *env, void *self, muse_cell fn )
+{
+	return generator_list( env, (generator_t*)self, MUSE_NIL, fn );
+}
+
+static muse_cell generator_join( muse_env *env, void *self, muse_cell objlist, muse_cell reduction_fn )
+{
+	return generator_unsupported( env, self );
+}
+
+static muse_cell generator_collect( muse_env *env, void *self, muse_cell predicate, muse_cell mapper, muse_cell reduction_fn )
+{
+	return generator_list( env, (generator_t*)self, predicate, mapper );
+}
+
+static muse_cell generator_reduce( muse_env *env, void *self, muse_cell reduction_fn, muse_cell initial )
+{
+	generator_t *g = (generator_t*)self;
+	muse_cell result = initial;
+	int sp = _spos();
+
+	_spush(result);
+
+	for (;;)
+	{
+		muse_cell item = resume_generator( env, g, MUSE_NIL );
+
+		if ( g->state == GENERATOR_DONE )
+			return result;
+
+		result = _apply( reduction_fn, _cons( result, _cons( item, MUSE_NIL ) ), MUSE_TRUE );
+		_unwind(sp);
+		_spush(result);
+	}
+}
+
+static muse_cell generator_slice( muse_env *env, void *self, muse_cell argv )
+{
+	return generator_unsupported( env, self );
+}
+
+static muse_monad_view_t g_generator_monad_view =
+{
+	generator_unsupported,
+	generator_map,
+	generator_join,
+	generator_collect,
+	generator_reduce,
+	generator_slice
+};
+
+static void *generator_view( muse_env *env, int id )
+{
+	switch ( id )
+	{
+		case 'mnad' : return &g_generator_monad_view;
+		case 'iter' : return generator_iterator;
+		default : return NULL;
+	}
+}
+
+static muse_functional_object_type_t g_generator_type =
+{
+	'muSE',
+	'gnrt',
+	sizeof(generator_t),
+	(muse_nativefn_t)fn_generator_object,
+	generator_view,
+	generator_init,
+	generator_mark,
+	generator_destroy,
+	NULL
+};
+
+/**
+ * @code (generator (fn (yield) ...)) @endcode
+ *
+ * Creates a generator that hands out the values that the given
+ * function passes to \c yield, one at a time. The function isn't
+ * run until the first value is asked for, and then only until it
+ * yields. Calling the generator as @code (g [value]) @endcode
+ * runs it to its next yield and evaluates to the yielded value. The
+ * yield in turn evaluates to \p value, so values can be passed in
+ * both directions. Once the function returns, the generator is done
+ * and evaluates to \c (). For example -
+ * @code
+ * (define (count-up yield i)
+ *   (yield i)
+ *   (count-up yield (+ i 1)))
+ * (define (count-from n)
+ *   (generator (fn (yield) (count-up yield n))))
+ * (define c (count-from 10))
+ * (print (c) (c) (c))
+ * @endcode
+ * prints \c 10 \c 11 \c 12.
+ *
+ * A generator can be given to \ref fn_for_each "for-each",
+ * \ref fn_reduce "reduce", \ref fn_find "find", \ref fn_andmap "andmap"
+ * and \ref fn_ormap "ormap", which run it until it is done or until
+ * they have what they need. \ref fn_map "map" and \ref fn_collect "collect"
+ * turn a generator into a lazy list that runs the generator as the
+ * list is walked, so that an endless generator can be taken a few
+ * values at a time -
+ * @code
+ * (print (take 3 (collect (count-from 1) (fn (x) (= 0 (% x 2))) ())))
+ * @endcode
+ * prints \c (2 4 6).
+ *
+ * The function starts out with the symbol values of the process that
+ * created the generator as they are when the generator is first run,
+ * much like a spawned process does, and its changes to them aren't
+ * seen outside. Only the creating process can run the generator. An exception
+ * that the function doesn't handle ends the generator and is raised
+ * again where the generator was called.
+ *
+ * @exception error:generator-running
+ * Raised when a generator is called from within its own function.
+ * Handler format: @code (fn (resume 'error:generator-running g) ...) @endcode
+ *
+ * @exception error:generator-process
+ * Handler format: @code (fn (resume 'error:generator-process g) ...) @endcode
+ */
+muse_cell fn_generator( muse_env *env, void *context, muse_cell args )
+{
+	return _mk_functional_object( &g_generator_type, args );
+}
+
+/**
+ * @code (generator-done? g) @endcode
+ *
+ * Evaluates to \c T if the generator's function has returned or
+ * ended with an exception, and to \c () if it can produce more
+ * values. Since a generator evaluates to \c () once it is done,
+ * this tells that apart from a yielded \c ().
+ */
+muse_cell fn_generator_done_p( muse_env *env, void *context, muse_cell args )
+{
+	generator_t *g = (generator_t*)_functional_object_data( _evalnext(&args), 'gnrt' );
+	return (g && g->state == GENERATOR_DONE) ? _t() : MUSE_NIL;
+}
+
+void muse_define_builtin_type_generator( muse_env *env )
+{
+	int sp = _spos();
+	_define( _csymbol(L"generator"), _mk_nativefn( fn_generator, NULL ) );
+	_define( _csymbol(L"generator-done?"), _mk_nativefn( fn_generator_done_p, NULL ) );
+	_unwind(sp);
+}
+
+/*@}*/
+/*@}*/
@@ -255,7 +255,10 @@ static muse_cell json_read_key( muse_port_t p )
 	const muse_char *strptr = muse_text_contents( env, str, &len );
 	str = muse_symbol( env, strptr, strptr + len );
 	_unwind(sp);
-	return str;
+
+	/* Unreferenced symbols can be collected, so keep the key
+	on the stack while its value is being read. */
+	return _spush(str);
 }
 
 static muse_cell json_read_string( muse_port_t p )
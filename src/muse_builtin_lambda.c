@@ -12,6 +12,7 @@
 
 #include "muse_builtins.h"
 #include "muse_port.h"
+#include <string.h>
 
 static void anonymize_formals( muse_env *env, muse_cell syms )
 {
@@ -345,6 +346,473 @@ muse_cell fn_with_recent( muse_env *env, void *context, muse_cell args )
 	}
 }
 
+/**
+ * @addtogroup LexicalAddressing Lexical addressing
+ *
+ * Formal parameters and \c let variables are normally bound by saving
+ * the symbol's value on the bindings stack and restoring it on exit.
+ * When the \c MUSE_LEXICAL_ADDRESSING parameter is set (or after
+ * <tt>(lexical-addressing on)</tt>), \ref syntax_lambda "fn" looks at
+ * the body of every closure it creates. If none of the formals is
+ * referred to other than by evaluating it - i.e. it isn't quoted,
+ * assigned, captured by an inner \c fn or passed to a syntax that
+ * might not evaluate it - the formals and such \c let variables are
+ * kept in a frame on the evaluation stack and references to them are
+ * replaced by references to frame slots.
+ *
+ * This changes the meaning of code that relies on a callee seeing the
+ * caller's local variables by name (for example a \c fn: block defined
+ * elsewhere), which is why it has to be asked for.
+ */
+/*@{*/
+
+enum { MUSE_MAX_LEXICAL_VARS = 64 };
+
+typedef struct
+{
+	muse_cell symbol;
+	muse_cell site;	/**< The formals or let binding cell that introduced the variable. */
+	int slot;		/**< The frame slot, or -1 if the variable is bound to the symbol. */
+} lexical_var_t;
+
+typedef struct
+{
+	muse_boolean rewrite;	/**< MUSE_FALSE while looking for dynamic references, MUSE_TRUE while rewriting. */
+	muse_boolean overflow;
+	int num_vars;
+	lexical_var_t vars[MUSE_MAX_LEXICAL_VARS];
+	int num_escaped;
+	muse_cell escaped[MUSE_MAX_LEXICAL_VARS];
+	int num_slots;
+} lexical_pass_t;
+
+static muse_boolean lexical_is_list( muse_env *env, muse_cell list )
+{
+	while ( list > 0 && _cellt(list) == MUSE_CONS_CELL )
+		list = _tail(list);
+
+	return list == MUSE_NIL;
+}
+
+static muse_boolean lexical_is_var( muse_env *env, muse_cell sym )
+{
+	return sym > 0 && _cellt(sym) == MUSE_SYMBOL_CELL && sym != _builtin_symbol(MUSE_IT);
+}
+
+static int lexical_find( lexical_pass_t *lp, muse_cell sym )
+{
+	int i = lp->num_vars;
+
+	while ( i-- > 0 )
+	{
+		if ( lp->vars[i].symbol == sym )
+			return i;
+	}
+
+	return -1;
+}
+
+static void lexical_push( lexical_pass_t *lp, muse_cell sym, muse_cell site, int slot )
+{
+	if ( lp->num_vars < MUSE_MAX_LEXICAL_VARS )
+	{
+		lexical_var_t *v = lp->vars + (lp->num_vars++);
+		v->symbol	= sym;
+		v->site		= site;
+		v->slot		= slot;
+	}
+	else
+		lp->overflow = MUSE_TRUE;
+}
+
+static muse_boolean lexical_escaped( lexical_pass_t *lp, muse_cell site )
+{
+	int i;
+
+	for ( i = 0; i < lp->num_escaped; ++i )
+	{
+		if ( lp->escaped[i] == site )
+			return MUSE_TRUE;
+	}
+
+	return MUSE_FALSE;
+}
+
+/**
+ * Marks all variables mentioned anywhere in the given expression
+ * as being referred to dynamically.
+ */
+static void lexical_opaque( muse_env *env, lexical_pass_t *lp, muse_cell expr )
+{
+	while ( !lp->rewrite && expr > 0 )
+	{
+		switch ( _cellt(expr) )
+		{
+		case MUSE_SYMBOL_CELL :
+			{
+				int i = lexical_find( lp, expr );
+				if ( i >= 0 && !lexical_escaped( lp, lp->vars[i].site ) )
+				{
+					if ( lp->num_escaped < MUSE_MAX_LEXICAL_VARS )
+						lp->escaped[lp->num_escaped++] = lp->vars[i].site;
+					else
+						lp->overflow = MUSE_TRUE;
+				}
+			}
+			return;
+		case MUSE_CONS_CELL :
+			lexical_opaque( env, lp, _head(expr) );
+			expr = _tail(expr);
+			break;
+		default :
+			return;
+		}
+	}
+}
+
+static muse_cell lexical_expr( muse_env *env, lexical_pass_t *lp, muse_cell expr );
+
+static muse_cell lexical_list( muse_env *env, lexical_pass_t *lp, muse_cell list )
+{
+	if ( list == MUSE_NIL )
+		return MUSE_NIL;
+	else
+	{
+		muse_cell h = lexical_expr( env, lp, _head(list) );
+		muse_cell t = lexical_list( env, lp, _tail(list) );
+		return lp->rewrite ? _cons( h, t ) : list;
+	}
+}
+
+/**
+ * (let ((var expr) ...) body...) where all the vars are symbols.
+ * The let is turned into a ({{let}} ((slot . expr) ...) body...)
+ * if none of its variables is referred to dynamically.
+ */
+static muse_cell lexical_let( muse_env *env, lexical_pass_t *lp, muse_cell expr )
+{
+	muse_cell bindings = _head(_tail(expr));
+	muse_cell body = _tail(_tail(expr));
+	muse_cell b;
+	muse_boolean lexical = lp->rewrite;
+
+	for ( b = bindings; b; b = _tail(b) )
+	{
+		muse_cell binding = _head(b);
+
+		if ( b < 0 || _cellt(b) != MUSE_CONS_CELL
+			|| binding <= 0 || _cellt(binding) != MUSE_CONS_CELL
+			|| !lexical_is_var( env, _head(binding) ) 
+			|| _tail(binding) <= 0 || _cellt(_tail(binding)) != MUSE_CONS_CELL
+			|| _tail(_tail(binding)) != MUSE_NIL )
+		{
+			lexical_opaque( env, lp, _tail(expr) );
+			return expr;
+		}
+
+		if ( lexical_escaped( lp, binding ) )
+			lexical = MUSE_FALSE;
+	}
+
+	{
+		int num_vars = lp->num_vars;
+		muse_cell new_bindings = MUSE_NIL, last = MUSE_NIL;
+
+		/* The bindings are made in sequence, so each expression
+		sees the variables bound before it. */
+		for ( b = bindings; b; b = _tail(b) )
+		{
+			muse_cell binding = _head(b);
+			muse_cell e = lexical_expr( env, lp, _head(_tail(binding)) );
+			int slot = lexical ? lp->num_slots++ : -1;
+
+			lexical_push( lp, _head(binding), binding, slot );
+
+			if ( lp->rewrite )
+			{
+				muse_cell item = _cons( lexical ? _cons( _mk_int(slot), e ) : _cons( _head(binding), _cons( e, MUSE_NIL ) ), MUSE_NIL );
+
+				if ( last )
+					_sett( last, item );
+				else
+					new_bindings = item;
+				last = item;
+			}
+		}
+
+		body = lexical_list( env, lp, body );
+		lp->num_vars = num_vars;
+
+		if ( lp->rewrite )
+			return _cons( lexical ? _builtin_symbol(MUSE_LEXICAL_LET) : _head(expr), _cons( new_bindings, body ) );
+		else
+			return expr;
+	}
+}
+
+static muse_cell lexical_application( muse_env *env, lexical_pass_t *lp, muse_cell expr )
+{
+	muse_cell h = _head(expr);
+	muse_cell args = _tail(expr);
+
+	if ( h > 0 && lexical_is_list( env, args ) )
+	{
+		if ( _cellt(h) == MUSE_NATIVEFN_CELL )
+		{
+			muse_nativefn_t f = _ptr(h)->fn.fn;
+
+			if ( f == syntax_let && args )
+				return lexical_let( env, lp, expr );
+
+			if ( f == syntax_if || f == syntax_when || f == syntax_unless || f == syntax_do
+				|| f == fn_and || f == fn_or )
+			{
+				args = lexical_list( env, lp, args );
+				return lp->rewrite ? _cons( h, args ) : expr;
+			}
+
+			if ( f == syntax_case && args )
+			{
+				/* Only the object is evaluated here. The cases bind symbols. */
+				muse_cell object = lexical_expr( env, lp, _head(args) );
+				lexical_opaque( env, lp, _tail(args) );
+				return lp->rewrite ? _cons( h, _cons( object, _tail(args) ) ) : expr;
+			}
+
+			if ( f == syntax_cond )
+			{
+				muse_cell c, clauses = MUSE_NIL, last = MUSE_NIL;
+
+				for ( c = args; c; c = _tail(c) )
+				{
+					muse_cell clause = _head(c);
+					if ( clause <= 0 || _cellt(clause) != MUSE_CONS_CELL || !lexical_is_list( env, clause ) )
+					{
+						lexical_opaque( env, lp, args );
+						return expr;
+					}
+				}
+
+				for ( c = args; c; c = _tail(c) )
+				{
+					muse_cell item = _cons( lexical_list( env, lp, _head(c) ), MUSE_NIL );
+					if ( last )
+						_sett( last, item );
+					else
+						clauses = item;
+					last = item;
+				}
+
+				return lp->rewrite ? _cons( h, clauses ) : expr;
+			}
+		}
+
+		/* A symbol that isn't defined yet when the closure is created
+		is usually a function defined later, such as the one being
+		defined when it calls itself. It is taken to evaluate its
+		arguments, which is part of what lexical addressing asks for. */
+		if ( muse_compiled_strict( env, h )
+			|| (_cellt(h) == MUSE_SYMBOL_CELL && lexical_find( lp, h ) < 0 && _symval(h) == h) )
+		{
+			args = lexical_list( env, lp, args );
+			return lp->rewrite ? _cons( h, args ) : expr;
+		}
+	}
+
+	/* We don't know whether the arguments will be evaluated,
+	but the function position certainly will be. */
+	lexical_opaque( env, lp, args );
+
+	if ( h > 0 && (_cellt(h) == MUSE_SYMBOL_CELL || _cellt(h) == MUSE_CONS_CELL) )
+	{
+		h = lexical_expr( env, lp, h );
+		return lp->rewrite ? _cons( h, args ) : expr;
+	}
+
+	return expr;
+}
+
+static muse_cell lexical_expr( muse_env *env, lexical_pass_t *lp, muse_cell expr )
+{
+	if ( expr <= 0 )
+		return expr;
+
+	switch ( _cellt(expr) )
+	{
+	case MUSE_SYMBOL_CELL :
+		if ( lp->rewrite )
+		{
+			int i = lexical_find( lp, expr );
+			if ( i >= 0 && lp->vars[i].slot >= 0 )
+				return _cons( _builtin_symbol(MUSE_LEXICAL_REF), _mk_int( lp->vars[i].slot ) );
+		}
+		return expr;
+	case MUSE_CONS_CELL :
+		return lexical_application( env, lp, expr );
+	default :
+		return expr;
+	}
+}
+
+static int lexical_push_formals( muse_env *env, lexical_pass_t *lp, muse_cell formals )
+{
+	int n = 0;
+
+	for ( ; formals > 0 && _cellt(formals) == MUSE_CONS_CELL; formals = _tail(formals), ++n )
+		lexical_push( lp, _head(formals), formals, lp->rewrite ? n : -1 );
+
+	if ( formals )
+	{
+		lexical_push( lp, formals, formals, lp->rewrite ? n : -1 );
+		++n;
+	}
+
+	return n;
+}
+
+/**
+ * Rewrites the body of a freshly created closure into
+ * @code ({{frame}} (num-slots . formals) body...) @endcode
+ * where the body refers to the formals and let variables
+ * as frame slots. The closure is left alone if any of the
+ * formals is referred to dynamically.
+ *
+ * @see muse_enter_lexical_frame()
+ */
+static void lexical_address( muse_env *env, muse_cell closure )
+{
+	muse_cell formals = _head(closure);
+	muse_cell body = _tail(closure);
+	muse_cell exprs, f;
+	lexical_pass_t lp;
+	int i, n;
+
+	if ( formals < 0 || body == MUSE_NIL || _head(body) >= 0 )
+		return;
+
+	exprs = _tail(body);
+	if ( exprs == MUSE_NIL || !lexical_is_list( env, exprs ) )
+		return;
+
+	/* Only simple argument lists of distinct symbols. */
+	for ( f = formals; f > 0 && _cellt(f) == MUSE_CONS_CELL; f = _tail(f) )
+	{
+		if ( !lexical_is_var( env, _head(f) ) )
+			return;
+	}
+
+	if ( f && !lexical_is_var( env, f ) )
+		return;
+
+	memset( &lp, 0, sizeof(lp) );
+	n = lexical_push_formals( env, &lp, formals );
+
+	for ( i = 0; i < n; ++i )
+	{
+		if ( lexical_find( &lp, lp.vars[i].symbol ) != i )
+			return;
+	}
+
+	/* Find out which variables are referred to dynamically. */
+	lexical_list( env, &lp, exprs );
+
+	if ( lp.overflow )
+		return;
+
+	for ( i = 0; i < n; ++i )
+	{
+		if ( lexical_escaped( &lp, lp.vars[i].site ) )
+			return;
+	}
+
+	/* Rewrite. */
+	lp.rewrite		= MUSE_TRUE;
+	lp.num_vars		= 0;
+	lp.num_slots	= lexical_push_formals( env, &lp, formals );
+	exprs			= lexical_list( env, &lp, exprs );
+
+	if ( lp.overflow || lp.num_slots == 0 )
+		return;
+
+	_sett( body, _cons( _cons( _builtin_symbol(MUSE_LEXICAL_FRAME), 
+							   _cons( _cons( _mk_int(lp.num_slots), formals ), exprs ) ),
+						MUSE_NIL ) );
+}
+
+/**
+ * @code ({{frame}} (num-slots . formals) body...) @endcode
+ *
+ * Evaluates the body of a lexically addressed function whose formals
+ * have already been bound to its arguments - as when the function is
+ * a case of a generic function. The function call itself is handled
+ * by muse_apply_lambda.
+ */
+muse_cell fn_lexical_frame( muse_env *env, void *context, muse_cell args )
+{
+	int sp = _spos();
+	int prev_frame = muse_enter_lexical_frame( env, _head(args), MUSE_NIL, MUSE_FALSE );
+	muse_cell result = _do( _tail(args) );
+
+	return muse_leave_lexical_frame( env, sp, prev_frame, result );
+}
+
+/**
+ * @code ({{local}} . slot) @endcode
+ *
+ * The value of a local variable of the current lexically addressed
+ * function. \ref muse_eval handles these directly, so this is only
+ * used when the expression is applied by other means.
+ */
+muse_cell fn_lexical_ref( muse_env *env, void *context, muse_cell args )
+{
+	return *_lexical_slot( _ptr(args)->i );
+}
+
+/**
+ * @code ({{let}} ((slot . expr) ...) body...) @endcode
+ *
+ * A \c let whose variables are kept in the current frame.
+ */
+muse_cell fn_lexical_let( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell bindings = _next(&args);
+
+	while ( bindings )
+	{
+		muse_cell binding = _next(&bindings);
+		int sp = _spos();
+		muse_cell value = _eval( _tail(binding) );
+
+		*_lexical_slot( _ptr(_head(binding))->i ) = value;
+		_unwind(sp);
+	}
+
+	return _do(args);
+}
+
+/**
+ * @code (lexical-addressing on) or (lexical-addressing off) @endcode
+ *
+ * Turns lexical addressing of closures created from here
+ * on by \ref syntax_lambda "fn" on or off. Without an
+ * argument, evaluates to the current setting.
+ */
+muse_cell fn_lexical_addressing( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell on = _csymbol(L"on");
+	muse_cell off = _csymbol(L"off");
+	if ( args ) {
+		muse_cell arg = _next(&args);
+		if ( arg == on ) { env->parameters[MUSE_LEXICAL_ADDRESSING] = MUSE_TRUE; return on; }
+		if ( arg == off ) { env->parameters[MUSE_LEXICAL_ADDRESSING] = MUSE_FALSE; return off; }
+		return MUSE_NIL;
+	} else {
+		return env->parameters[MUSE_LEXICAL_ADDRESSING] ? on : off;
+	}
+}
+
+/*@}*/
+
 /**
  * @code (fn formal-args ...body...) @endcode
  * Common syntax -
@@ -498,6 +966,9 @@ muse_cell syntax_lambda( muse_env *env, void *context, muse_cell args )
 		}
 	}
 
+	if ( env->parameters[MUSE_LEXICAL_ADDRESSING] )
+		lexical_address( env, closure );
+
 	return closure;
 }
 
@@ -570,6 +1041,287 @@ muse_cell syntax_block( muse_env *env, void *context, muse_cell args )
 	return _setcellt( args, MUSE_LAMBDA_CELL );
 }
 
+muse_cell guarded_do( muse_env *env, muse_cell expr );
+
+/**
+ * Number of distinct argument types for which a generic function
+ * remembers the applicable cases. A call site that only ever sees
+ * one type of argument is always served from the first entry.
+ */
+#define MUSE_GFN_CACHE_SIZE 4
+
+enum
+{
+	GFN_KEY_NOARGS = 8,	/**< The generic was called with no arguments. */
+	GFN_KEY_NIL	= 9		/**< The first argument is (). */
+};
+
+typedef struct
+{
+	int type;
+	int type_word;
+	muse_cell cases;
+} gfn_cache_entry_t;
+
+/**
+ * The dispatcher of a generic function takes the place of
+ * \ref syntax_case "case" in the body of the generic. It keeps a
+ * small table mapping the type of the first argument - the cell
+ * type and, for functional objects, the type word - to the sub-list
+ * of cases whose argument pattern can possibly match an argument of
+ * that type. The cases in each sub-list remain in definition order,
+ * so the first case that binds is the same one \c case would pick.
+ */
+typedef struct
+{
+	muse_functional_object_t base;
+	muse_cell cases;	/**< The case list the table was built from. */
+	int count, next;
+	gfn_cache_entry_t entries[MUSE_GFN_CACHE_SIZE];
+} gfn_dispatch_t;
+
+static muse_boolean gfn_dispatch_key( muse_env *env, muse_cell args, int *type, int *type_word )
+{
+	muse_cell a;
+
+	*type_word = 0;
+
+	if ( args == MUSE_NIL )
+	{
+		*type = GFN_KEY_NOARGS;
+		return MUSE_TRUE;
+	}
+
+	if ( args < 0 || _cellt(args) != MUSE_CONS_CELL )
+		return MUSE_FALSE;
+
+	a = _head(args);
+	if ( a == MUSE_NIL )
+	{
+		*type = GFN_KEY_NIL;
+		return MUSE_TRUE;
+	}
+
+	/* Lazy arguments are left alone, since the case that
+	finally matches might not want them forced. */
+	if ( a < 0 || _cellt(a) == MUSE_LAZY_CELL )
+		return MUSE_FALSE;
+
+	*type = _cellt(a);
+	if ( *type == MUSE_NATIVEFN_CELL )
+	{
+		muse_functional_object_t *obj = _fnobjdata(a);
+		if ( obj )
+			*type_word = obj->type_info->type_word;
+	}
+
+	return MUSE_TRUE;
+}
+
+/**
+ * Returns MUSE_FALSE only if muse_equal() can never be true for
+ * the given literal and a value of the given type.
+ */
+static muse_boolean gfn_literal_may_match( muse_env *env, muse_cell lit, int type, int type_word )
+{
+	if ( lit < 0 )
+		return MUSE_TRUE;
+
+	if ( lit == MUSE_NIL )
+		return type == GFN_KEY_NIL;
+
+	switch ( _cellt(lit) )
+	{
+	case MUSE_INT_CELL :
+	case MUSE_FLOAT_CELL :
+		return type == MUSE_INT_CELL || type == MUSE_FLOAT_CELL;
+	case MUSE_NATIVEFN_CELL :
+		{
+			muse_functional_object_t *obj = _fnobjdata(lit);
+			return type == MUSE_NATIVEFN_CELL && type_word == (obj ? obj->type_info->type_word : 0);
+		}
+	default :
+		return type == _cellt(lit);
+	}
+}
+
+/**
+ * Returns MUSE_FALSE only if muse_bind_formals() can never succeed
+ * in binding the given pattern to a value of the given type.
+ */
+static muse_boolean gfn_pattern_may_match( muse_env *env, muse_cell pattern, int type, int type_word )
+{
+	if ( pattern < 0 )
+		return MUSE_TRUE;
+
+	if ( pattern == MUSE_NIL )
+		return type == GFN_KEY_NIL;
+
+	switch ( _cellt(pattern) )
+	{
+	case MUSE_SYMBOL_CELL :
+	case MUSE_LAMBDA_CELL :	/* Guards can accept anything. */
+		return MUSE_TRUE;
+	case MUSE_CONS_CELL :
+		if ( _isquote(_head(pattern)) )
+			return gfn_literal_may_match( env, _tail(pattern), type, type_word );
+		else
+			return type == MUSE_CONS_CELL;
+	default :
+		return gfn_literal_may_match( env, pattern, type, type_word );
+	}
+}
+
+static muse_boolean gfn_case_may_match( muse_env *env, muse_cell formals, int type, int type_word )
+{
+	if ( type == GFN_KEY_NOARGS )
+		return gfn_pattern_may_match( env, formals, GFN_KEY_NIL, 0 );
+
+	if ( formals > 0 && _cellt(formals) == MUSE_CONS_CELL && !_isquote(_head(formals)) )
+		return gfn_pattern_may_match( env, _head(formals), type, type_word );
+
+	/* The pattern applies to the argument list as a whole. */
+	return gfn_pattern_may_match( env, formals, MUSE_CONS_CELL, 0 );
+}
+
+/**
+ * Returns the cases of the generic that are worth trying
+ * for the given arguments.
+ */
+static muse_cell gfn_select_cases( muse_env *env, gfn_dispatch_t *d, muse_cell args, muse_cell cases )
+{
+	int type, type_word, i;
+
+	if ( cases != d->cases )
+	{
+		/* A case was added in front of the existing ones. */
+		d->cases = cases;
+		d->count = d->next = 0;
+	}
+
+	if ( !gfn_dispatch_key( env, args, &type, &type_word ) )
+		return cases;
+
+	for ( i = 0; i < d->count; ++i )
+	{
+		if ( d->entries[i].type == type && d->entries[i].type_word == type_word )
+			return d->entries[i].cases;
+	}
+
+	/* Cache miss. Collect the cases that can match and
+	remember them against this type of argument. */
+	{
+		muse_cell selection = MUSE_NIL, last = MUSE_NIL;
+		muse_cell c = cases;
+		gfn_cache_entry_t *e;
+
+		while ( c )
+		{
+			muse_cell thiscase = _next(&c);
+			if ( gfn_case_may_match( env, _head(thiscase), type, type_word ) )
+			{
+				muse_cell item = _cons( thiscase, MUSE_NIL );
+				if ( last )
+					_sett( last, item );
+				else
+					selection = item;
+				last = item;
+			}
+		}
+
+		if ( d->count < MUSE_GFN_CACHE_SIZE )
+			e = d->entries + (d->count++);
+		else
+			e = d->entries + (d->next++ % MUSE_GFN_CACHE_SIZE);
+
+		e->type			= type;
+		e->type_word	= type_word;
+		e->cases		= selection;
+
+		return selection;
+	}
+}
+
+static void gfn_dispatch_mark( muse_env *env, void *ptr )
+{
+	gfn_dispatch_t *d = (gfn_dispatch_t*)ptr;
+	int i;
+
+	muse_mark( env, d->cases );
+	for ( i = 0; i < d->count; ++i )
+		muse_mark( env, d->entries[i].cases );
+}
+
+/**
+ * Writes out as "case" so that a generic function's
+ * body reads the same as it did before.
+ */
+static void gfn_dispatch_write( muse_env *env, void *ptr, void *port )
+{
+	port_write( "case", 4, (muse_port_t)port );
+}
+
+/**
+ * Same as \ref syntax_case "case", except that only the
+ * cases selected by the dispatch table are tried.
+ */
+static muse_cell fn_gfn_dispatch( muse_env *env, gfn_dispatch_t *d, muse_cell args )
+{
+	muse_cell object = _evalnext(&args);
+	muse_cell cases = gfn_select_cases( env, d, object, args );
+	int bsp = _bspos();
+
+	while ( cases )
+	{
+		muse_cell thiscase = _next(&cases);
+
+		if ( muse_bind_formals( env, _head(thiscase), object ) )
+		{
+			muse_cell result = guarded_do( env, _tail(thiscase) );
+
+			_unwind_bindings(bsp);
+			return muse_add_recent_item( env, (muse_int)syntax_case, result );
+		}
+	}
+
+	MUSE_DIAGNOSTICS({
+		muse_message( env,	L"Error in case expression",
+						L"The object\n\t%m\nfailed to match any case.",
+						object 
+						);
+	});
+
+	return MUSE_NIL;
+}
+
+static muse_functional_object_type_t g_gfn_dispatch_type =
+{
+	'muSE',
+	'gfnd',
+	sizeof(gfn_dispatch_t),
+	(muse_nativefn_t)fn_gfn_dispatch,
+	NULL,
+	NULL,
+	gfn_dispatch_mark,
+	NULL,
+	gfn_dispatch_write
+};
+
+/**
+ * Called when a case is added to a generic function
+ * so that its dispatch table gets rebuilt.
+ */
+void gfn_dispatch_invalidate( muse_env *env, muse_cell case_e )
+{
+	gfn_dispatch_t *d = (gfn_dispatch_t*)muse_functional_object_data( env, _head(case_e), 'gfnd' );
+
+	if ( d )
+	{
+		d->cases = MUSE_NIL;
+		d->count = d->next = 0;
+	}
+}
+
 static muse_cell case_lambda( muse_env *env, muse_cell fn )
 {
 	muse_cell generic_args = _csymbol(L"{{generic-args}}");
@@ -581,7 +1333,7 @@ static muse_cell case_lambda( muse_env *env, muse_cell fn )
 	/* Construct a "case-lambda" for the generic function. */
 	{
 		muse_cell gfn = _setcellt( _cons( qqopt_generic_args,
-										  _cons( _cons( _symval(_csymbol(L"case")),
+										  _cons( _cons( muse_mk_functional_object( env, &g_gfn_dispatch_type, MUSE_NIL ),
 														_cons( generic_args,
 															   _cons( case_e, 
 																	  MUSE_NIL ) ) ),
@@ -633,7 +1385,10 @@ static muse_cell case_lambda( muse_env *env, muse_cell fn )
  *
  * There is some overhead to using generic functions
  * versus normal functions - the overhead of dispatching a given
- * set of arguments to the appropriate case. 
+ * set of arguments to the appropriate case. To keep this low, each
+ * generic remembers, for the last few types of first argument it has
+ * seen, which cases can possibly match and only tries those. Adding
+ * a case clears what it remembers.
  */
 /*@{*/
 
@@ -760,7 +1515,7 @@ static int bind_keys( muse_env *env, muse_cell kvpairs, muse_boolean args_alread
  */
 muse_cell fn_call_w_keywords( muse_env *env, void *context, muse_cell args )
 {
-	yield_process(env,1);
+	_yield(1);
 
 	{
 		muse_cell f = _evalnext(&args);
@@ -837,7 +1592,7 @@ static int bind_alist( muse_env *env, muse_cell kvpairs )
  */
 muse_cell fn_apply_w_keywords( muse_env *env, void *context, muse_cell args )
 {
-	yield_process(env,1);
+	_yield(1);
 
 	{
 		muse_cell f = _evalnext(&args);
@@ -991,8 +1746,6 @@ muse_cell syntax_let( muse_env *env, void *context, muse_cell args )
 	return result;
 }
 
-muse_cell guarded_do( muse_env *env, muse_cell expr );
-
 /**
  * (case object &lt;match-cases&gt;).
  * Syntax -
@@ -1148,4 +1901,80 @@ muse_cell fn_lcons( muse_env *env, void *context, muse_cell args )
 
 	return _cons( h, t );
 }
+
+/**
+ * Realizes the next chunk of a chunked stream. The arguments are
+ * of the form (me generator chunk-size) and, like for lazy_mapper,
+ * only this function generates calls to itself.
+ */
+static muse_cell chunked_stream_next( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell orig = args;
+	muse_cell me = _quq(_head(args));
+	muse_cell generator = _quq(_head(args = _tail(args)));
+	muse_int size = _ptr(_quq(_head(_tail(args))))->i;
+	muse_cell h = MUSE_NIL, t = MUSE_NIL;
+	int sp = _spos();
+	muse_int i;
+
+	for ( i = 0; i < size; ++i )
+	{
+		muse_cell item = _apply( generator, MUSE_NIL, MUSE_TRUE );
+
+		if ( !item )
+			return h;
+
+		if ( h )
+		{
+			muse_cell c = _cons( item, MUSE_NIL );
+			_sett( t, c );
+			t = c;
+		}
+		else
+			h = t = _cons( item, MUSE_NIL );
+
+		_unwind(sp);
+		_spush(h);
+	}
+
+	/* The generator may have more. Produce them only when the
+	tail of the chunk is needed. */
+	_sett( t, _setcellt( _cons( me, orig ), MUSE_LAZY_CELL ) );
+	return h;
+}
+
+/**
+ * @code (chunked-stream generator [chunk-size]) @endcode
+ *
+ * Creates a lazy list whose elements are given by repeatedly calling
+ * the \p generator function with no arguments until it returns ().
+ * Unlike a stream built using \ref fn_lcons "lcons", the elements are
+ * produced \p chunk-size (default 32) at a time into ordinary cons cells 
+ * and only the tail of each chunk is lazy. So the cost of delaying
+ * and forcing is paid once per chunk rather than once per element.
+ *
+ * The result is an ordinary list as far as \ref fn_first "first", 
+ * \ref fn_rest "rest", \ref fn_map "map", \ref fn_collect "collect"
+ * and friends are concerned. The first chunk is produced right away.
+ * 
+ * For example, to process the lines of a file -
+ * @code
+ * (define lines (chunked-stream (fn () (read-line port)) 64))
+ * @endcode
+ *
+ * @see \ref fn_lcons "lcons"
+ */
+muse_cell fn_chunked_stream( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell generator = _evalnext(&args);
+	muse_int size = args ? _intvalue(_evalnext(&args)) : 32;
+
+	if ( size < 1 )
+		size = 1;
+
+	return chunked_stream_next( env, NULL, 
+				_cons( _mk_nativefn( chunked_stream_next, NULL ), 
+					_cons( generator, 
+						_cons( _mk_int(size), MUSE_NIL ) ) ) );
+}
 /*@}*/
@@ -14,6 +14,41 @@
 #include <math.h>
 #include <stdlib.h>
 
+/**
+ * Most arithmetic in practice is on exactly two numbers.
+ * The operators check for this case first and compute the result
+ * directly when both arguments are integers or both are numbers,
+ * without walking the argument list. The result is the same as
+ * that of the general case.
+ */
+static inline muse_boolean is_binary( muse_env *env, muse_cell args )
+{
+	return (args && _tail(args) && !_tail(_tail(args))) ? MUSE_TRUE : MUSE_FALSE;
+}
+
+/**
+ * Evaluates the two arguments of a binary operation. Returns
+ * \c MUSE_TRUE if both are numbers. Otherwise \p args is set to
+ * the evaluated arguments so that the general case can report
+ * the type error.
+ */
+static inline muse_boolean binary_numbers( muse_env *env, muse_cell *args, muse_cell *a, muse_cell *b )
+{
+	(*a) = _evalnext(args);
+	(*b) = _evalnext(args);
+
+	if ( _isnumber(*a) && _isnumber(*b) )
+		return MUSE_TRUE;
+
+	(*args) = _cons( _qq(*a), _cons( _qq(*b), MUSE_NIL ) );
+	return MUSE_FALSE;
+}
+
+static inline muse_boolean both_int( muse_env *env, muse_cell a, muse_cell b )
+{
+	return (_cellt(a) == MUSE_INT_CELL && _cellt(b) == MUSE_INT_CELL) ? MUSE_TRUE : MUSE_FALSE;
+}
+
 /**
  * @code (+ ...numbers...) @endcode
  * add sums up all of its arguments and returns the result.
@@ -26,6 +61,18 @@ muse_cell fn_add( muse_env *env, void *context, muse_cell args )
 	muse_float f = 0.0;
 	muse_boolean result_is_float = MUSE_FALSE;
 	
+	if ( is_binary( env, args ) )
+	{
+		muse_cell a, b;
+		if ( binary_numbers( env, &args, &a, &b ) )
+		{
+			if ( both_int( env, a, b ) )
+				return _mk_int( _ptr(a)->i + _ptr(b)->i );
+			else
+				return _mk_float( _floatvalue(a) + _floatvalue(b) );
+		}
+	}
+	
 	while ( args )
 	{
 		muse_cell arg = _evalnext(&args);
@@ -68,6 +115,18 @@ muse_cell fn_sub( muse_env *env, void *context, muse_cell args )
 	muse_boolean result_is_float = MUSE_FALSE;
 	muse_cell c = MUSE_NIL;
 	
+	if ( is_binary( env, args ) )
+	{
+		muse_cell a, b;
+		if ( binary_numbers( env, &args, &a, &b ) )
+		{
+			if ( both_int( env, a, b ) )
+				return _mk_int( _ptr(a)->i - _ptr(b)->i );
+			else
+				return _mk_float( _floatvalue(a) - _floatvalue(b) );
+		}
+	}
+	
 	if ( !args )
 		return _mk_int(0);
 	
@@ -128,6 +187,18 @@ muse_cell fn_mul( muse_env *env, void *context, muse_cell args )
 	muse_float f = 1.0;
 	muse_boolean result_is_float = MUSE_FALSE;
 	
+	if ( is_binary( env, args ) )
+	{
+		muse_cell a, b;
+		if ( binary_numbers( env, &args, &a, &b ) )
+		{
+			if ( both_int( env, a, b ) )
+				return _mk_int( _ptr(a)->i * _ptr(b)->i );
+			else
+				return _mk_float( _floatvalue(a) * _floatvalue(b) );
+		}
+	}
+	
 	while ( args )
 	{
 		muse_cell arg = _evalnext(&args);
@@ -169,6 +240,13 @@ muse_cell fn_div( muse_env *env, void *context, muse_cell args )
 	muse_float f = 1.0;
 	muse_cell c = MUSE_NIL;
 	
+	if ( is_binary( env, args ) )
+	{
+		muse_cell a, b;
+		if ( binary_numbers( env, &args, &a, &b ) )
+			return _mk_float( _floatvalue(a) / _floatvalue(b) );
+	}
+	
 	if ( !args )
 		return _mk_int(0);
 	
@@ -284,6 +362,28 @@ muse_cell fn_trunc( muse_env *env, void *context, muse_cell args )
 	}
 }
 
+/**
+ * Returns a random number in the range [0,1) using the environment's
+ * own xorshift64* generator. The C library's rand() keeps its state
+ * in a global, which environments running on different threads would
+ * share and contend for.
+ */
+static double random_unit( muse_env *env )
+{
+	unsigned long long x = (unsigned long long)env->random_state;
+
+	if ( x == 0 )
+		x = 88172645463325252ULL;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	env->random_state = (muse_int)x;
+
+	/* The top 53 bits make a double in [0,1). */
+	return (double)((x * 2685821657736338717ULL) >> 11) / 9007199254740992.0;
+}
+
 /**
  * @code (rand M [N]) @endcode
  * Generates a random number.
@@ -314,7 +414,7 @@ muse_cell fn_rand( muse_env *env, void *context, muse_cell args )
 
 			{
 				muse_int dn = _ptr(N)->i - m;
-				return _mk_int( m + (muse_int)(rand() * dn / (1.0+RAND_MAX)) );
+				return _mk_int( m + (muse_int)(random_unit(env) * dn) );
 			}
 		}
 		break;
@@ -324,7 +424,7 @@ muse_cell fn_rand( muse_env *env, void *context, muse_cell args )
 			muse_float m = 0.0;
 			if ( M )
 				m = _ptr(M)->f;
-			return _mk_float( m + rand() * (_ptr(N)->f - m) / (1.0+RAND_MAX) );
+			return _mk_float( m + random_unit(env) * (_ptr(N)->f - m) );
 		}
 		break;
 			
@@ -396,21 +396,18 @@ muse_cell fn_alert( muse_env *env, void *context, muse_cell args )
  */
 static int urlclearchar( muse_char c )
 {
-	static int g_chartable_prepared = 0;
-	static unsigned char g_chartable[32];
-
-	if ( !g_chartable_prepared ) {
-		static const char *clearchars = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_.:/";
-		const char *ci = clearchars;
-		memset( g_chartable, 0, sizeof(g_chartable) );
-		for ( ; *ci; ++ci ) {
-			g_chartable[(*ci)>>3] |= (1 << ((*ci) & 7));
-		}
-		g_chartable_prepared = 1;
-	}
+	/* A bit per ASCII character, set for the characters in
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_.:/".
+	The table is constant so that environments on different threads
+	can share it without having to prepare it first. */
+	static const unsigned char k_chartable[16] =
+	{
+		0x00, 0x00, 0x00, 0x00, 0x00, 0xc0, 0xff, 0x07,
+		0xfe, 0xff, 0xff, 0x87, 0xfe, 0xff, 0xff, 0x07
+	};
 
 	if ( (c & 0x7f) == c ) {
-		return g_chartable[c >> 3] & (1 << (c & 7));
+		return k_chartable[c >> 3] & (1 << (c & 7));
 	} else {
 		return 0;
 	}
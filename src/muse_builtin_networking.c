@@ -47,7 +47,7 @@ muse_cell fn_multicast_group_p( muse_env *env, void *context, muse_cell args );
 #	define INVALID_SOCKET (-1)
 #	define closesocket(x) close(x)
 #	define ioctlsocket(a,b,c) ioctl(a,b,c)
-extern int errno;
+#	include <errno.h>
 #	define WSAGetLastError() errno
 #	define _snprintf snprintf
 #else
@@ -146,10 +146,31 @@ library! What a stupid thing to have to do! */
 	}
 #endif
 
+typedef enum 
+{
+	POLL_SOCKET_FAILED,
+	POLL_SOCKET_ERROR,
+	POLL_SOCKET_SET,
+	POLL_SOCKET_WAITING
+} poll_socket_status_t;
+
+/**
+ * A process waiting for a socket to get ready. It lives
+ * on the waiting process's stack.
+ */
+typedef struct
+{
+	muse_process_frame_t *process;
+	SOCKET socket;
+	int cat;
+	poll_socket_status_t status;
+} socket_waiter_t;
+
 typedef struct _muse_net_t
 {
-	fd_set fdsets[3]; // 0 = read, 1 = write, 2 = except
-	int reductions;
+	fd_set fdsets[3]; // Sockets known to be ready. 0 = read, 1 = write, 2 = except
+	int num_waiters, max_waiters;
+	socket_waiter_t **waiters;
 } muse_net_t;
 
 
@@ -159,52 +180,195 @@ static void prepare_for_network_poll( muse_env *env, SOCKET s, int cat )
 	FD_CLR( s, &(env->net->fdsets[2]) );
 }
 
-typedef enum 
+static void remove_socket_waiter( muse_env *env, int i )
 {
-	POLL_SOCKET_FAILED,
-	POLL_SOCKET_ERROR,
-	POLL_SOCKET_SET
-} poll_socket_status_t;
+	muse_net_t *net = env->net;
+	net->waiters[i] = net->waiters[--net->num_waiters];
+	env->io_waiting--;
+}
 
-static poll_socket_status_t poll_network( muse_env *env, SOCKET s, int cat )
+/**
+ * The scheduler's poll_io hook. Checks the sockets that processes 
+ * are waiting for in one select() and resumes the processes whose 
+ * sockets got ready, waiting for up to \p timeout_us for that to happen
+ * or for a message to arrive from another environment.
+ */
+static void poll_sockets( muse_env *env, muse_int timeout_us )
 {
-	while ( !FD_ISSET(s, &(env->net->fdsets[cat])) )
+	muse_net_t *net = env->net;
+	fd_set fdsets[3];
+#ifdef MUSE_PLATFORM_WINDOWS
+	struct timeval tv = { (long)(timeout_us / 1000000), (long)(timeout_us % 1000000) };
+#else
+	struct timeval tv = { (time_t)(timeout_us / 1000000), (suseconds_t)(timeout_us % 1000000) };
+#endif
+	int i, nfds, wake_fd;
+
+	FD_ZERO( &fdsets[0] );
+	FD_ZERO( &fdsets[1] );
+	FD_ZERO( &fdsets[2] );
+
+	for ( i = 0; i < net->num_waiters; ++i )
+	{
+		FD_SET( net->waiters[i]->socket, &fdsets[net->waiters[i]->cat] );
+		FD_SET( net->waiters[i]->socket, &fdsets[2] );
+	}
+
+	/* A message from another environment also ends the wait. */
+	wake_fd = muse_remote_wake_fd(env);
+	if ( wake_fd >= 0 )
+		FD_SET( wake_fd, &fdsets[0] );
+
+	nfds = select( FD_SETSIZE, &fdsets[0], &fdsets[1], &fdsets[2], &tv );
+
+	/* An interrupted select counts as a wait that turned up nothing. The 
+	scheduler calls us again with whatever is left of its own timeout, 
+	after it has had a chance to handle what the signal asked for. */
+	if ( nfds == 0 || (nfds == SOCKET_ERROR && WSAGetLastError() == EINTR) )
+		return;
+
+	if ( wake_fd >= 0 && nfds != SOCKET_ERROR && FD_ISSET( wake_fd, &fdsets[0] ) )
+		muse_clear_remote_wake(env);
+
+	if ( nfds == SOCKET_ERROR )
+	{
+		FD_ZERO( &(net->fdsets[0]) );
+		FD_ZERO( &(net->fdsets[1]) );
+		FD_ZERO( &(net->fdsets[2]) );
+	}
+
+	for ( i = 0; i < net->num_waiters; )
 	{
-		FD_SET(s, &(env->net->fdsets[cat]) );
-		FD_SET(s, &(env->net->fdsets[2]) );
+		socket_waiter_t *w = net->waiters[i];
 
+		if ( nfds == SOCKET_ERROR )
+			w->status = POLL_SOCKET_FAILED;
+		else if ( FD_ISSET( w->socket, &fdsets[2] ) )
+		{
+			FD_SET( w->socket, &(net->fdsets[2]) );
+			w->status = POLL_SOCKET_ERROR;
+		}
+		else if ( FD_ISSET( w->socket, &fdsets[w->cat] ) )
 		{
-			int current_reductions = env->net->reductions;
-			procrastinate(env);
+			FD_SET( w->socket, &(net->fdsets[w->cat]) );
+			w->status = POLL_SOCKET_SET;
+		}
+		else
+		{
+			++i;
+			continue;
+		}
 
-			if ( env->net->reductions == current_reductions )
-			{
-				/* We have to do the reduction. */
-				static const struct timeval g_tv = {0,500};
-				int nfds = select( FD_SETSIZE, &(env->net->fdsets[0]), &(env->net->fdsets[1]), &(env->net->fdsets[2]), (struct timeval *)&g_tv );
-				env->net->reductions++;
+		remove_socket_waiter( env, i );
+		resume_process( w->process );
+	}
+}
 
-				if ( nfds == SOCKET_ERROR )
-				{
-					FD_ZERO( &(env->net->fdsets[0]) );
-					FD_ZERO( &(env->net->fdsets[1]) );
-					FD_ZERO( &(env->net->fdsets[2]) );
-					return POLL_SOCKET_FAILED;
-				}
+/**
+ * Pauses the current process until the socket is ready for reading
+ * (\p cat = 0) or writing (\p cat = 1), or until the environment's timer 
+ * reaches \p wakeup_us if it isn't negative. Returns POLL_SOCKET_WAITING 
+ * in the latter case. Other processes run in the meantime.
+ */
+static poll_socket_status_t pause_for_socket( muse_env *env, SOCKET s, int cat, muse_int wakeup_us )
+{
+	muse_net_t *net = env->net;
+	socket_waiter_t w;
+	int i;
+
+	w.process	= env->current_process;
+	w.socket	= s;
+	w.cat		= cat;
+	w.status	= POLL_SOCKET_WAITING;
+
+	if ( net->num_waiters == net->max_waiters )
+	{
+		net->max_waiters = net->max_waiters ? net->max_waiters * 2 : 16;
+		net->waiters = (socket_waiter_t**)realloc( net->waiters, net->max_waiters * sizeof(socket_waiter_t*) );
+	}
+
+	net->waiters[net->num_waiters++] = &w;
+	env->io_waiting++;
+
+	pause_process( env, MUSE_PROCESS_WAITING_IO, wakeup_us );
+
+	if ( w.status == POLL_SOCKET_WAITING )
+	{
+		/* Timed out. We're still in the list. */
+		for ( i = 0; i < net->num_waiters; ++i )
+		{
+			if ( net->waiters[i] == &w )
+			{
+				remove_socket_waiter( env, i );
+				break;
 			}
+		}
+	}
+
+	return w.status;
+}
+
+/**
+ * Waits until the socket is known to be ready for reading (\p cat = 0) 
+ * or writing (\p cat = 1). Within an atomic block, the socket is waited
+ * for without letting other processes run.
+ */
+static poll_socket_status_t wait_for_socket( muse_env *env, SOCKET s, int cat )
+{
+	while ( !FD_ISSET(s, &(env->net->fdsets[cat])) )
+	{
+		poll_socket_status_t status;
+
+		if ( env->current_process->atomicity == 0 )
+			status = pause_for_socket( env, s, cat, -1 );
+		else
+		{
+			fd_set fdsets[3];
+			int nfds;
+
+			FD_ZERO( &fdsets[0] );
+			FD_ZERO( &fdsets[1] );
+			FD_ZERO( &fdsets[2] );
+			FD_SET( s, &fdsets[cat] );
+			FD_SET( s, &fdsets[2] );
+
+			nfds = select( FD_SETSIZE, &fdsets[0], &fdsets[1], &fdsets[2], NULL );
+
+			if ( nfds == SOCKET_ERROR )
+				status = (WSAGetLastError() == EINTR) ? POLL_SOCKET_WAITING : POLL_SOCKET_FAILED;
+			else if ( FD_ISSET( s, &fdsets[2] ) )
+				status = POLL_SOCKET_ERROR;
 			else
 			{
-				/* Reduction was done by another polling process. */
+				FD_SET( s, &(env->net->fdsets[cat]) );
+				status = POLL_SOCKET_SET;
 			}
-
-			if ( FD_ISSET( s, &(env->net->fdsets[2]) ) )
-				return POLL_SOCKET_ERROR;
 		}
+
+		if ( status == POLL_SOCKET_FAILED || status == POLL_SOCKET_ERROR )
+			return status;
 	}
 
 	return POLL_SOCKET_SET;
 }
 
+/**
+ * Waits until the socket is ready for reading (\p cat = 0) or writing
+ * (\p cat = 1), letting other processes run in the meantime.
+ */
+static poll_socket_status_t poll_network( muse_env *env, SOCKET s, int cat )
+{
+	if ( env->trace_events == NULL || FD_ISSET(s, &(env->net->fdsets[cat])) )
+		return wait_for_socket( env, s, cat );
+	else
+	{
+		muse_int start_us = muse_elapsed_us(env->timer);
+		poll_socket_status_t status = wait_for_socket( env, s, cat );
+		muse_trace_event( env, cat ? "poll-network-write" : "poll-network-read", 'X', start_us, "socket", (muse_int)s );
+		return status;
+	}
+}
+
 /**
  * @name Point to point communication
  *
@@ -243,6 +407,14 @@ static void socket_close( void *s )
 	
 	if ( p->socket )
 	{
+		/* The socket's descriptor may be reused for another one,
+		which mustn't be taken to be ready. */
+		if ( p->base.env && p->base.env->net )
+		{
+			prepare_for_network_poll( p->base.env, p->socket, 0 );
+			prepare_for_network_poll( p->base.env, p->socket, 1 );
+		}
+
 		closesocket( p->socket );
 		p->socket = 0;
 		port_destroy( (muse_port_t)s );
@@ -331,6 +503,31 @@ static muse_port_type_t g_socket_type =
 	socket_flush
 };
 
+/**
+ * Returns the IPv4 address of the host \p name, which can either be
+ * in the 123.234.12.23 form or be a name to look up in the name server.
+ * Returns INADDR_NONE if there is no such host. Unlike gethostbyname(),
+ * getaddrinfo() returns its result in memory of its own, so environments
+ * on different threads can look up names at the same time.
+ */
+static in_addr_t resolve_host( const char *name )
+{
+	struct addrinfo hints, *res = NULL;
+	in_addr_t addr = inet_addr( name );
+
+	if ( addr != INADDR_NONE )
+		return addr;
+
+	memset( &hints, 0, sizeof(hints) );
+	hints.ai_family = AF_INET;
+	if ( getaddrinfo( name, NULL, &hints, &res ) != 0 || res == NULL )
+		return INADDR_NONE;
+
+	addr = ((struct sockaddr_in*)res->ai_addr)->sin_addr.s_addr;
+	freeaddrinfo( res );
+	return addr;
+}
+
 /**
  * @code (open-connection "server.somewhere.com" port)
  * (open-connection "231.41.59.26" 31415) @endcode
@@ -368,21 +565,11 @@ muse_cell fn_open_connection( muse_env *env, void *context, muse_cell args )
 	
 	portshort = (short)(portnum ? _intvalue(portnum) : MUSE_DEFAULT_MULTICAST_PORT);
 	
-	addr = inet_addr( serverStringAddress );
+	addr = resolve_host( serverStringAddress );
 	if ( addr == INADDR_NONE ) {
-		/* Address not in 123.234.12.23 form. Treat it as a name and look it up in the name server. */
-		struct hostent *ent = gethostbyname( serverStringAddress );
-		if ( ent == NULL ) {
-			/* Invalid server address. */
-			MUSE_DIAGNOSTICS3({ fprintf( stderr, "Connection to server '%s:%d' failed!\n", serverStringAddress, portshort ); herror("inet error:"); });
-			goto UNDO_CONN;
-		}
-		if ( ent->h_length > 0 ) {
-			addr = *(in_addr_t*)ent->h_addr;
-		} else {
-			MUSE_DIAGNOSTICS3({ fprintf( stderr, "Invalid address '%s:%d'!\n", serverStringAddress, portshort ); });
-			goto UNDO_CONN;
-		}
+		/* Invalid server address. */
+		MUSE_DIAGNOSTICS3({ fprintf( stderr, "Connection to server '%s:%d' failed!\n", serverStringAddress, portshort ); });
+		goto UNDO_CONN;
 	}
 	
 	port->address.sin_family		= AF_INET;
@@ -498,16 +685,9 @@ muse_cell fn_with_incoming_connections_to_port( muse_env *env, void *context, mu
 						colon[0] = '\0';
 						++colon;
 						listenPort = atoi(colon);
-						bindAddr = inet_addr(address);
-						if ( bindAddr == INADDR_NONE ) {
-							/* Address not in 123.234.12.23 form. Treat it as a name and look it up in the name server. */
-							struct hostent *ent = gethostbyname( address );
-
-							if ( ent == NULL || ent->h_length == 0 )
-								return muse_raise_error( env, _csymbol(L"error:invalid-port-spec"), _cons( portSpec, MUSE_NIL ) );
-
-							bindAddr = *(in_addr_t*)ent->h_addr;
-						}
+						bindAddr = resolve_host(address);
+						if ( bindAddr == INADDR_NONE )
+							return muse_raise_error( env, _csymbol(L"error:invalid-port-spec"), _cons( portSpec, MUSE_NIL ) );
 					} else {
 						listenPort = atoi(address);
 					}
@@ -592,6 +772,7 @@ muse_cell fn_with_incoming_connections_to_port( muse_env *env, void *context, mu
 					client = accept( conn->listenSocket, (struct sockaddr *)&client_address, &sockAddrSize );
 					break;
 				case POLL_SOCKET_FAILED:
+				case POLL_SOCKET_WAITING:
 					goto POLL_AGAIN;
 				case POLL_SOCKET_ERROR:
 					if ( conn->listenSocket ) closesocket(conn->listenSocket);
@@ -616,6 +797,8 @@ muse_cell fn_with_incoming_connections_to_port( muse_env *env, void *context, mu
 			client_port_cell = _mk_functional_object( &g_socket_type.obj, MUSE_NIL );
 			client_port = (socketport_t*)_port( client_port_cell );
 	
+			prepare_for_network_poll( env, client, 0 );
+			prepare_for_network_poll( env, client, 1 );
 			client_port->socket = client;
 			client_port->base.mode = MUSE_PORT_READ_WRITE;
 			client_port->base.eof = 0;
@@ -1008,22 +1191,48 @@ muse_cell fn_wait_for_input( muse_env *env, void *context, muse_cell args )
 		socketport_t *s = (socketport_t*)p;
 		
 		fd_set fds;
-#ifdef MUSE_PLATFORM_WINDOWS
-		struct timeval tv = { (long)(timeout_us / 1000000), (long)(timeout_us % 1000000) };
-#else
-		struct timeval tv = { (time_t)(timeout_us / 1000000), (suseconds_t)(timeout_us % 1000000) };
-#endif
-		FD_ZERO(&fds);
-		FD_SET( s->socket, &fds );
-		
+		muse_boolean atomic = (env->current_process->atomicity > 0);
+		muse_int deadline_us = muse_elapsed_us(env->timer) + timeout_us;
+		struct timeval tv = { 0, 0 };
+		int nfds;
+
+		/* Check without waiting first, unless in an atomic block. If 
+		there's no input yet, other processes run while this one waits.
+		The preemption timer's signal can interrupt the select, in which 
+		case we go back to waiting for whatever is left of the timeout. */
+		do
 		{
-			int result = select( (int)(s->socket + 1), &fds, NULL, NULL, &tv );
-			switch ( result )
+			if ( atomic )
 			{
-				case 1 : /* Success. */ return _t();
-				case 0 : /* Timed out. */ return _builtin_symbol(MUSE_TIMEOUT);
-				default: /* Error. */ return MUSE_NIL;
+				muse_int remaining_us = deadline_us - muse_elapsed_us(env->timer);
+				if ( remaining_us < 0 )
+					remaining_us = 0;
+				tv.tv_sec = (long)(remaining_us / 1000000);
+				tv.tv_usec = (long)(remaining_us % 1000000);
 			}
+
+			FD_ZERO(&fds);
+			FD_SET( s->socket, &fds );
+
+			nfds = select( (int)(s->socket + 1), &fds, NULL, NULL, &tv );
+		}
+		while ( nfds == SOCKET_ERROR && WSAGetLastError() == EINTR );
+
+		switch ( nfds )
+		{
+			case 1 : /* Success. */ return _t();
+			case 0 : break;
+			default: /* Error. */ return MUSE_NIL;
+		}
+
+		if ( atomic || timeout_us <= 0 )
+			return _builtin_symbol(MUSE_TIMEOUT);
+
+		switch ( pause_for_socket( env, s->socket, 0, deadline_us ) )
+		{
+			case POLL_SOCKET_SET : /* Success. */ return _t();
+			case POLL_SOCKET_WAITING : /* Timed out. */ return _builtin_symbol(MUSE_TIMEOUT);
+			default: /* Error. */ return MUSE_NIL;
 		}
 	}
 	else
@@ -1298,7 +1507,7 @@ static muse_cell fetch_uri( muse_env *env, fetch_uri_args_t *args, muse_cell arg
 				while ( InternetReadFile( huri, buffer, 4096, &bytesRead ) == FALSE || bytesRead > 0 )
 				{
 					fwrite( buffer, 1, bytesRead, f );
-					yield_process(env,1);
+					_yield(1);
 				}
 
 				// We have to close the file and the huri handle before committing
@@ -1423,6 +1632,8 @@ muse_cell fn_fetch_uri( muse_env *env, void *context, muse_cell args )
  */
 static muse_cell fn_network_shutdown( muse_env *env, void *context, muse_cell args )
 {
+	env->poll_io = NULL;
+	free(env->net->waiters);
 	free(env->net);
 	env->net = NULL;
 	muse_network_shutdown(env);
@@ -1809,6 +2020,7 @@ void muse_define_builtin_networking(muse_env *env)
 	FD_ZERO( &(env->net->fdsets[0]) );	// read
 	FD_ZERO( &(env->net->fdsets[1]) );	// write
 	FD_ZERO( &(env->net->fdsets[2]) );	// except
+	env->poll_io = poll_sockets;
 
 	/* Define a destructor function to shutdown the network when everything is done. 
 	Using braces in the symbol name ensures that this symbol cannot be written directly
@@ -0,0 +1,696 @@
+/**
+ * @file muse_builtin_parallel.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * Implements pmap and preduce, which spread their work over a pool
+ * of worker environments running on threads of their own.
+ */
+
+#include "muse_builtins.h"
+#include "muse_opcodes.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef MUSE_PLATFORM_WINDOWS
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+/** @addtogroup Processes */
+/*@{*/
+/**
+ * @defgroup Parallel Parallel map and reduce
+ *
+ * \ref fn_pmap "pmap" and \ref fn_preduce "preduce" split a vector
+ * or a list into chunks and hand them to a pool of worker environments,
+ * each running on a thread of its own. The function and the chunks are
+ * copied to the workers the way messages between environments are -
+ * see \ref fn_remote_pid "remote-pid" - and the results are copied back
+ * and put together in order.
+ *
+ * The pool belongs to the calling environment and is started when it
+ * is first needed, with as many workers as the MUSE_WORKER_THREADS
+ * parameter says, or one per processor.
+ */
+/*@{*/
+
+#ifdef MUSE_PLATFORM_WINDOWS
+typedef CRITICAL_SECTION	pool_lock_t;
+typedef CONDITION_VARIABLE	pool_cond_t;
+typedef HANDLE				pool_thread_t;
+#define pool_lock_init(l)		InitializeCriticalSection(l)
+#define pool_lock_destroy(l)	DeleteCriticalSection(l)
+#define pool_lock(l)			EnterCriticalSection(l)
+#define pool_unlock(l)			LeaveCriticalSection(l)
+#define pool_cond_init(c)		InitializeConditionVariable(c)
+#define pool_cond_destroy(c)
+#define pool_wait(c,l)			SleepConditionVariableCS(c,l,INFINITE)
+#define pool_signal(c)			WakeConditionVariable(c)
+#define pool_broadcast(c)		WakeAllConditionVariable(c)
+#define WORKER_ENTRY			unsigned __stdcall
+#define WORKER_RETURN			0
+#else
+typedef pthread_mutex_t		pool_lock_t;
+typedef pthread_cond_t		pool_cond_t;
+typedef pthread_t			pool_thread_t;
+#define pool_lock_init(l)		pthread_mutex_init(l,NULL)
+#define pool_lock_destroy(l)	pthread_mutex_destroy(l)
+#define pool_lock(l)			pthread_mutex_lock(l)
+#define pool_unlock(l)			pthread_mutex_unlock(l)
+#define pool_cond_init(c)		pthread_cond_init(c,NULL)
+#define pool_cond_destroy(c)	pthread_cond_destroy(c)
+#define pool_wait(c,l)			pthread_cond_wait(c,l)
+#define pool_signal(c)			pthread_cond_signal(c)
+#define pool_broadcast(c)		pthread_cond_broadcast(c)
+#define WORKER_ENTRY			void *
+#define WORKER_RETURN			NULL
+#endif
+
+enum
+{
+	PARALLEL_MAP,
+	PARALLEL_REDUCE,
+	CHUNKS_PER_WORKER = 4	/**< Chunks per worker when no grain size is given, to even out the load. */
+};
+
+typedef struct
+{
+	void	*input;		/**< The encoded items. */
+	void	*output;	/**< The encoded results, or the exception if the chunk failed. */
+	int		done;
+	int		failed;
+} chunk_t;
+
+typedef struct
+{
+	int		op;
+	void	*fn;			/**< The encoded function along with the globals it refers to. */
+	chunk_t	*chunks;
+	int		num_chunks;
+	int		num_ready;		/**< The chunks encoded so far. */
+	int		next;			/**< The next chunk for a worker to take. */
+	int		failed;			/**< Set when a chunk fails. The chunks after it are skipped. */
+	int		serial;			/**< Tells the workers when to decode the function again. */
+} job_t;
+
+typedef struct
+{
+	pool_lock_t		lock;
+	pool_cond_t		work;	/**< Signalled when chunks get ready or the pool is to be shut down. */
+	pool_cond_t		done;	/**< Signalled when a chunk is done. */
+	job_t			*job;
+	int				serial;
+	int				quit;
+	int				num_workers;
+	pool_thread_t	*threads;
+} worker_pool_t;
+
+/**
+ * Set on the threads of the workers, which run pmap and preduce
+ * by themselves instead of starting pools of their own.
+ */
+static MUSE_THREAD_LOCAL int g_is_worker = 0;
+
+static int num_processors()
+{
+#ifdef MUSE_PLATFORM_WINDOWS
+	SYSTEM_INFO info;
+	GetSystemInfo( &info );
+	return (int)info.dwNumberOfProcessors;
+#else
+	long n = sysconf( _SC_NPROCESSORS_ONLN );
+	return n > 0 ? (int)n : 1;
+#endif
+}
+
+/**
+ * Applies \p fn to each of the items and evaluates to the list of results.
+ */
+static muse_cell map_items( muse_env *env, muse_cell fn, muse_cell items )
+{
+	muse_cell results = MUSE_NIL, last = MUSE_NIL;
+	int sp = _spos();
+
+	while ( items )
+	{
+		muse_cell c = _cons( _apply( fn, _cons( muse_head( env, items ), MUSE_NIL ), MUSE_TRUE ), MUSE_NIL );
+
+		if ( last )
+			_sett( last, c );
+		else
+			results = c;
+
+		last = c;
+		items = muse_tail( env, items );
+		_unwind(sp);
+		_spush(results);
+		_spush(items);
+	}
+
+	_unwind(sp);
+	_spush(results);
+	return results;
+}
+
+/**
+ * Folds the items into \p acc using \p fn.
+ */
+static muse_cell reduce_items( muse_env *env, muse_cell fn, muse_cell acc, muse_cell items )
+{
+	int sp = _spos();
+
+	while ( items )
+	{
+		acc = _apply( fn, _cons( acc, _cons( muse_head( env, items ), MUSE_NIL ) ), MUSE_TRUE );
+		items = muse_tail( env, items );
+		_unwind(sp);
+		_spush(acc);
+		_spush(items);
+	}
+
+	_unwind(sp);
+	_spush(acc);
+	return acc;
+}
+
+/**
+ * Evaluates to a list of the \p count items of \p seq that start at
+ * index \p start of a vector, or at \p *cursor of a list, which is
+ * moved past them.
+ */
+static muse_cell take_items( muse_env *env, muse_cell seq, muse_boolean is_vector, muse_cell *cursor, int start, int count )
+{
+	muse_cell items = MUSE_NIL, last = MUSE_NIL;
+	int sp = _spos();
+	int i;
+
+	for ( i = 0; i < count; ++i )
+	{
+		muse_cell c;
+
+		if ( is_vector )
+			c = _cons( muse_vector_get( env, seq, start + i ), MUSE_NIL );
+		else
+		{
+			c = _cons( muse_head( env, *cursor ), MUSE_NIL );
+			*cursor = muse_tail( env, *cursor );
+		}
+
+		if ( last )
+			_sett( last, c );
+		else
+			items = c;
+
+		last = c;
+		_unwind(sp);
+		_spush(items);
+	}
+
+	return items;
+}
+
+typedef struct
+{
+	job_t		*job;
+	chunk_t		*chunk;
+	muse_cell	fn;
+	muse_boolean completed;
+} work_t;
+
+static muse_cell run_chunk( muse_env *env, work_t *w, muse_cell args )
+{
+	muse_cell items = muse_transfer_decode( env, w->chunk->input );
+	muse_cell result;
+
+	if ( w->job->op == PARALLEL_MAP )
+		result = map_items( env, w->fn, items );
+	else
+		result = reduce_items( env, w->fn, muse_head( env, items ), muse_tail( env, items ) );
+
+	w->completed = MUSE_TRUE;
+	return result;
+}
+
+/**
+ * Works on a chunk in a worker's environment, leaving the encoded
+ * results in the chunk. If the function raises an exception, the
+ * chunk fails and gets the exception instead - as much of it as
+ * can be copied back.
+ */
+static void work_on_chunk( muse_env *env, job_t *job, chunk_t *chunk, muse_cell fn, muse_cell handler )
+{
+	int sp = _spos();
+	work_t w = { job, chunk, fn, MUSE_FALSE };
+	muse_cell bad = MUSE_NIL;
+	muse_cell result = muse_try( env, _cons( handler, MUSE_NIL ), (muse_nativefn_t)run_chunk, &w, MUSE_NIL );
+	muse_cell exception;
+
+	if ( w.completed )
+	{
+		chunk->output = muse_transfer_encode( env, result, MUSE_FALSE, &bad );
+		if ( chunk->output )
+		{
+			_unwind(sp);
+			return;
+		}
+
+		exception = _cons( _csymbol(L"error:not-transferable"), _cons( bad, MUSE_NIL ) );
+	}
+	else
+	{
+		/* The handler gives us (resume 'error:x . info). */
+		exception = _tail(result);
+	}
+
+	chunk->failed = 1;
+	chunk->output = muse_transfer_encode( env, exception, MUSE_FALSE, &bad );
+	if ( chunk->output == NULL )
+	{
+		/* Send the exception with () in place of the parts
+		that can't be copied, so that handlers still match. */
+		muse_cell copy = _cons( _head(exception), MUSE_NIL ), last = copy;
+		muse_cell info = _tail(exception);
+
+		while ( info )
+		{
+			void *part = muse_transfer_encode( env, _head(info), MUSE_FALSE, &bad );
+			muse_cell c = _cons( part ? _head(info) : MUSE_NIL, MUSE_NIL );
+
+			muse_transfer_free( part );
+			_sett( last, c );
+			last = c;
+			info = _tail(info);
+		}
+
+		chunk->output = muse_transfer_encode( env, copy, MUSE_FALSE, &bad );
+	}
+
+	_unwind(sp);
+}
+
+static WORKER_ENTRY worker_main( void *arg )
+{
+	/* The signals belong to the environment that uses the pool. */
+	static const int k_worker_params[] = { MUSE_FLIGHT_RECORDER_SIGNALS, MUSE_FALSE, MUSE_END_OF_LIST };
+	worker_pool_t *pool = (worker_pool_t*)arg;
+	muse_env *env = muse_init_env(k_worker_params);
+	muse_cell handler, fn = MUSE_NIL;
+	int base_sp, serial = 0;
+
+	g_is_worker = 1;
+
+	/* A handler that catches everything - (fn exception exception). */
+	handler = muse_eval( env, muse_list( env, "SSS", L"fn", L"exception", L"exception" ), MUSE_FALSE );
+	_spush(handler);
+	base_sp = _spos();
+
+	pool_lock( &pool->lock );
+
+	while ( !pool->quit )
+	{
+		job_t *job = pool->job;
+
+		if ( job && job->next < job->num_ready )
+		{
+			chunk_t *chunk = job->chunks + job->next++;
+			int skip = job->failed;
+
+			pool_unlock( &pool->lock );
+
+			if ( !skip )
+			{
+				if ( serial != job->serial )
+				{
+					_unwind(base_sp);
+					fn = muse_transfer_decode( env, job->fn );
+					serial = job->serial;
+				}
+
+				work_on_chunk( env, job, chunk, fn, handler );
+			}
+
+			pool_lock( &pool->lock );
+			chunk->done = 1;
+			if ( chunk->failed )
+				job->failed = 1;
+			pool_broadcast( &pool->done );
+		}
+		else
+			pool_wait( &pool->work, &pool->lock );
+	}
+
+	pool_unlock( &pool->lock );
+	muse_destroy_env(env);
+	return WORKER_RETURN;
+}
+
+static worker_pool_t *get_pool( muse_env *env )
+{
+	worker_pool_t *pool = (worker_pool_t*)env->workers;
+
+	if ( pool == NULL )
+	{
+		int i;
+
+		pool = (worker_pool_t*)calloc( 1, sizeof(worker_pool_t) );
+		pool_lock_init( &pool->lock );
+		pool_cond_init( &pool->work );
+		pool_cond_init( &pool->done );
+
+		pool->num_workers = env->parameters[MUSE_WORKER_THREADS];
+		if ( pool->num_workers <= 0 )
+			pool->num_workers = num_processors();
+
+		pool->threads = (pool_thread_t*)calloc( pool->num_workers, sizeof(pool_thread_t) );
+		for ( i = 0; i < pool->num_workers; ++i )
+		{
+#ifdef MUSE_PLATFORM_WINDOWS
+			pool->threads[i] = (HANDLE)_beginthreadex( NULL, 0, worker_main, pool, 0, NULL );
+#else
+			pthread_create( pool->threads + i, NULL, worker_main, pool );
+#endif
+		}
+
+		env->workers = pool;
+	}
+
+	return pool;
+}
+
+/**
+ * Stops the workers and waits for them to finish.
+ * Called when the environment is destroyed.
+ */
+void muse_destroy_worker_pool( muse_env *env )
+{
+	worker_pool_t *pool = (worker_pool_t*)env->workers;
+	int i;
+
+	if ( pool == NULL )
+		return;
+
+	pool_lock( &pool->lock );
+	pool->quit = 1;
+	pool_broadcast( &pool->work );
+	pool_unlock( &pool->lock );
+
+	for ( i = 0; i < pool->num_workers; ++i )
+	{
+#ifdef MUSE_PLATFORM_WINDOWS
+		WaitForSingleObject( pool->threads[i], INFINITE );
+		CloseHandle( pool->threads[i] );
+#else
+		pthread_join( pool->threads[i], NULL );
+#endif
+	}
+
+	pool_cond_destroy( &pool->done );
+	pool_cond_destroy( &pool->work );
+	pool_lock_destroy( &pool->lock );
+	free( pool->threads );
+	free( pool );
+	env->workers = NULL;
+}
+
+/**
+ * Maps or reduces \p seq in this environment. Used when the work
+ * isn't worth spreading and within the workers themselves.
+ */
+static muse_cell serial_op( muse_env *env, int op, muse_cell fn, muse_cell initial, muse_cell seq, muse_boolean is_vector, int n )
+{
+	muse_cell cursor = seq;
+	muse_cell items = take_items( env, seq, is_vector, &cursor, 0, n );
+
+	if ( op == PARALLEL_REDUCE )
+		return reduce_items( env, fn, initial, items );
+
+	items = map_items( env, fn, items );
+
+	if ( is_vector )
+	{
+		muse_cell v = muse_mk_vector( env, n );
+		int i;
+
+		for ( i = 0; i < n; ++i )
+			muse_vector_put( env, v, i, _next(&items) );
+
+		return v;
+	}
+
+	return items;
+}
+
+static void free_job( job_t *job )
+{
+	int i;
+
+	for ( i = 0; i < job->num_chunks; ++i )
+	{
+		muse_transfer_free( job->chunks[i].input );
+		muse_transfer_free( job->chunks[i].output );
+	}
+
+	muse_transfer_free( job->fn );
+	free( job->chunks );
+}
+
+/**
+ * Does the work of pmap and preduce.
+ */
+static muse_cell parallel_op( muse_env *env, int op, muse_cell fn, muse_cell initial, muse_cell seq, int grain )
+{
+	int sp = _spos();
+	muse_boolean is_vector = _functional_object_data( seq, 'vect' ) ? MUSE_TRUE : MUSE_FALSE;
+	worker_pool_t *pool;
+	muse_cell cursor, result, last = MUSE_NIL, bad = MUSE_NIL;
+	job_t job;
+	int n, i, result_sp, index = 0;
+
+	if ( is_vector )
+		n = muse_vector_length( env, seq );
+	else
+	{
+		for ( n = 0, cursor = seq; cursor; cursor = muse_tail( env, cursor ) )
+			++n;
+	}
+
+	if ( g_is_worker || n == 0 )
+		return serial_op( env, op, fn, initial, seq, is_vector, n );
+
+	pool = get_pool(env);
+
+	if ( grain <= 0 )
+		grain = (n + pool->num_workers * CHUNKS_PER_WORKER - 1) / (pool->num_workers * CHUNKS_PER_WORKER);
+
+	if ( grain >= n )
+		return serial_op( env, op, fn, initial, seq, is_vector, n );
+
+	memset( &job, 0, sizeof(job) );
+	job.op			= op;
+	job.num_chunks	= (n + grain - 1) / grain;
+	job.fn			= muse_transfer_encode( env, fn, MUSE_TRUE, &bad );
+
+	if ( job.fn == NULL )
+		return muse_raise_error( env, _csymbol(L"error:not-transferable"), _cons( bad, MUSE_NIL ) );
+
+	job.chunks = (chunk_t*)calloc( job.num_chunks, sizeof(chunk_t) );
+
+	pool_lock( &pool->lock );
+	job.serial = ++(pool->serial);
+	pool->job = &job;
+	pool_unlock( &pool->lock );
+
+	/* Hand the chunks over as they get encoded, so that the
+	workers can start on the first ones meanwhile. */
+	cursor = seq;
+	for ( i = 0; i < job.num_chunks; ++i )
+	{
+		int count = (i < job.num_chunks - 1) ? grain : n - i * grain;
+		muse_cell items = take_items( env, seq, is_vector, &cursor, i * grain, count );
+
+		job.chunks[i].input = muse_transfer_encode( env, items, MUSE_FALSE, &bad );
+		_unwind(sp);
+		_spush(cursor);
+
+		pool_lock( &pool->lock );
+		if ( job.chunks[i].input == NULL )
+		{
+			/* The workers skip this and the remaining chunks. */
+			job.failed = 1;
+			job.num_ready = job.num_chunks;
+			pool_broadcast( &pool->work );
+			pool_unlock( &pool->lock );
+			break;
+		}
+
+		job.num_ready = i + 1;
+		pool_signal( &pool->work );
+		pool_unlock( &pool->lock );
+	}
+
+	_unwind(sp);
+
+	/* Gather the results in order as the chunks get done. */
+	result = (op == PARALLEL_MAP && is_vector) ? muse_mk_vector( env, n ) : MUSE_NIL;
+	result_sp = _spos();
+
+	for ( i = 0; i < job.num_chunks; ++i )
+	{
+		chunk_t *chunk = job.chunks + i;
+		muse_cell items;
+
+		pool_lock( &pool->lock );
+		while ( !chunk->done )
+			pool_wait( &pool->done, &pool->lock );
+		pool_unlock( &pool->lock );
+
+		if ( job.failed )
+			continue;
+
+		items = muse_transfer_decode( env, chunk->output );
+
+		if ( op == PARALLEL_MAP && is_vector )
+		{
+			while ( items )
+				muse_vector_put( env, result, index++, _next(&items) );
+		}
+		else
+		{
+			/* The mapped items, or the chunks' reductions to reduce further. */
+			if ( op == PARALLEL_REDUCE )
+				items = _cons( items, MUSE_NIL );
+
+			if ( last )
+				_sett( last, items );
+			else
+				result = items;
+
+			last = muse_list_last( env, items );
+		}
+
+		_unwind(result_sp);
+		_spush(result);
+	}
+
+	pool_lock( &pool->lock );
+	pool->job = NULL;
+	pool_unlock( &pool->lock );
+
+	if ( job.failed )
+	{
+		muse_cell exception = _cons( _csymbol(L"error:not-transferable"), _cons( bad, MUSE_NIL ) );
+
+		for ( i = 0; i < job.num_chunks; ++i )
+		{
+			if ( job.chunks[i].failed )
+			{
+				exception = muse_transfer_decode( env, job.chunks[i].output );
+				break;
+			}
+		}
+
+		free_job( &job );
+		return muse_raise_error( env, _head(exception), _tail(exception) );
+	}
+
+	free_job( &job );
+
+	if ( op == PARALLEL_REDUCE )
+		return reduce_items( env, fn, initial, result );
+
+	return result;
+}
+
+/**
+ * @code (pmap fn seq [grain]) @endcode
+ *
+ * Like \ref fn_map "map", except that the work is spread over a pool of
+ * worker environments, each running on its own thread. \p seq can be a
+ * vector or a list, and the result is a vector or a list accordingly,
+ * in the same order. \p seq is split into chunks of \p grain items and
+ * a worker maps one chunk at a time. Without a grain size, there are a
+ * few chunks per worker. The work is done right here if there is only
+ * one chunk. Pick a grain size that gives each chunk enough work to make
+ * up for copying it to a worker and its results back.
+ *
+ * The function is copied to the workers along with the values its closure
+ * captured and the definitions of the global symbols it refers to - such
+ * as functions that were defined after it, itself included if it is
+ * recursive. The items and the results are copied like messages to
+ * another environment. So the function shouldn't depend on changing
+ * anything other than its result. The calling environment waits while
+ * the workers are busy, and its other processes wait with it.
+ *
+ * For example -
+ * @code
+ * (define (score x) (* x x))
+ * (pmap score (vector 1 2 3 4 5) 2)
+ * @endcode
+ * evaluates to the vector <tt>{vector 1 4 9 16 25}</tt>.
+ *
+ * If the function raises an exception in a worker, the rest of the chunks
+ * are skipped and the exception is raised again here once the workers
+ * are done.
+ *
+ * @exception error:not-transferable
+ * Raised when the function, an item or a result can't be copied between
+ * environments. See \ref fn_remote_pid "remote-pid".
+ * Handler format: @code (fn (resume 'error:not-transferable value) ...) @endcode
+ */
+muse_cell fn_pmap( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell fn = _evalnext(&args);
+	muse_cell seq = _evalnext(&args);
+	int grain = args ? (int)_intvalue(_evalnext(&args)) : 0;
+
+	return parallel_op( env, PARALLEL_MAP, fn, MUSE_NIL, seq, grain );
+}
+
+/**
+ * @code (preduce fn initial seq [grain]) @endcode
+ *
+ * Like \ref fn_reduce "reduce", except that the chunks of \p grain items of
+ * \p seq are reduced by workers as \ref fn_pmap "pmap" does it. Each chunk
+ * is reduced starting with its first item, and the chunks' results are
+ * then reduced here, starting with \p initial. The result is the same as
+ * that of \ref fn_reduce "reduce" as long as \p fn is associative. For example -
+ * @code
+ * (preduce + 0 (vector 1 2 3 4 5 6 7 8) 2)
+ * @endcode
+ * evaluates to 36, as
+ * @code (+ (+ (+ (+ 0 (+ 1 2)) (+ 3 4)) (+ 5 6)) (+ 7 8)) @endcode
+ *
+ * @exception error:not-transferable
+ * Raised when the function, an item or a result can't be copied between
+ * environments. See \ref fn_remote_pid "remote-pid".
+ * Handler format: @code (fn (resume 'error:not-transferable value) ...) @endcode
+ */
+muse_cell fn_preduce( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell fn = _evalnext(&args);
+	muse_cell initial = _evalnext(&args);
+	muse_cell seq = _evalnext(&args);
+	int grain = args ? (int)_intvalue(_evalnext(&args)) : 0;
+
+	return parallel_op( env, PARALLEL_REDUCE, fn, initial, seq, grain );
+}
+
+void muse_define_builtin_parallel( muse_env *env )
+{
+	int sp = _spos();
+	_define( _csymbol(L"pmap"), _mk_nativefn( fn_pmap, NULL ) );
+	_define( _csymbol(L"preduce"), _mk_nativefn( fn_preduce, NULL ) );
+	_unwind(sp);
+}
+
+/*@}*/
+/*@}*/
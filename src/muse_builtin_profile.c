@@ -0,0 +1,1129 @@
+/**
+ * @file muse_builtin_profile.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * Implements a sampling profiler over the trace information
+ * maintained by muse_trace_push() and muse_trace_pop(), a call
+ * profiler that accounts for every function application and a recorder
+ * of interpreter events in the Chrome trace event format.
+ */
+
+#include "muse_builtins.h"
+#include "muse_port.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef MUSE_PLATFORM_WINDOWS
+#include <windows.h>
+#else
+#include <sys/time.h>
+#include <time.h>
+#endif
+
+#if defined(MUSE_PLATFORM_POSIX) && !defined(__APPLE__)
+#include <signal.h>
+#define MUSE_PROFILE_TIMER 1
+#endif
+
+/** @addtogroup Profiling */
+/*@{*/
+
+enum
+{
+	MUSE_PROFILE_DEFAULT_HZ		= 1000,
+	MUSE_PROFILE_MAX_FRAMES		= 1 << 18,	/**< Frame entries in the sample buffer (4MB). */
+	MUSE_PROFILE_MAX_LINE		= 4096,
+	MUSE_PROFILE_NAME_CACHE		= 1024,		/**< Must be a power of 2. */
+	MUSE_TRACE_MAX_EVENTS		= 1 << 20
+};
+
+/**
+ * An entry in the sample buffer. A sample is stored as a
+ * header entry whose \p fn field holds the number of frames
+ * that follow, outermost first.
+ */
+typedef struct
+{
+	muse_cell fn;
+	const muse_char *label;
+} profile_frame_t;
+
+typedef struct
+{
+	void *timer;
+	int hz;
+	volatile int used;		/**< Written only by the signal handler. */
+	volatile int dropped;
+	volatile int samples;
+	profile_frame_t *frames;
+} profiler_t;
+
+#ifdef MUSE_PROFILE_TIMER
+/**
+ * The SIGPROF handler. Copies the current process's trace frames
+ * into the sample buffer. It allocates nothing and touches neither
+ * the heap nor the stack of the environment, so the evaluator can
+ * be interrupted at any point.
+ */
+static void profile_tick( int sig, siginfo_t *info, void *context )
+{
+	muse_env *env = (muse_env*)info->si_value.sival_ptr;
+	profiler_t *p = env ? (profiler_t*)env->profiler : NULL;
+	muse_traceinfo_t *ti;
+	int top, bottom, used, n;
+
+	if ( p == NULL || env->current_process == NULL )
+		return;
+
+	ti = &(env->current_process->traceinfo);
+	top = ti->depth;
+	bottom = top - ti->size;
+	if ( bottom < 0 ) bottom = 0;
+
+	used = p->used;
+	if ( used + 1 + (top - bottom) > MUSE_PROFILE_MAX_FRAMES )
+	{
+		++(p->dropped);
+		return;
+	}
+
+	for ( n = 0; bottom < top; ++bottom )
+	{
+		muse_trace_t *t = ti->data + (bottom % ti->size);
+		if ( t->label == NULL && t->fn == MUSE_NIL )
+			continue;
+
+		++n;
+		p->frames[used+n].fn = t->fn;
+		p->frames[used+n].label = t->label;
+	}
+
+	p->frames[used].fn = n;
+	p->frames[used].label = NULL;
+	p->used = used + 1 + n;
+	++(p->samples);
+}
+
+static muse_boolean start_profile_timer( muse_env *env, profiler_t *p )
+{
+	struct sigaction sa;
+	struct sigevent sev;
+	struct itimerspec its;
+	timer_t *timer = (timer_t*)calloc( 1, sizeof(timer_t) );
+
+	memset( &sa, 0, sizeof(sa) );
+	sa.sa_sigaction = profile_tick;
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset( &sa.sa_mask );
+	sigaction( SIGPROF, &sa, NULL );
+
+	memset( &sev, 0, sizeof(sev) );
+	sev.sigev_notify = SIGEV_SIGNAL;
+	sev.sigev_signo = SIGPROF;
+	sev.sigev_value.sival_ptr = env;
+	muse_signal_this_thread( &sev );
+
+	/* Count only the CPU time of the thread running the environment,
+	so that other environments busy on other threads don't show up
+	as samples of this one. */
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	if ( timer_create( CLOCK_THREAD_CPUTIME_ID, &sev, timer ) != 0 )
+#else
+	if ( timer_create( CLOCK_PROCESS_CPUTIME_ID, &sev, timer ) != 0 )
+#endif
+	{
+		free( timer );
+		return MUSE_FALSE;
+	}
+
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = 1000000000 / p->hz;
+	its.it_value = its.it_interval;
+	timer_settime( *timer, 0, &its, NULL );
+
+	p->timer = timer;
+	return MUSE_TRUE;
+}
+
+static void stop_profile_timer( muse_env *env, profiler_t *p )
+{
+	if ( p->timer )
+	{
+		timer_delete( *(timer_t*)p->timer );
+		free( p->timer );
+		p->timer = NULL;
+	}
+}
+#else
+static muse_boolean start_profile_timer( muse_env *env, profiler_t *p )
+{
+	/* No CPU time timer available on this platform. */
+	return MUSE_FALSE;
+}
+
+static void stop_profile_timer( muse_env *env, profiler_t *p )
+{
+}
+#endif
+
+/**
+ * Stops sampling and detaches the profiler from the environment.
+ * Returns the profiler so that its samples can be reported.
+ */
+static profiler_t *detach_profiler( muse_env *env )
+{
+	profiler_t *p = (profiler_t*)env->profiler;
+	if ( p )
+	{
+		/* Detach first so that a pending tick finds nothing to do. */
+		env->profiler = NULL;
+		stop_profile_timer( env, p );
+	}
+	return p;
+}
+
+static void free_profiler( profiler_t *p )
+{
+	if ( p )
+	{
+		free( p->frames );
+		free( p );
+	}
+}
+
+/**
+ * Called when the environment is destroyed.
+ */
+void muse_stop_profiler( muse_env *env )
+{
+	free_profiler( detach_profiler(env) );
+}
+
+/**
+ * Finds the name of the given function. Looking up the name of a
+ * native function involves a scan of the symbol table, so the names
+ * are cached by function for the duration of a report. The cache
+ * holds pairs of function and name cells.
+ */
+static muse_cell profile_fn_name( muse_env *env, muse_cell fn, muse_cell *cache )
+{
+	/* Sampled functions are kept alive by muse_mark_profile_cells(),
+	but trace frames can hold cells of other types. */
+	int t = _cellt(fn);
+	int i = (int)(_celli(fn) & (MUSE_PROFILE_NAME_CACHE-1));
+	muse_cell name = MUSE_NIL;
+
+	if ( t != MUSE_LAMBDA_CELL && t != MUSE_NATIVEFN_CELL )
+		return MUSE_NIL;
+
+	for ( ; cache[2*i]; i = (i+1) & (MUSE_PROFILE_NAME_CACHE-1) )
+	{
+		if ( cache[2*i] == fn )
+			return cache[2*i+1];
+	}
+
+	if ( t == MUSE_LAMBDA_CELL )
+		name = meta_getname( env, fn );
+	else
+		name = fn_symbol_whose_value_is( env, NULL, _cons( fn, MUSE_NIL ) );
+
+	if ( name && _cellt(name) != MUSE_SYMBOL_CELL )
+		name = MUSE_NIL;
+
+	/* Leave one slot free so that lookups terminate. */
+	if ( cache[2*MUSE_PROFILE_NAME_CACHE] < MUSE_PROFILE_NAME_CACHE - 1 )
+	{
+		cache[2*i] = fn;
+		cache[2*i+1] = name;
+		++cache[2*MUSE_PROFILE_NAME_CACHE];
+	}
+
+	return name;
+}
+
+/**
+ * Appends the name of the given frame to the line, replacing
+ * the characters that have a meaning in the folded format.
+ */
+static size_t profile_frame_name( muse_env *env, const profile_frame_t *f, muse_cell *cache, muse_char *line, size_t pos, size_t maxlen )
+{
+	size_t start = pos;
+
+	if ( pos + 1 >= maxlen )
+		return pos;
+
+	if ( f->label )
+		pos += muse_sprintf( env, line+pos, maxlen-pos, L"%s", f->label );
+	else
+	{
+		int t = _cellt(f->fn);
+		muse_cell name = profile_fn_name( env, f->fn, cache );
+
+		if ( name )
+			pos += muse_sprintf( env, line+pos, maxlen-pos, L"%m", name );
+		else
+			pos += muse_sprintf( env, line+pos, maxlen-pos, L"%s", t == MUSE_NATIVEFN_CELL ? L"native" : L"fn" );
+	}
+
+	for ( ; start < pos; ++start )
+	{
+		if ( line[start] == ';' )
+			line[start] = ':';
+		else if ( line[start] == ' ' || line[start] == '\n' || line[start] == '\t' )
+			line[start] = '_';
+	}
+
+	return pos;
+}
+
+static int compare_lines( const void *a, const void *b )
+{
+	return strcmp( *(const char**)a, *(const char**)b );
+}
+
+/**
+ * Writes the samples in the "collapsed stack" format - one line
+ * per distinct stack with the frames separated by semicolons
+ * followed by the number of samples with that stack.
+ */
+static void write_folded( muse_env *env, profiler_t *p, muse_port_t port )
+{
+	char **lines = (char**)calloc( p->samples + 1, sizeof(char*) );
+	muse_char *line = (muse_char*)calloc( MUSE_PROFILE_MAX_LINE, sizeof(muse_char) );
+	muse_cell *cache = (muse_cell*)calloc( 2*MUSE_PROFILE_NAME_CACHE + 1, sizeof(muse_cell) );
+	int i = 0, n = 0;
+	int sp = _spos();
+
+	while ( i < p->used && n < p->samples )
+	{
+		int depth = p->frames[i].fn;
+		size_t pos = 0;
+		int j;
+
+		if ( depth == 0 )
+			pos = muse_sprintf( env, line, MUSE_PROFILE_MAX_LINE, L"%s", L"[toplevel]" );
+
+		for ( j = 1; j <= depth; ++j )
+		{
+			if ( j > 1 && pos + 1 < MUSE_PROFILE_MAX_LINE )
+				line[pos++] = ';';
+			pos = profile_frame_name( env, p->frames + i + j, cache, line, pos, MUSE_PROFILE_MAX_LINE );
+			_unwind(sp);
+		}
+
+		line[pos] = '\0';
+
+		{
+			size_t size = muse_utf8_size( line, pos );
+			lines[n] = (char*)malloc( size + 1 );
+			muse_unicode_to_utf8( lines[n], size + 1, line, pos );
+			++n;
+		}
+
+		i += 1 + depth;
+	}
+
+	qsort( lines, n, sizeof(char*), compare_lines );
+
+	for ( i = 0; i < n; )
+	{
+		int count = 1;
+		char num[32];
+
+		while ( i + count < n && strcmp( lines[i], lines[i+count] ) == 0 )
+			++count;
+
+		port_write( lines[i], strlen(lines[i]), port );
+		port_write( num, sprintf( num, " %d\n", count ), port );
+
+		for ( ; count > 0; --count, ++i )
+			free( lines[i] );
+	}
+
+	free( cache );
+	free( line );
+	free( lines );
+}
+
+/**
+ * @code (profile-start [hz]) @endcode
+ *
+ * Starts sampling the call stacks of muSE processes \p hz times
+ * a second of CPU time (default 1000). The frames sampled are the ones
+ * recorded for stack traces, so tracing must be enabled - see
+ * \ref fn_trace "trace". Only the innermost 32 calls of each
+ * stack are recorded. Calling profile-start while profiling discards
+ * the samples collected so far.
+ *
+ * Returns the sampling rate if profiling started, () if the
+ * platform has no suitable timer.
+ *
+ * @see \ref fn_profile_stop "profile-stop"
+ */
+muse_cell fn_profile_start( muse_env *env, void *context, muse_cell args )
+{
+	profiler_t *p;
+	int hz = args ? (int)_intvalue(_evalnext(&args)) : MUSE_PROFILE_DEFAULT_HZ;
+
+	if ( hz <= 0 || hz > 1000000 )
+		return muse_raise_error( env, _csymbol(L"error:bad-sampling-rate"), _cons( _mk_int(hz), MUSE_NIL ) );
+
+	muse_stop_profiler(env);
+
+	p = (profiler_t*)calloc( 1, sizeof(profiler_t) );
+	p->hz = hz;
+	p->frames = (profile_frame_t*)calloc( MUSE_PROFILE_MAX_FRAMES, sizeof(profile_frame_t) );
+	env->profiler = p;
+
+	if ( !start_profile_timer( env, p ) )
+	{
+		MUSE_DIAGNOSTICS({
+			muse_message( env, L"(profile-start)", L"Couldn't create a CPU time timer for sampling." );
+		});
+		muse_stop_profiler(env);
+		return MUSE_NIL;
+	}
+
+	return _mk_int(hz);
+}
+
+/**
+ * @code (profile-stop [file]) @endcode
+ *
+ * Stops the sampling started by \ref fn_profile_start "profile-start"
+ * and writes the collected stacks in the collapsed format understood
+ * by flamegraph tools - one line per distinct stack, outermost function
+ * first, followed by the number of samples. The output goes to the
+ * given file, or to the current output port if no file is given.
+ *
+ * Returns the number of samples, or () if profiling wasn't started.
+ * Samples that didn't fit into the buffer are reported as
+ * a diagnostic.
+ */
+muse_cell fn_profile_stop( muse_env *env, void *context, muse_cell args )
+{
+	profiler_t *p = detach_profiler(env);
+	muse_cell file = args ? _evalnext(&args) : MUSE_NIL;
+	muse_cell result;
+
+	if ( p == NULL )
+		return MUSE_NIL;
+
+	MUSE_DIAGNOSTICS({
+		if ( p->dropped > 0 )
+			muse_message( env, L"(profile-stop)", L"%d samples were dropped because the sample buffer was full.", p->dropped );
+	});
+
+	if ( file )
+	{
+		FILE *f = muse_fopen( _text_contents( file, NULL ), L"wb" );
+		if ( f == NULL )
+		{
+			free_profiler(p);
+			return muse_raise_error( env, _csymbol(L"error:open-file"), _cons( file, MUSE_NIL ) );
+		}
+		else
+		{
+			muse_port_t port = muse_assign_port( env, f, MUSE_PORT_WRITE );
+			write_folded( env, p, port );
+			muse_unassign_port( port );
+			fclose( f );
+		}
+	}
+	else
+	{
+		write_folded( env, p, muse_current_port( env, MUSE_STDOUT_PORT, NULL ) );
+	}
+
+	result = _mk_int(p->samples);
+	free_profiler(p);
+	return result;
+}
+
+/**
+ * Statistics of a function collected by the call profiler.
+ * Closures are accounted for by name, so that all closures created
+ * by the same definition share an entry, and native functions by
+ * their C function.
+ */
+typedef struct
+{
+	muse_cell		name;		/**< A symbol, or MUSE_NIL for anonymous closures. */
+	muse_nativefn_t	native;		/**< NULL for closures. */
+	muse_int		calls;
+	muse_int		inclusive_ns;
+	muse_int		exclusive_ns;
+	muse_int		cells;
+} call_stat_t;
+
+typedef struct
+{
+	muse_cell	fn;
+	int			stat;
+} call_cache_entry_t;
+
+typedef struct
+{
+	muse_boolean		enabled;
+	int					generation;	/**< Counts the times the profile was started afresh. */
+	int					num_stats, max_stats;
+	call_stat_t			*stats;
+	int					cache_count;
+	call_cache_entry_t	cache[MUSE_PROFILE_NAME_CACHE];	/**< Maps function cells to entries. */
+} call_profile_t;
+
+static muse_int profile_clock_ns()
+{
+#ifdef MUSE_PLATFORM_WINDOWS
+	LARGE_INTEGER t, freq;
+	QueryPerformanceCounter( &t );
+	QueryPerformanceFrequency( &freq );
+	return (muse_int)((double)t.QuadPart * 1e9 / (double)freq.QuadPart);
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec t;
+	clock_gettime( CLOCK_MONOTONIC, &t );
+	return (muse_int)t.tv_sec * 1000000000 + t.tv_nsec;
+#else
+	struct timeval t;
+	gettimeofday( &t, NULL );
+	return (muse_int)t.tv_sec * 1000000000 + (muse_int)t.tv_usec * 1000;
+#endif
+}
+
+static int find_call_stat( call_profile_t *cp, muse_cell name, muse_nativefn_t native )
+{
+	int i;
+
+	for ( i = 0; i < cp->num_stats; ++i )
+	{
+		if ( cp->stats[i].native == native && cp->stats[i].name == name )
+			return i;
+	}
+
+	if ( cp->num_stats == cp->max_stats )
+	{
+		cp->max_stats = cp->max_stats * 2 + 32;
+		cp->stats = (call_stat_t*)realloc( cp->stats, cp->max_stats * sizeof(call_stat_t) );
+	}
+
+	memset( cp->stats + i, 0, sizeof(call_stat_t) );
+	cp->stats[i].name = name;
+	cp->stats[i].native = native;
+	return cp->num_stats++;
+}
+
+/**
+ * Finds the entry of the given function, looking in the cache
+ * before resolving the function's name.
+ */
+static int call_stat_of( muse_env *env, call_profile_t *cp, muse_cell fn )
+{
+	int i = (int)(_celli(fn) & (MUSE_PROFILE_NAME_CACHE-1));
+	int stat;
+
+	for ( ; cp->cache[i].fn; i = (i+1) & (MUSE_PROFILE_NAME_CACHE-1) )
+	{
+		if ( cp->cache[i].fn == fn )
+			return cp->cache[i].stat;
+	}
+
+	if ( _cellt(fn) == MUSE_NATIVEFN_CELL )
+		stat = find_call_stat( cp, MUSE_NIL, _ptr(fn)->fn.fn );
+	else
+	{
+		muse_cell name = meta_getname( env, fn );
+		stat = find_call_stat( cp, (name && _cellt(name) == MUSE_SYMBOL_CELL) ? name : MUSE_NIL, NULL );
+	}
+
+	/* Leave one slot free so that lookups terminate. */
+	if ( cp->cache_count < MUSE_PROFILE_NAME_CACHE - 1 )
+	{
+		cp->cache[i].fn = fn;
+		cp->cache[i].stat = stat;
+		++(cp->cache_count);
+	}
+
+	return stat;
+}
+
+void muse_call_profile_forget_cells( muse_env *env )
+{
+	call_profile_t *cp = (call_profile_t*)env->call_profile;
+	memset( cp->cache, 0, sizeof(cp->cache) );
+	cp->cache_count = 0;
+}
+
+/**
+ * Pops the calls in progress beyond the first \p depth.
+ */
+static void pop_profiled_calls( muse_call_profile_calls_t *calls, int depth )
+{
+	while ( calls->depth > depth )
+		--(calls->active[calls->stats[--(calls->depth)]]);
+}
+
+/**
+ * Pushes a call to the function of entry \p stat and returns
+ * the number of calls to it that were already in progress.
+ */
+static int push_profiled_call( call_profile_t *cp, muse_call_profile_calls_t *calls, int stat )
+{
+	if ( calls->generation != cp->generation )
+	{
+		/* Calls made under an earlier profile don't count. */
+		calls->generation = cp->generation;
+		calls->depth = 0;
+		memset( calls->active, 0, calls->num_active * sizeof(int) );
+	}
+
+	if ( calls->depth == calls->max_depth )
+	{
+		calls->max_depth = calls->max_depth * 2 + 32;
+		calls->stats = (int*)realloc( calls->stats, calls->max_depth * sizeof(int) );
+	}
+
+	if ( stat >= calls->num_active )
+	{
+		calls->active = (int*)realloc( calls->active, cp->max_stats * sizeof(int) );
+		memset( calls->active + calls->num_active, 0, (cp->max_stats - calls->num_active) * sizeof(int) );
+		calls->num_active = cp->max_stats;
+	}
+
+	calls->stats[calls->depth++] = stat;
+	return calls->active[stat]++;
+}
+
+void muse_call_profile_enter( muse_env *env, muse_cell fn, muse_call_profile_frame_t *frame )
+{
+	call_profile_t *cp = (call_profile_t*)env->call_profile;
+	muse_process_frame_t *p = env->current_process;
+
+	if ( !cp->enabled )
+	{
+		frame->stat = -1;
+		return;
+	}
+
+	frame->stat = call_stat_of( env, cp, fn );
+	frame->generation = cp->generation;
+	++(cp->stats[frame->stat].calls);
+
+	/* Only the outermost of recursive calls counts towards the
+	inclusive time. The calls in progress are kept by process, since
+	the processes' calls interleave. */
+	frame->outermost = (push_profiled_call( cp, &p->call_profile_calls, frame->stat ) == 0);
+	frame->depth = p->call_profile_calls.depth - 1;
+
+	frame->saved_child_ns = p->call_profile_child_ns;
+	p->call_profile_child_ns = 0;
+	frame->start_cells = env->heap.cells_taken;
+	frame->start_ns = profile_clock_ns();
+}
+
+void muse_call_profile_leave( muse_env *env, muse_call_profile_frame_t *frame )
+{
+	call_profile_t *cp = (call_profile_t*)env->call_profile;
+	muse_process_frame_t *p = env->current_process;
+	muse_int elapsed;
+	call_stat_t *s;
+
+	/* The entry is gone if the profile was started afresh during the call. */
+	if ( frame->stat < 0 || frame->generation != cp->generation )
+		return;
+
+	elapsed = profile_clock_ns() - frame->start_ns;
+	s = cp->stats + frame->stat;
+
+	s->exclusive_ns += elapsed - p->call_profile_child_ns;
+	if ( frame->outermost )
+	{
+		s->inclusive_ns += elapsed;
+		s->cells += env->heap.cells_taken - frame->start_cells;
+	}
+
+	if ( p->call_profile_calls.generation == cp->generation )
+		pop_profiled_calls( &p->call_profile_calls, frame->depth );
+
+	p->call_profile_child_ns = frame->saved_child_ns + elapsed;
+}
+
+void muse_call_profile_unwind( muse_env *env, int depth )
+{
+	call_profile_t *cp = (call_profile_t*)env->call_profile;
+	muse_call_profile_calls_t *calls = &(env->current_process->call_profile_calls);
+
+	if ( cp && calls->generation == cp->generation )
+		pop_profiled_calls( calls, depth );
+}
+
+/**
+ * Called when the environment is destroyed.
+ */
+void muse_stop_call_profile( muse_env *env )
+{
+	call_profile_t *cp = (call_profile_t*)env->call_profile;
+	if ( cp )
+	{
+		env->call_profile = NULL;
+		free( cp->stats );
+		free( cp );
+	}
+}
+
+/**
+ * Gives names to the entries of native functions by looking
+ * for symbols whose values are the functions.
+ */
+static void name_native_call_stats( muse_env *env, call_profile_t *cp )
+{
+	muse_cell *syms = env->symbol_stack.bottom;
+	muse_cell *syms_end = env->symbol_stack.top;
+
+	for ( ; syms < syms_end; ++syms )
+	{
+		muse_cell value = *syms ? _symval(*syms) : MUSE_NIL;
+
+		if ( value > 0 && _cellt(value) == MUSE_NATIVEFN_CELL )
+		{
+			int j;
+			for ( j = 0; j < cp->num_stats; ++j )
+			{
+				if ( cp->stats[j].native == _ptr(value)->fn.fn && cp->stats[j].name == MUSE_NIL )
+					cp->stats[j].name = *syms;
+			}
+		}
+	}
+}
+
+static int compare_call_stats( const void *a, const void *b )
+{
+	muse_int ta = ((const call_stat_t*)a)->exclusive_ns;
+	muse_int tb = ((const call_stat_t*)b)->exclusive_ns;
+	return ta > tb ? -1 : (ta < tb ? 1 : 0);
+}
+
+/**
+ * @code (profile-calls [on|off]) @endcode
+ *
+ * <tt>(profile-calls on)</tt> starts counting every application of a closure
+ * or a native function, together with the time spent in the calls and the
+ * number of cells they allocated. Any previously collected counts are
+ * discarded. <tt>(profile-calls off)</tt> stops counting.
+ *
+ * <tt>(profile-calls)</tt> returns what has been collected as a list
+ * with one entry per function, in decreasing order of exclusive time -
+ * @code ((name calls inclusive-us exclusive-us cells) ...) @endcode
+ * The inclusive time and the cells of a function include its callees,
+ * but count only the outermost of recursive calls. Closures are
+ * identified by the name they were defined with. Anonymous closures
+ * are accounted together under the name \c fn and natives that have
+ * no global name under \c native. A tail call is accounted as a call
+ * made by the caller of the function that made it, since that's where
+ * it is evaluated.
+ *
+ * Times are wall clock times, so they include the time during
+ * which other processes ran.
+ */
+muse_cell fn_profile_calls( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell on = _csymbol(L"on");
+	muse_cell off = _csymbol(L"off");
+	call_profile_t *cp = (call_profile_t*)env->call_profile;
+
+	if ( args )
+	{
+		muse_cell arg = _evalnext(&args);
+
+		if ( arg == on )
+		{
+			/* Calls in progress, including this one, may still refer to
+			the profile, so it is started afresh in place. Their entries
+			belong to the previous generation and are ignored. */
+			if ( cp == NULL )
+			{
+				cp = (call_profile_t*)calloc( 1, sizeof(call_profile_t) );
+				env->call_profile = cp;
+			}
+
+			cp->num_stats = 0;
+			memset( cp->cache, 0, sizeof(cp->cache) );
+			cp->cache_count = 0;
+			++(cp->generation);
+			cp->enabled = MUSE_TRUE;
+			return on;
+		}
+
+		if ( arg == off )
+		{
+			if ( cp ) cp->enabled = MUSE_FALSE;
+			return off;
+		}
+
+		return MUSE_NIL;
+	}
+	else if ( cp == NULL )
+	{
+		return MUSE_NIL;
+	}
+	else
+	{
+		/* Don't account for the report itself. */
+		muse_boolean enabled = cp->enabled;
+		call_stat_t *stats = (call_stat_t*)malloc( (cp->num_stats + 1) * sizeof(call_stat_t) );
+		muse_cell result = MUSE_NIL, last = MUSE_NIL;
+		int i, sp;
+
+		cp->enabled = MUSE_FALSE;
+		name_native_call_stats( env, cp );
+		memcpy( stats, cp->stats, cp->num_stats * sizeof(call_stat_t) );
+		qsort( stats, cp->num_stats, sizeof(call_stat_t), compare_call_stats );
+
+		sp = _spos();
+		for ( i = 0; i < cp->num_stats; ++i )
+		{
+			call_stat_t *s = stats + i;
+			muse_cell name = s->name ? s->name : _csymbol( s->native ? L"native" : L"fn" );
+			muse_cell row = _cons( name,
+							_cons( _mk_int(s->calls),
+							_cons( _mk_int(s->inclusive_ns / 1000),
+							_cons( _mk_int(s->exclusive_ns / 1000),
+							_cons( _mk_int(s->cells), MUSE_NIL ) ) ) ) );
+			muse_cell c = _cons( row, MUSE_NIL );
+
+			if ( last )
+				_sett( last, c );
+			else
+				result = c;
+			last = c;
+
+			_unwind(sp);
+			_spush(result);
+		}
+
+		free( stats );
+		cp->enabled = enabled;
+		return result;
+	}
+}
+
+/**
+ * An event recorded for \ref fn_trace_events "trace-events".
+ * Events named by the interpreter have a static \p name, spans
+ * marked by \ref fn_trace_span "trace-span" have a \p symbol.
+ */
+typedef struct
+{
+	const char	*name;
+	muse_cell	symbol;
+	char		phase;		/**< 'X' for events with a duration, 'i' for instants. */
+	int			tid;
+	muse_int	ts_us, dur_us;
+	const char	*arg_name;
+	muse_int	arg;
+} trace_event_t;
+
+typedef struct
+{
+	int				num_events, max_events;
+	int				dropped;
+	trace_event_t	*events;
+} trace_events_t;
+
+/**
+ * Returns the id under which events of the given process are
+ * recorded - the "thread" of the process in the trace viewer.
+ */
+int muse_trace_event_tid( muse_env *env, muse_process_frame_t *p )
+{
+	return p ? (int)_celli( process_id(p) ) : 0;
+}
+
+static trace_event_t *new_trace_event( muse_env *env, char phase, muse_int start_us )
+{
+	trace_events_t *te = (trace_events_t*)env->trace_events;
+	trace_event_t *e;
+
+	if ( te->num_events == te->max_events )
+	{
+		if ( te->max_events >= MUSE_TRACE_MAX_EVENTS )
+		{
+			++(te->dropped);
+			return NULL;
+		}
+
+		te->max_events = te->max_events * 2 + 1024;
+		te->events = (trace_event_t*)realloc( te->events, te->max_events * sizeof(trace_event_t) );
+	}
+
+	e = te->events + (te->num_events++);
+	memset( e, 0, sizeof(trace_event_t) );
+	e->phase = phase;
+	e->tid = muse_trace_event_tid( env, env->current_process );
+	e->ts_us = start_us;
+	if ( phase == 'X' )
+		e->dur_us = muse_elapsed_us(env->timer) - start_us;
+	return e;
+}
+
+/**
+ * Records an event on the current process. For events with a duration
+ * (\p phase = 'X'), \p start_us is the time at which the event started,
+ * as given by muse_elapsed_us(env->timer), and the event ends now.
+ * Instant events (\p phase = 'i') happen at \p start_us.
+ * The argument is written only if \p arg_name is not NULL.
+ * Callers check that env->trace_events is non-NULL first.
+ */
+void muse_trace_event( muse_env *env, const char *name, char phase, muse_int start_us, const char *arg_name, muse_int arg )
+{
+	trace_event_t *e = new_trace_event( env, phase, start_us );
+	if ( e )
+	{
+		e->name = name;
+		e->arg_name = arg_name;
+		e->arg = arg;
+	}
+}
+
+/**
+ * Called when the environment is destroyed.
+ */
+void muse_stop_trace_events( muse_env *env )
+{
+	trace_events_t *te = (trace_events_t*)env->trace_events;
+	if ( te )
+	{
+		env->trace_events = NULL;
+		free( te->events );
+		free( te );
+	}
+}
+
+void muse_mark_profile_cells( muse_env *env )
+{
+	profiler_t *p = (profiler_t*)env->profiler;
+	call_profile_t *cp = (call_profile_t*)env->call_profile;
+	trace_events_t *te = (trace_events_t*)env->trace_events;
+	int i;
+
+	if ( p )
+	{
+		/* Samples taken while marking are of functions being
+		applied, which are marked anyway. */
+		int used = p->used;
+
+		for ( i = 0; i < used; i += 1 + p->frames[i].fn )
+		{
+			int j;
+			for ( j = 1; j <= p->frames[i].fn; ++j )
+				muse_mark( env, p->frames[i+j].fn );
+		}
+	}
+
+	if ( cp )
+	{
+		for ( i = 0; i < cp->num_stats; ++i )
+			muse_mark( env, cp->stats[i].name );
+	}
+
+	if ( te )
+	{
+		for ( i = 0; i < te->num_events; ++i )
+			muse_mark( env, te->events[i].symbol );
+	}
+}
+
+/**
+ * Writes the string as a JSON string, escaping what needs to be.
+ */
+static void write_json_string( muse_port_t port, const char *str )
+{
+	port_write( "\"", 1, port );
+	for ( ; *str; ++str )
+	{
+		char esc[8];
+		if ( *str == '"' || *str == '\\' )
+			port_write( esc, sprintf( esc, "\\%c", *str ), port );
+		else if ( (unsigned char)*str < 0x20 )
+			port_write( esc, sprintf( esc, "\\u%04x", *str ), port );
+		else
+			port_write( (void*)str, 1, port );
+	}
+	port_write( "\"", 1, port );
+}
+
+static void write_trace_events( muse_env *env, trace_events_t *te, muse_port_t port )
+{
+	int i;
+	char buffer[256];
+
+	port_write( "{\"traceEvents\":[", 16, port );
+
+	for ( i = 0; i < te->num_events; ++i )
+	{
+		trace_event_t *e = te->events + i;
+
+		port_write( i > 0 ? ",\n{\"name\":" : "\n{\"name\":", i > 0 ? 10 : 9, port );
+
+		if ( e->name )
+			write_json_string( port, e->name );
+		else
+		{
+			const muse_char *wname = muse_symbol_name( env, e->symbol );
+			size_t len = wcslen( wname );
+			size_t size = muse_utf8_size( wname, len );
+			char *name = (char*)malloc( size + 1 );
+			muse_unicode_to_utf8( name, size + 1, wname, len );
+			write_json_string( port, name );
+			free( name );
+		}
+
+		port_write( buffer, sprintf( buffer, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":" MUSE_FMT_INT ",\"pid\":1,\"tid\":%d",
+										e->name ? "muse" : "span", e->phase, e->ts_us, e->tid ), port );
+
+		if ( e->phase == 'X' )
+			port_write( buffer, sprintf( buffer, ",\"dur\":" MUSE_FMT_INT, e->dur_us ), port );
+		else
+			port_write( ",\"s\":\"t\"", 8, port );
+
+		if ( e->arg_name )
+			port_write( buffer, sprintf( buffer, ",\"args\":{\"%s\":" MUSE_FMT_INT "}", e->arg_name, e->arg ), port );
+
+		port_write( "}", 1, port );
+	}
+
+	port_write( "\n]}\n", 4, port );
+}
+
+/**
+ * @code (trace-events [on|off]) @endcode
+ *
+ * <tt>(trace-events on)</tt> starts recording interpreter activity in memory -
+ * garbage collections, process switches, waits on sockets, message posts and
+ * receives, and the spans marked using \ref fn_trace_span "trace-span".
+ * <tt>(trace-events off)</tt> stops recording and discards what was recorded.
+ * Use \ref fn_write_trace_events "write-trace-events" to get the events.
+ * Without an argument, returns whether events are being recorded.
+ *
+ * Each muSE process shows up as a thread in the trace viewer.
+ */
+muse_cell fn_trace_events( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell on = _csymbol(L"on");
+	muse_cell off = _csymbol(L"off");
+
+	if ( args )
+	{
+		muse_cell arg = _evalnext(&args);
+
+		if ( arg == on )
+		{
+			if ( env->trace_events == NULL )
+				env->trace_events = calloc( 1, sizeof(trace_events_t) );
+			return on;
+		}
+
+		if ( arg == off )
+		{
+			muse_stop_trace_events(env);
+			return off;
+		}
+
+		return MUSE_NIL;
+	}
+	else
+	{
+		return env->trace_events ? on : off;
+	}
+}
+
+/**
+ * @code (write-trace-events [file]) @endcode
+ *
+ * Writes the events recorded since \ref fn_trace_events "trace-events"
+ * was turned on or since the previous write, as a JSON file in the
+ * Chrome trace event format. The file can be opened in chrome://tracing
+ * or in Perfetto. The output goes to the current output port if no
+ * file is given. The written events are removed from memory while
+ * recording continues.
+ *
+ * Returns the number of events written.
+ */
+muse_cell fn_write_trace_events( muse_env *env, void *context, muse_cell args )
+{
+	trace_events_t *te = (trace_events_t*)env->trace_events;
+	muse_cell file = args ? _evalnext(&args) : MUSE_NIL;
+	int count;
+
+	if ( te == NULL )
+		return MUSE_NIL;
+
+	MUSE_DIAGNOSTICS({
+		if ( te->dropped > 0 )
+			muse_message( env, L"(write-trace-events)", L"%d events were dropped because the event buffer was full.", te->dropped );
+	});
+
+	if ( file )
+	{
+		FILE *f = muse_fopen( _text_contents( file, NULL ), L"wb" );
+		if ( f == NULL )
+			return muse_raise_error( env, _csymbol(L"error:open-file"), _cons( file, MUSE_NIL ) );
+		else
+		{
+			muse_port_t port = muse_assign_port( env, f, MUSE_PORT_WRITE );
+			write_trace_events( env, te, port );
+			muse_unassign_port( port );
+			fclose( f );
+		}
+	}
+	else
+	{
+		write_trace_events( env, te, muse_current_port( env, MUSE_STDOUT_PORT, NULL ) );
+	}
+
+	count = te->num_events;
+	te->num_events = 0;
+	te->dropped = 0;
+	return _mk_int(count);
+}
+
+/**
+ * @code (trace-span 'name ...body...) @endcode
+ *
+ * Evaluates the body and, if \ref fn_trace_events "trace-events" is on,
+ * records the time it took as an event with the given name. The name
+ * is a symbol or a string. Returns the value of the body. No event is
+ * recorded if the body raises an exception that is handled outside it.
+ */
+muse_cell fn_trace_span( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell name = _evalnext(&args);
+	muse_int start_us;
+	muse_cell result;
+
+	if ( env->trace_events == NULL )
+		return _force( _do(args) );
+
+	if ( _cellt(name) == MUSE_TEXT_CELL )
+		name = _spush( _csymbol( _text_contents( name, NULL ) ) );
+
+	start_us = muse_elapsed_us(env->timer);
+	result = _force( _do(args) );
+
+	if ( env->trace_events && _cellt(name) == MUSE_SYMBOL_CELL )
+	{
+		trace_event_t *e = new_trace_event( env, 'X', start_us );
+		if ( e )
+			e->symbol = name;
+	}
+
+	return result;
+}
+
+/*@}*/
+
@@ -0,0 +1,1372 @@
+/**
+ * @file muse_builtin_remote.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * Implements posting messages to processes of other environments,
+ * which may be running on other threads.
+ */
+
+#include "muse_builtins.h"
+#include "muse_opcodes.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#ifdef MUSE_PLATFORM_POSIX
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#define MUSE_REMOTE_WAKE_FD 1
+#ifdef __linux__
+#include <sys/eventfd.h>
+#define MUSE_REMOTE_EVENTFD 1
+#endif
+#endif
+
+/** @addtogroup Processes */
+/*@{*/
+/**
+ * @defgroup RemoteProcesses Messages between environments
+ *
+ * Environments share nothing, so a process can't hold the pid of
+ * a process in another environment. It can instead hold a
+ * \ref fn_remote_pid "remote pid", which \ref fn_post "post" and
+ * calls like those of a pid deliver messages through.
+ *
+ * Every environment that has processes that can be posted to from
+ * elsewhere has an inbox - a lock-free queue that any thread can
+ * push messages onto and that only the environment's own thread
+ * takes them off. A message is copied out of the sending heap into
+ * a single block of memory when it is posted, and copied into the
+ * receiving heap when the receiving environment next switches
+ * processes, at which point it goes into the receiving process's
+ * mailbox like any other message. An environment whose processes
+ * are all waiting is woken up by the first message to arrive in
+ * its empty inbox.
+ *
+ * The pids in a message are passed as remote pids, which become
+ * local pids again when they get back to their own environment, so
+ * a receiver can reply to the sender of a message as usual.
+ */
+/*@{*/
+
+enum
+{
+	MUSE_TRANSFER_MAX_DEPTH = 4096	/**< Nesting beyond this is taken to be a cycle. */
+};
+
+/**
+ * A message on its way to another environment. The encoded
+ * message follows the header in the same block of memory.
+ */
+typedef struct _remote_message_t
+{
+	struct _remote_message_t *next;
+	int				slot;			/**< The receiving process's entry in the export table. */
+	int				gen;			/**< The generation of that entry. */
+	size_t			size;
+	unsigned char	data[1];
+} remote_message_t;
+
+/**
+ * A process that can be posted to from other environments. The
+ * generation changes when the entry is reused, so that messages
+ * to a process that is gone aren't delivered to another one.
+ */
+typedef struct
+{
+	muse_cell	pid;
+	int			gen;
+	int			next_free;
+} export_t;
+
+typedef struct
+{
+	remote_message_t * volatile head;	/**< Pushed by any thread, newest first. */
+	volatile long	refs;				/**< The environment's and one per remote pid and pid in transit. */
+	volatile int	closed;				/**< Set when the environment is destroyed. */
+	int				wake_fd[2];			/**< Read and write ends. The same eventfd on Linux. */
+
+	/* Only used by the environment's own thread. */
+	export_t		*exports;
+	int				num_exports, max_exports;
+	int				free_export;		/**< 1 + the first free entry, or 0. */
+} muse_inbox_t;
+
+struct _muse_remote_pid_t
+{
+	muse_inbox_t	*inbox;
+	int				slot;
+	int				gen;
+};
+
+typedef struct
+{
+	muse_functional_object_t base;
+	struct _muse_remote_pid_t to;
+} remote_pid_t;
+
+static muse_inbox_t *create_inbox()
+{
+	muse_inbox_t *inbox = (muse_inbox_t*)calloc( 1, sizeof(muse_inbox_t) );
+
+	inbox->refs = 1;
+	inbox->wake_fd[0] = inbox->wake_fd[1] = -1;
+
+#if defined(MUSE_REMOTE_EVENTFD)
+	inbox->wake_fd[0] = inbox->wake_fd[1] = eventfd( 0, EFD_NONBLOCK );
+#elif defined(MUSE_REMOTE_WAKE_FD)
+	if ( pipe( inbox->wake_fd ) == 0 )
+	{
+		fcntl( inbox->wake_fd[0], F_SETFL, O_NONBLOCK );
+		fcntl( inbox->wake_fd[1], F_SETFL, O_NONBLOCK );
+	}
+	else
+		inbox->wake_fd[0] = inbox->wake_fd[1] = -1;
+#endif
+
+	return inbox;
+}
+
+static muse_inbox_t *env_inbox( muse_env *env )
+{
+	if ( env->inbox == NULL )
+		env->inbox = create_inbox();
+
+	return (muse_inbox_t*)env->inbox;
+}
+
+static void retain_inbox( muse_inbox_t *inbox )
+{
+	muse_atomic_add( &inbox->refs, 1 );
+}
+
+static void release_inbox( muse_inbox_t *inbox );
+
+/**
+ * Takes all the queued messages, oldest first.
+ */
+static remote_message_t *take_messages( muse_inbox_t *inbox )
+{
+	remote_message_t *m, *batch = NULL;
+
+	do
+	{
+		m = inbox->head;
+	}
+	while ( m && !muse_atomic_cas_ptr( &inbox->head, m, NULL ) );
+
+	while ( m )
+	{
+		remote_message_t *next = m->next;
+		m->next = batch;
+		batch = m;
+		m = next;
+	}
+
+	return batch;
+}
+
+static void drain_wake_fd( muse_inbox_t *inbox )
+{
+#ifdef MUSE_REMOTE_WAKE_FD
+	char buffer[64];
+	if ( inbox->wake_fd[0] >= 0 )
+		while ( read( inbox->wake_fd[0], buffer, sizeof(buffer) ) > 0 )
+			;
+#endif
+}
+
+/**
+ * Queues a message. Returns MUSE_FALSE if the receiving
+ * environment has been destroyed.
+ */
+static muse_boolean push_message( muse_inbox_t *inbox, remote_message_t *m )
+{
+	remote_message_t *head;
+
+	if ( inbox->closed )
+		return MUSE_FALSE;
+
+	do
+	{
+		head = inbox->head;
+		m->next = head;
+	}
+	while ( !muse_atomic_cas_ptr( &inbox->head, head, m ) );
+
+#ifdef MUSE_REMOTE_WAKE_FD
+	/* Only the message that finds the inbox empty needs to wake the
+	receiver up. It drains the wake fd before taking the messages. */
+	if ( head == NULL && inbox->wake_fd[1] >= 0 )
+	{
+#ifdef MUSE_REMOTE_EVENTFD
+		unsigned long long one = 1;
+#else
+		char one = 1;
+#endif
+		if ( write( inbox->wake_fd[1], &one, sizeof(one) ) < 0 )
+			; /* Already signalled. */
+	}
+#endif
+
+	return MUSE_TRUE;
+}
+
+/** @name Encoding messages */
+/*@{*/
+typedef struct
+{
+	unsigned char	*data;
+	size_t			size;
+	size_t			capacity;
+	muse_boolean	with_globals;	/**< Take along the global definitions that functions refer to. */
+	int				in_lambda;		/**< > 0 while encoding a function. */
+	muse_cell		*globals;		/**< The symbols that the functions refer to. */
+	int				num_globals, max_globals;
+	muse_cell		*lambdas;		/**< The functions being encoded, outermost first. */
+	int				num_lambdas, max_lambdas;
+} transfer_buffer_t;
+
+static void put_bytes( transfer_buffer_t *b, const void *bytes, size_t size )
+{
+	if ( b->size + size > b->capacity )
+	{
+		while ( b->size + size > b->capacity )
+			b->capacity *= 2;
+		b->data = (unsigned char*)realloc( b->data, b->capacity );
+	}
+
+	memcpy( b->data + b->size, bytes, size );
+	b->size += size;
+}
+
+static void put_tag( transfer_buffer_t *b, char tag )
+{
+	put_bytes( b, &tag, 1 );
+}
+
+static void put_int( transfer_buffer_t *b, int i )
+{
+	put_bytes( b, &i, sizeof(i) );
+}
+
+static void put_chars( transfer_buffer_t *b, const muse_char *chars, int length )
+{
+	put_int( b, length );
+	put_bytes( b, chars, length * sizeof(muse_char) );
+}
+
+/**
+ * Makes the process with the given pid reachable from other
+ * environments through the environment's export table.
+ */
+static void export_process( muse_env *env, muse_cell pid, struct _muse_remote_pid_t *to )
+{
+	muse_process_frame_t *p = (muse_process_frame_t*)_ptr(pid)->fn.context;
+	muse_inbox_t *inbox = env_inbox(env);
+
+	if ( p->remote_slot == 0 )
+	{
+		if ( inbox->free_export )
+		{
+			p->remote_slot = inbox->free_export;
+			inbox->free_export = inbox->exports[p->remote_slot-1].next_free;
+		}
+		else
+		{
+			if ( inbox->num_exports == inbox->max_exports )
+			{
+				inbox->max_exports = inbox->max_exports ? inbox->max_exports * 2 : 16;
+				inbox->exports = (export_t*)realloc( inbox->exports, inbox->max_exports * sizeof(export_t) );
+			}
+
+			inbox->exports[inbox->num_exports].gen = 0;
+			p->remote_slot = ++(inbox->num_exports);
+		}
+
+		inbox->exports[p->remote_slot-1].pid = pid;
+		inbox->exports[p->remote_slot-1].next_free = 0;
+	}
+
+	to->inbox	= inbox;
+	to->slot	= p->remote_slot;
+	to->gen		= inbox->exports[p->remote_slot-1].gen;
+}
+
+static muse_boolean is_local_pid( muse_env *env, muse_cell x )
+{
+	return _cellt(x) == MUSE_NATIVEFN_CELL && _ptr(x)->fn.fn == (muse_nativefn_t)fn_pid;
+}
+
+/**
+ * Notes a symbol that a function refers to. Closures already hold
+ * the values of the variables that were defined when they were made,
+ * so these are mostly the functions that are defined after the ones
+ * that call them, including recursive ones.
+ */
+static void note_global( transfer_buffer_t *b, muse_cell sym )
+{
+	int i;
+
+	if ( !b->with_globals )
+		return;
+
+	for ( i = 0; i < b->num_globals; ++i )
+	{
+		if ( b->globals[i] == sym )
+			return;
+	}
+
+	if ( b->num_globals == b->max_globals )
+	{
+		b->max_globals = b->max_globals ? b->max_globals * 2 : 16;
+		b->globals = (muse_cell*)realloc( b->globals, b->max_globals * sizeof(muse_cell) );
+	}
+
+	b->globals[b->num_globals++] = sym;
+}
+
+/**
+ * Appends the encoding of \p x to the buffer. Lazy values are
+ * forced on the way. Returns MUSE_FALSE and sets \p bad to the
+ * offending value if \p x holds something that can't be taken
+ * out of its environment, such as an object or a port.
+ *
+ * Functions are encoded as their formals and body, which hold the
+ * values their closures captured. Native functions are encoded as is
+ * if they are plain builtins - i.e. have no context - since all
+ * environments share the same code.
+ *
+ * Remote pids are written without taking references to their
+ * inboxes. That is done once the whole message is encoded.
+ */
+static muse_boolean encode_value( muse_env *env, transfer_buffer_t *b, muse_cell x, int depth, muse_cell *bad )
+{
+	int sp = _spos();
+	muse_cell seen = MUSE_NIL;
+	int steps = 0, next_seen = 1;
+
+	if ( depth > MUSE_TRANSFER_MAX_DEPTH )
+	{
+		*bad = x;
+		return MUSE_FALSE;
+	}
+
+	while ( 1 )
+	{
+		if ( x < 0 )
+		{
+			/* Quick-quoted. */
+			put_tag( b, 'q' );
+			x = -x;
+		}
+
+		if ( x == MUSE_NIL )
+		{
+			put_tag( b, 'n' );
+			break;
+		}
+
+		if ( _cellt(x) == MUSE_LAZY_CELL )
+		{
+			x = _force(x);
+			_unwind(sp);
+			_spush(x);
+			continue;
+		}
+
+		if ( _cellt(x) != MUSE_CONS_CELL )
+			break;
+
+		/* A list whose tail comes back to one of its own cells
+		is a cycle. The cell to look out for is moved ahead after
+		twice as many steps each time, which catches any cycle
+		without limiting the length of the list. */
+		if ( x == seen )
+		{
+			*bad = x;
+			_unwind(sp);
+			return MUSE_FALSE;
+		}
+
+		if ( ++steps == next_seen )
+		{
+			seen = x;
+			next_seen *= 2;
+		}
+
+		/* Lists are encoded by walking down the tail so that long
+		lists don't take deep recursion. */
+		put_tag( b, 'c' );
+		if ( !encode_value( env, b, _head(x), depth + 1, bad ) )
+		{
+			_unwind(sp);
+			return MUSE_FALSE;
+		}
+
+		x = _tail(x);
+		_unwind(sp);
+		_spush(x);
+	}
+
+	if ( x == MUSE_NIL )
+	{
+		_unwind(sp);
+		return MUSE_TRUE;
+	}
+
+	switch ( _cellt(x) )
+	{
+	case MUSE_INT_CELL :
+		put_tag( b, 'i' );
+		put_bytes( b, &(_ptr(x)->i), sizeof(muse_int) );
+		break;
+
+	case MUSE_FLOAT_CELL :
+		put_tag( b, 'f' );
+		put_bytes( b, &(_ptr(x)->f), sizeof(muse_float) );
+		break;
+
+	case MUSE_TEXT_CELL :
+		{
+			int length = 0;
+			const muse_char *chars = _text_contents( x, &length );
+			put_tag( b, 't' );
+			put_chars( b, chars, length );
+		}
+		break;
+
+	case MUSE_SYMBOL_CELL :
+		{
+			int length = 0;
+			muse_cell name = _symname(x);
+			const muse_char *chars;
+
+			if ( !name )
+			{
+				*bad = x;
+				_unwind(sp);
+				return MUSE_FALSE;
+			}
+
+			chars = _text_contents( name, &length );
+			put_tag( b, 's' );
+			put_chars( b, chars, length );
+
+			if ( b->in_lambda )
+				note_global( b, x );
+		}
+		break;
+
+	case MUSE_LAMBDA_CELL :
+		{
+			muse_cell body = _tail(x);
+			int i;
+
+			/* A recursive function holds itself in its body, since
+			define fills in the function it declared first. Such a
+			function refers back to the one being encoded. */
+			for ( i = 0; i < b->num_lambdas; ++i )
+			{
+				if ( b->lambdas[i] == x )
+				{
+					put_tag( b, 'r' );
+					put_bytes( b, &i, sizeof(i) );
+					_unwind(sp);
+					return MUSE_TRUE;
+				}
+			}
+
+			if ( b->num_lambdas == b->max_lambdas )
+			{
+				b->max_lambdas = b->max_lambdas ? b->max_lambdas * 2 : 16;
+				b->lambdas = (muse_cell*)realloc( b->lambdas, b->max_lambdas * sizeof(muse_cell) );
+			}
+
+			b->lambdas[b->num_lambdas++] = x;
+
+			/* Leave out the meta object that fn puts at the head of
+			the body. It only describes the function for reflection,
+			so the receiver makes a fresh one in its place. */
+			if ( body && _head(body) < 0 && _cellt(_quq(_head(body))) == MUSE_NATIVEFN_CELL )
+			{
+				body = _tail(body);
+				put_tag( b, 'l' );
+			}
+			else
+				put_tag( b, 'L' );
+
+			b->in_lambda++;
+			if ( !encode_value( env, b, _head(x), depth + 1, bad ) || !encode_value( env, b, body, depth + 1, bad ) )
+			{
+				b->in_lambda--;
+				b->num_lambdas--;
+				_unwind(sp);
+				return MUSE_FALSE;
+			}
+			b->in_lambda--;
+			b->num_lambdas--;
+		}
+		break;
+
+	case MUSE_NATIVEFN_CELL :
+		{
+			remote_pid_t *r = (remote_pid_t*)_functional_object_data( x, 'rpid' );
+			struct _muse_remote_pid_t to;
+
+			if ( r || is_local_pid( env, x ) )
+			{
+				if ( r )
+					to = r->to;
+				else
+					export_process( env, x, &to );
+
+				put_tag( b, 'p' );
+				put_bytes( b, &to, sizeof(to) );
+			}
+			else if ( _functional_object_data( x, 'vect' ) )
+			{
+				int i, length = muse_vector_length( env, x );
+				put_tag( b, 'v' );
+				put_int( b, length );
+				for ( i = 0; i < length; ++i )
+				{
+					if ( !encode_value( env, b, muse_vector_get( env, x, i ), depth + 1, bad ) )
+					{
+						_unwind(sp);
+						return MUSE_FALSE;
+					}
+				}
+			}
+			else if ( _functional_object_data( x, 'barr' ) )
+			{
+				muse_int size = (muse_int)muse_bytes_size( env, x );
+				put_tag( b, 'b' );
+				put_bytes( b, &size, sizeof(size) );
+				put_bytes( b, muse_bytes_data( env, x, 0 ), (size_t)size );
+			}
+			else if ( _ptr(x)->fn.context == NULL )
+			{
+				put_tag( b, 'F' );
+				put_bytes( b, &(_ptr(x)->fn.fn), sizeof(muse_nativefn_t) );
+			}
+			else
+			{
+				*bad = x;
+				_unwind(sp);
+				return MUSE_FALSE;
+			}
+		}
+		break;
+
+	default:
+		*bad = x;
+		_unwind(sp);
+		return MUSE_FALSE;
+	}
+
+	_unwind(sp);
+	return MUSE_TRUE;
+}
+/*@}*/
+
+/** @name Decoding messages */
+/*@{*/
+typedef struct
+{
+	const unsigned char	*data;
+	size_t				pos;
+	muse_boolean		keep_refs;	/**< Leave the message's references to the inboxes of its pids alone. */
+	muse_cell			*lambdas;	/**< The functions being decoded, outermost first. */
+	int					num_lambdas, max_lambdas;
+} transfer_reader_t;
+
+static void get_bytes( transfer_reader_t *r, void *bytes, size_t size )
+{
+	memcpy( bytes, r->data + r->pos, size );
+	r->pos += size;
+}
+
+static int get_int( transfer_reader_t *r )
+{
+	int i;
+	get_bytes( r, &i, sizeof(i) );
+	return i;
+}
+
+/**
+ * Walks over an encoded value, adding \p delta to the reference
+ * counts of the inboxes of the remote pids in it.
+ */
+static void adjust_refs( transfer_reader_t *r, int delta )
+{
+	while ( 1 )
+	{
+		switch ( r->data[r->pos++] )
+		{
+		case 'q' : continue;
+		case 'c' :
+		case 'l' :
+		case 'L' : adjust_refs( r, delta ); continue;
+		case 'n' : return;
+		case 'F' : r->pos += sizeof(muse_nativefn_t); return;
+		case 'r' : r->pos += sizeof(int); return;
+		case 'i' : r->pos += sizeof(muse_int); return;
+		case 'f' : r->pos += sizeof(muse_float); return;
+		case 't' :
+		case 's' : r->pos += get_int(r) * sizeof(muse_char); return;
+		case 'b' :
+			{
+				muse_int size;
+				get_bytes( r, &size, sizeof(size) );
+				r->pos += (size_t)size;
+			}
+			return;
+		case 'v' :
+			{
+				int i, length = get_int(r);
+				for ( i = 0; i < length; ++i )
+					adjust_refs( r, delta );
+			}
+			return;
+		case 'p' :
+			{
+				struct _muse_remote_pid_t to;
+				get_bytes( r, &to, sizeof(to) );
+				if ( delta > 0 )
+					retain_inbox( to.inbox );
+				else
+					release_inbox( to.inbox );
+			}
+			return;
+		default:
+			return;
+		}
+	}
+}
+
+/**
+ * Adjusts the references of all the values in a message - the
+ * message itself and the global definitions that follow it.
+ */
+static void adjust_message_refs( remote_message_t *m, int delta )
+{
+	transfer_reader_t r = { m->data, 0, MUSE_FALSE, NULL, 0, 0 };
+
+	while ( r.pos < m->size )
+	{
+		if ( r.data[r.pos] == 'd' )
+		{
+			r.pos++;
+			adjust_refs( &r, delta );
+		}
+
+		adjust_refs( &r, delta );
+	}
+}
+
+static void free_message( remote_message_t *m )
+{
+	adjust_message_refs( m, -1 );
+	free( m );
+}
+
+static muse_cell mk_remote_pid( muse_env *env, const struct _muse_remote_pid_t *to );
+
+/**
+ * Makes a pid of a process of this environment or a remote pid out
+ * of the given reference, whose reference to its inbox is taken over.
+ */
+static muse_cell import_pid( muse_env *env, struct _muse_remote_pid_t *to )
+{
+	muse_inbox_t *inbox = (muse_inbox_t*)env->inbox;
+
+	if ( to->inbox == inbox && to->slot <= inbox->num_exports && inbox->exports[to->slot-1].gen == to->gen )
+	{
+		muse_cell pid = inbox->exports[to->slot-1].pid;
+		release_inbox( to->inbox );
+		return pid;
+	}
+	else
+	{
+		muse_cell rpid = mk_remote_pid( env, to );
+		release_inbox( to->inbox );
+		return rpid;
+	}
+}
+
+/**
+ * Builds the encoded value in the environment's heap. The
+ * value is left on the stack.
+ */
+static muse_cell decode_value( muse_env *env, transfer_reader_t *r )
+{
+	int sp = _spos();
+	char tag = r->data[r->pos++];
+
+	switch ( tag )
+	{
+	case 'q' :
+		{
+			muse_cell x = decode_value( env, r );
+			return x ? -x : x;
+		}
+
+	case 'n' :
+		return MUSE_NIL;
+
+	case 'c' :
+		{
+			muse_cell first = _cons( decode_value( env, r ), MUSE_NIL );
+			muse_cell last = first;
+			int list_sp;
+
+			_unwind(sp);
+			_spush(first);
+			list_sp = _spos();
+
+			while ( r->data[r->pos] == 'c' )
+			{
+				muse_cell c;
+				r->pos++;
+				c = _cons( decode_value( env, r ), MUSE_NIL );
+				_sett( last, c );
+				last = c;
+				_unwind(list_sp);
+			}
+
+			_sett( last, decode_value( env, r ) );
+			_unwind(list_sp);
+			return first;
+		}
+
+	case 'i' :
+		{
+			muse_int i;
+			get_bytes( r, &i, sizeof(i) );
+			return _mk_int(i);
+		}
+
+	case 'f' :
+		{
+			muse_float f;
+			get_bytes( r, &f, sizeof(f) );
+			return _mk_float(f);
+		}
+
+	case 't' :
+	case 's' :
+		{
+			int length = get_int(r);
+			const muse_char *chars = (const muse_char*)(r->data + r->pos);
+			muse_cell x;
+
+			/* The characters may not be aligned in the buffer. */
+			muse_char *aligned = (muse_char*)malloc( (length + 1) * sizeof(muse_char) );
+			memcpy( aligned, chars, length * sizeof(muse_char) );
+			r->pos += length * sizeof(muse_char);
+
+			if ( tag == 't' )
+				x = muse_mk_text( env, aligned, aligned + length );
+			else
+				x = muse_symbol( env, aligned, aligned + length );
+
+			free( aligned );
+			return x;
+		}
+
+	case 'v' :
+		{
+			int i, length = get_int(r);
+			muse_cell v = muse_mk_vector( env, length );
+			int vector_sp = _spos();
+
+			for ( i = 0; i < length; ++i )
+			{
+				muse_vector_put( env, v, i, decode_value( env, r ) );
+				_unwind(vector_sp);
+			}
+
+			return v;
+		}
+
+	case 'b' :
+		{
+			muse_int size;
+			muse_cell bytes;
+			get_bytes( r, &size, sizeof(size) );
+			bytes = muse_mk_bytes( env, (size_t)size );
+			get_bytes( r, muse_bytes_data( env, bytes, 0 ), (size_t)size );
+			return bytes;
+		}
+
+	case 'p' :
+		{
+			struct _muse_remote_pid_t to;
+			get_bytes( r, &to, sizeof(to) );
+			if ( r->keep_refs )
+				retain_inbox( to.inbox );
+			return import_pid( env, &to );
+		}
+
+	case 'l' :
+	case 'L' :
+		{
+			muse_cell f = _setcellt( _cons( MUSE_NIL, MUSE_NIL ), MUSE_LAMBDA_CELL );
+			muse_cell formals, body;
+
+			if ( r->num_lambdas == r->max_lambdas )
+			{
+				r->max_lambdas = r->max_lambdas ? r->max_lambdas * 2 : 16;
+				r->lambdas = (muse_cell*)realloc( r->lambdas, r->max_lambdas * sizeof(muse_cell) );
+			}
+
+			r->lambdas[r->num_lambdas++] = f;
+			formals = decode_value( env, r );
+			body = decode_value( env, r );
+			_setht( f, formals, body );
+			r->num_lambdas--;
+
+			if ( tag == 'l' )
+				muse_get_meta( env, f );
+			_unwind(sp);
+			_spush(f);
+			return f;
+		}
+
+	case 'r' :
+		return r->lambdas[get_int(r)];
+
+	case 'F' :
+		{
+			muse_nativefn_t fn;
+			get_bytes( r, &fn, sizeof(fn) );
+			return _mk_nativefn( fn, NULL );
+		}
+
+	default:
+		muse_assert( !"Corrupt message from another environment!" );
+		return MUSE_NIL;
+	}
+}
+/*@}*/
+
+/**
+ * Builds the given value in the environment's heap along with the
+ * global definitions that follow it, which are defined on the way.
+ * The value is left on the stack. Unless \p keep_refs is true, the
+ * pids in the message take over its references to their inboxes.
+ */
+static muse_cell decode_message( muse_env *env, remote_message_t *m, muse_boolean keep_refs )
+{
+	transfer_reader_t r = { m->data, 0, keep_refs, NULL, 0, 0 };
+	muse_cell x = decode_value( env, &r );
+	int sp = _spos();
+
+	while ( r.pos < m->size && r.data[r.pos] == 'd' )
+	{
+		muse_cell sym;
+		r.pos++;
+		sym = decode_value( env, &r );
+		_define( sym, decode_value( env, &r ) );
+		_unwind(sp);
+	}
+
+	free( r.lambdas );
+
+	return x;
+}
+
+/**
+ * Encodes \p x into a message. If \p with_globals is true, the
+ * definitions of the global symbols that the functions in \p x refer
+ * to are encoded after it, leaving out the ones that can't be taken
+ * out of this environment. Returns NULL and sets \p bad if \p x holds
+ * something that can't be.
+ */
+static remote_message_t *encode_message( muse_env *env, muse_cell x, muse_boolean with_globals, muse_cell *bad )
+{
+	int sp = _spos();
+	transfer_buffer_t b;
+	remote_message_t *m;
+	int i;
+
+	memset( &b, 0, sizeof(b) );
+	b.capacity		= 256;
+	b.size			= offsetof( remote_message_t, data );
+	b.data			= (unsigned char*)malloc( b.capacity );
+	b.with_globals	= with_globals;
+
+	if ( !encode_value( env, &b, x, 0, bad ) )
+	{
+		/* The offending value may have come from forcing a lazy
+		value, so keep it around for the caller's error. */
+		_unwind(sp);
+		_spush(*bad);
+		free( b.lambdas );
+		free( b.globals );
+		free( b.data );
+		return NULL;
+	}
+
+	/* The globals' own functions can add to the list as it is walked. */
+	for ( i = 0; i < b.num_globals; ++i )
+	{
+		muse_cell sym = b.globals[i];
+		muse_cell value = _symval(sym);
+		size_t mark = b.size;
+		muse_cell ignored = MUSE_NIL;
+
+		if ( value == sym || value == MUSE_NIL )
+			continue;
+
+		put_tag( &b, 'd' );
+		b.in_lambda = 0;
+		b.num_lambdas = 0;
+		if ( !encode_value( env, &b, sym, 0, &ignored ) || !encode_value( env, &b, value, 0, &ignored ) )
+			b.size = mark;
+		_unwind(sp);
+	}
+
+	free( b.lambdas );
+	free( b.globals );
+
+	m = (remote_message_t*)b.data;
+	m->next	= NULL;
+	m->slot	= 0;
+	m->gen	= 0;
+	m->size	= b.size - offsetof( remote_message_t, data );
+
+	/* The remote pids in the message keep their
+	inboxes around until it is delivered. */
+	adjust_message_refs( m, 1 );
+	return m;
+}
+
+/**
+ * Encodes \p msg for the process \p to and posts it. Evaluates to T
+ * if the message got queued and to () if the receiving environment
+ * is gone. Raises error:not-transferable if the message holds
+ * something that can't be taken out of this environment.
+ */
+static muse_cell post_remote( muse_env *env, const struct _muse_remote_pid_t *to, muse_cell msg )
+{
+	muse_cell bad = MUSE_NIL;
+	remote_message_t *m = encode_message( env, msg, MUSE_FALSE, &bad );
+
+	if ( m == NULL )
+		return muse_raise_error( env, _csymbol(L"error:not-transferable"), _cons( bad, MUSE_NIL ) );
+
+	m->slot	= to->slot;
+	m->gen	= to->gen;
+
+	if ( push_message( to->inbox, m ) )
+		return _t();
+
+	free_message( m );
+	return MUSE_NIL;
+}
+
+static void release_inbox( muse_inbox_t *inbox )
+{
+	if ( muse_atomic_add( &inbox->refs, -1 ) == 0 )
+	{
+		remote_message_t *m = take_messages( inbox );
+
+		while ( m )
+		{
+			remote_message_t *next = m->next;
+			free_message( m );
+			m = next;
+		}
+
+#ifdef MUSE_REMOTE_WAKE_FD
+		if ( inbox->wake_fd[0] >= 0 )
+			close( inbox->wake_fd[0] );
+		if ( inbox->wake_fd[1] >= 0 && inbox->wake_fd[1] != inbox->wake_fd[0] )
+			close( inbox->wake_fd[1] );
+#endif
+		free( inbox->exports );
+		free( inbox );
+	}
+}
+
+/**
+ * Delivers the messages that have arrived from other environments
+ * to the mailboxes of their processes. Messages to processes that
+ * have ended are dropped. A mailbox takes messages from other
+ * environments even when it is full, since the senders can't be
+ * made to wait for it.
+ */
+void muse_deliver_remote_messages( muse_env *env )
+{
+	muse_inbox_t *inbox = (muse_inbox_t*)env->inbox;
+	remote_message_t *m;
+
+	if ( inbox == NULL || inbox->head == NULL )
+		return;
+
+	drain_wake_fd( inbox );
+	m = take_messages( inbox );
+
+	while ( m )
+	{
+		remote_message_t *next = m->next;
+		int sp = _spos();
+		muse_cell msg = decode_message( env, m, MUSE_FALSE );
+
+		if ( m->slot <= inbox->num_exports && inbox->exports[m->slot-1].gen == m->gen )
+		{
+			muse_process_frame_t *p = (muse_process_frame_t*)_ptr( inbox->exports[m->slot-1].pid )->fn.context;
+
+			if ( p->state_bits != MUSE_PROCESS_DEAD )
+				post_message_from( p, msg, MUSE_NIL );
+		}
+
+		_unwind(sp);
+		free( m );
+		m = next;
+	}
+}
+
+/**
+ * Blocks for up to \p timeout_us or until a message arrives
+ * from another environment. The caller delivers the messages
+ * afterwards, so the wake descriptor is reset here.
+ */
+void muse_wait_remote_messages( muse_env *env, muse_int timeout_us )
+{
+	muse_inbox_t *inbox = (muse_inbox_t*)env->inbox;
+
+	if ( inbox->head || timeout_us <= 0 )
+		return;
+
+#ifdef MUSE_REMOTE_WAKE_FD
+	if ( inbox->wake_fd[0] >= 0 )
+	{
+		struct pollfd fd;
+		fd.fd		= inbox->wake_fd[0];
+		fd.events	= POLLIN;
+		fd.revents	= 0;
+		if ( poll( &fd, 1, (int)((timeout_us + 999) / 1000) ) > 0 )
+			drain_wake_fd( inbox );
+		return;
+	}
+#endif
+
+	/* Nothing to wait on. Look at the inbox every now and then. */
+	muse_sleep( timeout_us < MUSE_IO_POLL_INTERVAL_US ? timeout_us : MUSE_IO_POLL_INTERVAL_US );
+}
+
+/**
+ * Returns the descriptor that becomes readable when a message
+ * arrives in the environment's empty inbox, or -1 if there is
+ * none. The networking module waits on it along with the sockets.
+ */
+int muse_remote_wake_fd( muse_env *env )
+{
+	muse_inbox_t *inbox = (muse_inbox_t*)env->inbox;
+	return inbox ? inbox->wake_fd[0] : -1;
+}
+
+/**
+ * Resets the wake descriptor after it was found to be readable.
+ * It can be left signalled with the inbox empty if the messages
+ * were taken before the sender got around to signalling it.
+ */
+void muse_clear_remote_wake( muse_env *env )
+{
+	if ( env->inbox )
+		drain_wake_fd( (muse_inbox_t*)env->inbox );
+}
+
+/**
+ * Frees the export table entry of a process that is being freed.
+ * Messages still on their way to it are dropped on arrival.
+ */
+void muse_unexport_process( muse_process_frame_t *p )
+{
+	muse_inbox_t *inbox = (muse_inbox_t*)p->env->inbox;
+
+	if ( inbox && p->remote_slot )
+	{
+		export_t *e = inbox->exports + p->remote_slot - 1;
+		e->pid			= MUSE_NIL;
+		e->gen++;
+		e->next_free	= inbox->free_export;
+		inbox->free_export = p->remote_slot;
+	}
+
+	p->remote_slot = 0;
+}
+
+/**
+ * Called when the environment is destroyed. Messages posted to
+ * it from now on are dropped by the sender. The inbox itself stays
+ * until the remote pids that refer to it are gone.
+ */
+void muse_close_inbox( muse_env *env )
+{
+	muse_inbox_t *inbox = (muse_inbox_t*)env->inbox;
+
+	if ( inbox )
+	{
+		remote_message_t *m;
+
+		inbox->closed = 1;
+		m = take_messages( inbox );
+		while ( m )
+		{
+			remote_message_t *next = m->next;
+			free_message( m );
+			m = next;
+		}
+
+		free( inbox->exports );
+		inbox->exports = NULL;
+		inbox->num_exports = inbox->max_exports = inbox->free_export = 0;
+
+		env->inbox = NULL;
+		release_inbox( inbox );
+	}
+}
+
+/**
+ * Calling a remote pid posts the arguments as a message prefixed
+ * with the pid of the sending process, just like calling a pid does.
+ */
+static muse_cell fn_remote_pid_object( muse_env *env, remote_pid_t *r, muse_cell args )
+{
+	int sp = _spos();
+	muse_cell result = MUSE_NIL;
+
+	if ( args )
+	{
+		muse_cell msg = _cons( process_id(env->current_process), muse_eval_list(env,args) );
+		result = post_remote( env, &r->to, msg );
+	}
+
+	_unwind(sp);
+	return result;
+}
+
+static void remote_pid_destroy( muse_env *env, void *ptr )
+{
+	remote_pid_t *r = (remote_pid_t*)ptr;
+
+	if ( r->to.inbox )
+	{
+		release_inbox( r->to.inbox );
+		r->to.inbox = NULL;
+	}
+}
+
+static muse_functional_object_type_t g_remote_pid_type =
+{
+	'muSE',
+	'rpid',
+	sizeof(remote_pid_t),
+	(muse_nativefn_t)fn_remote_pid_object,
+	NULL,
+	NULL,
+	NULL,
+	remote_pid_destroy,
+	NULL
+};
+
+/**
+ * Makes a remote pid object that takes its own reference to the inbox.
+ */
+static muse_cell mk_remote_pid( muse_env *env, const struct _muse_remote_pid_t *to )
+{
+	muse_cell rpid = _mk_functional_object( &g_remote_pid_type, MUSE_NIL );
+	remote_pid_t *r = (remote_pid_t*)_functional_object_data( rpid, 'rpid' );
+
+	r->to = *to;
+	retain_inbox( to->inbox );
+	return rpid;
+}
+
+muse_boolean muse_is_remote_pid( muse_env *env, muse_cell pid )
+{
+	return _functional_object_data( pid, 'rpid' ) ? MUSE_TRUE : MUSE_FALSE;
+}
+
+/**
+ * Posts \p msg as is to the process of the remote pid \p rpid.
+ * Used by \ref fn_post "post".
+ */
+muse_cell muse_post_to_remote_pid( muse_env *env, muse_cell rpid, muse_cell msg )
+{
+	remote_pid_t *r = (remote_pid_t*)_functional_object_data( rpid, 'rpid' );
+	return post_remote( env, &r->to, msg );
+}
+
+/**
+ * @code (remote-pid [pid]) @endcode
+ *
+ * Evaluates to a remote pid for the given process, or for the current
+ * process if \p pid is omitted. A remote pid can be used from any
+ * environment - \ref fn_post "post" accepts it in place of a pid and
+ * calling it as @code (rpid 'MsgType . args) @endcode posts the
+ * message with the pid of the sending process at its head, just like
+ * calling a pid does. Either way, it evaluates to \c T if the message
+ * was sent and to \c () if the environment of the receiving process
+ * has been destroyed. A message to a process that has ended is dropped.
+ *
+ * The message is copied to the receiving environment. It can hold
+ * numbers, strings, symbols, lists, vectors, byte arrays, functions
+ * and pids. The receiver gets pids as remote pids that it can reply to.
+ * A function takes along the values its closure captured, but the
+ * other symbols it refers to are looked up in the receiving environment.
+ * Lazy values are computed before the message is sent. Messages from
+ * another environment don't wait for room in a full mailbox, and
+ * @code (receive pid) @endcode only waits for messages from
+ * processes of the same environment.
+ *
+ * Pass a remote pid to another environment in a message, or with
+ * muse_export_pid() and muse_import_pid() from C.
+ *
+ * @exception error:not-transferable
+ * Raised when a message holds a value that can't be copied to
+ * another environment, such as an object or a port.
+ * Handler format: @code (fn (resume 'error:not-transferable value) ...) @endcode
+ */
+muse_cell fn_remote_pid( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell pid = args ? _evalnext(&args) : process_id(env->current_process);
+	struct _muse_remote_pid_t to;
+
+	if ( muse_is_remote_pid( env, pid ) )
+		return pid;
+
+	if ( !pid || !is_local_pid( env, pid ) )
+	{
+		MUSE_DIAGNOSTICS({
+			muse_message( env, L"(remote-pid >>pid<<)", L"Expected a process id.\nGot\n\t%m\ninstead.", pid );
+		});
+		return MUSE_NIL;
+	}
+
+	export_process( env, pid, &to );
+	return mk_remote_pid( env, &to );
+}
+
+/**
+ * @code (remote-pid? x) @endcode
+ *
+ * Evaluates to \p x if it is a remote pid and to \c () if it isn't.
+ */
+muse_cell fn_remote_pid_p( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell x = _evalnext(&args);
+	return muse_is_remote_pid( env, x ) ? x : MUSE_NIL;
+}
+
+/**
+ * Returns a reference to the process \p pid that can be handed to
+ * another environment, possibly running on another thread, which
+ * makes a remote pid out of it using muse_import_pid(). Must be called
+ * on the thread of \p env. Returns NULL if \p pid isn't a process id.
+ * Release the reference with muse_release_pid().
+ */
+MUSEAPI muse_remote_pid_t *muse_export_pid( muse_env *env, muse_cell pid )
+{
+	struct _muse_remote_pid_t *to;
+
+	if ( muse_is_remote_pid( env, pid ) )
+	{
+		to = (struct _muse_remote_pid_t*)malloc( sizeof(struct _muse_remote_pid_t) );
+		*to = ((remote_pid_t*)_functional_object_data( pid, 'rpid' ))->to;
+	}
+	else if ( pid && is_local_pid( env, pid ) )
+	{
+		to = (struct _muse_remote_pid_t*)malloc( sizeof(struct _muse_remote_pid_t) );
+		export_process( env, pid, to );
+	}
+	else
+		return NULL;
+
+	retain_inbox( to->inbox );
+	return to;
+}
+
+/**
+ * Makes a remote pid in \p env for the exported process \p rpid.
+ * The reference remains with the caller.
+ */
+MUSEAPI muse_cell muse_import_pid( muse_env *env, const muse_remote_pid_t *rpid )
+{
+	struct _muse_remote_pid_t to = *rpid;
+	retain_inbox( to.inbox );
+	return import_pid( env, &to );
+}
+
+MUSEAPI void muse_release_pid( muse_remote_pid_t *rpid )
+{
+	if ( rpid )
+	{
+		release_inbox( rpid->inbox );
+		free( rpid );
+	}
+}
+
+/**
+ * Posts \p msg from \p env to the process \p to in whichever
+ * environment it is in. Returns MUSE_FALSE if that environment
+ * has been destroyed. Raises error:not-transferable like
+ * \ref fn_remote_pid "remote-pid".
+ */
+MUSEAPI muse_boolean muse_post_remote( muse_env *env, const muse_remote_pid_t *to, muse_cell msg )
+{
+	int sp = _spos();
+	muse_cell result = post_remote( env, to, msg );
+	_unwind(sp);
+	return result ? MUSE_TRUE : MUSE_FALSE;
+}
+
+/**
+ * Copies \p x out of the environment, for muse_transfer_decode() to
+ * build in another environment. If \p with_globals is true, the copy
+ * includes the global definitions that the functions in \p x refer to.
+ * Returns NULL and sets \p bad to the offending value if \p x holds
+ * something that can't be copied.
+ */
+void *muse_transfer_encode( muse_env *env, muse_cell x, muse_boolean with_globals, muse_cell *bad )
+{
+	return encode_message( env, x, with_globals, bad );
+}
+
+/**
+ * Builds a copy made by muse_transfer_encode() in \p env, defining
+ * the globals that came with it. The copy can be decoded any number
+ * of times and by any number of environments at once.
+ */
+muse_cell muse_transfer_decode( muse_env *env, const void *data )
+{
+	return decode_message( env, (remote_message_t*)data, MUSE_TRUE );
+}
+
+void muse_transfer_free( void *data )
+{
+	if ( data )
+		free_message( (remote_message_t*)data );
+}
+
+void muse_define_builtin_type_remote_pid( muse_env *env )
+{
+	int sp = _spos();
+	_define( _csymbol(L"remote-pid"), _mk_nativefn( fn_remote_pid, NULL ) );
+	_define( _csymbol(L"remote-pid?"), _mk_nativefn( fn_remote_pid_p, NULL ) );
+	_unwind(sp);
+}
+
+/*@}*/
+/*@}*/
@@ -651,7 +651,7 @@ static muse_cell xml_read_tag( muse_env *env, muse_port_t p, int *shareable )
 		{
 			int sp = _spos();
 			int localshareable = 1;
-			muse_cell tag = muse_csymbol_utf8(env,sym);
+			muse_cell tag = _spush( muse_csymbol_utf8(env,sym) );
 			muse_cell attribs = xml_read_tag_attribs(env,p,&localshareable);
 			muse_cell body = xml_read_tag_body(env,p,tag,&localshareable);
 			muse_cell result = MUSE_NIL;
@@ -29,6 +29,7 @@ static const struct _builtins
 {		L"lazy",		fn_lazy				},
 {		L"cons",		fn_cons				},
 {		L"lcons",		fn_lcons			},
+{		L"chunked-stream",	fn_chunked_stream	},
 {		L"eval",		fn_eval				},
 {		L"fn",			syntax_lambda		},
 {		L"lambda",		syntax_lambda		},
@@ -42,11 +43,19 @@ static const struct _builtins
 {		L"the",			fn_the				},
 {		L"meta",		fn_meta				},
 {		L"trace",		fn_trace			},
+{		L"lexical-addressing",	fn_lexical_addressing	},
+{		L"profile-start",	fn_profile_start	},
+{		L"profile-stop",	fn_profile_stop		},
+{		L"profile-calls",	fn_profile_calls	},
+{		L"trace-events",	fn_trace_events		},
+{		L"write-trace-events",	fn_write_trace_events	},
+{		L"trace-span",		fn_trace_span		},
 {		L"with-recent",	fn_with_recent		},
 {		L"symbol-whose-value-is",	fn_symbol_whose_value_is	},
 
 /************** Continuations and exception mechanism ***************/
 {		L"call/cc",		fn_callcc			},
+{		L"call/ec",		fn_callec			},
 {		L"try",			syntax_try				},
 {		L"raise",		fn_raise			},
 {		L"retry",		fn_retry			},
@@ -196,6 +205,8 @@ static const struct _builtins
 {		L"run",			fn_run				},
 {		L"post",		fn_post				},
 {		L"process?",	fn_process_p		},
+{		L"process-info",	fn_process_info		},
+{		L"processes",	fn_processes		},
 {		L"with-timeout-us",	fn_with_timeout_us	},
 
 /************** Miscellaneous **************/
@@ -205,6 +216,7 @@ static const struct _builtins
 {		L"time-taken-us",			fn_time_taken_us			},
 {		L"generate-documentation",	fn_generate_documentation	},
 {		L"load-plugin",				fn_load_plugin				},
+{		L"compile-module",			fn_compile_module			},
 {		L"list-files",				fn_list_files				},
 {		L"list-folders",			fn_list_folders				},
 {		L"split",					fn_split					},
@@ -238,6 +250,11 @@ void muse_load_builtin_fns(muse_env *env)
 		
 		++b;
 	}
+
+	_define( _builtin_symbol(MUSE_LEXICAL_FRAME), _mk_nativefn( fn_lexical_frame, NULL ) );
+	_define( _builtin_symbol(MUSE_LEXICAL_REF), _mk_nativefn( fn_lexical_ref, NULL ) );
+	_define( _builtin_symbol(MUSE_LEXICAL_LET), _mk_nativefn( fn_lexical_let, NULL ) );
+	_unwind(sp);
 		
 	muse_define_put_macro(env);
 	muse_define_builtin_local(env);
@@ -247,9 +264,12 @@ void muse_load_builtin_fns(muse_env *env)
 	muse_define_builtin_type_bytes(env);
 	muse_define_builtin_type_module(env);
 	muse_define_builtin_type_box(env);
+	muse_define_builtin_type_generator(env);
+	muse_define_builtin_type_remote_pid(env);
 	muse_define_builtin_fileport(env);
 	muse_define_builtin_memport(env);
 	muse_define_builtin_networking(env);
+	muse_define_builtin_parallel(env);
 	muse_register_com_support(env);
 	muse_define_image_properties(env);
 	muse_define_xml_codes(env);
@@ -547,7 +567,7 @@ muse_cell fn_stats( muse_env *env, void *context, muse_cell args )
 						 muse_list( env, "SiSiSiSi",
 								   L"free-cells", free_cell_count,
 								   L"stack-size", sp,
-								   L"symbol-count", env->num_symbols,
+								   L"symbol-count", env->num_symbols - (int)(env->free_locals.top - env->free_locals.bottom),
 								   L"bindings-depth", _bspos()/2 ) );
 }
 
@@ -972,21 +992,17 @@ muse_cell fn_generate_documentation( muse_env *env, void *context, muse_cell arg
 		return MUSE_NIL;
 	p = muse_assign_port(env, f, MUSE_PORT_WRITE);
 
-	/* The symbol table is a hash table where each bucket has a list
-	of symbols. */
+	/* The symbol stack holds all the symbols. */
 	size = sprintf( (char*)buffer, "/** @defgroup %S */\n/*@{*/\n", _text_contents( filename, NULL ) );
 	port_write( buffer, size, p );
 	{
 		muse_cell *syms = env->symbol_stack.bottom;
-		muse_cell *syms_end = syms + env->symbol_stack.size;
+		muse_cell *syms_end = env->symbol_stack.top;
 
-		while ( syms < syms_end )
+		for ( ; syms < syms_end; ++syms )
 		{
-			muse_cell s = *syms++;
-			while ( s )
-			{
-				gendoc_for_symbol( env,_next(&s), p);
-			}
+			if ( *syms )
+				gendoc_for_symbol( env, *syms, p );
 		}
 	}
 	size = sprintf( (char*)buffer, "\n/*@}*/\n" );
@@ -1225,13 +1241,29 @@ muse_cell fn_this_process( muse_env *env, void *context, muse_cell args )
 	return process_id( env->current_process );
 }
 
+static const muse_char *k_priority_names[MUSE_NUM_PRIORITIES] = { L"high", L"normal", L"low" };
+
 /**
- * @code (spawn (fn () [body]) [attention]) -> pid @endcode
+ * @code (spawn (fn () [body]) [attention] [priority] [mailbox-capacity]) -> pid @endcode
  *
  * Spawns a new process which will evaluate the given thunk.
  * The (optional) attention value is a positive integer
  * giving the number of reductions to perform in the created process
  * before yielding to other processes. The default value is 10.
+ * Give () as the attention to use the default along with a priority.
+ *
+ * The (optional) priority is one of the symbols \c 'high, \c 'normal
+ * and \c 'low and defaults to \c 'normal. A process that can run
+ * always runs before those of lower priority, so a busy high priority 
+ * process keeps the others from running. Processes of the same
+ * priority take turns.
+ *
+ * The (optional) mailbox capacity is a positive integer that limits the
+ * number of messages waiting in the process's mailbox. A process that 
+ * sends a message to a full mailbox waits until the receiver makes room,
+ * which keeps a fast producer from running away from a slow consumer.
+ * \ref fn_post "post" can fail instead of waiting. Without a capacity, 
+ * the mailbox is unbounded.
  *
  * The result of the spawn expression is a pid using which you can
  * identify the created process and send messages to it by using the
@@ -1241,14 +1273,38 @@ muse_cell fn_this_process( muse_env *env, void *context, muse_cell args )
  * So if you want to create a server process, you can express
  * it as an infinitely tail recursive function. (Tail recursive
  * calls are stack optimized.)
+ *
+ * @exception error:bad-priority
+ * Handler format: @code (fn (resume 'error:bad-priority value) ...) @endcode
  */
 muse_cell fn_spawn( muse_env *env, void *context, muse_cell args )
 {
 	muse_cell thunk = _evalnext(&args);
-	int attention = args ? (int)_intvalue( _evalnext(&args) ) : env->parameters[MUSE_DEFAULT_ATTENTION];
+	muse_cell attention = args ? _evalnext(&args) : MUSE_NIL;
+	muse_cell priority = args ? _evalnext(&args) : MUSE_NIL;
+	muse_cell capacity = args ? _evalnext(&args) : MUSE_NIL;
+	muse_process_frame_t *p = NULL;
+	int i;
 
-	muse_process_frame_t *p = init_process_mailbox( create_process( env, attention, thunk, NULL ) );
+	for ( i = 0; priority && i < MUSE_NUM_PRIORITIES; ++i )
+	{
+		if ( priority == _csymbol( k_priority_names[i] ) )
+			break;
+	}
+
+	if ( i == MUSE_NUM_PRIORITIES )
+		return muse_raise_error( env, _csymbol(L"error:bad-priority"), _cons( priority, MUSE_NIL ) );
+
+	p = init_process_mailbox( create_process( env, attention ? (int)_intvalue(attention) : env->parameters[MUSE_DEFAULT_ATTENTION], thunk, NULL ) );
+	if ( priority )
+		p->priority = i;
+	if ( capacity && _intvalue(capacity) > 0 )
+		p->mailbox_capacity = (int)_intvalue(capacity);
 	prime_process( p );
+	muse_flight_record( env, "spawn: process " MUSE_FMT_INT, _celli( process_id(p) ), 0 );
+
+	/* Time spent before there was another process to switch to isn't a stall. */
+	env->last_switch_us = muse_elapsed_us(env->timer);
 	return process_id( p );
 }
 
@@ -1282,13 +1338,19 @@ muse_cell syntax_atomic( muse_env *env, void *context, muse_cell args )
  * received from that specific process. If a timeout value (in microseconds) 
  * is given, it waits until either a message is received or the timeout expires. 
  * If the timeout expired, the receive expression evaluates to MUSE_NIL - i.e. to ().
+ *
+ * The mailbox keeps the messages from each process in a queue of their
+ * own, so receiving from a specific process doesn't have to look through
+ * the messages from the others. Receiving a message makes room for one
+ * more from a process waiting on a full mailbox - see \ref fn_spawn "spawn".
  */
 muse_cell fn_receive( muse_env *env, void *context, muse_cell args )
 {
 	muse_process_frame_t *p = env->current_process;
 	muse_cell pid = MUSE_NIL;
 	muse_int timeout_us = -1;
-	muse_cell msgs = MUSE_NIL;
+	muse_cell msg = MUSE_NIL;
+	muse_int start_us = env->trace_events ? muse_elapsed_us(env->timer) : 0;
 
 	if ( args )
 	{
@@ -1314,56 +1376,40 @@ muse_cell fn_receive( muse_env *env, void *context, muse_cell args )
 
 	/* Set the pid wwe're waiting for. */
 	p->waiting_for_pid = pid;
-	msgs = p->mailbox;
 
-	if ( pid )
-	{
-		/* Search for the message. */
-		while ( _tail(msgs) && _head(_head(_tail(msgs))) != pid )
-			msgs = _tail(msgs);
-	}
-
-	if ( !_tail(msgs) )
+	if ( !next_message( p, pid ) )
 	{
 		/* Wait for timeout value if specified. */
-		p->state_bits = MUSE_PROCESS_WAITING;
-
-		if ( timeout_us > 0 )
-		{
-			p->state_bits |= MUSE_PROCESS_HAS_TIMEOUT;
-			p->timeout_us = muse_elapsed_us(env->timer) + timeout_us;
-		}
+		pause_process( env, MUSE_PROCESS_WAITING_MESSAGE, (timeout_us > 0) ? muse_elapsed_us(env->timer) + timeout_us : -1 );
 
-		switch_to_process( env, p->next );
+		/* A with-timeout-us block may have expired during the wait. */
+		if ( p->expired_eval_timeouts > 0 )
+			check_timeout(env);
 	}
 
 	/* Check for message again. If there's still no message, return with MUSE_NIL. 
 	An actual message will never be MUSE_NIL because it will contain the PID of the
 	sending process at the head. */
-	msgs = p->mailbox;
-
-	if ( pid )
-	{
-		/* Search for the message. */
-		while ( _tail(msgs) && _head(_head(_tail(msgs))) != pid )
-			msgs = _tail(msgs);
-	}
+	msg = next_message( p, pid );
 
-	if ( _tail(msgs) )
+	if ( msg )
 	{
 		/* Yes! We've received a message. Remove it from the queue and return it. */
-		muse_cell msg = _tail(msgs);
 		p->waiting_for_pid = MUSE_NIL; /**< No longer waiting for a pid. */
-		_sett( msgs, _tail( msg ) );
+		msg = take_message( p, msg );
 
-		/* After removing, check if we've reached the end of the message queue. */
-		if ( msg == p->mailbox_end )
-			p->mailbox_end = msgs;
+		if ( env->trace_events )
+			muse_trace_event( env, "receive", 'X', start_us, "from", _celli( _head(msg) ) );
 
-		return _head( msg );
+		return msg;
 	}
 	else
+	{
+		if ( env->trace_events )
+			muse_trace_event( env, "receive", 'X', start_us, NULL, 0 );
+
 		return MUSE_NIL; /**< We've timed out. */
+	}
 }
 
 
@@ -1377,21 +1423,15 @@ muse_cell fn_receive( muse_env *env, void *context, muse_cell args )
  */
 muse_cell fn_run( muse_env *env, void *context, muse_cell args )
 {
-	muse_process_frame_t *p = env->current_process;
 	muse_int timeout_us = args ? _intvalue( _evalnext(&args) ) : -1;
 	muse_int endtime_us = timeout_us + muse_elapsed_us(env->timer);
 
 	do
 	{
-		p->state_bits = MUSE_PROCESS_WAITING;
+		pause_process( env, 0, (timeout_us >= 0) ? endtime_us : -1 );
 
-		if ( timeout_us >= 0 )
-		{
-			p->state_bits |= MUSE_PROCESS_HAS_TIMEOUT;
-			p->timeout_us = endtime_us;
-		}
-
-		switch_to_process( env, env->current_process->next );
+		if ( env->current_process->expired_eval_timeouts > 0 )
+			check_timeout(env);
 	}
 	while ( timeout_us < 0 );
 
@@ -1411,7 +1451,7 @@ static muse_cell is_pid( muse_env *env, muse_cell pid )
 }
 
 /**
- * @code (post msg [pid]) @endcode
+ * @code (post msg [pid] ['block|'fail]) @endcode
  *
  * Allows you to post an arbitrary sexpr as a message to the current process.
  * The difference between using post and \ref fn_pid "pid" (as a function)
@@ -1427,6 +1467,15 @@ static muse_cell is_pid( muse_env *env, muse_cell pid )
  * be diverted to another process without modification. In this case, the 
  * message is not posted to the current process.
  *
+ * If the other process's mailbox is full (see \ref fn_spawn "spawn"), 
+ * posting with \c 'block - the default - waits until there is room for 
+ * the message, and posting with \c 'fail posts nothing. Evaluates to T
+ * if the message got posted and to () if it didn't.
+ *
+ * The pid can also be a \ref fn_remote_pid "remote pid" of a process in
+ * another environment. The message is then copied over to it and the
+ * mode doesn't matter, since such messages don't wait for room.
+ *
  * Ex: Postponing the processing of a message -
  * @code
  * (case (receive)
@@ -1435,6 +1484,14 @@ static muse_cell is_pid( muse_env *env, muse_cell pid )
  *    ...
  *    (any (post any)))
  * @endcode
+ *
+ * @exception error:bad-post-mode
+ * Handler format: @code (fn (resume 'error:bad-post-mode value) ...) @endcode
+ *
+ * @exception error:not-transferable
+ * Raised when posting to a remote pid a message that can't be copied
+ * to another environment. See \ref fn_remote_pid "remote-pid".
+ * Handler format: @code (fn (resume 'error:not-transferable value) ...) @endcode
  */
 muse_cell fn_post( muse_env *env, void *context, muse_cell args )
 {
@@ -1444,13 +1501,26 @@ muse_cell fn_post( muse_env *env, void *context, muse_cell args )
 	{
 		/* We've been given a pid to post to. */
 		muse_cell pid = _evalnext(&args);
+		muse_cell mode = args ? _evalnext(&args) : MUSE_NIL;
+		muse_process_frame_t *p;
 
 		MUSE_DIAGNOSTICS({
-			if ( !_is_pid(pid) )
+			if ( !_is_pid(pid) && !muse_is_remote_pid(env,pid) )
 				muse_message( env,L"(post msg >>[pid]<<)", L"Expected a process id as the second argument.\nGot\n\t%m\ninstead.", pid );
 		});
 
-		post_message( (muse_process_frame_t*)(_ptr(pid)->fn.context), msg );
+		if ( mode && mode != _csymbol(L"block") && mode != _csymbol(L"fail") )
+			return muse_raise_error( env, _csymbol(L"error:bad-post-mode"), _cons( mode, MUSE_NIL ) );
+
+		if ( muse_is_remote_pid( env, pid ) )
+			return muse_post_to_remote_pid( env, pid, msg );
+
+		p = (muse_process_frame_t*)(_ptr(pid)->fn.context);
+
+		if ( !wait_for_mailbox_room( env, p, (mode == _csymbol(L"fail")) ? MUSE_FALSE : MUSE_TRUE ) )
+			return MUSE_NIL;
+
+		post_message( p, msg );
 	}
 	else
 	{
@@ -1458,7 +1528,7 @@ muse_cell fn_post( muse_env *env, void *context, muse_cell args )
 		post_message( env->current_process, msg );
 	}
 
-	return MUSE_NIL;
+	return _builtin_symbol( MUSE_T );
 }
 
 /**
@@ -1471,6 +1541,89 @@ muse_cell fn_process_p( muse_env *env, void *context, muse_cell args )
 	return _is_pid( _evalnext(&args) );
 }
 
+/**
+ * @code (process-info [pid]) @endcode
+ *
+ * Evaluates to an object whose properties describe the given
+ * process, or the current process if \p pid is omitted -
+ *	- \c state - one of \c new, \c running, \c waiting or \c ended.
+ *	- \c priority - 0 for high, 1 for normal and 2 for low.
+ *	- \c attention - the reductions the process gets per turn.
+ *	- \c reductions - the function applications it has evaluated so far.
+ *	- \c running-us - the time it has spent running.
+ *	- \c waiting-message-us, \c waiting-timeout-us, \c waiting-socket-us
+ *	  and \c waiting-mailbox-us - the time it has spent waiting in 
+ *	  \ref fn_receive "receive", in \ref fn_run "run", for a socket and for
+ *	  room in a full mailbox respectively.
+ *	- \c cells-allocated - the cells allocated while it was running.
+ *	- \c mailbox-length - the messages waiting to be received.
+ *	- \c mailbox-capacity - () if its mailbox is unbounded.
+ *	- \c stack-high-water and \c bindings-high-water - the most cells
+ *	  it has used on its evaluation and bindings stacks.
+ *	- \c cstack-high-water - the most bytes it has used on its C stack,
+ *	  or () for the main process.
+ *
+ * Evaluates to () if \p pid isn't a process id. See \ref fn_processes "processes".
+ */
+muse_cell fn_process_info( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell pid = args ? _evalnext(&args) : process_id(env->current_process);
+	muse_process_info_t info;
+	const muse_char *state;
+	muse_cell obj;
+
+	if ( !muse_process_info( env, pid, &info ) )
+		return MUSE_NIL;
+
+	if ( info.state_bits == MUSE_PROCESS_DEAD )
+		state = L"ended";
+	else if ( info.state_bits & MUSE_PROCESS_VIRGIN )
+		state = L"new";
+	else if ( info.state_bits & MUSE_PROCESS_WAITING )
+		state = L"waiting";
+	else
+		state = L"running";
+
+	obj = fn_new(env,NULL,MUSE_NIL);
+	muse_put_many( env, obj,
+				  muse_list( env, "SSSiSiSISI",
+							L"state", state,
+							L"priority", info.priority,
+							L"attention", info.attention,
+							L"reductions", info.reductions,
+							L"running-us", info.running_us ) );
+	muse_put_many( env, obj,
+				  muse_list( env, "SISISISI",
+							L"waiting-message-us", info.waiting_us[MUSE_WAIT_MESSAGE],
+							L"waiting-timeout-us", info.waiting_us[MUSE_WAIT_TIMEOUT],
+							L"waiting-socket-us", info.waiting_us[MUSE_WAIT_SOCKET],
+							L"waiting-mailbox-us", info.waiting_us[MUSE_WAIT_MAILBOX] ) );
+	return muse_put_many( env, obj,
+						 muse_list( env, "SISiScSiSiSc",
+								   L"cells-allocated", info.cells_allocated,
+								   L"mailbox-length", info.mailbox_length,
+								   L"mailbox-capacity", info.mailbox_capacity ? _mk_int(info.mailbox_capacity) : MUSE_NIL,
+								   L"stack-high-water", info.stack_high_water,
+								   L"bindings-high-water", info.bindings_high_water,
+								   L"cstack-high-water", (info.cstack_high_water >= 0) ? _mk_int(info.cstack_high_water) : MUSE_NIL ) );
+}
+
+/**
+ * @code (processes) @endcode
+ *
+ * Evaluates to a list of the pids of all the processes that haven't
+ * ended yet, starting with the current process. Together with
+ * \ref fn_process_info "process-info", this helps find processes that
+ * hog the scheduler or the heap -
+ * @code
+ * (map (fn (pid) (list pid (get (process-info pid) 'reductions))) (processes))
+ * @endcode
+ */
+muse_cell fn_processes( muse_env *env, void *context, muse_cell args )
+{
+	return muse_processes(env);
+}
+
 /**
  * @code (with-timeout-us 'id us ...body...) @endcode
  *
@@ -1491,8 +1644,8 @@ muse_cell fn_with_timeout_us( muse_env *env, void *context, muse_cell args )
 		int bsp = _bspos();
 		push_timeout( env, id, timeout_us );
 		result = muse_force( env, muse_do( env, args ) );
+		pop_timeout( env );
 		_unwind_bindings(bsp);
-		env->current_process->num_eval_timeouts--;
 	}
 
 	return result;
@@ -1724,27 +1877,24 @@ muse_cell fn_symbol_whose_value_is( muse_env *env, void *context, muse_cell args
 	/* Traverse the symbol table and find the symbol that
 	has the given cell as its value. */
 
-	muse_stack symbols = env->symbol_stack;
-	int i;
-	for ( i = 0; i < symbols.size; ++i )
+	muse_cell *syms = env->symbol_stack.bottom;
+	muse_cell *syms_end = env->symbol_stack.top;
+	for ( ; syms < syms_end; ++syms )
 	{
-		muse_cell symlist = symbols.bottom[i];
-		
-		while ( symlist )
-		{
-			muse_cell sym = _next(&symlist);
+		muse_cell sym = *syms;
 
-			if ( _symval(sym) == value ) {
-				if ( !symbol_on_stack(env,sym) ) /* Value found. */
-					return sym;
-			} else {
-				/* Recursively search any modules for such a value. */
-				void *data = muse_functional_object_data( env, _symval(sym), 'mmod' );
-				if ( data ) {
-					muse_cell found = module_find_symbol_with_value( env, data, value );
-					if ( found )
-						return _cons( sym, found );
-				}
+		if ( !sym ) {
+			continue;
+		} else if ( _symval(sym) == value ) {
+			if ( !symbol_on_stack(env,sym) ) /* Value found. */
+				return sym;
+		} else {
+			/* Recursively search any modules for such a value. */
+			void *data = muse_functional_object_data( env, _symval(sym), 'mmod' );
+			if ( data ) {
+				muse_cell found = module_find_symbol_with_value( env, data, value );
+				if ( found )
+					return _cons( sym, found );
 			}
 		}
 	}
@@ -27,6 +27,7 @@ muse_cell fn_quote( muse_env *env, void *context, muse_cell args );
 muse_cell fn_lazy( muse_env *env, void *context, muse_cell args );
 muse_cell fn_cons( muse_env *env, void *context, muse_cell args );
 muse_cell fn_lcons( muse_env *env, void *context, muse_cell args );
+muse_cell fn_chunked_stream( muse_env *env, void *context, muse_cell args );
 muse_cell syntax_lambda( muse_env *env, void *context, muse_cell args );
 muse_cell syntax_block( muse_env *env, void *context, muse_cell args );
 muse_cell syntax_generic_lambda( muse_env *env, void *context, muse_cell args );
@@ -38,9 +39,11 @@ muse_cell fn_apply_w_keywords( muse_env *env, void *context, muse_cell args );
 muse_cell fn_eval( muse_env *env, void *context, muse_cell args );
 muse_cell fn_call_w_keywords( muse_env *env, void *context, muse_cell args );
 muse_cell fn_callcc( muse_env *env, void *context, muse_cell args );
+muse_cell fn_callec( muse_env *env, void *context, muse_cell args );
 muse_cell fn_the( muse_env *env, void *context, muse_cell args );
 muse_cell fn_meta( muse_env *env, void *context, muse_cell args );
 muse_cell fn_trace( muse_env *env, void *context, muse_cell args );
+muse_cell fn_lexical_addressing( muse_env *env, void *context, muse_cell args );
 muse_cell fn_with_recent( muse_env *env, void *context, muse_cell args );
 muse_cell fn_symbol_whose_value_is( muse_env *env, void *context, muse_cell args );
 /*@}*/
@@ -236,6 +239,8 @@ muse_cell fn_receive( muse_env *env, void *context, muse_cell args );
 muse_cell fn_run( muse_env *env, void *context, muse_cell args );
 muse_cell fn_post( muse_env *env, void *context, muse_cell args );
 muse_cell fn_process_p( muse_env *env, void *context, muse_cell args );
+muse_cell fn_process_info( muse_env *env, void *context, muse_cell args );
+muse_cell fn_processes( muse_env *env, void *context, muse_cell args );
 muse_cell fn_with_timeout_us( muse_env *env, void *context, muse_cell args );
 /*@}*/
 
@@ -247,6 +252,7 @@ muse_cell fn_substring( muse_env *env, void *context, muse_cell args );
 muse_cell fn_time_taken_us( muse_env *env, void *context, muse_cell args );
 muse_cell fn_generate_documentation( muse_env *env, void *context, muse_cell args );
 muse_cell fn_load_plugin( muse_env *env, void *context, muse_cell args );
+muse_cell fn_compile_module( muse_env *env, void *context, muse_cell args );
 muse_cell fn_list_files( muse_env *env, void *context, muse_cell args );
 muse_cell fn_list_folders( muse_env *env, void *context, muse_cell args );
 muse_cell fn_split( muse_env *env, void *context, muse_cell args );
@@ -263,7 +269,69 @@ muse_cell fn_to_upper( muse_env *env, void *context, muse_cell args );
 muse_cell fn_stats( muse_env *env, void *context, muse_cell args );
 /*@}*/
 
+/**
+ * @addtogroup CompiledModules Compiled modules
+ *
+ * Runtime support for plugins generated by \ref fn_compile_module "compile-module".
+ * The generated C code calls only these and the functions in muse_opcodes.h.
+ */
+/*@{*/
+
+/**
+ * The head of the block that holds a compiled module's constants and
+ * link tables. Plugins are shared by all environments that load them,
+ * so each environment gets a block of its own, which is the context
+ * of the module's native functions.
+ */
+typedef struct _muse_compiled_module_t
+{
+	int marker;		/**< Tells the module's functions apart from other natives. */
+	struct _muse_compiled_module_t *next;	/**< The environment's other blocks. */
+} muse_compiled_module_t;
+
+typedef void (*muse_compiled_link_t)( muse_env *env, void *module );
+
+muse_compiled_module_t *muse_compiled_module( muse_env *env, size_t size );
+muse_boolean muse_compiled_strict( muse_env *env, muse_cell fn );
+muse_boolean muse_compiled_is( muse_env *env, muse_cell value, muse_nativefn_t fn );
+void muse_compiled_keep( muse_env *env, muse_cell c );
+muse_cell muse_compiled_link( muse_env *env, muse_cell expr, muse_boolean list_start );
+int muse_compiled_guard( muse_env *env );
+muse_cell muse_compiled_unguard( muse_env *env, int bp, muse_int key, muse_cell result );
+muse_cell muse_compiled_text( muse_env *env, const char *utf8, int length );
+muse_cell muse_compiled_define( muse_env *env, muse_cell symbol, muse_nativefn_t fn, muse_compiled_link_t link, void *module, muse_cell source );
+/*@}*/
+
+/** @addtogroup LexicalAddressing */
+/*@{*/
+muse_cell fn_lexical_frame( muse_env *env, void *context, muse_cell args );
+muse_cell fn_lexical_ref( muse_env *env, void *context, muse_cell args );
+muse_cell fn_lexical_let( muse_env *env, void *context, muse_cell args );
+/*@}*/
+
+/**
+ * @addtogroup Profiling Profiling
+ *
+ * A sampling profiler that records the stack trace information of the
+ * running process on a CPU time timer. The collected stacks are written in
+ * the "collapsed" format used by flamegraph tools. A call profiler
+ * counts every function application instead. Interpreter activity can
+ * also be recorded for viewing as a timeline in a trace viewer.
+ */
+/*@{*/
+muse_cell fn_profile_start( muse_env *env, void *context, muse_cell args );
+muse_cell fn_profile_stop( muse_env *env, void *context, muse_cell args );
+muse_cell fn_profile_calls( muse_env *env, void *context, muse_cell args );
+muse_cell fn_trace_events( muse_env *env, void *context, muse_cell args );
+muse_cell fn_write_trace_events( muse_env *env, void *context, muse_cell args );
+muse_cell fn_trace_span( muse_env *env, void *context, muse_cell args );
+void muse_stop_profiler( muse_env *env );
+void muse_stop_call_profile( muse_env *env );
+void muse_stop_trace_events( muse_env *env );
+/*@}*/
+
 void muse_load_builtin_fns( muse_env *env );
+void gfn_dispatch_invalidate( muse_env *env, muse_cell case_e );
 void muse_define_put_macro( muse_env *env );
 
 /** 
@@ -286,9 +354,12 @@ void muse_define_builtin_type_hashtable(muse_env *env);
 void muse_define_builtin_type_bytes( muse_env *env );
 void muse_define_builtin_type_module( muse_env *env );
 void muse_define_builtin_type_box(muse_env *env);
+void muse_define_builtin_type_generator( muse_env *env );
+void muse_define_builtin_type_remote_pid( muse_env *env );
 /*@}*/
 
 void muse_define_builtin_networking(muse_env *env);
+void muse_define_builtin_parallel( muse_env *env );
 void muse_define_builtin_local(muse_env *env);
 void muse_register_com_support( muse_env *env );
 void muse_define_xml_codes(muse_env *env);
@@ -0,0 +1,1134 @@
+/**
+ * @file muse_compile.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * Ahead-of-time translation of muSE source modules into C source that
+ * can be built into a plugin and linked using \ref fn_load_plugin "load-plugin".
+ *
+ * Top level function definitions of the form
+ * @code (define (f x y ...) ...) @endcode or
+ * @code (define f (fn (x y ...) ...)) @endcode
+ * are translated into native functions that call the muSE C API.
+ * All other top level expressions are embedded into the plugin as
+ * data and evaluated when the plugin is linked, in source order.
+ *
+ * The translated functions follow the interpreter's binding rules -
+ * formal parameters are bound dynamically using \c _pushdef, free
+ * symbols are bound at link time the same way \ref syntax_lambda "fn" binds
+ * them when creating a closure and symbols that are undefined at that
+ * point are looked up when the function runs. Function applications
+ * check at run time whether the function being applied evaluates its
+ * arguments. If it does, the arguments are computed by the compiled
+ * code. Otherwise, the (bind-copied) source expression is handed to
+ * the function as the interpreter would do. A compiled module can
+ * therefore be loaded in place of its source and later definitions
+ * continue to take effect.
+ */
+
+#include "muse_builtins.h"
+#include "muse_port.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <math.h>
+
+/** @addtogroup CompiledModules */
+/*@{*/
+
+/**
+ * The marker of the blocks that are the context pointers of all
+ * native functions created for compiled definitions. It differs
+ * from that of functional objects.
+ */
+static const int k_compiled_module_marker = 'mcfn';
+
+/**
+ * The slot that holds the environment's compiled module blocks.
+ */
+static const int k_compiled_modules_slot = 'mcmd';
+
+static void free_compiled_modules( muse_env *env, muse_int *slot )
+{
+	muse_compiled_module_t *m = (muse_compiled_module_t*)(size_t)(*slot);
+
+	while ( m )
+	{
+		muse_compiled_module_t *next = m->next;
+		free( m );
+		m = next;
+	}
+
+	(*slot) = 0;
+}
+
+/**
+ * Allocates a zeroed block of \p size bytes for the constants and
+ * link tables of a compiled module, starting with a \ref muse_compiled_module_t.
+ * Called by the entry point of the plugin each time it is loaded. The block
+ * lives as long as the environment.
+ */
+muse_compiled_module_t *muse_compiled_module( muse_env *env, size_t size )
+{
+	muse_int *slot = muse_slot( env, k_compiled_modules_slot );
+	muse_compiled_module_t *m = (muse_compiled_module_t*)calloc( 1, size );
+
+	if ( (*slot) == 0 )
+		muse_set_slot_cleanup_proc( env, k_compiled_modules_slot, free_compiled_modules );
+
+	m->marker = k_compiled_module_marker;
+	m->next = (muse_compiled_module_t*)(size_t)(*slot);
+	(*slot) = (muse_int)(size_t)m;
+	return m;
+}
+
+/**
+ * Native functions which evaluate all their arguments in order
+ * and therefore can be given arguments evaluated by compiled code.
+ */
+static const muse_nativefn_t k_strict_fns[] =
+{
+	fn_add, fn_sub, fn_mul, fn_div, fn_idiv, fn_mod, fn_inc, fn_dec, fn_trunc,
+	fn_eq, fn_equal, fn_ne, fn_lt, fn_gt, fn_le, fn_ge, fn_not, fn_min, fn_max,
+	fn_cons, fn_list, fn_first, fn_rest, fn_nth, fn_length,
+	NULL
+};
+
+/**
+ * Returns \c MUSE_TRUE if the given function is known to evaluate
+ * all its arguments - i.e. normal lambdas, compiled functions and a few
+ * common builtins.
+ */
+muse_boolean muse_compiled_strict( muse_env *env, muse_cell fn )
+{
+	switch ( _cellt(fn) )
+	{
+	case MUSE_LAMBDA_CELL :
+		return _head(fn) >= 0 ? MUSE_TRUE : MUSE_FALSE;
+	case MUSE_NATIVEFN_CELL :
+		{
+			const muse_nativefn_cell *f = &_ptr(fn)->fn;
+
+			if ( f->context && ((const muse_compiled_module_t*)f->context)->marker == k_compiled_module_marker )
+				return MUSE_TRUE;
+
+			if ( f->context == NULL )
+			{
+				const muse_nativefn_t *s = k_strict_fns;
+				for ( ; *s; ++s )
+				{
+					if ( *s == f->fn )
+						return MUSE_TRUE;
+				}
+			}
+		}
+		return MUSE_FALSE;
+	default:
+		return MUSE_FALSE;
+	}
+}
+
+/**
+ * Returns \c MUSE_TRUE if the given value is the builtin native
+ * function implemented by \p fn.
+ */
+muse_boolean muse_compiled_is( muse_env *env, muse_cell value, muse_nativefn_t fn )
+{
+	return (_cellt(value) == MUSE_NATIVEFN_CELL && _ptr(value)->fn.fn == fn && _ptr(value)->fn.context == NULL)
+		? MUSE_TRUE
+		: MUSE_FALSE;
+}
+
+/**
+ * Cells held by compiled code in its tables are kept alive
+ * by placing them on the property list slot of a hidden symbol. The plist
+ * is shared by all processes, unlike the symbol's value. Symbols need
+ * to be kept too since unreferenced ones can be collected.
+ */
+void muse_compiled_keep( muse_env *env, muse_cell c )
+{
+	if ( c > 0 )
+	{
+		int sp = _spos();
+		muse_cell sym = _csymbol(L"{compiled-module-cells}");
+		_sett( _tail(sym), _cons( c, _tail(_tail(sym)) ) );
+		_unwind(sp);
+	}
+}
+
+/**
+ * Binds the given expression the same way \ref syntax_lambda "fn" binds
+ * the body of a closure and keeps the result alive. Called by the link
+ * procedures of compiled functions with the formal parameters anonymized.
+ */
+muse_cell muse_compiled_link( muse_env *env, muse_cell expr, muse_boolean list_start )
+{
+	muse_cell result = muse_bind_copy_expr( env, expr, list_start );
+	muse_compiled_keep( env, _quq(result) );
+	return result;
+}
+
+/**
+ * Equivalent of the scope guard used by \ref syntax_if "if" and
+ * \ref syntax_do "do". Returns the bindings stack position to
+ * pass to muse_compiled_unguard().
+ */
+int muse_compiled_guard( muse_env *env )
+{
+	int bp;
+	muse_push_copy_recent_scope(env);
+	bp = _bspos();
+	_push_binding(_builtin_symbol(MUSE_IT));
+	return bp;
+}
+
+muse_cell muse_compiled_unguard( muse_env *env, int bp, muse_int key, muse_cell result )
+{
+	_unwind_bindings(bp);
+	return muse_pop_recent_scope( env, key, result );
+}
+
+muse_cell muse_compiled_text( muse_env *env, const char *utf8, int length )
+{
+	return muse_mk_text_utf8( env, utf8, utf8 + length );
+}
+
+static muse_boolean is_generic( muse_env *env, muse_cell gen )
+{
+	return ((_cellt(gen) == MUSE_LAMBDA_CELL) && (_quq(_head(gen)) == _csymbol(L"{{generic-args}}")))
+		? MUSE_TRUE
+		: MUSE_FALSE;
+}
+
+/**
+ * Defines the given symbol to the compiled function. If the definition
+ * has to extend a generic function or happens in a local context, the
+ * source form is evaluated instead so that \ref fn_define "define" can
+ * do its job.
+ */
+muse_cell muse_compiled_define( muse_env *env, muse_cell symbol, muse_nativefn_t fn, muse_compiled_link_t link, void *module, muse_cell source )
+{
+	if ( _bspos() > 0 || is_generic( env, _symval(symbol) ) )
+		return _eval(source);
+
+	link( env, module );
+
+	{
+		muse_cell f = _mk_nativefn( fn, module );
+		_define( symbol, f );
+		muse_compiled_keep( env, f );
+		return f;
+	}
+}
+
+/************************************************/
+/* Compiler                                      */
+/************************************************/
+
+typedef struct
+{
+	char *text;
+	size_t length, capacity;
+} buffer_t;
+
+static void buffer_printf( buffer_t *b, const char *format, ... )
+{
+	for (;;)
+	{
+		size_t avail = b->capacity - b->length;
+		int n;
+		va_list args;
+
+		va_start( args, format );
+		n = vsnprintf( b->text ? b->text + b->length : NULL, avail, format, args );
+		va_end( args );
+
+		if ( n >= 0 && (size_t)n < avail )
+		{
+			b->length += n;
+			return;
+		}
+
+		b->capacity = 2 * b->capacity + (n > 0 ? n : 0) + 256;
+		b->text = (char*)realloc( b->text, b->capacity );
+	}
+}
+
+static void buffer_reset( buffer_t *b )
+{
+	b->length = 0;
+	if ( b->text )
+		b->text[0] = '\0';
+}
+
+static void buffer_destroy( buffer_t *b )
+{
+	free( b->text );
+	b->text = NULL;
+	b->length = b->capacity = 0;
+}
+
+typedef struct
+{
+	muse_env *env;
+
+	buffer_t constants;		/**< Statements that create the constants K[]. */
+	buffer_t functions;		/**< Translated function definitions. */
+	buffer_t forms;			/**< Statements of the plugin entry point. */
+	buffer_t link;			/**< Link statements of the function being compiled. */
+	buffer_t body;			/**< Body expression of the function being compiled. */
+
+	muse_cell *const_cells;	/**< Open addressing table for reusing constants. */
+	int *const_index;
+	int const_capacity;
+	int num_constants;
+
+	muse_cell *sym_cells;	/**< Symbol -> link slot within the current function. */
+	int *sym_slots;
+	int num_syms, sym_capacity;
+
+	int num_links;
+	int num_flags;
+	int num_functions;
+	int num_temps;
+	int num_guards;
+	muse_boolean ok;
+} compiler_t;
+
+static int find_constant( compiler_t *c, muse_cell v )
+{
+	int i;
+
+	if ( c->const_capacity == 0 )
+		return -1;
+
+	i = (int)(((unsigned long)v * 2654435761u) & (c->const_capacity - 1));
+	while ( c->const_index[i] >= 0 )
+	{
+		if ( c->const_cells[i] == v )
+			return c->const_index[i];
+		i = (i + 1) & (c->const_capacity - 1);
+	}
+
+	return -1;
+}
+
+static void add_constant( compiler_t *c, muse_cell v, int k )
+{
+	int i;
+
+	if ( 2 * (c->num_constants + 1) > c->const_capacity )
+	{
+		muse_cell *cells = c->const_cells;
+		int *index = c->const_index;
+		int capacity = c->const_capacity;
+
+		c->const_capacity = capacity ? 2 * capacity : 256;
+		c->const_cells = (muse_cell*)calloc( c->const_capacity, sizeof(muse_cell) );
+		c->const_index = (int*)malloc( c->const_capacity * sizeof(int) );
+		memset( c->const_index, 0xff, c->const_capacity * sizeof(int) );
+
+		for ( i = 0; i < capacity; ++i )
+		{
+			if ( index[i] >= 0 )
+			{
+				int j = (int)(((unsigned long)cells[i] * 2654435761u) & (c->const_capacity - 1));
+				while ( c->const_index[j] >= 0 )
+					j = (j + 1) & (c->const_capacity - 1);
+				c->const_cells[j] = cells[i];
+				c->const_index[j] = index[i];
+			}
+		}
+
+		free( cells );
+		free( index );
+	}
+
+	i = (int)(((unsigned long)v * 2654435761u) & (c->const_capacity - 1));
+	while ( c->const_index[i] >= 0 )
+		i = (i + 1) & (c->const_capacity - 1);
+	c->const_cells[i] = v;
+	c->const_index[i] = k;
+}
+
+/**
+ * Writes the given UTF8 bytes as the contents of a C string literal.
+ */
+static void write_c_string( buffer_t *b, const char *s, size_t length )
+{
+	size_t i;
+	for ( i = 0; i < length; ++i )
+	{
+		unsigned char ch = (unsigned char)s[i];
+		if ( ch < 32 || ch >= 127 || ch == '"' || ch == '\\' || ch == '?' )
+			buffer_printf( b, "\\%03o", ch );
+		else
+			buffer_printf( b, "%c", ch );
+	}
+}
+
+static char *to_utf8( const muse_char *w, int wlen, size_t *length )
+{
+	size_t maxlen = 6 * (size_t)wlen + 1;
+	char *s = (char*)malloc( maxlen );
+	(*length) = muse_unicode_to_utf8( s, maxlen, w, wlen );
+	s[*length] = '\0';
+	return s;
+}
+
+/**
+ * Emits C code that recreates the given value when the plugin is
+ * linked and returns its index in the constants table K[], or -1
+ * if the value cannot be written out - for example, functions
+ * or other native objects created at read time.
+ */
+static int compile_constant( compiler_t *c, muse_cell v )
+{
+	muse_env *env = c->env;
+	int k = find_constant( c, v );
+
+	if ( k >= 0 )
+		return k;
+
+	if ( v == MUSE_NIL )
+	{
+		k = c->num_constants++;
+		buffer_printf( &c->constants, "\tK[%d] = MUSE_NIL;\n", k );
+	}
+	else if ( v < 0 )
+	{
+		int q = compile_constant( c, _quq(v) );
+		if ( q < 0 )
+			return -1;
+		k = c->num_constants++;
+		buffer_printf( &c->constants, "\tK[%d] = _qq(K[%d]);\n", k, q );
+	}
+	else switch ( _cellt(v) )
+	{
+		case MUSE_CONS_CELL :
+			{
+				int h = compile_constant( c, _head(v) );
+				int t = (h >= 0) ? compile_constant( c, _tail(v) ) : -1;
+				if ( t < 0 )
+					return -1;
+				k = c->num_constants++;
+				buffer_printf( &c->constants, "\tK[%d] = _cons( K[%d], K[%d] );\n", k, h, t );
+			}
+			break;
+		case MUSE_INT_CELL :
+			k = c->num_constants++;
+			if ( _ptr(v)->i == (-9223372036854775807LL - 1) )
+				buffer_printf( &c->constants, "\tK[%d] = _mk_int( -9223372036854775807LL - 1 );\n", k );
+			else
+				buffer_printf( &c->constants, "\tK[%d] = _mk_int( " MUSE_FMT_INT "LL );\n", k, _ptr(v)->i );
+			break;
+		case MUSE_FLOAT_CELL :
+			if ( !(_ptr(v)->f == _ptr(v)->f) || fabs(_ptr(v)->f) > 1e308 )
+				return -1; /* NaNs and infinities. */
+			k = c->num_constants++;
+			buffer_printf( &c->constants, "\tK[%d] = _mk_float( %a );\n", k, (double)_ptr(v)->f );
+			break;
+		case MUSE_TEXT_CELL :
+			{
+				int wlen = 0;
+				const muse_char *w = _text_contents( v, &wlen );
+				size_t length = 0;
+				char *s = to_utf8( w, wlen, &length );
+				k = c->num_constants++;
+				buffer_printf( &c->constants, "\tK[%d] = muse_compiled_text( env, \"", k );
+				write_c_string( &c->constants, s, length );
+				buffer_printf( &c->constants, "\", %d );\n", (int)length );
+				free( s );
+			}
+			break;
+		case MUSE_SYMBOL_CELL :
+			{
+				const muse_char *name = muse_symbol_name( env, v );
+				size_t length = 0;
+				char *s = NULL;
+				if ( name == NULL )
+					return -1; /* Anonymous symbols have no name to intern. */
+				s = to_utf8( name, (int)wcslen(name), &length );
+				k = c->num_constants++;
+				buffer_printf( &c->constants, "\tK[%d] = muse_csymbol_utf8( env, \"", k );
+				write_c_string( &c->constants, s, length );
+				buffer_printf( &c->constants, "\" );\n" );
+				free( s );
+			}
+			break;
+		default:
+			return -1;
+	}
+
+	buffer_printf( &c->constants, "\tmuse_compiled_keep( env, K[%d] );\n\t_unwind(sp);\n", k );
+	add_constant( c, v, k );
+	return k;
+}
+
+static int new_link( compiler_t *c, const char *format, ... )
+{
+	int slot = c->num_links++;
+	char loc[512];
+	va_list args;
+	va_start( args, format );
+	vsnprintf( loc, sizeof(loc), format, args );
+	va_end( args );
+	buffer_printf( &c->link, "\tL[%d] = %s;\n", slot, loc );
+	return slot;
+}
+
+/**
+ * Returns the link slot of the given free symbol in the
+ * function being compiled.
+ */
+static int symbol_link( compiler_t *c, muse_cell sym )
+{
+	int i, k;
+
+	for ( i = 0; i < c->num_syms; ++i )
+	{
+		if ( c->sym_cells[i] == sym )
+			return c->sym_slots[i];
+	}
+
+	k = compile_constant( c, sym );
+	if ( k < 0 )
+	{
+		c->ok = MUSE_FALSE;
+		return 0;
+	}
+
+	if ( c->num_syms == c->sym_capacity )
+	{
+		c->sym_capacity = c->sym_capacity ? 2 * c->sym_capacity : 32;
+		c->sym_cells = (muse_cell*)realloc( c->sym_cells, c->sym_capacity * sizeof(muse_cell) );
+		c->sym_slots = (int*)realloc( c->sym_slots, c->sym_capacity * sizeof(int) );
+	}
+
+	c->sym_cells[c->num_syms] = sym;
+	c->sym_slots[c->num_syms] = new_link( c, "muse_compiled_link( env, K[%d], MUSE_TRUE )", k );
+	return c->sym_slots[c->num_syms++];
+}
+
+static muse_boolean is_proper_list( muse_env *env, muse_cell list )
+{
+	while ( list > 0 && _cellt(list) == MUSE_CONS_CELL )
+		list = _tail(list);
+	return list == MUSE_NIL ? MUSE_TRUE : MUSE_FALSE;
+}
+
+static muse_boolean is_named( muse_env *env, muse_cell sym, const muse_char *name )
+{
+	const muse_char *symname = (sym > 0 && _cellt(sym) == MUSE_SYMBOL_CELL) ? muse_symbol_name(env,sym) : NULL;
+	return (symname && wcscmp( symname, name ) == 0) ? MUSE_TRUE : MUSE_FALSE;
+}
+
+static void compile_expr( compiler_t *c, muse_cell expr, int loc );
+
+/**
+ * Compiles the elements of the list at the given location
+ * separated by commas.
+ */
+static void compile_sequence( compiler_t *c, muse_cell list, int loc, const char *separator )
+{
+	muse_env *env = c->env;
+	int i = 0;
+
+	while ( list )
+	{
+		int e = new_link( c, "_head(muse_tail_n( env, L[%d], %d ))", loc, i );
+		if ( i > 0 )
+			buffer_printf( &c->body, "%s", separator );
+		compile_expr( c, _head(list), e );
+		list = _tail(list);
+		++i;
+	}
+}
+
+/**
+ * Compiles a special form whose head symbol is expected to be bound
+ * to the builtin \p fn. Returns MUSE_FALSE if \p expr isn't such a form.
+ * The flag I[] is set at link time if the head symbol indeed refers to
+ * the builtin, otherwise the generic path is taken at run time.
+ */
+static muse_boolean compile_special_form( compiler_t *c, muse_cell expr, int loc, int head_slot, const char *generic )
+{
+	muse_env *env = c->env;
+	muse_cell head = _head(expr);
+	muse_cell args = _tail(expr);
+	int flag = 0;
+
+	if ( is_named( env, head, L"quote" ) )
+	{
+		int k = compile_constant( c, args );
+		if ( k < 0 )
+		{
+			c->ok = MUSE_FALSE;
+			return MUSE_TRUE;
+		}
+		flag = c->num_flags++;
+		buffer_printf( &c->link, "\tI[%d] = muse_compiled_is( env, mc_ref(L[%d]), fn_quote );\n", flag, head_slot );
+		buffer_printf( &c->body, "(I[%d] ? K[%d] : %s)", flag, k, generic );
+		return MUSE_TRUE;
+	}
+
+	if ( !is_proper_list( env, args ) )
+		return MUSE_FALSE;
+
+	if ( is_named( env, head, L"if" ) && args && _tail(args) && !_tail(_tail(_tail(args))) )
+	{
+		int t = c->num_temps++;
+		int g = c->num_guards++;
+		int loc_args = new_link( c, "_tail(L[%d])", loc );
+		flag = c->num_flags++;
+		buffer_printf( &c->link, "\tI[%d] = muse_compiled_is( env, mc_ref(L[%d]), syntax_if );\n", flag, head_slot );
+		buffer_printf( &c->body, "(I[%d] ? (t%d = ", flag, t );
+		compile_expr( c, _head(args), new_link( c, "_head(L[%d])", loc_args ) );
+		buffer_printf( &c->body, ", g%d = muse_compiled_guard(env), muse_compiled_unguard( env, g%d, (muse_int)syntax_if, t%d ? ", g, g, t );
+		compile_expr( c, _head(_tail(args)), new_link( c, "_head(_tail(L[%d]))", loc_args ) );
+		buffer_printf( &c->body, " : " );
+		if ( _tail(_tail(args)) )
+			compile_expr( c, _head(_tail(_tail(args))), new_link( c, "_head(_tail(_tail(L[%d])))", loc_args ) );
+		else
+			buffer_printf( &c->body, "MUSE_NIL" );
+		buffer_printf( &c->body, " )) : %s)", generic );
+		return MUSE_TRUE;
+	}
+
+	if ( is_named( env, head, L"do" ) )
+	{
+		int g = c->num_guards++;
+		flag = c->num_flags++;
+		buffer_printf( &c->link, "\tI[%d] = muse_compiled_is( env, mc_ref(L[%d]), syntax_do );\n", flag, head_slot );
+		buffer_printf( &c->body, "(I[%d] ? (g%d = muse_compiled_guard(env), muse_compiled_unguard( env, g%d, 0, (", flag, g, g );
+		if ( args )
+			compile_sequence( c, args, new_link( c, "_tail(L[%d])", loc ), ", " );
+		else
+			buffer_printf( &c->body, "MUSE_NIL" );
+		buffer_printf( &c->body, ") )) : %s)", generic );
+		return MUSE_TRUE;
+	}
+
+	if ( is_named( env, head, L"and" ) || is_named( env, head, L"or" ) )
+	{
+		muse_boolean is_and = is_named( env, head, L"and" );
+		int t = c->num_temps++;
+		int loc_args = new_link( c, "_tail(L[%d])", loc );
+		int i = 0;
+		muse_cell a = args;
+		flag = c->num_flags++;
+		buffer_printf( &c->link, "\tI[%d] = muse_compiled_is( env, mc_ref(L[%d]), %s );\n", flag, head_slot, is_and ? "fn_and" : "fn_or" );
+		buffer_printf( &c->body, "(I[%d] ? ((", flag );
+		if ( !args )
+			buffer_printf( &c->body, "0" );
+		for ( ; a; a = _tail(a), ++i )
+		{
+			if ( i > 0 )
+				buffer_printf( &c->body, is_and ? " && " : " || " );
+			buffer_printf( &c->body, "(t%d = ", t );
+			compile_expr( c, _head(a), new_link( c, "_head(muse_tail_n( env, L[%d], %d ))", loc_args, i ) );
+			buffer_printf( &c->body, ") != MUSE_NIL" );
+		}
+		buffer_printf( &c->body, ") ? t%d : MUSE_NIL) : %s)", t, generic );
+		return MUSE_TRUE;
+	}
+
+	return MUSE_FALSE;
+}
+
+/**
+ * Compiles a function application. The function is evaluated first.
+ * If it evaluates its arguments, the compiled argument expressions are
+ * used. Otherwise the bind-copied source arguments are passed on unevaluated.
+ */
+static void compile_application( compiler_t *c, muse_cell expr, int loc )
+{
+	muse_env *env = c->env;
+	muse_cell head = _head(expr);
+	muse_cell args = _tail(expr);
+	muse_boolean compile_args = is_proper_list( env, args );
+	int head_slot = -1;
+	char generic[128];
+
+	if ( head > 0 && _cellt(head) == MUSE_SYMBOL_CELL )
+	{
+		muse_cell value = _symval(head);
+
+		head_slot = symbol_link( c, head );
+
+		/* Native functions that are known at compile time to take their
+		arguments unevaluated (such as let, case, fn, try ...) are always
+		handed their source arguments. */
+		if ( value != head && !muse_compiled_strict( env, value )
+			&& (_cellt(value) == MUSE_NATIVEFN_CELL || _cellt(value) == MUSE_LAMBDA_CELL) )
+			compile_args = MUSE_FALSE;
+
+		sprintf( generic, "_force(muse_apply( env, mc_ref(L[%d]), _tail(L[%d]), MUSE_FALSE, MUSE_FALSE ))", head_slot, loc );
+
+		if ( compile_special_form( c, expr, loc, head_slot, generic ) )
+			return;
+
+		if ( !compile_args )
+		{
+			buffer_printf( &c->body, "%s", generic );
+			return;
+		}
+	}
+
+	{
+		int tf = c->num_temps++;
+
+		buffer_printf( &c->body, "(t%d = ", tf );
+		if ( head_slot >= 0 )
+			buffer_printf( &c->body, "mc_ref(L[%d])", head_slot );
+		else
+			compile_expr( c, head, new_link( c, "_head(L[%d])", loc ) );
+
+		if ( compile_args )
+		{
+			int argc = 0, i;
+			int first_temp = c->num_temps;
+			int loc_args = new_link( c, "_tail(L[%d])", loc );
+			muse_cell a = args;
+
+			for ( ; a; a = _tail(a) )
+				++argc;
+			c->num_temps += argc;
+
+			buffer_printf( &c->body, ", muse_compiled_strict( env, t%d ) ? (", tf );
+			for ( i = 0, a = args; a; a = _tail(a), ++i )
+			{
+				buffer_printf( &c->body, "t%d = ", first_temp + i );
+				compile_expr( c, _head(a), new_link( c, "_head(muse_tail_n( env, L[%d], %d ))", loc_args, i ) );
+				buffer_printf( &c->body, ", " );
+			}
+			buffer_printf( &c->body, "_force(muse_apply( env, t%d, ", tf );
+			for ( i = 0; i < argc; ++i )
+				buffer_printf( &c->body, "_cons( t%d, ", first_temp + i );
+			buffer_printf( &c->body, "MUSE_NIL" );
+			for ( i = 0; i < argc; ++i )
+				buffer_printf( &c->body, " )" );
+			buffer_printf( &c->body, ", MUSE_TRUE, MUSE_FALSE ))) : " );
+		}
+		else
+		{
+			buffer_printf( &c->body, ", " );
+		}
+
+		buffer_printf( &c->body, "_force(muse_apply( env, t%d, _tail(L[%d]), MUSE_FALSE, MUSE_FALSE )))", tf, loc );
+	}
+}
+
+/**
+ * Compiles the given expression into a C expression. \p loc is the
+ * link slot which will hold the bind-copied version of the expression.
+ */
+static void compile_expr( compiler_t *c, muse_cell expr, int loc )
+{
+	if ( expr <= 0 )
+	{
+		/* () and quick-quoted values evaluate to themselves. */
+		int k = compile_constant( c, _quq(expr) );
+		if ( k < 0 )
+			c->ok = MUSE_FALSE;
+		buffer_printf( &c->body, "K[%d]", k );
+		return;
+	}
+
+	switch ( _cellt(expr) )
+	{
+		case MUSE_SYMBOL_CELL :
+			buffer_printf( &c->body, "mc_ref(L[%d])", symbol_link( c, expr ) );
+			break;
+		case MUSE_CONS_CELL :
+			compile_application( c, expr, loc );
+			break;
+		case MUSE_INT_CELL :
+		case MUSE_FLOAT_CELL :
+		case MUSE_TEXT_CELL :
+			{
+				int k = compile_constant( c, expr );
+				if ( k < 0 )
+					c->ok = MUSE_FALSE;
+				buffer_printf( &c->body, "K[%d]", k );
+			}
+			break;
+		default:
+			/* Functions and other objects created at read time. */
+			c->ok = MUSE_FALSE;
+			buffer_printf( &c->body, "MUSE_NIL" );
+	}
+}
+
+static muse_boolean is_definer( muse_env *env, muse_cell sym )
+{
+	return is_named( env, sym, L"define" ) || is_named( env, sym, L"define-extension" )
+		|| is_named( env, sym, L"define-override" ) || is_named( env, sym, L"local" );
+}
+
+/**
+ * Local definitions extend the scope of a function body beyond a single
+ * expression. Such functions are left to the interpreter.
+ */
+static muse_boolean contains_definitions( muse_env *env, muse_cell expr )
+{
+	while ( expr > 0 && _cellt(expr) == MUSE_CONS_CELL )
+	{
+		muse_cell h = _head(expr);
+		if ( h > 0 && (is_definer( env, h ) || contains_definitions( env, h )) )
+			return MUSE_TRUE;
+		expr = _tail(expr);
+	}
+	return MUSE_FALSE;
+}
+
+static muse_boolean valid_formals( muse_env *env, muse_cell formals )
+{
+	while ( formals > 0 && _cellt(formals) == MUSE_CONS_CELL )
+	{
+		muse_cell f = _head(formals);
+		if ( f <= 0 || _cellt(f) != MUSE_SYMBOL_CELL || muse_symbol_name(env,f) == NULL )
+			return MUSE_FALSE;
+		formals = _tail(formals);
+	}
+
+	return (formals == MUSE_NIL || (formals > 0 && _cellt(formals) == MUSE_SYMBOL_CELL && muse_symbol_name(env,formals)))
+		? MUSE_TRUE
+		: MUSE_FALSE;
+}
+
+/**
+ * Recognizes @code (define (name . formals) . body) @endcode and
+ * @code (define name (fn formals . body)) @endcode where formals
+ * is a list of symbols.
+ */
+static muse_boolean is_compilable_definition( muse_env *env, muse_cell form, muse_cell *name, muse_cell *formals, muse_cell *body )
+{
+	muse_cell rest, target;
+
+	if ( form <= 0 || _cellt(form) != MUSE_CONS_CELL )
+		return MUSE_FALSE;
+
+	if ( !(_head(form) > 0 && _cellt(_head(form)) == MUSE_SYMBOL_CELL && muse_compiled_is( env, _symval(_head(form)), fn_define )) )
+		return MUSE_FALSE;
+
+	rest = _tail(form);
+	if ( rest <= 0 || _cellt(rest) != MUSE_CONS_CELL )
+		return MUSE_FALSE;
+
+	target = _head(rest);
+	rest = _tail(rest);
+
+	if ( target > 0 && _cellt(target) == MUSE_CONS_CELL )
+	{
+		(*name) = _head(target);
+		(*formals) = _tail(target);
+		(*body) = rest;
+
+		if ( rest > 0 && _cellt(_head(rest)) == MUSE_CONS_CELL && _head(_head(rest)) == _builtin_symbol(MUSE_DOC) )
+			return MUSE_FALSE;
+	}
+	else if ( target > 0 && _cellt(target) == MUSE_SYMBOL_CELL && rest > 0 && _cellt(rest) == MUSE_CONS_CELL && _tail(rest) == MUSE_NIL )
+	{
+		muse_cell f = _head(rest);
+		if ( f <= 0 || _cellt(f) != MUSE_CONS_CELL || !is_proper_list( env, f ) || !_tail(f) )
+			return MUSE_FALSE;
+		if ( !(_head(f) > 0 && _cellt(_head(f)) == MUSE_SYMBOL_CELL && muse_compiled_is( env, _symval(_head(f)), syntax_lambda )) )
+			return MUSE_FALSE;
+
+		(*name) = target;
+		(*formals) = _head(_tail(f));
+		(*body) = _tail(_tail(f));
+	}
+	else
+		return MUSE_FALSE;
+
+	return ((*name) > 0 && _cellt(*name) == MUSE_SYMBOL_CELL && muse_symbol_name(env,*name)
+			&& valid_formals( env, *formals )
+			&& (*body) && is_proper_list( env, *body )
+			&& !contains_definitions( env, *body ))
+		? MUSE_TRUE
+		: MUSE_FALSE;
+}
+
+static void write_name_comment( compiler_t *c, buffer_t *b, muse_cell name )
+{
+	size_t length = 0;
+	const muse_char *w = muse_symbol_name( c->env, name );
+	char *s = to_utf8( w, (int)wcslen(w), &length );
+	size_t i;
+
+	/* Keep the comment well formed whatever the symbol looks like. */
+	for ( i = 0; i < length; ++i )
+	{
+		if ( s[i] == '*' || s[i] == '/' || (unsigned char)s[i] < 32 )
+			s[i] = '_';
+	}
+
+	buffer_printf( b, "/* %s */\n", s );
+	free( s );
+}
+
+/**
+ * Translates the given definition into a native function and
+ * its link procedure. Returns MUSE_FALSE if some part of it
+ * cannot be translated.
+ */
+static muse_boolean compile_function( compiler_t *c, muse_cell form, muse_cell name, muse_cell formals, muse_cell body )
+{
+	muse_env *env = c->env;
+	int fnum = c->num_functions;
+	int kform, kname, kbody, self, loc_body, i, argc = 0;
+	muse_cell f;
+
+	buffer_reset( &c->link );
+	buffer_reset( &c->body );
+	c->num_syms = 0;
+	c->num_temps = 0;
+	c->num_guards = 0;
+	c->ok = MUSE_TRUE;
+
+	kform = compile_constant( c, form );
+	kname = compile_constant( c, name );
+	kbody = compile_constant( c, body );
+	if ( kform < 0 || kname < 0 || kbody < 0 )
+		return MUSE_FALSE;
+
+	self = c->num_links++;
+	loc_body = new_link( c, "muse_compiled_link( env, K[%d], MUSE_FALSE )", kbody );
+
+	compile_sequence( c, body, loc_body, ",\n\t\t" );
+
+	if ( !c->ok )
+		return MUSE_FALSE;
+
+	/* The function. */
+	write_name_comment( c, &c->functions, name );
+	buffer_printf( &c->functions, "static muse_cell mc_fn_%d( muse_env *env, void *context, muse_cell args )\n{\n", fnum );
+	buffer_printf( &c->functions, "\tmc_module_t *m = (mc_module_t*)context;\n\tint sp = _spos();\n\tint bsp = _bspos();\n\tmuse_cell result;\n" );
+	for ( f = formals; f > 0 && _cellt(f) == MUSE_CONS_CELL; f = _tail(f), ++argc )
+		buffer_printf( &c->functions, "\tmuse_cell a%d = _evalnext(&args);\n", argc );
+	if ( f )
+		buffer_printf( &c->functions, "\tmuse_cell ar = muse_eval_list( env, args );\n" );
+	for ( i = 0; i < c->num_temps; ++i )
+		buffer_printf( &c->functions, "\tmuse_cell t%d;\n", i );
+	for ( i = 0; i < c->num_guards; ++i )
+		buffer_printf( &c->functions, "\tint g%d;\n", i );
+	buffer_printf( &c->functions, "\n" );
+	for ( i = 0, f = formals; f > 0 && _cellt(f) == MUSE_CONS_CELL; f = _tail(f), ++i )
+		buffer_printf( &c->functions, "\t_pushdef( K[%d], a%d );\n", compile_constant( c, _head(f) ), i );
+	if ( f )
+		buffer_printf( &c->functions, "\t_pushdef( K[%d], ar );\n", compile_constant( c, f ) );
+	buffer_printf( &c->functions,
+		"\tmuse_push_recent_scope(env);\n"
+		"\t_pushdef( _builtin_symbol(MUSE_IT), _builtin_symbol(MUSE_IT) );\n\n"
+		"\tresult = (%s);\n\n"
+		"\t_unwind_bindings(bsp);\n"
+		"\tresult = muse_pop_recent_scope( env, L[%d], result );\n"
+		"\t_unwind(sp);\n"
+		"\t_spush(result);\n"
+		"\treturn result;\n"
+		"}\n\n",
+		c->body.text, self );
+
+	/* The link procedure. The formals are anonymized while linking,
+	just like syntax_lambda does when creating a closure. */
+	buffer_printf( &c->functions, "static void mc_link_%d( muse_env *env, void *module )\n{\n\tmc_module_t *m = (mc_module_t*)module;\n\tint bsp = _bspos();\n", fnum );
+	for ( f = formals; f > 0 && _cellt(f) == MUSE_CONS_CELL; f = _tail(f) )
+		buffer_printf( &c->functions, "\t_pushdef( K[%d], K[%d] );\n", compile_constant( c, _head(f) ), compile_constant( c, _head(f) ) );
+	if ( f )
+		buffer_printf( &c->functions, "\t_pushdef( K[%d], K[%d] );\n", compile_constant( c, f ), compile_constant( c, f ) );
+	buffer_printf( &c->functions, "%s\t_unwind_bindings(bsp);\n}\n\n", c->link.text ? c->link.text : "" );
+
+	buffer_printf( &c->forms, "\t_unwind(sp);\n\tresult = L[%d] = muse_compiled_define( env, K[%d], mc_fn_%d, mc_link_%d, m, K[%d] );\n",
+				   self, kname, fnum, fnum, kform );
+
+	c->num_functions++;
+	return MUSE_TRUE;
+}
+
+static muse_boolean compile_form( compiler_t *c, muse_cell form )
+{
+	muse_env *env = c->env;
+	muse_cell name = MUSE_NIL, formals = MUSE_NIL, body = MUSE_NIL;
+
+	if ( is_compilable_definition( env, form, &name, &formals, &body )
+		 && !is_generic( env, _symval(name) )
+		 && compile_function( c, form, name, formals, body ) )
+		return MUSE_TRUE;
+
+	{
+		int k = compile_constant( c, form );
+		if ( k < 0 )
+		{
+			muse_message( env, L"compile-module",
+				L"The expression\n\t%m\ncontains objects that cannot be written out as C code.", form );
+			return MUSE_FALSE;
+		}
+
+		buffer_printf( &c->forms, "\t_unwind(sp);\n\tresult = _eval( K[%d] );\n", k );
+		return MUSE_TRUE;
+	}
+}
+
+static void write_module( compiler_t *c, FILE *out )
+{
+	fprintf( out,
+		"/* Generated by the muSE module compiler. Do not edit. */\n\n"
+		"#include \"muse_builtins.h\"\n\n"
+		"#define mc_ref(l) ((l) <= 0 ? _quq(l) : (_cellt(l) == MUSE_SYMBOL_CELL ? _symval(l) : (l)))\n\n"
+		"/* The plugin is shared by all environments that load it, so the\n"
+		"   tables are kept in a block of the loading environment. */\n"
+		"typedef struct\n{\n"
+		"\tmuse_compiled_module_t base;\n"
+		"\tmuse_cell K[%d];\n"
+		"\tmuse_cell L[%d];\n"
+		"\tmuse_boolean I[%d];\n"
+		"} mc_module_t;\n\n"
+		"#define K (m->K)\n"
+		"#define L (m->L)\n"
+		"#define I (m->I)\n\n",
+		c->num_constants + 1, c->num_links + 1, c->num_flags + 1 );
+
+	if ( c->functions.text )
+		fwrite( c->functions.text, 1, c->functions.length, out );
+
+	fprintf( out, "static void mc_init_constants( muse_env *env, mc_module_t *m )\n{\n\tint sp = _spos();\n" );
+	if ( c->constants.text )
+		fwrite( c->constants.text, 1, c->constants.length, out );
+	fprintf( out, "}\n\n" );
+
+	fprintf( out,
+		"#ifdef MUSE_PLATFORM_WINDOWS\n"
+		"__declspec(dllexport)\n"
+		"#endif\n"
+		"muse_cell muse_plugin_entry( void *module, muse_env *env, muse_cell arglist )\n"
+		"{\n"
+		"\tmc_module_t *m = (mc_module_t*)muse_compiled_module( env, sizeof(mc_module_t) );\n"
+		"\tint sp = _spos();\n"
+		"\tmuse_cell result = MUSE_NIL;\n\n"
+		"\tmc_init_constants( env, m );\n\n" );
+	if ( c->forms.text )
+		fwrite( c->forms.text, 1, c->forms.length, out );
+	fprintf( out, "\n\t_unwind(sp);\n\t_spush(result);\n\treturn result;\n}\n" );
+}
+
+/**
+ * Reads all the expressions in the given source stream and writes out
+ * C source for a plugin that has the same effect as loading the source
+ * using muse_load(). Each expression is evaluated after it is translated,
+ * so that macros defined in the module are expanded in the rest of it, just
+ * as they would be when loading the source.
+ *
+ * @return MUSE_TRUE if the whole module could be translated.
+ *
+ * @see \ref fn_compile_module "compile-module"
+ */
+MUSEAPI muse_boolean muse_compile_module( muse_env *env, FILE *in, FILE *out )
+{
+	int sp = _spos();
+	muse_boolean ok = MUSE_TRUE;
+	compiler_t c;
+	muse_port_t p = muse_assign_port( env, in, MUSE_PORT_TRUSTED_INPUT );
+	muse_port_t prevIn = muse_current_port( env, MUSE_INPUT_PORT, p );
+
+	memset( &c, 0, sizeof(c) );
+	c.env = env;
+
+	while ( port_eof(p) == 0 )
+	{
+		muse_cell expr = muse_pread(p);
+
+		if ( expr < 0 )
+			break;
+
+		_unwind(sp);
+		_spush(expr);
+
+		if ( !compile_form( &c, expr ) )
+			ok = MUSE_FALSE;
+
+		_eval(expr);
+		_unwind(sp);
+	}
+
+	muse_current_port( env, MUSE_INPUT_PORT, prevIn );
+	muse_unassign_port(p);
+
+	if ( ok )
+		write_module( &c, out );
+
+	buffer_destroy( &c.constants );
+	buffer_destroy( &c.functions );
+	buffer_destroy( &c.forms );
+	buffer_destroy( &c.link );
+	buffer_destroy( &c.body );
+	free( c.const_cells );
+	free( c.const_index );
+	free( c.sym_cells );
+	free( c.sym_slots );
+
+	return ok;
+}
+
+/**
+ * @code (compile-module "source.scm" "output.c") @endcode
+ *
+ * Translates the given muSE source file into C source for a plugin.
+ * Build the output as a shared library against the muSE headers and
+ * load it using \ref fn_load_plugin "load-plugin" in place of the
+ * source file. The build/posix/muse-compile script does both steps.
+ *
+ * Evaluates to \c T on success and \c () if the source couldn't
+ * be read or contains expressions that can't be written out as C code.
+ *
+ * @see muse_compile_module()
+ */
+muse_cell fn_compile_module( muse_env *env, void *context, muse_cell args )
+{
+	muse_cell source = _evalnext(&args);
+	muse_cell output = _evalnext(&args);
+	FILE *in = muse_fopen( _text_contents( source, NULL ), L"rb" );
+	FILE *out = NULL;
+	muse_boolean ok = MUSE_FALSE;
+
+	if ( in == NULL )
+	{
+		MUSE_DIAGNOSTICS({
+			muse_message( env, L"(compile-module >>source<< output)", L"The file [%m] doesn't exist!", source );
+		});
+		return MUSE_NIL;
+	}
+
+	out = muse_fopen( _text_contents( output, NULL ), L"wb" );
+	if ( out == NULL )
+	{
+		fclose( in );
+		MUSE_DIAGNOSTICS({
+			muse_message( env, L"(compile-module source >>output<<)", L"Couldn't open [%m] for writing.", output );
+		});
+		return MUSE_NIL;
+	}
+
+	{
+		int source_pos = 0;
+		if ( muSEexec_check( in, &source_pos, NULL, NULL ) )
+			fseek( in, source_pos, SEEK_SET );
+		else
+			fseek( in, 0, SEEK_SET );
+	}
+
+	ok = muse_compile_module( env, in, out );
+	fclose( in );
+	fclose( out );
+
+	return ok ? _t() : MUSE_NIL;
+}
+
+/*@}*/
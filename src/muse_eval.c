@@ -52,6 +52,10 @@ MUSEAPI muse_cell muse_eval( muse_env *env, muse_cell sexpr, muse_boolean lazy )
 			/* Symbol evaluation */
 			return _symval(sexpr);
 		case MUSE_CONS_CELL		:
+			/* Local variable of a lexically addressed function. */
+			if ( _head(sexpr) == env->builtin_symbols[MUSE_LEXICAL_REF] )
+				return *_lexical_slot( _ptr(_tail(sexpr))->i );
+
 			/* Function application */
 			{
 				muse_cell result = muse_apply( env, _eval(_head(sexpr)), _tail(sexpr), MUSE_FALSE, lazy );
@@ -124,7 +128,19 @@ muse_cell muse_apply_nativefn( muse_env *env, muse_cell fn, muse_cell args )
 {
 	register muse_nativefn_cell *f = &_ptr(fn)->fn;
 	muse_assert( f->fn != NULL );
-	return f->fn( env, f->context, args );
+
+	if ( env->call_profile == NULL )
+		return f->fn( env, f->context, args );
+	else
+	{
+		muse_call_profile_frame_t frame;
+		muse_cell result;
+
+		muse_call_profile_enter( env, fn, &frame );
+		result = f->fn( env, f->context, args );
+		muse_call_profile_leave( env, &frame );
+		return result;
+	}
 }
 
 /**
@@ -275,19 +291,156 @@ MUSEAPI muse_boolean muse_bind_formals( muse_env *env, muse_cell formals, muse_c
 muse_cell syntax_lambda( muse_env *env, void *context, muse_cell args );
 
 /**
- * Applies the given function specification to the
- * given argument list and returns whatever the function
- * returns. The function *must* be a lambda function
- * and not a C-native function. The formal argument
- * list of the function is bound to the given
- * argument list and the body of the function is
- * invoked. The formals are unbound after the function
- * completes and the result of evaluating the body
- * is returned.
- * 
- * @see syntax_lambda
+ * Pushes the local variables of a lexically addressed function
+ * onto the stack. The \p spec is of the form <tt>(num-slots . formals)</tt>
+ * where the formals are a list of symbols, possibly ending with
+ * a rest symbol. The first slots hold the arguments and the rest
+ * are for the function's \c let variables.
+ *
+ * If \p bind_args is MUSE_FALSE, the formals have already been bound
+ * by the caller - as happens when the function is a case of a generic -
+ * and their values are taken from the symbols.
  */
-muse_cell muse_apply_lambda( muse_env *env, muse_cell fn, muse_cell args )
+int muse_enter_lexical_frame( muse_env *env, muse_cell spec, muse_cell args, muse_boolean bind_args )
+{
+	muse_process_frame_t *p = env->current_process;
+	muse_stack *s = &p->stack;
+	int sp = _spos();
+	int num_slots = (int)_ptr(_head(spec))->i;
+	muse_cell formals = _tail(spec);
+
+	if ( sp + num_slots > s->size )
+		grow_stack( env, s, sp + num_slots, env->parameters[MUSE_STACK_SIZE] );
+	muse_assert( sp + num_slots <= s->size );
+
+	if ( bind_args )
+	{
+		/* Check the argument count and force any lazy parts of the
+		argument list first, so that nothing gets evaluated while the
+		frame is being pushed. Arguments are rarely lazy. */
+		muse_cell f = formals, a;
+
+		if ( _cellt(args) == MUSE_LAZY_CELL )
+			args = _force(args);
+
+		for ( a = args; f && _cellt(f) == MUSE_CONS_CELL; f = _tail(f) )
+		{
+			if ( !a || _cellt(a) != MUSE_CONS_CELL )
+			{
+				_unwind(sp);
+				return -1;
+			}
+
+			if ( _cellt(_head(a)) == MUSE_LAZY_CELL )
+				muse_head(env,a);
+
+			a = (_cellt(_tail(a)) == MUSE_LAZY_CELL) ? muse_tail(env,a) : _tail(a);
+		}
+
+		if ( a && !f )
+		{
+			_unwind(sp);
+			return -1;
+		}
+	}
+
+	for ( ; formals && _cellt(formals) == MUSE_CONS_CELL; formals = _tail(formals) )
+	{
+		if ( bind_args )
+		{
+			*(s->top++) = _head(args);
+			args = _tail(args);
+		}
+		else
+			*(s->top++) = _symval(_head(formals));
+	}
+
+	if ( formals )
+		*(s->top++) = bind_args ? args : _symval(formals);
+
+	while ( s->top - s->bottom < sp + num_slots )
+		*(s->top++) = MUSE_NIL;
+
+	{
+		int prev_frame = p->lexical_frame;
+		p->lexical_frame = sp;
+		return prev_frame;
+	}
+}
+
+muse_cell muse_leave_lexical_frame( muse_env *env, int sp, int prev_frame, muse_cell result )
+{
+	env->current_process->lexical_frame = prev_frame;
+	_unwind(sp);
+	_spush(result);
+	return result;
+}
+
+/**
+ * Returns the frame expression <tt>({{frame}} spec . body)</tt> if
+ * the given function was lexically addressed by \ref syntax_lambda
+ * and MUSE_NIL otherwise.
+ */
+static inline muse_cell lexical_frame_of( muse_env *env, muse_cell fn )
+{
+	muse_cell body = _tail(_tail(fn));
+
+	if ( body > 0 && _tail(body) == MUSE_NIL )
+	{
+		muse_cell e = _head(body);
+		if ( e > 0 && _cellt(e) == MUSE_CONS_CELL && _head(e) == env->builtin_symbols[MUSE_LEXICAL_FRAME] )
+			return e;
+	}
+
+	return MUSE_NIL;
+}
+
+/**
+ * Same as muse_apply_lambda, except that the arguments go into
+ * the function's frame instead of being bound to the formals.
+ */
+static muse_cell apply_lexical_lambda( muse_env *env, muse_cell fn, muse_cell frame, muse_cell args )
+{
+	int sp = _spos();
+	int bsp = _bspos();
+	muse_boolean trace = env->parameters[MUSE_ENABLE_TRACE];
+	int prev_frame;
+
+	if ( trace ) muse_trace_push( env, NULL, fn, args );
+
+	prev_frame = muse_enter_lexical_frame( env, _head(_tail(frame)), args, MUSE_TRUE );
+
+	if ( prev_frame >= 0 )
+	{
+		muse_push_recent_scope(env);
+		_pushdef( _builtin_symbol(MUSE_IT), _builtin_symbol(MUSE_IT) );
+
+		{
+			muse_cell result = _do( _tail(_tail(frame)) );
+
+			_unwind_bindings(bsp);
+			muse_leave_lexical_frame( env, sp, prev_frame, result );
+
+			if ( trace ) muse_trace_pop(env);
+			return muse_pop_recent_scope( env, fn, result );
+		}
+	}
+	else
+	{
+		MUSE_DIAGNOSTICS({
+			muse_message(	env, L"Function application",
+							L"The given arguments\n\t%m\n"
+							L"do not match the function's argument specification\n\t%m",
+							args,
+							_head(fn) );
+		});
+
+		muse_trace_pop(env);
+		return MUSE_NIL;
+	}
+}
+
+static muse_cell apply_lambda( muse_env *env, muse_cell fn, muse_cell args )
 {
 	/* The formals list could be quick quoted to indicate that
 	the arguments must not be evaluated - i.e. the function is
@@ -300,6 +453,12 @@ muse_cell muse_apply_lambda( muse_env *env, muse_cell fn, muse_cell args )
 	int bsp = _bspos();
 	muse_boolean trace = env->parameters[MUSE_ENABLE_TRACE];
 
+	{
+		muse_cell frame = lexical_frame_of( env, fn );
+		if ( frame )
+			return apply_lexical_lambda( env, fn, frame, args );
+	}
+
 	if ( trace ) muse_trace_push( env, NULL, fn, args );
 
 	/* Bind all formal parameters. If binding failed, return MUSE_NIL. */
@@ -341,6 +500,35 @@ muse_cell muse_apply_lambda( muse_env *env, muse_cell fn, muse_cell args )
 	}
 }
 
+/**
+ * Applies the given function specification to the
+ * given argument list and returns whatever the function
+ * returns. The function *must* be a lambda function
+ * and not a C-native function. The formal argument
+ * list of the function is bound to the given
+ * argument list and the body of the function is
+ * invoked. The formals are unbound after the function
+ * completes and the result of evaluating the body
+ * is returned.
+ * 
+ * @see syntax_lambda
+ */
+muse_cell muse_apply_lambda( muse_env *env, muse_cell fn, muse_cell args )
+{
+	if ( env->call_profile == NULL )
+		return apply_lambda( env, fn, args );
+	else
+	{
+		muse_call_profile_frame_t frame;
+		muse_cell result;
+
+		muse_call_profile_enter( env, fn, &frame );
+		result = apply_lambda( env, fn, args );
+		muse_call_profile_leave( env, &frame );
+		return result;
+	}
+}
+
 /**
  * Quick quoting a cell is used as an efficient means
  * to pass expressions that have already been evaluated.
@@ -401,7 +589,7 @@ static inline int intmin( int m, int n )
 MUSEAPI muse_cell muse_apply( muse_env *env, muse_cell fn, muse_cell args, muse_boolean args_already_evaluated, muse_boolean lazy )
 {
 	/* Check whether we've devoted enough attention to this process. */
-	yield_process(env,1);
+	_yield(1);
 
 	{
 		int sp = _spos();
@@ -0,0 +1,409 @@
+/**
+ * @file muse_flight_recorder.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * Implements the flight recorder - a small ring of the most recent
+ * notable events in an environment, such as garbage collections, heap
+ * growth, process creation and exit, raised exceptions and processes
+ * that hold on to the CPU for long. The recorder is always on. Its
+ * contents are dumped along with the stack traces of all processes
+ * when an assertion fails, on SIGUSR1 and on fatal signals, so that
+ * there is some context to go by when a muSE process hangs or dies.
+ * SIGUSR1 only asks for a dump, which is written at the next function
+ * application or process switch, where it is safe to do so.
+ *
+ * The dump goes to the file named by the \c MUSE_FLIGHT_RECORDER_FILE
+ * environment variable if it is set, and to stderr otherwise.
+ */
+
+#include "muse_opcodes.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(MUSE_PLATFORM_POSIX)
+#include <signal.h>
+#define MUSE_FLIGHT_RECORDER_SIGNALS_AVAILABLE 1
+#endif
+
+enum
+{
+	MUSE_FLIGHT_REPORT_CHARS	= 8192
+};
+
+/**
+ * Records an event. \p format is a printf format that takes up to
+ * two integers, \p a and \p b, and must be a string constant
+ * since only the pointer is kept. Recording amounts to a few
+ * stores and reading the clock.
+ */
+void muse_flight_record( muse_env *env, const char *format, muse_int a, muse_int b )
+{
+	muse_flight_recorder_t *fr = env->flight_recorder;
+	if ( fr )
+	{
+		muse_flight_event_t *e = fr->events + ((fr->next++) & (MUSE_FLIGHT_RECORDER_SIZE-1));
+		e->ts_us = muse_elapsed_us(env->timer);
+		e->format = format;
+		e->process = env->current_process ? _celli( process_id(env->current_process) ) : 0;
+		e->a = a;
+		e->b = b;
+		e->symbol = MUSE_NIL;
+	}
+}
+
+/**
+ * Same as muse_flight_record(), but also records a symbol
+ * whose name is written after the event.
+ */
+void muse_flight_record_symbol( muse_env *env, const char *format, muse_cell symbol )
+{
+	muse_flight_recorder_t *fr = env->flight_recorder;
+	muse_flight_record( env, format, 0, 0 );
+	if ( fr && symbol > 0 && _cellt(symbol) == MUSE_SYMBOL_CELL )
+		fr->events[(fr->next-1) & (MUSE_FLIGHT_RECORDER_SIZE-1)].symbol = symbol;
+}
+
+/**
+ * Keeps the symbols of recorded events from being collected.
+ */
+void muse_mark_flight_recorder( muse_env *env )
+{
+	muse_flight_recorder_t *fr = env->flight_recorder;
+	int i;
+
+	if ( fr )
+	{
+		for ( i = 0; i < MUSE_FLIGHT_RECORDER_SIZE; ++i )
+			muse_mark( env, fr->events[i].symbol );
+	}
+}
+
+static void dump_events( muse_env *env, FILE *f )
+{
+	muse_flight_recorder_t *fr = env->flight_recorder;
+	unsigned int i = (fr->next > MUSE_FLIGHT_RECORDER_SIZE) ? fr->next - MUSE_FLIGHT_RECORDER_SIZE : 0;
+
+	fprintf( f, "--- last %u events ---\n", fr->next - i );
+
+	for ( ; i < fr->next; ++i )
+	{
+		muse_flight_event_t *e = fr->events + (i & (MUSE_FLIGHT_RECORDER_SIZE-1));
+
+		fprintf( f, "[" MUSE_FMT_INT " us] process %d: ", e->ts_us, e->process );
+		fprintf( f, e->format, e->a, e->b );
+
+		if ( e->symbol )
+		{
+			const muse_char *name = muse_symbol_name( env, e->symbol );
+			char buffer[256];
+			muse_unicode_to_utf8( buffer, sizeof(buffer), name, wcslen(name) );
+			fprintf( f, " %s", buffer );
+		}
+
+		fputc( '\n', f );
+	}
+}
+
+static void dump_traces( muse_env *env, FILE *f )
+{
+	muse_process_frame_t *cp = env->current_process;
+	muse_process_frame_t *p = cp;
+	muse_char *report = (muse_char*)calloc( MUSE_FLIGHT_REPORT_CHARS, sizeof(muse_char) );
+	char *utf8 = (char*)calloc( MUSE_FLIGHT_REPORT_CHARS * 3, 1 );
+
+	if ( report == NULL || utf8 == NULL || p == NULL )
+	{
+		free( report );
+		free( utf8 );
+		return;
+	}
+
+	do
+	{
+		size_t n;
+
+		/* The trace report is that of the current process. */
+		env->current_process = p;
+		n = muse_trace_report( env, MUSE_FLIGHT_REPORT_CHARS - 1, report );
+		env->current_process = cp;
+
+		muse_unicode_to_utf8( utf8, MUSE_FLIGHT_REPORT_CHARS * 3, report, n );
+		fprintf( f, "--- process %d%s ---%s\n", (int)_celli( process_id(p) ), (p == cp) ? " (running)" : "", utf8 );
+
+		p = p->next;
+	}
+	while ( p && p != cp );
+
+	free( report );
+	free( utf8 );
+}
+
+/**
+ * Writes the recorded events and the stack traces of all
+ * processes, giving \p reason as the cause of the dump.
+ */
+MUSEAPI void muse_flight_recorder_dump( muse_env *env, const char *reason )
+{
+	const char *path = getenv( "MUSE_FLIGHT_RECORDER_FILE" );
+	FILE *f = path ? fopen( path, "a" ) : NULL;
+
+	/* A crash while dumping shouldn't dump again. */
+	if ( env == NULL || env->flight_recorder == NULL || env->flight_recorder->dumping )
+	{
+		if ( f ) fclose( f );
+		return;
+	}
+
+	env->flight_recorder->dumping = 1;
+
+	if ( f == NULL )
+		f = stderr;
+
+	fprintf( f, "\n=== muSE flight recorder: %s at " MUSE_FMT_INT " us ===\n", reason, muse_elapsed_us(env->timer) );
+	dump_events( env, f );
+	fflush( f );
+	dump_traces( env, f );
+	fprintf( f, "=== end of flight recorder dump ===\n" );
+	fflush( f );
+
+	if ( f != stderr )
+		fclose( f );
+
+	env->flight_recorder->dumping = 0;
+}
+
+/**
+ * Dumps the flight recorder when the process is about to die.
+ * An assertion failure aborts, so this makes sure that the
+ * SIGABRT that follows doesn't dump a second time.
+ */
+void muse_flight_recorder_crash( muse_env *env, const char *reason )
+{
+	if ( env && env->flight_recorder && !env->flight_recorder->crashed )
+	{
+		env->flight_recorder->crashed = 1;
+		muse_flight_recorder_dump( env, reason );
+	}
+}
+
+#ifdef MUSE_FLIGHT_RECORDER_SIGNALS_AVAILABLE
+static const int k_fatal_signals[] = { SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT };
+enum { NUM_FATAL_SIGNALS = sizeof(k_fatal_signals) / sizeof(k_fatal_signals[0]) };
+
+/**
+ * Signals are process wide, so only the first environment
+ * to be created with MUSE_FLIGHT_RECORDER_SIGNALS gets dumped.
+ * Environments can be created and destroyed on several threads
+ * at once, so the handlers are claimed and given back with a
+ * compare-and-swap. Only the signal handler reads this variable
+ * directly - an environment looks at its own \c owns_signals.
+ */
+static muse_env * volatile g_flight_env = NULL;
+static struct sigaction g_prev_usr1;
+static struct sigaction g_prev_fatal[NUM_FATAL_SIGNALS];
+
+/**
+ * Set by SIGUSR1. Writing the dump takes stdio, the heap and the
+ * process ring, none of which can be touched in a signal handler,
+ * so it is left to muse_flight_recorder_poll().
+ */
+static volatile sig_atomic_t g_dump_requested = 0;
+
+/**
+ * Fatal signals are handled on a stack of their own, since
+ * overflowing the C stack of a process faults on its guard page
+ * and leaves no room there to run the handler. Alternate signal
+ * stacks belong to threads, so each thread that creates environments
+ * gets one, which the environments created on it share.
+ */
+enum { MUSE_FLIGHT_SIGNAL_STACK_SIZE = 65536 };
+
+typedef struct
+{
+	stack_t stack;
+	int users;		/**< The environments using the stack. */
+} signal_stack_t;
+
+static MUSE_THREAD_LOCAL signal_stack_t t_signal_stack;
+
+static void acquire_signal_stack( muse_env *env )
+{
+	signal_stack_t *s = &t_signal_stack;
+
+	if ( s->users == 0 )
+	{
+		stack_t current;
+
+		/* Leave a stack that the host set up for the thread alone. */
+		if ( sigaltstack( NULL, &current ) != 0 || !(current.ss_flags & SS_DISABLE) )
+			return;
+
+		s->stack.ss_sp = malloc( MUSE_FLIGHT_SIGNAL_STACK_SIZE );
+		s->stack.ss_size = MUSE_FLIGHT_SIGNAL_STACK_SIZE;
+		s->stack.ss_flags = 0;
+		if ( s->stack.ss_sp == NULL || sigaltstack( &s->stack, NULL ) != 0 )
+		{
+			free( s->stack.ss_sp );
+			s->stack.ss_sp = NULL;
+			return;
+		}
+	}
+
+	++(s->users);
+	env->flight_recorder->signal_stack = s;
+}
+
+static void release_signal_stack( muse_env *env )
+{
+	signal_stack_t *s = (signal_stack_t*)env->flight_recorder->signal_stack;
+
+	env->flight_recorder->signal_stack = NULL;
+
+	/* Only the thread that installed the stack can take it down. If the
+	environment is destroyed on another thread, the stack stays. */
+	if ( s == NULL || s != &t_signal_stack )
+		return;
+
+	if ( --(s->users) == 0 )
+	{
+		stack_t disable;
+		memset( &disable, 0, sizeof(disable) );
+		disable.ss_flags = SS_DISABLE;
+		sigaltstack( &disable, NULL );
+		free( s->stack.ss_sp );
+		s->stack.ss_sp = NULL;
+	}
+}
+
+static void flight_recorder_signal( int sig )
+{
+	int i;
+
+	if ( sig == SIGUSR1 )
+	{
+		muse_env *env = g_flight_env;
+
+		/* The environment looks at its preemption flag at every
+		function application, so that is where the dump happens. */
+		g_dump_requested = 1;
+		if ( env )
+			env->preempt_requested = 1;
+		return;
+	}
+
+	/* The process is about to die, so the dump is written right here
+	even though that isn't safe in general. It is the last chance. */
+
+	for ( i = 0; i < NUM_FATAL_SIGNALS; ++i )
+	{
+		if ( k_fatal_signals[i] == sig )
+		{
+			char reason[32];
+			sprintf( reason, "fatal signal %d", sig );
+			muse_flight_recorder_crash( g_flight_env, reason );
+
+			/* Let whatever handled the signal before have it. */
+			sigaction( sig, g_prev_fatal + i, NULL );
+			raise( sig );
+			return;
+		}
+	}
+}
+
+static void install_signal_handlers( muse_env *env )
+{
+	struct sigaction sa;
+	int i;
+
+	if ( !muse_atomic_cas_ptr( &g_flight_env, NULL, env ) )
+		return;
+
+	env->flight_recorder->owns_signals = MUSE_TRUE;
+
+	memset( &sa, 0, sizeof(sa) );
+	sa.sa_handler = flight_recorder_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset( &sa.sa_mask );
+
+	sigaction( SIGUSR1, &sa, &g_prev_usr1 );
+
+	/* Threads without an alternate stack run the handler on their own. */
+	sa.sa_flags |= SA_ONSTACK;
+	for ( i = 0; i < NUM_FATAL_SIGNALS; ++i )
+		sigaction( k_fatal_signals[i], &sa, g_prev_fatal + i );
+}
+
+static void remove_signal_handlers( muse_env *env )
+{
+	int i;
+
+	if ( !env->flight_recorder->owns_signals )
+		return;
+
+	sigaction( SIGUSR1, &g_prev_usr1, NULL );
+	for ( i = 0; i < NUM_FATAL_SIGNALS; ++i )
+		sigaction( k_fatal_signals[i], g_prev_fatal + i, NULL );
+
+	/* The swap publishes the restored state to the next claimant. */
+	env->flight_recorder->owns_signals = MUSE_FALSE;
+	muse_atomic_cas_ptr( &g_flight_env, env, NULL );
+}
+#else
+static void acquire_signal_stack( muse_env *env )
+{
+}
+
+static void release_signal_stack( muse_env *env )
+{
+}
+
+static void install_signal_handlers( muse_env *env )
+{
+}
+
+static void remove_signal_handlers( muse_env *env )
+{
+}
+#endif
+
+/**
+ * Writes the dump that SIGUSR1 asked for, if any. Called at safe
+ * points - function applications and process switches.
+ */
+void muse_flight_recorder_poll( muse_env *env )
+{
+#ifdef MUSE_FLIGHT_RECORDER_SIGNALS_AVAILABLE
+	if ( g_dump_requested && env->flight_recorder->owns_signals )
+	{
+		g_dump_requested = 0;
+		muse_flight_recorder_dump( env, "SIGUSR1" );
+	}
+#endif
+}
+
+void muse_init_flight_recorder( muse_env *env )
+{
+	env->flight_recorder = (muse_flight_recorder_t*)calloc( 1, sizeof(muse_flight_recorder_t) );
+
+	/* The handlers are process wide, so they can be run on the thread of
+	any environment, including one that doesn't have them installed. */
+	acquire_signal_stack( env );
+
+	if ( env->parameters[MUSE_FLIGHT_RECORDER_SIGNALS] )
+		install_signal_handlers( env );
+}
+
+void muse_destroy_flight_recorder( muse_env *env )
+{
+	remove_signal_handlers( env );
+	release_signal_stack( env );
+	free( env->flight_recorder );
+	env->flight_recorder = NULL;
+}
@@ -21,6 +21,7 @@
 #include <windows.h>
 #else
 #include <sys/time.h>
+#include <errno.h>
 #endif
 
 #include "muse_port.h"
@@ -171,7 +172,11 @@ MUSEAPI void muse_sleep( muse_int time_us )
 	Sleep( (DWORD)(time_us / 1000) );
 #else
 	struct timeval tv = { (time_t)(time_us / 1000000), (suseconds_t)(time_us % 1000000) };
-	select( 1, NULL, NULL, NULL, &tv );
+
+	/* The preemption timer may interrupt the wait. Linux leaves 
+	the remaining time in tv in that case. */
+	while ( select( 1, NULL, NULL, NULL, &tv ) < 0 && errno == EINTR && (tv.tv_sec > 0 || tv.tv_usec > 0) )
+		;
 #endif
 }
 
@@ -329,6 +334,9 @@ MUSEAPI void muse_assert_failed( void *_env, const char *file, int line, const c
 	}
 	port_putc( '\n', out );
 	port_putc( '\n', out );
+	port_flush( out );
+
+	muse_flight_recorder_crash( env, "assertion failed" );
 
 	assert(0);
 }
@@ -584,7 +592,7 @@ static size_t muse_vsprintf( muse_env *env, muse_char *buffer, size_t maxlen, co
 					#ifdef MUSE_PLATFORM_WIN32
 					localtime_s( &_tm, &t );
 					#else
-					_tm = *localtime(&t);
+					localtime_r( &t, &_tm );
 					#endif
 					len += wcsftime( buffer+len, maxlen-len, L"%Y-%m-%d %H:%M:%S", &_tm );
 				}
@@ -815,34 +823,24 @@ MUSEAPI muse_cell muse_similar_symbol( muse_env *env, muse_cell symbol, int *out
 	/* Traverse the symbol table and find the symbol that is
 	not the given symbol, but is the least edit distance from it. */
 
-	muse_stack symbols = env->symbol_stack;
+	muse_cell *syms = env->symbol_stack.bottom;
+	muse_cell *syms_end = env->symbol_stack.top;
 
-	int i;
-	for ( i = 0; i < symbols.size; ++i )
+	for ( ; syms < syms_end; ++syms )
 	{
-		muse_cell symlist = symbols.bottom[i];
-
-		/* Each entry in the symbols hash table is a list of symbols.
-		So traverse the list and examine each symbol. */
+		muse_cell s2 = *syms;
+		const muse_char *s2name = s2 ? muse_symbol_name(env,s2) : NULL;
 
-		while ( symlist )
+		/* Don't consider comparing the symbol with itself.
+		Ignore operators and special symbols. */
+		if ( s2name && s2 != symbol && isalpha(s2name[0]) && (predicate ? predicate(env,context,s2) : MUSE_TRUE) )
 		{
-			muse_cell s2 = _head(symlist);
-			const muse_char *s2name = muse_symbol_name(env,s2);
-
-			/* Don't consider comparing the symbol with itself.
-			Ignore operators and special symbols. */
-			if ( s2 != symbol && isalpha(s2name[0]) && (predicate ? predicate(env,context,s2) : MUSE_TRUE) )
+			int d = (int)levenshtein_distance( s1, s2name );
+			if ( d < distance )
 			{
-				int d = (int)levenshtein_distance( s1, s2name );
-				if ( d < distance )
-				{
-					result = s2;
-					distance = d;
-				}
+				result = s2;
+				distance = d;
 			}
-
-			symlist = _tail(symlist);
 		}
 	}
 
@@ -868,19 +866,12 @@ MUSEAPI muse_cell muse_symbol_with_value( muse_env *env, muse_cell value )
 	/* Traverse the symbol table and find the symbol that
 	has the given cell as its value. */
 
-	muse_stack symbols = env->symbol_stack;
-	int i;
-	for ( i = 0; i < symbols.size; ++i )
+	muse_cell *syms = env->symbol_stack.bottom;
+	muse_cell *syms_end = env->symbol_stack.top;
+	for ( ; syms < syms_end; ++syms )
 	{
-		muse_cell symlist = symbols.bottom[i];
-		
-		while ( symlist )
-		{
-			muse_cell sym = _next(&symlist);
-
-			if ( _symval(sym) == value ) /* Value found. */
-				return sym;
-		}
+		if ( *syms && _symval(*syms) == value ) /* Value found. */
+			return *syms;
 	}
 
 	return MUSE_NIL;
@@ -16,6 +16,7 @@
 #ifndef __MUSE_H__
 #include "muse.h"
 #endif
+#include <limits.h>
 
 BEGIN_MUSE_C_FUNCTIONS
 
@@ -96,6 +97,32 @@ typedef struct
 							the next cell pushed on top of the stack. */
 } muse_stack;
 
+void grow_stack( muse_env *env, muse_stack *s, int min_size, int max_size );
+
+/**
+ * An entry of the symbol table's name index.
+ */
+typedef struct
+{
+	muse_int hash;		/**< Hash of the symbol's name. */
+	int length;			/**< Length of the name in characters. */
+	int gc_epoch;		/**< The heap's gc_epoch when the symbol was last looked up. */
+	muse_cell symbol;	/**< The interned symbol, or MUSE_NIL for a free slot. */
+} muse_symbol_entry_t;
+
+/**
+ * The symbol table's name index is an open addressing hash
+ * table that lives outside the heap. It is doubled in size
+ * whenever it gets 3/4 full, so the number of symbols is not
+ * limited by the initial capacity.
+ */
+typedef struct
+{
+	int capacity;					/**< Always a power of 2. */
+	int count;						/**< Number of occupied entries. */
+	muse_symbol_entry_t *entries;
+} muse_symbol_index_t;
+
 /**
  * The muse heap is an array of cells where the cells available
  * for allocation are collected into a free list.
@@ -113,6 +140,8 @@ typedef struct
 	long int				free_cell_count; /**< The number of free cells. This is used nearly
 											only for diagnostic purposes. May be removed in the
 											future for efficiency reasons. */
+	muse_int			cells_taken;	/**< The number of cells ever taken from the free list. */
+	int					gc_epoch;		/**< The number of garbage collections so far. */
 	unsigned char		*keep;		/**< The keep vector is a set of marks for cells that
 										 must always survive garbage collection. You set a 
 										 mark in the keep vector by calling muse_mark() on
@@ -142,6 +171,48 @@ typedef struct
 	muse_trace_t *data;
 } muse_traceinfo_t;
 
+/**
+ * The profiled calls that a process has in progress, innermost last,
+ * and how many of them each entry of the call profile has, so that
+ * only the outermost of recursive calls counts towards the inclusive
+ * time. Belongs to the call profile of the given \p generation.
+ */
+typedef struct
+{
+	int generation;
+	int depth, max_depth;
+	int *stats;
+	int num_active;
+	int *active;
+} muse_call_profile_calls_t;
+
+/**
+ * An entry of the flight recorder. The event is described
+ * by the printf format applied to \p a and \p b.
+ *
+ * @see muse_flight_record()
+ */
+typedef struct
+{
+	muse_int	ts_us;
+	const char	*format;
+	int			process;
+	muse_int	a, b;
+	muse_cell	symbol;
+} muse_flight_event_t;
+
+enum { MUSE_FLIGHT_RECORDER_SIZE = 256 }; /**< Must be a power of 2. */
+
+typedef struct
+{
+	unsigned int		next;
+	muse_boolean		owns_signals;	/**< Whether this environment's handlers are installed. */
+	void				*signal_stack;	/**< The alternate signal stack of the thread that created the environment. */
+	volatile int		dumping;		/**< Set while a dump is being written. */
+	volatile int		crashed;		/**< Set once the dump of a crash has been written. */
+	muse_flight_event_t	events[MUSE_FLIGHT_RECORDER_SIZE];
+} muse_flight_recorder_t;
+
 typedef enum
 {
 	MUSE_PROCESS_DEAD			= 0x0,
@@ -149,9 +220,87 @@ typedef enum
 	MUSE_PROCESS_PAUSED			= 0x2,
 	MUSE_PROCESS_RUNNING		= 0x4,
 	MUSE_PROCESS_WAITING		= 0x8,
-	MUSE_PROCESS_HAS_TIMEOUT	= 0x10
+	MUSE_PROCESS_HAS_TIMEOUT	= 0x10,
+	MUSE_PROCESS_WAITING_IO		= 0x20,	/**< Waiting for a socket. Messages don't wake it up. */
+	MUSE_PROCESS_WAITING_ROOM	= 0x40,	/**< Waiting for room in a full mailbox. Messages don't wake it up. */
+	MUSE_PROCESS_WAITING_MESSAGE = 0x80	/**< Waiting in \ref fn_receive "receive". */
 } muse_process_state_bits_t;
 
+/**
+ * Scheduling priorities of processes. A runnable process always
+ * runs before the runnable processes of lower priority. Processes
+ * of the same priority take turns.
+ */
+typedef enum
+{
+	MUSE_PRIORITY_HIGH		= 0,
+	MUSE_PRIORITY_NORMAL	= 1,
+	MUSE_PRIORITY_LOW		= 2,
+	MUSE_NUM_PRIORITIES		= 3
+} muse_priority_t;
+
+typedef enum
+{
+	MUSE_TIMER_WAKEUP,			/**< Ends a timed wait of the process. */
+	MUSE_TIMER_EVAL_TIMEOUT		/**< Makes the process check its \ref fn_with_timeout_us "with-timeout-us" blocks. */
+} muse_timer_kind_t;
+
+/**
+ * A deadline registered with the environment's timer heap.
+ */
+typedef struct
+{
+	muse_int	due_us;		///< When the timer expires, on the environment's timer.
+	int			index;		///< The timer's position in the heap, or -1 if it isn't set.
+	int			kind;		///< One of muse_timer_kind_t.
+	struct _muse_process_frame_t *process; ///< The process the timer acts on.
+} muse_timer_t;
+
+/**
+ * A binary min-heap of the timers that are set, ordered by
+ * their due times. Only expired timers get visited, and the
+ * earliest deadline is always the first entry.
+ */
+typedef struct
+{
+	int				count, capacity;
+	muse_timer_t	**timers;
+} muse_timer_heap_t;
+
+/**
+ * A doubly linked queue of processes, linked through
+ * the processes' \c queue_next and \c queue_prev fields.
+ */
+typedef struct
+{
+	struct _muse_process_frame_t *head, *tail;
+} muse_process_queue_t;
+
+/**
+ * The messages in a mailbox from one sender, oldest first. 
+ * \c first and \c last are entries of the mailbox list and 
+ * the entries are chained through their message nodes.
+ */
+typedef struct
+{
+	muse_cell	sender;		///< The sender's pid, or MUSE_NIL for a free slot.
+	muse_cell	first, last;
+} muse_sender_queue_t;
+
+/**
+ * Indexes a process's mailbox by sender so that receiving from
+ * a given process doesn't have to scan the other messages. It is
+ * an open addressing hash table with linear probing that lives
+ * outside the heap and is doubled whenever it gets 3/4 full.
+ * Only messages that are lists headed by a pid are indexed.
+ */
+typedef struct
+{
+	int					capacity;	///< Zero or a power of 2.
+	int					count;
+	muse_sender_queue_t	*queues;
+} muse_mailbox_index_t;
+
 /*
 typedef struct {
 	muse_int	key;
@@ -201,6 +350,38 @@ typedef struct {
 	recent_contexts_t contexts;
 } recent_t;
 
+enum
+{
+	MUSE_LOCALS_PAGE_BITS = 6,
+	MUSE_LOCALS_PAGE_SIZE = 1 << MUSE_LOCALS_PAGE_BITS
+};
+
+/**
+ * A page of process local symbol values. Pages are shared
+ * between processes and copied when a process that shares
+ * a page changes one of its values. A slot that holds
+ * MUSE_NO_LOCAL_VALUE has no value in the process, which
+ * means the symbol evaluates to itself.
+ */
+typedef struct
+{
+	int			refs;			/**< The number of processes and continuations sharing the page. */
+	int			mark_epoch;		/**< The last garbage collection that marked the page. */
+	muse_cell	cells[MUSE_LOCALS_PAGE_SIZE];
+} muse_locals_page_t;
+
+/**
+ * The symbol values of a process. A process only has pages
+ * for the parts of the symbol table in which it or the
+ * process that spawned it gave symbols values. Missing
+ * pages, including those beyond \c num_pages, have no values.
+ */
+typedef struct
+{
+	int					num_pages;
+	muse_locals_page_t	**pages;
+} muse_locals_t;
+
 /**
  * A frame is the local environment of a process.
  */
@@ -214,7 +395,16 @@ typedef struct _muse_process_frame_t
 	int			remaining_attention;
 	int			atomicity;
 	jmp_buf		jmp;
-	muse_int	timeout_us;
+	muse_timer_t wakeup;	///< Ends a timed wait.
+	int			priority;	///< One of muse_priority_t.
+
+	struct _muse_process_frame_t *queue_next, *queue_prev;
+	muse_process_queue_t *queue;
+	/**<
+	 * The ready queue that the process is in, if any. The running 
+	 * process and waiting processes are in no queue.
+	 */
+
 	muse_stack	stack;
 	muse_stack	bindings_stack;
 	/**<
@@ -226,21 +416,60 @@ typedef struct _muse_process_frame_t
 	 * and the odd indices are all their bound values.
 	 */
 
-	muse_stack	locals;
+	muse_locals_t	locals;
 	/**<
 	 * The "locals" are a set of process-local storage values.
-	 * A symbol's value is different for each process.
+	 * A symbol's value is different for each process. A spawned
+	 * process shares the pages of its parent until it changes them.
+	 */
+
+	int			lexical_frame;
+	/**<
+	 * Stack position of the frame of the innermost lexically
+	 * addressed function being evaluated. The function's local
+	 * variables occupy consecutive stack entries from here.
+	 */
+
+	struct _muse_trap_point_t *traps;		///< The innermost \ref syntax_try "try" block being evaluated.
+	struct _muse_trap_point_t *free_traps;	///< Trap points kept for reuse by try blocks.
+
+	struct _muse_escape_point_t *escape_points;
+	/**<
+	 * The innermost \ref fn_callec "call/ec" whose continuation can
+	 * still be invoked. Escape points live on the C stack and are
+	 * linked to the enclosing ones.
+	 */
+
+	muse_cell	generator;
+	/**<
+	 * The \ref fn_generator "generator" that the process is running,
+	 * or () if none. While a generator runs, the evaluation state of
+	 * the process is that of the generator.
 	 */
 
 	muse_stack	cstack; ///< Holds the C stack pointer. If the pointer is NULL, its the main process.
+	char		*cstack_mapping; ///< The pages of the C stack, including the guard page, when mapped.
 
 	muse_cell	thunk;
 	muse_cell	mailbox;
 	muse_cell	mailbox_end;
+	/**<
+	 * Each entry of the mailbox list is <tt>((msg . next-from-sender) . next)</tt>.
+	 * A message received out of order has its entry's head replaced by
+	 * the mailbox cell and the entry is dropped once it reaches the front.
+	 */
+	int			mailbox_count;		///< The number of messages in the mailbox.
+	int			mailbox_capacity;	///< Senders wait while the mailbox holds this many messages. 0 if unbounded.
+	muse_mailbox_index_t senders;
+	muse_process_queue_t blocked_senders; ///< Processes waiting for room in the mailbox.
 	muse_cell	waiting_for_pid;
+	int			remote_slot;		///< 1 + the process's entry in the environment's export table, or 0 if it has none.
 
 	muse_traceinfo_t traceinfo; ///< Holds a finite depth of stack trace information.
 
+	muse_int	call_profile_child_ns; ///< Time spent in calls made by the innermost profiled call.
+	muse_call_profile_calls_t call_profile_calls;
+
 	muse_port_t current_port[4]; ///< Per-process current input/output/error ports.
 
 	/** Each process has a "recent" list - a vector of 8
@@ -251,6 +480,18 @@ typedef struct _muse_process_frame_t
 	recent_t recent;
 
 	int			num_eval_timeouts;
+	int			expired_eval_timeouts; ///< Non-zero when an eval timeout may have expired.
+
+	/* Accounting for muse_process_info(). Running time and cells
+	are brought up to date when the process is switched away from. */
+	muse_int	reductions;
+	muse_int	running_us;
+	muse_int	cells_allocated;
+	muse_int	switched_in_us;		///< When the process last got to run.
+	muse_int	switched_in_cells;	///< The heap's cells_taken when the process last got to run.
+	muse_int	waiting_us[MUSE_NUM_WAIT_REASONS];
+	muse_int	wait_started_us;
+	int			wait_reason;		///< One of muse_wait_reason_t, while the process waits.
 } muse_process_frame_t;
 
 typedef struct
@@ -271,15 +512,41 @@ enum { MUSE_MAX_SLOTS = 16 };
 struct _muse_env
 {
 	muse_heap			heap;
-	muse_stack			symbol_stack;
-	int					num_symbols;
+	muse_stack			symbol_stack;		/**< Interned symbols by local index, including gensyms. 
+												 Entries of collected symbols are MUSE_NIL. */
+	muse_symbol_index_t	symbol_index;		/**< Looks up named symbols. */
+	muse_stack			free_locals;		/**< Local indices of collected symbols, for reuse. */
+	int					num_symbols;		/**< The number of local indices in use or free. */
 
 	muse_cell			specials;
 	muse_cell			*builtin_symbols;
 	int					*parameters;
 	void				*stack_base;
 	void				*timer;
+	void				*preempt_timer;		/**< Non-NULL if processes are preempted by a timer. */
+	int					preempt_timer_index;	/**< The timer's entry in the table of running preemption timers. */
+	volatile int		preempt_requested;	/**< Set by the preemption timer and by SIGUSR1, cleared on process switch. */
+	void				*profiler;			/**< Non-NULL while the sampling profiler is running. */
+	void				*call_profile;		/**< Non-NULL once calls have been profiled. */
+	void				*trace_events;		/**< Non-NULL while interpreter events are being recorded. */
+	muse_int			random_state;		/**< State of the generator behind rand, so environments don't share one. */
+	void				*inbox;				/**< Non-NULL once processes of other environments can post to this one. */
+	void				*workers;			/**< The worker pool of \ref fn_pmap "pmap", created when it is first used. */
+	muse_flight_recorder_t	*flight_recorder;
+	muse_int			last_switch_us;		/**< When the running process got to run or, if later, when another process woke up. */
 	muse_process_frame_t	*current_process;
+	muse_process_queue_t	ready[MUSE_NUM_PRIORITIES];	/**< Runnable processes other than the current one, by priority. */
+	muse_timer_heap_t	timers;				/**< Process wakeups and eval timeouts. */
+	int					io_waiting;			/**< The number of processes waiting for sockets to get ready. */
+	muse_int			next_io_poll_us;	/**< When to next check for ready sockets while other processes run. */
+	void				(*poll_io)( muse_env *env, muse_int timeout_us );
+	/**<
+	 * Resumes the processes whose sockets got ready, waiting for
+	 * up to \p timeout_us for one to do so. Set by the networking module.
+	 */
+	muse_process_frame_t	*free_processes;	/**< Frames of dead processes kept for reuse, linked through \c next. */
+	int					num_free_processes;
+	int					num_guarded_cstacks;	/**< The number of process C stacks that have guard pages. */
 	muse_boolean		collecting_garbage;
 	struct _muse_net_t	*net;
 	muse_port_t			stdports[3];
@@ -374,6 +641,89 @@ muse_cell muse_pop_recent_scope( muse_env *env, muse_int key, muse_cell value );
  */
 int muse_forget_it_temporarily( muse_env *env );
 
+/**
+ * Pushes the frame of a lexically addressed function and makes
+ * it the current frame. Returns the previous frame position to be
+ * passed to muse_leave_lexical_frame(), or -1 if the arguments
+ * don't match the function's formals.
+ */
+int muse_enter_lexical_frame( muse_env *env, muse_cell spec, muse_cell args, muse_boolean bind_args );
+
+/**
+ * Pops the frame pushed at stack position \p sp, leaving
+ * only the result on the stack.
+ */
+muse_cell muse_leave_lexical_frame( muse_env *env, int sp, int prev_frame, muse_cell result );
+
+/**
+ * Holds what the call profiler needs to account for one call.
+ * It lives on the C stack of the caller of muse_call_profile_enter().
+ */
+typedef struct
+{
+	int			stat;			/**< Index of the function's entry, -1 if not profiled. */
+	int			generation;		/**< The profile the entry belongs to. */
+	int			depth;			/**< The process's calls in progress when the call was made. */
+	muse_boolean outermost;
+	muse_int	start_ns;
+	muse_int	saved_child_ns;
+	muse_int	start_cells;
+} muse_call_profile_frame_t;
+
+/**
+ * Starts accounting for a call to \p fn when calls are being profiled.
+ * Every call must be matched by muse_call_profile_leave().
+ */
+void muse_call_profile_enter( muse_env *env, muse_cell fn, muse_call_profile_frame_t *frame );
+void muse_call_profile_leave( muse_env *env, muse_call_profile_frame_t *frame );
+
+/**
+ * Forgets the profiled calls of the current process beyond the first
+ * \p depth, which an exception or an escape has abandoned.
+ */
+void muse_call_profile_unwind( muse_env *env, int depth );
+
+/**
+ * The call profiler remembers functions by cell. Called after a
+ * garbage collection since the cells may have been reused.
+ */
+void muse_call_profile_forget_cells( muse_env *env );
+
+/**
+ * Records an interpreter event for viewing in a trace viewer.
+ * Call only when env->trace_events is non-NULL.
+ */
+void muse_trace_event( muse_env *env, const char *name, char phase, muse_int start_us, const char *arg_name, muse_int arg );
+int muse_trace_event_tid( muse_env *env, muse_process_frame_t *p );
+
+/**
+ * Marks the cells the profilers hold on to for their reports - the
+ * sampled functions and the names of functions and events. Symbols
+ * that aren't referenced from the heap can be collected too.
+ */
+void muse_mark_profile_cells( muse_env *env );
+
+/**
+ * Directs the signals of a timer created with \p sev to the
+ * calling thread, where the platform allows it.
+ */
+struct sigevent;
+void muse_signal_this_thread( struct sigevent *sev );
+
+/**
+ * A process that runs for longer than this without
+ * letting others run is recorded as a stall.
+ */
+#define MUSE_FLIGHT_STALL_US 100000
+
+void muse_init_flight_recorder( muse_env *env );
+void muse_destroy_flight_recorder( muse_env *env );
+void muse_flight_record( muse_env *env, const char *format, muse_int a, muse_int b );
+void muse_flight_record_symbol( muse_env *env, const char *format, muse_cell symbol );
+void muse_flight_recorder_crash( muse_env *env, const char *reason );
+void muse_flight_recorder_poll( muse_env *env );
+void muse_mark_flight_recorder( muse_env *env );
+
 /**
  * The cell index is stored in the upper 29 bits
  * of the \c muse_cell. This returns the index of 
@@ -396,17 +746,29 @@ static inline muse_cell _cellati( int i )
 /**
  * Returns a newly allocated process local cell.
  * The return value is an index into the locals stack.
+ * Indices of collected symbols are reused.
  */
 #define _newlocal() op_newlocal(env)
 static inline int op_newlocal( muse_env *env )
 {
-	return env->num_symbols++;
+	if ( env->free_locals.top > env->free_locals.bottom )
+		return (int)*(--env->free_locals.top);
+	else
+		return env->num_symbols++;
 }
 static inline muse_cell _localcell(int ix)
 {
 	return 7 + (ix << 3);
 }
 
+/**
+ * What a process local slot holds when its symbol has no value in
+ * the process. Unlike the local cell of the symbol, which is also a
+ * valid reference to a lazy cell, it can't be a cell reference -
+ * not even a quick-quoted one.
+ */
+#define MUSE_NO_LOCAL_VALUE ((muse_cell)LONG_MIN)
+
 /**
  * Returns the type of the cell referred to by
  * the given cell reference. The type is encoded in 
@@ -511,6 +873,8 @@ static inline muse_cell op_spush( muse_env *env, muse_cell cell )
 {
 	if ( cell )
 	{
+		if ( _stack()->top - _stack()->bottom >= _stack()->size )
+			grow_stack( env, _stack(), _stack()->size + 1, env->parameters[MUSE_STACK_SIZE] );
 		muse_assert( _stack()->top - _stack()->bottom < _stack()->size );
 		muse_assert( _celli(_quq(cell)) >= 0 && _celli(_quq(cell)) < env->heap.size_cells );
 		return *(_stack()->top++) = cell;
@@ -518,6 +882,11 @@ static inline muse_cell op_spush( muse_env *env, muse_cell cell )
 	else
 		return MUSE_NIL;
 }
+#define _lexical_slot(k) op_lexical_slot(env,k)
+static inline muse_cell *op_lexical_slot( muse_env *env, muse_int k )
+{
+	return env->current_process->stack.bottom + env->current_process->lexical_frame + k;
+}
 #define _spos() op_spos(env)
 static inline int op_spos(muse_env *env)
 {
@@ -541,12 +910,13 @@ static inline muse_stack *op_symstack(muse_env *env)
 {
 	return &env->symbol_stack;
 }
+static inline muse_cell op_symval( muse_env *env, muse_cell symbol );
 #define _head(c) op_head(env,c)
 static inline muse_cell op_head( muse_env *env, muse_cell c )
 {
 	muse_assert( _cellt(c) == MUSE_CONS_CELL || _cellt(c) == MUSE_SYMBOL_CELL || _cellt(c) == MUSE_LAMBDA_CELL || _cellt(c) == MUSE_LAZY_CELL );
 	if ( _cellt(c) == MUSE_SYMBOL_CELL )
-		return 	env->current_process->locals.bottom[_ptr(c)->cons.head >> 3];
+		return op_symval(env,c);
 	else
 		return _ptr(c)->cons.head;
 }
@@ -603,16 +973,39 @@ static inline void op_setht( muse_env *env, muse_cell c, muse_cell h, muse_cell
 	p->cons.head = h;
 	p->cons.tail = t;
 }
+muse_cell *muse_own_local( muse_process_frame_t *p, int ix );
 #define _define(symbol,value) op_define(env,symbol,value)
 static inline muse_cell op_define( muse_env *env, muse_cell symbol, muse_cell value )
 {
-	env->current_process->locals.bottom[_ptr(symbol)->cons.head >> 3] = value;
+	int ix = (int)(_ptr(symbol)->cons.head >> 3);
+	muse_locals_t *l = &env->current_process->locals;
+	int page = ix >> MUSE_LOCALS_PAGE_BITS;
+
+	if ( page < l->num_pages && l->pages[page] && l->pages[page]->refs == 1 )
+		l->pages[page]->cells[ix & (MUSE_LOCALS_PAGE_SIZE-1)] = value;
+	else
+		*muse_own_local( env->current_process, ix ) = value;
+
 	return value;
 }
+/**
+ * Returns the value of the local with index \p ix in the given
+ * process, or MUSE_NO_LOCAL_VALUE if it has no value in the process.
+ */
+static inline muse_cell muse_local( muse_process_frame_t *p, int ix )
+{
+	int page = ix >> MUSE_LOCALS_PAGE_BITS;
+
+	if ( page < p->locals.num_pages && p->locals.pages[page] )
+		return p->locals.pages[page]->cells[ix & (MUSE_LOCALS_PAGE_SIZE-1)];
+	else
+		return MUSE_NO_LOCAL_VALUE;
+}
 #define _symval(symbol) op_symval(env,symbol)
 static inline muse_cell op_symval( muse_env *env, muse_cell symbol )
 {
-	return env->current_process->locals.bottom[_ptr(symbol)->cons.head >> 3];
+	muse_cell value = muse_local( env->current_process, (int)(_ptr(symbol)->cons.head >> 3) );
+	return (value == MUSE_NO_LOCAL_VALUE) ? symbol : value;
 }
 #define _bspos() op_bspos(env)
 static inline int op_bspos(muse_env *env)
@@ -623,6 +1016,8 @@ static inline int op_bspos(muse_env *env)
 static inline void op_push_binding( muse_env *env, muse_cell symbol )
 {
 	muse_stack *s = &env->current_process->bindings_stack;
+	if ( s->top - s->bottom >= s->size - 1 )
+		grow_stack( env, s, s->size + 2, env->parameters[MUSE_STACK_SIZE] * 2 );
 	muse_assert( s->top - s->bottom < s->size - 1 );
 	*(s->top++) = symbol;
 	*(s->top++) = _symval(symbol);
@@ -678,6 +1073,7 @@ static inline muse_cell op_takefreecell(muse_env *env)
 	c = _step( &(env->heap.free_cells) );
 	_sett(c,MUSE_NIL);
 	env->heap.free_cell_count--;
+	env->heap.cells_taken++;
 	return c;
 }
 #define _returncell(c) op_returncell(env,c)
@@ -730,19 +1126,107 @@ muse_process_frame_t *create_process( muse_env *env, int attention, muse_cell th
 muse_process_frame_t *init_process_mailbox( muse_process_frame_t *p );
 muse_boolean prime_process( muse_process_frame_t *process );
 muse_boolean switch_to_process( muse_env *env, muse_process_frame_t *process );
+muse_boolean run_next_process( muse_env *env );
+void pause_process( muse_env *env, int wait_bits, muse_int wakeup_us );
+void resume_process( muse_process_frame_t *process );
 void yield_process( muse_env *env, int spent_attention );
+void preempt_process( muse_env *env );
+
 muse_boolean procrastinate( muse_env *env );
 muse_boolean remove_process( muse_process_frame_t *process );
 muse_cell process_id( muse_process_frame_t *process );
 muse_boolean is_main_process( muse_env *env );
 void mark_process( muse_process_frame_t *p );
 void free_process( muse_process_frame_t *p );
+void close_escape_points( muse_env *env, muse_process_frame_t *p, struct _muse_escape_point_t *upto );
+void mark_trap_points( muse_env *env, struct _muse_trap_point_t *trap );
+void destroy_trap_points( muse_process_frame_t *p );
+void fail_generator( muse_env *env, muse_cell condition );
 muse_cell fn_pid( muse_env *env, muse_process_frame_t *process, muse_cell args );
 void post_message( muse_process_frame_t *process, muse_cell msg );
+void post_message_from( muse_process_frame_t *process, muse_cell msg, muse_cell from );
+muse_boolean wait_for_mailbox_room( muse_env *env, muse_process_frame_t *process, muse_boolean block );
+muse_cell next_message( muse_process_frame_t *process, muse_cell pid );
+muse_cell take_message( muse_process_frame_t *process, muse_cell entry );
 void enter_atomic(muse_env *env);
 void leave_atomic(muse_env *env);
 void push_timeout( muse_env *env, muse_cell id, muse_int timeout_us );
+void pop_timeout( muse_env *env );
+void unwind_timeouts( muse_env *env, int depth );
 void check_timeout( muse_env *env );
+void destroy_timers( muse_env *env );
+
+/**
+ * Messages from other environments, which may be running on other
+ * threads. They are queued in the environment's inbox and delivered
+ * to the mailboxes of the receiving processes at scheduler points.
+ */
+void muse_deliver_remote_messages( muse_env *env );
+void muse_wait_remote_messages( muse_env *env, muse_int timeout_us );
+int muse_remote_wake_fd( muse_env *env );
+void muse_clear_remote_wake( muse_env *env );
+void muse_unexport_process( muse_process_frame_t *p );
+void muse_close_inbox( muse_env *env );
+muse_boolean muse_is_remote_pid( muse_env *env, muse_cell pid );
+muse_cell muse_post_to_remote_pid( muse_env *env, muse_cell rpid, muse_cell msg );
+void *muse_transfer_encode( muse_env *env, muse_cell x, muse_boolean with_globals, muse_cell *bad );
+muse_cell muse_transfer_decode( muse_env *env, const void *data );
+void muse_transfer_free( void *data );
+void muse_destroy_worker_pool( muse_env *env );
+
+/**
+ * While other processes run, the sockets that processes
+ * wait for are checked at most this often.
+ */
+#define MUSE_IO_POLL_INTERVAL_US 1000
+
+/**
+ * The longest the scheduler blocks at a time when no process can run.
+ */
+#define MUSE_IDLE_WAIT_US 1000000
+
+/**
+ * The evaluation and bindings stacks of a process start with
+ * this many cells and double as needed, up to MUSE_STACK_SIZE
+ * cells for the evaluation stack and twice that for bindings.
+ */
+#define MUSE_INITIAL_STACK_SIZE 256
+
+/**
+ * The most frames of dead processes that are kept around
+ * for new processes to reuse along with their stacks.
+ */
+#define MUSE_PROCESS_POOL_SIZE 256
+
+/**
+ * Each guard page below a process's C stack splits its memory
+ * mapping in two and systems limit the number of mappings a
+ * program can have. So only this many C stacks get guard pages.
+ */
+#define MUSE_MAX_GUARDED_CSTACKS 8192
+
+/**
+ * The least address space reserved for a process's C stack when
+ * it is mapped. Mapped stacks only take memory for the pages that
+ * the process touches, so they can afford deeper recursion.
+ */
+#define MUSE_MAPPED_CSTACK_SIZE (256*1024)
+
+/**
+ * Gives other processes a chance to run. With a preemption timer,
+ * this is a single check of the flag set by the timer. Otherwise
+ * the current process's attention is spent. The flag is also set
+ * when SIGUSR1 asks for a flight recorder dump.
+ */
+#define _yield(spent_attention) op_yield(env,spent_attention)
+static inline void op_yield( muse_env *env, int spent_attention )
+{
+	env->current_process->reductions += spent_attention;
+	if ( env->preempt_requested )
+		preempt_process(env);
+	else if ( env->preempt_timer == NULL )
+		yield_process( env, spent_attention );
+}
 
 /* Converts the given 16-bit unicode char to utf8 and stores
 it into the given buffer. Returns the number of bytes used. */
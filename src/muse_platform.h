@@ -54,6 +54,24 @@ typedef long long longlong_t;
 
 #define MUSE_PLATFORM_POSIX 1
 
+/*
+ * Environments are independent of each other and can be run
+ * concurrently on separate threads, one thread per environment.
+ * What little state the evaluator needs outside of an environment,
+ * such as the environment that is switching stacks to start a
+ * process, is kept per thread.
+ */
+#define MUSE_THREAD_LOCAL __thread
+
+/*
+ * Atomic operations for the little state that environments on
+ * different threads do share, such as the queues through which
+ * they post messages to each other. Both are full barriers.
+ * muse_atomic_add() evaluates to the new value.
+ */
+#define muse_atomic_cas_ptr(dest,oldval,newval) __sync_bool_compare_and_swap( (dest), (oldval), (newval) )
+#define muse_atomic_add(dest,n) __sync_add_and_fetch( (dest), (n) )
+
 #  if defined(BSD) || __APPLE__ & __MACH__
 #      define MUSE_PLATFORM_BSD 1
 #  endif
@@ -65,6 +65,7 @@ void port_init( muse_env *env, muse_port_base_t *p )
 	p->pretty_print = env->parameters[MUSE_PRETTY_PRINT];
 	p->tab_size		= env->parameters[MUSE_TAB_SIZE];
 	p->pp_align_level = 0;
+	p->quoted = 0;
 	p->pp_max_indent_cols = MAX_INDENT_COLS;
 	p->pp_align_cols = (int*)calloc( p->pp_max_indent_cols, sizeof(int) );
 }
@@ -1163,7 +1164,7 @@ static muse_cell _read_list( muse_port_t f )
 	else
 	{
 		muse_cell h, t, next_element;
-		int sp;
+		int sp, quoted;
 		
 		ez_skip_whitespace(f,0,0);
 		c = port_getc(f);
@@ -1200,6 +1201,11 @@ static muse_cell _read_list( muse_port_t f )
 		
 		_seth( h, next_element );
 		_unwind(sp);
+
+		/* The rest of a (quote ...) expression is data, just
+		like the expression after a quote character. */
+		quoted = (next_element == _builtin_symbol(MUSE_QUOTE)) ? 1 : 0;
+		f->quoted += quoted;
 		
 		/* Read more list elements and add to the list tail. */
 		while ( !port_eof(f) )
@@ -1218,6 +1224,7 @@ static muse_cell _read_list( muse_port_t f )
 					MUSE_DIAGNOSTICS({
 						muse_message( env,L"Parser", L"Didn't expect the file to end after\n\t%m\nwhile parsing a list.", _head(t) );
 					});
+					f->quoted -= quoted;
 					return PARSE_ERROR;
 				}
 				
@@ -1226,7 +1233,10 @@ static muse_cell _read_list( muse_port_t f )
 					/* Yes its a cons pair. Set the last cons cell's tail and finish up. */
 					next_element = muse_pread( f );
 					if ( next_element < 0 )
+					{
+						f->quoted -= quoted;
 						return next_element; /* Parse error. */
+					}
 					
 					_sett( t, next_element );
 					_unwind(sp);
@@ -1238,6 +1248,7 @@ static muse_cell _read_list( muse_port_t f )
 						MUSE_DIAGNOSTICS({
 							muse_message( env,L"Parser", L"[line:%d col:%d] The list should end after\n\t. %m", f->in.line, f->in.column, _tail(t) );
 						});
+						f->quoted -= quoted;
 						return PARSE_ERROR_BAD_CONS_SYNTAX;
 						/* Next token after second item of cons pair must be ')' */
 					}
@@ -1259,7 +1270,10 @@ static muse_cell _read_list( muse_port_t f )
 				/* Add one more element to the list. */
 				next_element = muse_pread( f );
 				if ( next_element < 0 )
+				{
+					f->quoted -= quoted;
 					return next_element; /* Parse error. */
+				}
 			}
 
 			/* Add to the end of the list. */
@@ -1272,6 +1286,7 @@ static muse_cell _read_list( muse_port_t f )
 		}
 
 		/* Return the list. */
+		f->quoted -= quoted;
 		return h;
 	}
 }
@@ -1315,6 +1330,54 @@ static muse_boolean is_macro_sexpr( muse_env *env, muse_cell sexpr )
 }
 
 
+extern muse_cell fn_add( muse_env *env, void *context, muse_cell args );
+extern muse_cell fn_sub( muse_env *env, void *context, muse_cell args );
+extern muse_cell fn_mul( muse_env *env, void *context, muse_cell args );
+extern muse_cell fn_div( muse_env *env, void *context, muse_cell args );
+
+/**
+ * Returns \c MUSE_TRUE if the given sexpr is an arithmetic
+ * expression on number literals, such as @code (* 2 3.14159) @endcode,
+ * which can be computed at read time. The head symbol must
+ * refer to one of the builtin operators +, -, * or / when
+ * the expression is read, much like for macro expressions.
+ * Sub-expressions have already been folded by then, so
+ * nested expressions fold as well.
+ */
+static muse_boolean is_constant_sexpr( muse_env *env, muse_cell sexpr )
+{
+	muse_cell fn, args;
+
+	if ( sexpr <= 0 || _cellt(sexpr) != MUSE_CONS_CELL )
+		return MUSE_FALSE;
+
+	fn = _head(sexpr);
+	if ( fn <= 0 || _cellt(fn) != MUSE_SYMBOL_CELL )
+		return MUSE_FALSE;
+
+	fn = _symval(fn);
+	if ( _cellt(fn) != MUSE_NATIVEFN_CELL || _ptr(fn)->fn.context != NULL )
+		return MUSE_FALSE;
+
+	if ( _ptr(fn)->fn.fn != fn_add && _ptr(fn)->fn.fn != fn_sub 
+		&& _ptr(fn)->fn.fn != fn_mul && _ptr(fn)->fn.fn != fn_div )
+		return MUSE_FALSE;
+
+	args = _tail(sexpr);
+	if ( !args )
+		return MUSE_FALSE;
+
+	while ( args > 0 && _cellt(args) == MUSE_CONS_CELL )
+	{
+		muse_cell arg = _head(args);
+		if ( arg <= 0 || !_isnumber(arg) )
+			return MUSE_FALSE;
+		args = _tail(args);
+	}
+
+	return args == MUSE_NIL ? MUSE_TRUE : MUSE_FALSE;
+}
+
 #define _mk_bytes(size) mk_bytes(env,size)
 extern muse_cell mk_bytes( muse_env *env, muse_int size );
 
@@ -1426,7 +1489,9 @@ MUSEAPI muse_cell muse_pread( muse_port_t f )
 		muse_cell expr = MUSE_NIL;
 		int saved_mode = f->mode;
 		f->mode &= ~MUSE_PORT_READ_DETECT_MACROS;
+		f->quoted++;
 		expr = muse_pread( f );
+		f->quoted--;
 		f->mode = saved_mode;
 		return muse_quote(env,expr);
 	}
@@ -1454,11 +1519,16 @@ MUSEAPI muse_cell muse_pread( muse_port_t f )
 				2.	The expression is delimited by (), but we've been
 					asked to detect and expand macro expressions (braces
 					or parens) and the head of the list is a macro symbol. 
+				3.	The expression is delimited by (), we've been asked
+					to detect macros and it is arithmetic on number literals
+					that isn't part of quoted data.
 			*/
 			if ( (f->mode & MUSE_PORT_READ_EXPAND_BRACES) && (c == '{') ) {
 				return peval( env, f, sexpr );
 			} else if ( (f->mode & MUSE_PORT_READ_DETECT_MACROS) && (c == '(') && is_macro_sexpr(env, sexpr) ) {
 				return peval_macro( env, f, sexpr );
+			} else if ( (f->mode & MUSE_PORT_READ_DETECT_MACROS) && (c == '(') && !f->quoted && is_constant_sexpr(env, sexpr) ) {
+				return peval( env, f, sexpr );
 			} else if ( env->parameters[MUSE_ENABLE_OBJC] && (c == '[') ) {
 				/* 
 				Objective C bridge:
@@ -92,6 +92,9 @@ typedef struct _muse_port_base_t
 	int mode;
 	int eof, error, pretty_print, tab_size;
 
+	/** > 0 while reading quoted data, whose arithmetic isn't computed at read time. */
+	int quoted;
+
 	/** Environment owning the port. */
 	muse_env *env;
 
@@ -14,6 +14,7 @@
 
 #include <ctype.h>
 #include <io.h>
+#include <intrin.h>
 
 #ifndef __cplusplus
 #define inline __inline
@@ -46,6 +47,17 @@ typedef __int64 longlong_t;
 
 #define MUSE_PLATFORM_WINDOWS 1
 
+#define MUSE_THREAD_LOCAL __declspec(thread)
+
+#ifdef _WIN64
+#	define muse_atomic_cas_ptr(dest,oldval,newval) \
+		(_InterlockedCompareExchangePointer( (void * volatile *)(dest), (void*)(newval), (void*)(oldval) ) == (void*)(oldval))
+#else
+#	define muse_atomic_cas_ptr(dest,oldval,newval) \
+		(_InterlockedCompareExchange( (long volatile *)(dest), (long)(newval), (long)(oldval) ) == (long)(oldval))
+#endif
+#define muse_atomic_add(dest,n) (_InterlockedExchangeAdd( (long volatile *)(dest), (n) ) + (n))
+
 #ifdef MUSE_DLL
 #	ifdef _LIB		// We're building the muSE DLL itself.
 #		define MUSEAPI __declspec(dllexport)
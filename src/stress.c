@@ -0,0 +1,162 @@
+/**
+ * @file stress.c
+ * @author Srikumar K. S. (mailto:kumar@muvee.com)
+ *
+ * Copyright (c) 2006 Jointly owned by Srikumar K. S. and muvee Technologies Pte. Ltd.
+ *
+ * All rights reserved. See LICENSE.txt distributed with this source code
+ * or http://muvee-symbolic-expressions.googlecode.com/svn/trunk/LICENSE.txt
+ * for terms and conditions under which this software is provided to you.
+ *
+ * Stress test for running independent environments concurrently. One
+ * thread per processor repeatedly creates an environment, loads one of
+ * the given scripts into it and destroys it again. Each thread starts at
+ * a different script so that all of them are being run at the same time.
+ * Files ending in .so are plugins built by build/posix/muse-compile and
+ * are linked instead, since a plugin's code is shared by the environments.
+ *
+ * Usage: muse-stress [--threads N] [--rounds N] [--preempt] file.scm|file.so ...
+ *
+ * Build it with build/posix/build-stress and run it over the scripts in
+ * examples/ and the module it compiles, preferably also with -fsanitize=thread.
+ * It is meant to crash, hang or get reported by the sanitizer if environments
+ * share mutable state.
+ */
+
+#include "muse.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char *k_args_threads_switch	= "--threads";
+static const char *k_args_rounds_switch		= "--rounds";
+static const char *k_args_preempt_switch	= "--preempt";
+
+/** The preemption timer interval used with --preempt. */
+#define STRESS_PREEMPTION_INTERVAL_US 1000
+
+typedef struct
+{
+	int id;
+	int rounds;
+	int num_files;
+	char **files;
+	muse_boolean preempt;
+	int envs_run;
+	int failures;
+} stress_thread_t;
+
+static muse_boolean is_plugin( const char *file )
+{
+	size_t length = strlen(file);
+	return (length > 3 && strcmp( file + length - 3, ".so" ) == 0) ? MUSE_TRUE : MUSE_FALSE;
+}
+
+static void *stress_thread( void *arg )
+{
+	stress_thread_t *t = (stress_thread_t*)arg;
+	int preempt_params[] = { MUSE_PREEMPTION_INTERVAL_US, STRESS_PREEMPTION_INTERVAL_US, MUSE_END_OF_LIST };
+	int r, i;
+
+	for ( r = 0; r < t->rounds; ++r )
+	{
+		for ( i = 0; i < t->num_files; ++i )
+		{
+			const char *file = t->files[(i + t->id) % t->num_files];
+			muse_env *env = muse_init_env( t->preempt ? preempt_params : NULL );
+			FILE *f = fopen( file, "rb" );
+
+			if ( f && is_plugin(file) )
+			{
+				muse_char path[1024];
+
+				fclose(f);
+				muse_utf8_to_unicode( path, 1024, file, strlen(file) + 1 );
+				muse_link_plugin( env, path, MUSE_NIL );
+				t->envs_run++;
+			}
+			else if ( f )
+			{
+				muse_load( env, f );
+				fclose(f);
+				t->envs_run++;
+			}
+			else
+			{
+				fprintf( stderr, "muse-stress: can't open '%s'.\n", file );
+				t->failures++;
+			}
+
+			muse_destroy_env(env);
+		}
+	}
+
+	return NULL;
+}
+
+int main( int argc, char **argv )
+{
+	int num_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int rounds = 10;
+	muse_boolean preempt = MUSE_FALSE;
+	stress_thread_t *threads;
+	pthread_t *handles;
+	int i, envs_run = 0, failures = 0;
+
+	for ( i = 1; i < argc && strncmp( argv[i], "--", 2 ) == 0; ++i )
+	{
+		if ( strcmp( argv[i], k_args_threads_switch ) == 0 && i+1 < argc )
+			num_threads = atoi( argv[++i] );
+		else if ( strcmp( argv[i], k_args_rounds_switch ) == 0 && i+1 < argc )
+			rounds = atoi( argv[++i] );
+		else if ( strcmp( argv[i], k_args_preempt_switch ) == 0 )
+			preempt = MUSE_TRUE;
+		else
+			break;
+	}
+
+	if ( i >= argc || num_threads <= 0 || rounds <= 0 )
+	{
+		fprintf( stderr, "Usage: muse-stress [--threads N] [--rounds N] [--preempt] file.scm|file.so ...\n" );
+		return 1;
+	}
+
+	threads = (stress_thread_t*)calloc( num_threads, sizeof(stress_thread_t) );
+	handles = (pthread_t*)calloc( num_threads, sizeof(pthread_t) );
+
+	{
+		int first_file = i, t;
+
+		for ( t = 0; t < num_threads; ++t )
+		{
+			threads[t].id			= t;
+			threads[t].rounds		= rounds;
+			threads[t].num_files	= argc - first_file;
+			threads[t].files		= argv + first_file;
+			threads[t].preempt		= preempt;
+
+			if ( pthread_create( handles + t, NULL, stress_thread, threads + t ) != 0 )
+			{
+				fprintf( stderr, "muse-stress: can't start thread %d.\n", t );
+				num_threads = t;
+				failures++;
+				break;
+			}
+		}
+	}
+
+	for ( i = 0; i < num_threads; ++i )
+	{
+		pthread_join( handles[i], NULL );
+		envs_run += threads[i].envs_run;
+		failures += threads[i].failures;
+	}
+
+	printf( "muse-stress: ran %d environments on %d threads, %d failures.\n", envs_run, num_threads, failures );
+
+	free(handles);
+	free(threads);
+	return failures > 0 ? 1 : 0;
+}